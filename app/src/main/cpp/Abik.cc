@@ -0,0 +1,1151 @@
+#include "abik.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
+#include <optional>
+#include <random>
+
+#include "avb/footer.h"
+#include "cpio_build.hpp"
+#include "cpio_extract.hpp"
+#include "job.h"
+#include "log.h"
+#include "mkbootimg/bootimg.h"
+#include "mkbootimg/vendorbootimg.h"
+#include "parser_config.h"
+#include "ramdisk/codec.h"
+#include "ramdisk/patch.h"
+#include "ramdisk/ramdisk.h"
+#include "ramdisk/seek_index.h"
+#include "ramdisk/segments.h"
+#include "scheduler.h"
+#include "session.h"
+#include "task_graph.h"
+#include "trace.h"
+#include "unpackbootimg/bootimg.h"
+#include "unpackbootimg/vendorbootimg.h"
+
+constexpr std::string s_vendor_boot_magic = "VNDRBOOT";
+constexpr std::string s_boot_magic = "ANDROID!";
+namespace fs = std::filesystem;
+
+namespace {
+uint64_t DirectorySize(const fs::path &dir) {
+  uint64_t size = 0;
+  std::error_code ec;
+  for (auto it = fs::recursive_directory_iterator(dir, ec);
+       !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+    if (it->is_regular_file(ec)) size += it->file_size(ec);
+  }
+  return size;
+}
+
+uint64_t FileSize(const fs::path &path) {
+  std::error_code ec;
+  const auto size = fs::file_size(path, ec);
+  return ec ? 0 : size;
+}
+
+uint64_t FilesSize(std::initializer_list<fs::path> paths) {
+  uint64_t size = 0;
+  for (const auto &path : paths) {
+    if (!path.empty()) size += FileSize(path);
+  }
+  return size;
+}
+
+// Runs task(0) .. task(count - 1) on the scheduler. Tasks must not start
+// job stages.
+template <typename F>
+bool ForEachSegment(size_t count, F &&task) {
+  return ParallelFor(count, TaskThreads(), task);
+}
+
+fs::path SegmentPath(const fs::path &ramdisk, size_t index) {
+  return ramdisk.string() + "." + std::to_string(index);
+}
+
+// The last segment takes the untagged entries.
+std::string SegmentTag(size_t index, size_t count) {
+  return index + 1 < count ? std::to_string(index) : std::string();
+}
+
+// Decodes input, named name in the log, into output and removes it.
+bool DecompressRamdisk(const fs::path &input, const fs::path &output,
+                       const Codec &codec, const fs::path &name) {
+  if (codec.format != FORMAT_NONE) {
+    LOG("Decompressing %s using %s", name.c_str(),
+        std::string(codec.name).c_str());
+  }
+  return DecodeFile(codec, input, output);
+}
+
+// Compresses the cpio at path in place.
+bool CompressRamdisk(const fs::path &path, const Codec &codec,
+                     const fs::path &name) {
+  if (codec.format != FORMAT_NONE) {
+    LOG("Compressing %s using %s", name.c_str(),
+        std::string(codec.name).c_str());
+  }
+  const fs::path tmp = path.string() + ".tmp";
+  if (!EncodeFile(codec, path, tmp)) return false;
+  std::error_code ec;
+  fs::rename(tmp, path, ec);
+  if (ec) {
+    LOGE("File replacement failed: %s", ec.message().c_str());
+    fs::remove(tmp, ec);
+    return false;
+  }
+  return true;
+}
+
+bool DecompressSegment(const fs::path &input, const fs::path &output,
+                       uint8_t format) {
+  TraceSpan span("decompress", input.filename().native());
+  span.SetInput(input);
+  const Codec *codec = FindCodec(format);
+  if (codec == nullptr ||
+      !DecompressRamdisk(input, output, *codec, input.filename())) {
+    return false;
+  }
+  span.SetOutput(output);
+  return true;
+}
+
+bool CompressSegment(const fs::path &input, uint8_t format) {
+  TraceSpan span("compress", input.filename().native());
+  span.SetInput(input);
+  const Codec *codec = FindCodec(format);
+  if (codec == nullptr || !CompressRamdisk(input, *codec, input.filename())) {
+    return false;
+  }
+  span.SetOutput(input);
+  return true;
+}
+
+void RemoveSegments(const fs::path &ramdisk, size_t count) {
+  std::error_code ec;
+  for (size_t i = 0; i < count; ++i) {
+    const fs::path part = SegmentPath(ramdisk, i);
+    fs::remove(part, ec);
+    fs::remove(part.string() + ".cpio", ec);
+    fs::remove(part.string() + ".tmp", ec);
+  }
+}
+
+// Rebuilds a ramdisk unpacked from several segments as laid out in its
+// SEGMENTS_FILE, compressing the segments in parallel. Runs as a step of the
+// build graph, inside the caller's job stage.
+bool BuildRamdiskSegments(const fs::path &ramdisk_in,
+                          const fs::path &ramdisk_out) {
+  const auto segments = ReadSegmentLayout(ramdisk_in / SEGMENTS_FILE);
+  if (!segments) {
+    LOGE("Invalid segment layout in %s", ramdisk_in.filename().c_str());
+    return false;
+  }
+  const size_t count = segments->size();
+  LOG("Compressing %s as %zu segments", ramdisk_in.filename().c_str(), count);
+  {
+    TraceSpan span("cpio_build", ramdisk_in.filename().native());
+    for (size_t i = 0; i < count; ++i) {
+      if (!BuildCPIO(ramdisk_in, SegmentPath(ramdisk_out, i),
+                     SegmentTag(i, count))) {
+        RemoveSegments(ramdisk_out, count);
+        return false;
+      }
+    }
+  }
+
+  if (!ForEachSegment(count, [&](size_t i) {
+        return CompressSegment(SegmentPath(ramdisk_out, i),
+                               (*segments)[i].format);
+      })) {
+    RemoveSegments(ramdisk_out, count);
+    return false;
+  }
+
+  std::ofstream out(ramdisk_out, std::ios::binary | std::ios::trunc);
+  for (size_t i = 0; out && i < count; ++i) {
+    std::ifstream part(SegmentPath(ramdisk_out, i), std::ios::binary);
+    out << part.rdbuf();
+    const std::string padding((*segments)[i].padding, '\0');
+    out.write(padding.data(), static_cast<std::streamsize>(padding.size()));
+  }
+  out.close();
+  RemoveSegments(ramdisk_out, count);
+  if (!out) {
+    LOGE("Error writing %s", ramdisk_out.string().c_str());
+    return false;
+  }
+  return true;
+}
+
+// Estimated cost of each build step per input byte, relative to writing the
+// cpio, for ordering the build graph.
+constexpr uint64_t CPIO_BUILD_COST = 1;
+
+uint64_t CompressCost(uint8_t compression_method) {
+  switch (compression_method) {
+    case FORMAT_LZ4:
+      return 8;
+    case FORMAT_GZIP:
+      return 12;
+    case FORMAT_LZMA:
+      return 100;
+    default:
+      return 1;
+  }
+}
+
+bool BuildRamdiskCpio(const fs::path &ramdisk_in, const fs::path &ramdisk_out) {
+  LOG("Compressing %s using cpio", ramdisk_in.filename().c_str());
+  TraceSpan span("cpio_build", ramdisk_in.filename().native());
+  if (!BuildCPIO(ramdisk_in, ramdisk_out)) {
+    return false;
+  }
+  span.SetOutput(ramdisk_out);
+  return true;
+}
+
+bool CompressBuiltRamdisk(const fs::path &ramdisk_in,
+                          const fs::path &ramdisk_out,
+                          uint8_t compression_method) {
+  TraceSpan span("compress", ramdisk_in.filename().native());
+  span.SetInput(ramdisk_out);
+  if (const Codec *codec = FindCodec(compression_method)) {
+    if (!CompressRamdisk(ramdisk_out, *codec, ramdisk_in.filename())) {
+      return false;
+    }
+  } else {
+    LOG("Compression method is unknown!");
+    LOG("%s will be kept uncompressed!", ramdisk_in.filename().c_str());
+  }
+  span.SetOutput(ramdisk_out);
+  return true;
+}
+
+// Adds the steps that turn ramdisk_in, a directory unpack left or a file it
+// kept as is, into ramdisk_out and returns the last of them. The bytes they
+// report as progress are added to stage_total.
+TaskGraph::Node AddRamdiskBuild(TaskGraph &graph, const fs::path &ramdisk_in,
+                                const fs::path &ramdisk_out,
+                                uint8_t compression_method,
+                                uint64_t &stage_total) {
+  const std::string name = ramdisk_in.filename().native();
+  if (!fs::is_directory(ramdisk_in)) {
+    // Images without a ramdisk have nothing to copy; they are built without.
+    return graph.Add("copy " + name, FileSize(ramdisk_in), [=] {
+      std::error_code ec;
+      fs::copy_file(ramdisk_in, ramdisk_out,
+                    fs::copy_options::overwrite_existing, ec);
+      return true;
+    });
+  }
+  const uint64_t size = DirectorySize(ramdisk_in);
+  const uint64_t compress_cost = size * CompressCost(compression_method);
+  stage_total += 2 * size;
+  if (fs::exists(ramdisk_in / SEGMENTS_FILE)) {
+    return graph.Add("segments " + name, size * CPIO_BUILD_COST + compress_cost,
+                     [=] { return BuildRamdiskSegments(ramdisk_in, ramdisk_out); });
+  }
+  const auto cpio = graph.Add("cpio " + name, size * CPIO_BUILD_COST, [=] {
+    return BuildRamdiskCpio(ramdisk_in, ramdisk_out);
+  });
+  return graph.Add(
+      "compress " + name, compress_cost,
+      [=] {
+        return CompressBuiltRamdisk(ramdisk_in, ramdisk_out,
+                                    compression_method);
+      },
+      {cpio});
+}
+
+// Runs the build graph of the image at output: the ramdisk steps share one
+// job stage, and the image write that ends the graph starts its own.
+bool RunBuildGraph(TaskGraph &graph, const fs::path &output,
+                   uint64_t ramdisk_total) {
+  JobStage("ramdisk_build", output.filename().native(), ramdisk_total);
+  if (!graph.Run()) return false;
+  LOG("Critical path: %s", graph.CriticalPath().c_str());
+  return true;
+}
+
+// An input of an image section, with the step that builds it unless it is
+// taken as is.
+struct SectionInput {
+  fs::path path;
+  std::optional<TaskGraph::Node> built;
+};
+
+// How a builder lays out its image: the file sections, placed from the
+// sizes the inputs have when it is called, and the header pieces, which
+// need every input final.
+struct ImageParts {
+  std::function<std::optional<ImagePlan>()> sections;
+  std::function<std::optional<std::vector<ImagePiece>>()> headers;
+};
+
+// Adds the steps writing the image to graph and runs it. A regular file
+// gets one step per input, listed in layout order, that writes it at its
+// offset once the inputs ahead of it, whose sizes place it, are built; those
+// ahead of every ramdisk are copied while the ramdisks build. "image_write"
+// then adds the header and footer. A sink that cannot seek gets the whole
+// image from "image_write" in one pass once every input is built.
+bool RunImageBuild(TaskGraph &graph, const std::vector<SectionInput> &inputs,
+                   const ImageParts &parts, const fs::path &output,
+                   int output_fd, const std::string &output_name,
+                   const std::optional<avb::HashFooterArgs> &avb,
+                   uint64_t ramdisk_total) {
+  std::vector<TaskGraph::Node> built;
+  uint64_t inputs_size = 0;
+  for (const auto &input : inputs) {
+    if (input.built) built.push_back(*input.built);
+    if (!input.path.empty()) inputs_size += FileSize(input.path);
+  }
+  const std::string name = output.filename().native();
+  auto plan = [&]() -> std::optional<ImagePlan> {
+    LOG("Building to: %s",
+        utils::OutputName(output, output_fd, output_name).c_str());
+    auto image = parts.sections();
+    if (!image) return std::nullopt;
+    auto headers = parts.headers();
+    if (!headers) return std::nullopt;
+    for (auto &piece : *headers) image->pieces.push_back(std::move(piece));
+    return image;
+  };
+
+  if (output_fd >= 0 && !utils::AcceptsPositionedWrites(output_fd)) {
+    graph.Add(
+        "image_write", inputs_size,
+        [&] {
+          TraceSpan span("image_write", name);
+          JobStage("image_write", name, inputs_size);
+          auto image = plan();
+          return image && utils::WriteImage(output, output_fd, image->size,
+                                            image->pieces, avb);
+        },
+        built);
+    return RunBuildGraph(graph, output, ramdisk_total);
+  }
+
+  const int fd = output_fd >= 0 ? output_fd
+                                : open(output.c_str(),
+                                       O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                                       0644);
+  // An earlier, longer image in output_fd must not show through the padding.
+  if (fd < 0 || (output_fd >= 0 && ftruncate(fd, 0) != 0)) {
+    LOGE("Failed to open %s for writing", name.c_str());
+    return false;
+  }
+  // The header covers every ramdisk, even one with no section.
+  std::vector<TaskGraph::Node> written = built;
+  std::vector<TaskGraph::Node> placed_by;
+  for (const auto &input : inputs) {
+    if (input.built) placed_by.push_back(*input.built);
+    if (input.path.empty()) continue;
+    const fs::path path = input.path;
+    written.push_back(graph.Add(
+        "write " + path.filename().native(), FileSize(path),
+        [&parts, path, fd] {
+          auto sections = parts.sections();
+          if (!sections) return false;
+          for (const auto &piece : sections->pieces) {
+            if (piece.path == path) return WriteImagePiece(fd, piece);
+          }
+          return true;  // empty, so it has no section
+        },
+        placed_by));
+  }
+  graph.Add(
+      "image_write", 0,
+      [&] {
+        TraceSpan span("image_write", name);
+        JobStage("image_write", name, 0);
+        auto image = plan();
+        const bool ok =
+            image && utils::FinishImage(fd, image->size, image->pieces, avb);
+        span.SetOutput(output);
+        return ok;
+      },
+      std::move(written));
+  // The section writes report their bytes along with the ramdisk steps.
+  bool ok = RunBuildGraph(graph, output, ramdisk_total + inputs_size);
+  if (output_fd < 0) {
+    if (close(fd) != 0) ok = false;
+    std::error_code ec;
+    if (!ok) fs::remove(output, ec);
+  }
+  return ok;
+}
+
+// Unpacks a ramdisk of several segments: they are split out and decoded in
+// parallel, then extracted in order into one tree.
+bool UnpackRamdiskSegments(const fs::path &ramdisk_in, int fd,
+                           const std::vector<RamdiskSegment> &segments) {
+  const size_t count = segments.size();
+  LOG("%s has %zu segments", ramdisk_in.filename().c_str(), count);
+  std::error_code ec;
+  {
+    TraceSpan span("decompress", ramdisk_in.filename().native());
+    span.SetInput(ramdisk_in);
+    JobStage("decompress", ramdisk_in.filename().native(),
+             FileSize(ramdisk_in));
+    for (size_t i = 0; i < count; ++i) {
+      if (!WriteRamdiskSegment(fd, segments[i], SegmentPath(ramdisk_in, i))) {
+        RemoveSegments(ramdisk_in, count);
+        return false;
+      }
+    }
+    fs::remove(ramdisk_in, ec);
+    if (!ForEachSegment(count, [&](size_t i) {
+          const fs::path part = SegmentPath(ramdisk_in, i);
+          return DecompressSegment(part, part.string() + ".cpio",
+                                   segments[i].format);
+        })) {
+      RemoveSegments(ramdisk_in, count);
+      return false;
+    }
+  }
+
+  LOG("Decompressing %s using cpio", ramdisk_in.filename().c_str());
+  TraceSpan span("cpio_extract", ramdisk_in.filename().native());
+  uint64_t total = 0;
+  for (size_t i = 0; i < count; ++i) {
+    total += FileSize(SegmentPath(ramdisk_in, i).string() + ".cpio");
+  }
+  JobStage("cpio_extract", ramdisk_in.filename().native(), total);
+  for (size_t i = 0; i < count; ++i) {
+    if (!ExtractCPIO(SegmentPath(ramdisk_in, i).string() + ".cpio", ramdisk_in,
+                     SegmentTag(i, count))) {
+      RemoveSegments(ramdisk_in, count);
+      return false;
+    }
+  }
+  RemoveSegments(ramdisk_in, count);
+  return WriteSegmentLayout(segments, ramdisk_in / SEGMENTS_FILE);
+}
+}  // namespace
+
+bool UnpackRamdisk(fs::path &ramdisk_in, uint8_t compression_method) {
+  std::error_code ec;
+  const Codec *codec = FindCodec(compression_method);
+  if (codec == nullptr) {
+    LOG("Compression method is unknown!");
+    LOG("%s will be kept compressed!", ramdisk_in.filename().c_str());
+    return true;
+  }
+  if (int fd = open(ramdisk_in.c_str(), O_RDONLY | O_CLOEXEC); fd >= 0) {
+    const auto segments = FindRamdiskSegments(fd, 0, FileSize(ramdisk_in));
+    bool ret = true;
+    if (segments.size() > 1) {
+      ret = UnpackRamdiskSegments(ramdisk_in, fd, segments);
+    }
+    close(fd);
+    if (segments.size() > 1) return ret;
+  }
+  fs::path ramdisk_tmp = ramdisk_in.string() + ".tmp";
+  {
+    TraceSpan span("decompress", ramdisk_in.filename().native());
+    span.SetInput(ramdisk_in);
+    JobStage("decompress", ramdisk_in.filename().native(), FileSize(ramdisk_in));
+    if (!DecompressRamdisk(ramdisk_in, ramdisk_tmp, *codec,
+                           ramdisk_in.filename())) {
+      return false;
+    }
+    span.SetOutput(ramdisk_tmp);
+  }
+  LOG("Decompressing %s using cpio", ramdisk_in.filename().c_str());
+  TraceSpan span("cpio_extract", ramdisk_in.filename().native());
+  span.SetInput(ramdisk_tmp);
+  JobStage("cpio_extract", ramdisk_in.filename().native(),
+           FileSize(ramdisk_tmp));
+  if (!ExtractCPIO(ramdisk_tmp, ramdisk_in)) {
+    return false;
+  }
+  fs::remove_all(ramdisk_tmp, ec);
+  return true;
+}
+
+std::string GenRandomString(std::size_t length) {
+  const std::string charset =
+      "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+  std::random_device rd;
+  std::mt19937 generator(rd());
+
+  std::uniform_int_distribution<> distribution(
+      0, static_cast<int>(charset.size() - 1));
+
+  std::string randomString;
+  randomString.reserve(length);
+
+  for (std::size_t i = 0; i < length; ++i) {
+    randomString += charset[distribution(generator)];
+  }
+
+  return randomString;
+}
+
+void try_clean(const fs::path &directory, const std::string &extension) {
+  std::error_code ec;
+  try {
+    for (const auto &entry : fs::directory_iterator(directory)) {
+      if (entry.is_regular_file() && entry.path().extension() == extension) {
+        fs::remove(entry.path(), ec);
+      }
+    }
+  } catch (...) {
+  }
+}
+
+namespace {
+// Loads the AVB footer settings unpack left in workdir. Having none is fine;
+// a config that is present but unusable fails the build.
+bool LoadFooterArgs(const std::string &workdir,
+                    std::optional<avb::HashFooterArgs> &footer) {
+  std::error_code ec;
+  const fs::path path = fs::path(workdir) / avb::AVB_FOOTER_CONFIG;
+  if (!fs::exists(path, ec)) return true;
+  footer = avb::ReadFooterConfig(path);
+  if (!footer) LOGE("Invalid %s", path.filename().c_str());
+  return footer.has_value();
+}
+
+// The image goes to <workdir>/image-new (vendor_boot-new), or into output_fd
+// when that is set, leaving any earlier image in workdir alone.
+bool BuildFromWorkdir(const std::string &workdir, int output_fd,
+                      const std::string &output_name) {
+  std::error_code ec;
+  const fs::path config_file = fs::path(workdir) / CONFIG_FILE;
+  std::optional<ImageConfig> config;
+  {
+    TraceSpan span("config_read", CONFIG_FILE);
+    span.SetInput(config_file);
+    config = ReadParserConfig(config_file);
+  }
+  if (!config) return false;
+
+  bool ret = false;
+  if (const auto *boot = std::get_if<BootImageInfo>(&*config)) {
+    LOG("boot magic: %s", s_boot_magic.c_str());
+    const BootImageInfo &info = *boot;
+    auto ramdisk = fs::path(workdir) / fs::path("ramdisk");
+    auto ramdisk_build = fs::path(ramdisk.string() + ".build");
+    TaskGraph graph;
+    uint64_t ramdisk_total = 0;
+    const auto ramdisk_built =
+        AddRamdiskBuild(graph, ramdisk, ramdisk_build,
+                        info.ramdisk_compression, ramdisk_total);
+    BootImageArgs args;
+    if (info.kernel_size > 0) {
+      args.kernel = fs::path(fs::path(workdir) / "kernel");
+      args.kernel_offset = info.kernel_load_address;
+    }
+    if (info.ramdisk_size > 0) {
+      args.ramdisk = ramdisk_build;
+      args.ramdisk_offset = info.ramdisk_load_address;
+    }
+    if (info.second_size > 0) {
+      args.second = fs::path(fs::path(workdir) / "second");
+      args.second_offset = info.second_load_address;
+    }
+    if (info.dtb_size > 0) {
+      args.dtb = fs::path(fs::path(workdir) / "dtb");
+      args.dtb_offset = info.dtb_load_address;
+    }
+    if (info.recovery_dtbo_size > 0) {
+      args.recovery_dtbo = fs::path(fs::path(workdir) / "recovery_dtbo");
+    }
+    args.tags_offset = info.tags_load_address;
+    args.os_version.patch_level_str = info.os_patch_level;
+    args.os_version.version_str = info.os_version;
+    args.header_version = info.header_version;
+    args.board = info.product_name;
+    args.base =
+        0x0;  // unpackbootimg returns offsets with base already being included
+    args.page_size = info.page_size;
+    args.cmdline = info.cmdline;
+    if (!info.extra_cmdline.empty()) args.cmdline += " " + info.extra_cmdline;
+    if (!LoadFooterArgs(workdir, args.avb)) return false;
+    args.output = fs::path(workdir) / fs::path("image-new");
+    args.output_fd = output_fd;
+    args.output_name = output_name;
+    if (output_fd < 0) fs::remove_all(args.output, ec);
+    ret = RunImageBuild(
+        graph,
+        {{args.kernel, {}},
+         {args.ramdisk, ramdisk_built},
+         {args.second, {}},
+         {args.recovery_dtbo, {}},
+         {args.dtb, {}}},
+        {[&] { return BootImageSections(args); },
+         [&]() -> std::optional<std::vector<ImagePiece>> {
+           auto header = BootImageHeader(args);
+           if (!header) return std::nullopt;
+           return std::vector<ImagePiece>{std::move(*header)};
+         }},
+        args.output, output_fd, output_name, args.avb, ramdisk_total);
+    try_clean(workdir, ".build");
+  } else {
+    LOG("boot magic: %s", s_vendor_boot_magic.c_str());
+    const auto &info = std::get<VendorBootImageInfo>(*config);
+    VendorBootArgs args;
+    if (info.dtb_size > 0) {
+      args.dtb = fs::path(fs::path(workdir) / "dtb");
+      args.dtb_offset = info.dtb_load_address;
+    }
+    args.tags_offset = info.tags_load_address;
+    args.page_size = info.page_size;
+    args.header_version = info.header_version;
+    args.kernel_offset = info.kernel_load_address;
+    args.ramdisk_offset = info.ramdisk_load_address;
+    args.board = info.product_name;
+    args.base =
+        0x0;  // unpackbootimg returns offsets with base already being included
+    if (info.vendor_bootconfig_size > 0) {
+      args.bootconfig = fs::path(fs::path(workdir) / "bootconfig");
+    }
+    args.vendor_cmdline = info.cmdline;
+    // Every ramdisk fragment builds independently; the image waits on all.
+    TaskGraph graph;
+    uint64_t ramdisk_total = 0;
+    std::vector<TaskGraph::Node> ramdisks_built;
+    std::vector<VendorRamdiskEntry> rds;
+    if (info.header_version > 3) {
+        for (const auto &i: info.vendor_ramdisk_table) {
+            VendorRamdiskEntry entry;
+            auto ramdisk = fs::path(workdir) / fs::path(i.output_name);
+            auto ramdisk_build = fs::path(ramdisk.string() + ".build");
+            ramdisks_built.push_back(
+                AddRamdiskBuild(graph, ramdisk, ramdisk_build,
+                                i.ramdisk_compression, ramdisk_total));
+            entry.path = ramdisk_build;
+            entry.type = i.type;
+            entry.name = i.name;
+            rds.push_back(entry);
+        }
+    } else {
+        auto ramdisk = fs::path(workdir) / fs::path("vendor_ramdisk");
+        auto ramdisk_build = fs::path(ramdisk.string() + ".build");
+        ramdisks_built.push_back(
+            AddRamdiskBuild(graph, ramdisk, ramdisk_build,
+                            info.ramdisk_compression, ramdisk_total));
+        args.vendor_ramdisk = ramdisk_build;
+    }
+    args.ramdisks = rds;
+    if (!LoadFooterArgs(workdir, args.avb)) return false;
+    args.output = fs::path(workdir) / fs::path("vendor_boot-new");
+    args.output_fd = output_fd;
+    args.output_name = output_name;
+    if (output_fd < 0) fs::remove_all(args.output, ec);
+    // Ramdisks were added to the graph in layout order.
+    std::vector<SectionInput> inputs;
+    if (info.header_version > 3) {
+      for (size_t i = 0; i < rds.size(); ++i) {
+        inputs.push_back({rds[i].path, ramdisks_built[i]});
+      }
+    } else {
+      inputs.push_back({args.vendor_ramdisk, ramdisks_built[0]});
+    }
+    inputs.push_back({args.dtb, {}});
+    inputs.push_back({args.bootconfig, {}});
+    const fs::path output = args.output;
+    const auto avb = args.avb;
+    VendorBootBuilder builder(std::move(args));
+    ret = RunImageBuild(graph, inputs,
+                        {[&] { return builder.Sections(); },
+                         [&] { return builder.Headers(); }},
+                        output, output_fd, output_name, avb, ramdisk_total);
+    try_clean(workdir, ".build");
+  }
+
+  return ret;
+}
+}  // namespace
+
+bool mkbootimg_wrapper(const std::string &workdir, int output_fd,
+                       const std::string &output_name) {
+  bool ret = BuildFromWorkdir(workdir, output_fd, output_name);
+  // Failed or cancelled builds leave their intermediate ramdisks behind.
+  if (!ret) {
+    try_clean(workdir, ".build");
+    try_clean(workdir, ".tmp");
+  }
+  return ret;
+}
+
+namespace {
+// Saves the settings of the AVB footer at the end of fd, if it has one, for
+// the build to recreate it.
+bool SaveHashFooter(int fd, const std::string &workdir) {
+  auto footer = avb::ReadHashFooter(fd);
+  if (!footer) return true;
+  LOG("AVB footer: %s, partition size %llu, %s",
+      footer->args.partition_name.c_str(),
+      static_cast<unsigned long long>(footer->args.partition_size),
+      footer->algorithm.c_str());
+  if (!avb::WriteFooterConfig(*footer,
+                              fs::path(workdir) / avb::AVB_FOOTER_CONFIG)) {
+    LOGE("Failed to write %s", std::string(avb::AVB_FOOTER_CONFIG).c_str());
+    return false;
+  }
+  return true;
+}
+
+bool DecompressRamdisks(
+    const std::optional<BootImageInfo> &boot_info,
+    const std::optional<VendorBootImageInfo> &vendor_boot_info,
+    const std::string &workdir) {
+  if (boot_info && boot_info->ramdisk_compression != FORMAT_OTHER) {
+    fs::path ramdisk_in = fs::path(workdir) / "ramdisk";
+    return UnpackRamdisk(ramdisk_in, boot_info->ramdisk_compression);
+  }
+  if (!vendor_boot_info) return true;
+  if (vendor_boot_info->header_version > 3) {
+    for (const auto &i : vendor_boot_info->vendor_ramdisk_table) {
+      if (i.ramdisk_compression == FORMAT_OTHER) continue;
+      fs::path ramdisk_in = fs::path(workdir) / i.output_name;
+      if (!UnpackRamdisk(ramdisk_in, i.ramdisk_compression)) return false;
+    }
+  } else if (vendor_boot_info->ramdisk_compression != FORMAT_OTHER) {
+    fs::path ramdisk_in = fs::path(workdir) / "vendor_ramdisk";
+    return UnpackRamdisk(ramdisk_in, vendor_boot_info->ramdisk_compression);
+  }
+  return true;
+}
+
+// Unpacks an image from a pipe or socket in one forward pass: the header
+// gives the order of the sections, and what follows the last one is kept
+// only as far as it is needed to find an AVB footer.
+bool UnpackStream(int fd, const std::string &workdir, bool dec_ramdisk) {
+  LOG("Input is not seekable; unpacking in one pass");
+  utils::StreamReader in(fd);
+  const auto magic = in.Peek(8);
+  const std::string_view magic_str(reinterpret_cast<const char *>(magic.data()),
+                                   magic.size());
+
+  std::optional<BootImageInfo> boot_info;
+  std::optional<VendorBootImageInfo> vendor_boot_info;
+  if (magic_str == s_boot_magic) {
+    LOG("boot magic: %s", s_boot_magic.c_str());
+    boot_info = UnpackBootImage(in, workdir, dec_ramdisk);
+  } else if (magic_str == s_vendor_boot_magic) {
+    LOG("boot magic: %s", s_vendor_boot_magic.c_str());
+    vendor_boot_info = UnpackVendorBootImage(in, workdir, dec_ramdisk);
+  } else {
+    LOGE("Invalid boot magic: %s", utils::toHexString(magic_str).c_str());
+    return false;
+  }
+  if (!boot_info && !vendor_boot_info) {
+    LOGE("Failed to unpack boot image");
+    return false;
+  }
+
+  // The footer sits at the very end of the partition and points back at
+  // vbmeta, so the tail is spooled sparsely at its own offsets and read as
+  // if it were the image.
+  const fs::path tail_path = fs::path(workdir) / ".image_tail";
+  std::error_code ec;
+  bool ok = false;
+  {
+    TraceSpan span("stream_tail");
+    if (in.SpoolRest(tail_path)) {
+      int tail = open(tail_path.c_str(), O_RDONLY | O_CLOEXEC);
+      ok = tail >= 0 && SaveHashFooter(tail, workdir);
+      if (tail >= 0) close(tail);
+    } else {
+      LOGE("Error reading the end of the image");
+    }
+  }
+  fs::remove(tail_path, ec);
+  if (!ok) return false;
+
+  if (!DecompressRamdisks(boot_info, vendor_boot_info, workdir)) return false;
+
+  Session *session = Session::Current();
+  if (session != nullptr && session->seek_index()) {
+    LOG("Seek index skipped: it needs a seekable image");
+  }
+  return true;
+}
+}  // namespace
+
+bool unpackbootimg_wrapper(int fd, const std::string &workdir,
+                           bool dec_ramdisk) {
+  if (!utils::CreateDirectory(workdir)) {
+    LOGE("Could not create output directory");
+    return false;
+  }
+  if (!IsSeekable(fd)) return UnpackStream(fd, workdir, dec_ramdisk);
+
+  char magic[8];
+  if (!ReadFullyAt(fd, magic, sizeof(magic), 0)) {
+    LOGE("Failed to read boot magic");
+    return false;
+  }
+
+  std::optional<BootImageInfo> boot_info;
+  std::optional<VendorBootImageInfo> vendor_boot_info;
+
+  if (std::string_view(magic, 8) == s_boot_magic) {
+    LOG("boot magic: %s", s_boot_magic.c_str());
+    boot_info = UnpackBootImage(fd, workdir, dec_ramdisk);
+  } else if (std::string_view(magic, 8) == s_vendor_boot_magic) {
+    LOG("boot magic: %s", s_vendor_boot_magic.c_str());
+    vendor_boot_info = UnpackVendorBootImage(fd, workdir, dec_ramdisk);
+  } else {
+    LOGE("Invalid boot magic: %s",
+         utils::toHexString(std::string_view(magic, 8)).c_str());
+    return false;
+  }
+
+  if (!boot_info && !vendor_boot_info) {
+    LOGE("Failed to unpack boot image");
+    return false;
+  }
+
+  if (!SaveHashFooter(fd, workdir)) return false;
+  if (dec_ramdisk &&
+      !DecompressRamdisks(boot_info, vendor_boot_info, workdir)) {
+    return false;
+  }
+
+  Session *session = Session::Current();
+  if (session != nullptr && session->seek_index()) {
+    LOG("Indexing ramdisks");
+    TraceSpan span("seek_index", fs::path(workdir).filename().native());
+    if (!WriteSeekIndex(fd, fs::path(workdir) / SEEK_INDEX_FILE)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+namespace {
+// Claims a fresh directory/input_name for one job.
+std::optional<fs::path> MakeWorkdir(const std::string &directory,
+                                    std::string input_name) {
+  if (input_name.empty()) input_name = GenRandomString(16);
+  std::string workdir = directory + "/" + input_name;
+
+  try {
+    std::filesystem::create_directories(directory);
+  } catch (...) {
+    LOGE("Failed to create: %s", workdir.c_str());
+    return std::nullopt;
+  }
+
+  auto unique_work_dir = get_unique_path(workdir);
+  if (!utils::CreateDirectory(unique_work_dir)) {
+    LOGE("Failed to create: %s", unique_work_dir.c_str());
+    return std::nullopt;
+  }
+  return unique_work_dir;
+}
+
+// Runs job under its own trace when the bound session asks for tracing, and
+// writes the trace to <project>.trace.json beside the project directory.
+template <typename F>
+bool Traced(fs::path project, const char *name, F &&job) {
+  Session *session = Session::Current();
+  if (session == nullptr || !session->tracing()) return job();
+  if (!project.has_filename()) project = project.parent_path();
+
+  Trace trace;
+  session->set_trace(&trace);
+  bool ret;
+  {
+    TraceSpan span(name, project.filename().native());
+    ret = job();
+  }
+  session->set_trace(nullptr);
+
+  const fs::path output = project.string() + ".trace.json";
+  if (trace.WriteChromeJson(output)) {
+    LOG("Trace written to %s", output.filename().c_str());
+  } else {
+    LOGE("Error writing trace %s", output.string().c_str());
+  }
+  return ret;
+}
+
+void LogBatchSummary(const std::vector<BatchResult> &results) {
+  const auto ok = std::count_if(results.begin(), results.end(),
+                                [](const auto &r) { return r.ok; });
+  LOG("Batch finished: %zu/%zu succeeded", static_cast<size_t>(ok),
+      results.size());
+}
+}  // namespace
+
+bool UnpackImage(int fd, const std::string &directory, std::string input_name,
+                 bool extract_ramdisk) {
+  if (fd < 0) {
+    LOGE("Input file descriptor is invalid");
+    return false;
+  }
+
+  auto workdir = MakeWorkdir(directory, std::move(input_name));
+  if (!workdir) return false;
+
+  auto [ret, elapsed] = measure([&] {
+    return Traced(*workdir, "unpack", [&] {
+      return unpackbootimg_wrapper(fd, workdir->string(), extract_ramdisk);
+    });
+  });
+
+  std::error_code ec;
+  if (!ret) fs::remove_all(*workdir, ec);
+
+  LOG(ret ? "Done in %.1fs!" : "Failed in %.1fs!", elapsed.count());
+  return ret;
+}
+
+bool BuildImage(const std::string &workdir, int output_fd,
+                const std::string &output_name) {
+  if (workdir.empty()) {
+    LOGE("No input directory");
+    return false;
+  }
+
+  auto [ret, elapsed] = measure([&] {
+    return Traced(workdir, "build",
+                  [&] {
+                    return mkbootimg_wrapper(workdir, output_fd, output_name);
+                  });
+  });
+
+  LOG(ret ? "Done in %.1fs!" : "Failed in %.1fs!", elapsed.count());
+  return ret;
+}
+
+bool ExtractImageEntries(int fd, const std::string &directory,
+                         std::string input_name,
+                         const std::vector<std::string> &patterns,
+                         const std::string &index) {
+  if (fd < 0) {
+    LOGE("Input file descriptor is invalid");
+    return false;
+  }
+  if (patterns.empty()) {
+    LOGE("Nothing to extract");
+    return false;
+  }
+
+  auto workdir = MakeWorkdir(directory, std::move(input_name));
+  if (!workdir) return false;
+
+  auto [ret, elapsed] = measure([&] {
+    return Traced(*workdir, "extract_entries", [&] {
+      return ExtractRamdiskEntries(fd, patterns, *workdir, index);
+    });
+  });
+
+  std::error_code ec;
+  if (!ret) fs::remove_all(*workdir, ec);
+
+  LOG(ret ? "Done in %.1fs!" : "Failed in %.1fs!", elapsed.count());
+  return ret;
+}
+
+bool PatchImageRamdisk(int fd, const std::string &ramdisk,
+                       const std::string &spec, const std::string &output) {
+  if (fd < 0) {
+    LOGE("Input file descriptor is invalid");
+    return false;
+  }
+
+  auto ops = ParseRamdiskOps(spec);
+  auto sections = LocateRamdisks(fd);
+  if (!ops || !sections) return false;
+
+  auto section = std::find_if(sections->begin(), sections->end(),
+                              [&](const auto &s) { return s.name == ramdisk; });
+  if (section == sections->end()) {
+    LOGE("No ramdisk named %s", ramdisk.c_str());
+    return false;
+  }
+
+  int out_fd =
+      open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (out_fd < 0) {
+    LOGE("Error creating output file: %s", output.c_str());
+    return false;
+  }
+
+  auto [ret, elapsed] = measure([&] {
+    return Traced(output, "patch", [&] {
+      return PatchRamdisk(fd, *section, *ops, out_fd, section->format);
+    });
+  });
+  if (close(out_fd) != 0) ret = false;
+
+  std::error_code ec;
+  if (!ret) fs::remove(output, ec);
+
+  LOG(ret ? "Done in %.1fs!" : "Failed in %.1fs!", elapsed.count());
+  return ret;
+}
+
+namespace {
+bool PatchHeaderInPlace(int fd, const ImageHeaderPatch &patch) {
+  char magic[8];
+  if (!ReadFullyAt(fd, magic, sizeof(magic), 0)) {
+    LOGE("Failed to read boot magic");
+    return false;
+  }
+  const std::string_view kind(magic, sizeof(magic));
+
+  if (kind == s_boot_magic) {
+    if (patch.bootconfig) {
+      LOGE("Boot images have no bootconfig section");
+      return false;
+    }
+    BootImagePatch boot_patch;
+    boot_patch.cmdline = patch.cmdline;
+    boot_patch.os_version = patch.os_version;
+    boot_patch.os_patch_level = patch.os_patch_level;
+    boot_patch.board = patch.board;
+    boot_patch.avb_key = patch.avb_key;
+    return PatchBootImage(fd, boot_patch);
+  }
+  if (kind == s_vendor_boot_magic) {
+    if (patch.os_version || patch.os_patch_level) {
+      LOGE("vendor_boot images have no OS version");
+      return false;
+    }
+    VendorBootImagePatch vendor_patch;
+    vendor_patch.vendor_cmdline = patch.cmdline;
+    vendor_patch.board = patch.board;
+    if (patch.bootconfig) vendor_patch.bootconfig = fs::path(*patch.bootconfig);
+    vendor_patch.avb_key = patch.avb_key;
+    return PatchVendorBootImage(fd, vendor_patch);
+  }
+  LOGE("Invalid boot magic: %s", utils::toHexString(kind).c_str());
+  return false;
+}
+}  // namespace
+
+bool PatchImageHeader(int fd, const ImageHeaderPatch &patch,
+                      const std::string &output) {
+  if (fd < 0) {
+    LOGE("Input file descriptor is invalid");
+    return false;
+  }
+
+  int out_fd = open(output.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    0644);
+  if (out_fd < 0) {
+    LOGE("Error creating output file: %s", output.c_str());
+    return false;
+  }
+
+  LOG("Patching header of: %s", fs::path(output).filename().c_str());
+  auto [ret, elapsed] = measure([&] {
+    return Traced(output, "patch_header", [&] {
+      if (!CloneFile(fd, out_fd)) {
+        LOGE("Error copying the image");
+        return false;
+      }
+      return PatchHeaderInPlace(out_fd, patch);
+    });
+  });
+  if (close(out_fd) != 0) ret = false;
+
+  std::error_code ec;
+  if (!ret) fs::remove(output, ec);
+
+  LOG(ret ? "Done in %.1fs!" : "Failed in %.1fs!", elapsed.count());
+  return ret;
+}
+
+JobId StartUnpackImage(std::unique_ptr<LogSink> sink, bool tracing, int fd,
+                       std::string directory, std::string input_name,
+                       bool extract_ramdisk) {
+  const int job_fd = fd >= 0 ? fcntl(fd, F_DUPFD_CLOEXEC, 0) : -1;
+  return StartJob(std::move(sink), LEVEL_EXTRACT, tracing,
+                  [job_fd, directory = std::move(directory),
+                   input_name = std::move(input_name), extract_ramdisk] {
+                    bool ret = UnpackImage(job_fd, directory, input_name,
+                                           extract_ramdisk);
+                    if (job_fd >= 0) close(job_fd);
+                    return ret;
+                  });
+}
+
+JobId StartBuildImage(std::unique_ptr<LogSink> sink, bool tracing,
+                      std::string workdir, int output_fd) {
+  const int job_fd =
+      output_fd >= 0 ? fcntl(output_fd, F_DUPFD_CLOEXEC, 0) : -1;
+  return StartJob(std::move(sink), LEVEL_BUILD, tracing,
+                  [job_fd, workdir = std::move(workdir)] {
+                    bool ret = BuildImage(workdir, job_fd);
+                    if (job_fd >= 0) close(job_fd);
+                    return ret;
+                  });
+}
+
+std::vector<BatchResult> UnpackImages(const Session &session,
+                                      const std::vector<int> &fds,
+                                      const std::vector<std::string> &names,
+                                      const std::string &directory,
+                                      bool extract_ramdisk,
+                                      const BatchLimits &limits) {
+  // Work directories are claimed up front, so jobs with the same name
+  // cannot race for one.
+  std::vector<BatchJob> jobs;
+  for (size_t i = 0; i < fds.size(); ++i) {
+    const int fd = fds[i];
+    auto workdir =
+        MakeWorkdir(directory, i < names.size() ? names[i] : std::string());
+    const std::string name =
+        workdir ? workdir->filename().string() : std::string();
+
+    struct stat st {};
+    const uint64_t cost =
+        fd >= 0 && fstat(fd, &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+    jobs.push_back(BatchJob{
+        name, cost, [fd, workdir, extract_ramdisk] {
+          if (fd < 0) {
+            LOGE("Input file descriptor is invalid");
+            return false;
+          }
+          if (!workdir) return false;
+          bool ret = Traced(*workdir, "unpack", [&] {
+            return unpackbootimg_wrapper(fd, workdir->string(), extract_ramdisk);
+          });
+          std::error_code ec;
+          if (!ret) fs::remove_all(*workdir, ec);
+          return ret;
+        }});
+  }
+
+  auto results = RunBatch(session, jobs, limits);
+  LogBatchSummary(results);
+  return results;
+}
+
+std::vector<BatchResult> BuildImages(const Session &session,
+                                     const std::vector<std::string> &workdirs,
+                                     const BatchLimits &limits) {
+  std::vector<BatchJob> jobs;
+  for (const auto &workdir : workdirs) {
+    jobs.push_back(BatchJob{fs::path(workdir).filename().string(),
+                            DirectorySize(workdir), [workdir] {
+                              if (workdir.empty()) {
+                                LOGE("No input directory");
+                                return false;
+                              }
+                              return Traced(workdir, "build", [&] {
+                                return mkbootimg_wrapper(workdir);
+                              });
+                            }});
+  }
+
+  auto results = RunBatch(session, jobs, limits);
+  LogBatchSummary(results);
+  return results;
+}
@@ -0,0 +1,157 @@
+#include "buffer_pool.h"
+
+#include <algorithm>
+#include <new>
+#include <utility>
+
+namespace {
+// Enough for a couple of concurrent jobs each streaming one section.
+constexpr size_t DEFAULT_BUDGET = 16 * POOL_BUFFER_SIZE;
+
+char *Allocate() {
+  return static_cast<char *>(::operator new(
+      POOL_BUFFER_SIZE, std::align_val_t(POOL_BUFFER_ALIGNMENT)));
+}
+
+void Free(char *data) {
+  ::operator delete(data, std::align_val_t(POOL_BUFFER_ALIGNMENT));
+}
+}  // namespace
+
+BufferPool::Buffer::Buffer(Buffer &&other) noexcept
+    : pool_(std::exchange(other.pool_, nullptr)),
+      data_(std::exchange(other.data_, nullptr)) {}
+
+BufferPool::Buffer &BufferPool::Buffer::operator=(Buffer &&other) noexcept {
+  if (this != &other) {
+    if (pool_) pool_->Release(data_);
+    pool_ = std::exchange(other.pool_, nullptr);
+    data_ = std::exchange(other.data_, nullptr);
+  }
+  return *this;
+}
+
+BufferPool::Buffer::~Buffer() {
+  if (pool_) pool_->Release(data_);
+}
+
+BufferPool::Charge::Charge(Charge &&other) noexcept
+    : pool_(std::exchange(other.pool_, nullptr)),
+      buffers_(std::exchange(other.buffers_, 0)),
+      bytes_(std::exchange(other.bytes_, 0)) {}
+
+BufferPool::Charge &BufferPool::Charge::operator=(Charge &&other) noexcept {
+  if (this != &other) {
+    if (pool_) pool_->Unreserve(buffers_);
+    pool_ = std::exchange(other.pool_, nullptr);
+    buffers_ = std::exchange(other.buffers_, 0);
+    bytes_ = std::exchange(other.bytes_, 0);
+  }
+  return *this;
+}
+
+BufferPool::Charge::~Charge() {
+  if (pool_) pool_->Unreserve(buffers_);
+}
+
+bool BufferPool::Charge::Set(size_t bytes) {
+  const size_t buffers = (bytes + POOL_BUFFER_SIZE - 1) / POOL_BUFFER_SIZE;
+  if (buffers > buffers_) {
+    if (!pool_ || !pool_->Reserve(buffers - buffers_)) return false;
+  } else if (pool_) {
+    pool_->Unreserve(buffers_ - buffers);
+  }
+  buffers_ = buffers;
+  bytes_ = bytes;
+  return true;
+}
+
+BufferPool &BufferPool::Shared() {
+  static BufferPool pool(DEFAULT_BUDGET);
+  return pool;
+}
+
+BufferPool::BufferPool(size_t budget)
+    : limit_(std::max<size_t>(1, budget / POOL_BUFFER_SIZE)) {}
+
+BufferPool::~BufferPool() {
+  for (char *data : idle_) Free(data);
+}
+
+void BufferPool::SetBudget(size_t bytes) {
+  std::lock_guard lock(mutex_);
+  limit_ = std::max<size_t>(1, bytes / POOL_BUFFER_SIZE);
+  while (allocated_ > limit_ && !idle_.empty()) {
+    Free(idle_.back());
+    idle_.pop_back();
+    --allocated_;
+  }
+  cv_.notify_all();
+}
+
+size_t BufferPool::budget() const {
+  std::lock_guard lock(mutex_);
+  return limit_ * POOL_BUFFER_SIZE;
+}
+
+BufferPool::Buffer BufferPool::Acquire() {
+  std::unique_lock lock(mutex_);
+  cv_.wait(lock, [this] { return !idle_.empty() || allocated_ < limit_; });
+  if (!idle_.empty()) {
+    char *data = idle_.back();
+    idle_.pop_back();
+    return Buffer(this, data);
+  }
+  ++allocated_;
+  lock.unlock();
+  try {
+    return Buffer(this, Allocate());
+  } catch (...) {
+    lock.lock();
+    --allocated_;
+    cv_.notify_one();
+    throw;
+  }
+}
+
+void BufferPool::Release(char *data) {
+  {
+    std::lock_guard lock(mutex_);
+    if (allocated_ > limit_) {
+      --allocated_;
+    } else {
+      idle_.push_back(data);
+      data = nullptr;
+    }
+  }
+  if (data) Free(data);
+  cv_.notify_one();
+}
+
+std::optional<BufferPool::Charge> BufferPool::TryCharge(size_t bytes) {
+  Charge charge(this);
+  if (!charge.Set(bytes)) return std::nullopt;
+  return charge;
+}
+
+bool BufferPool::Reserve(size_t buffers) {
+  std::lock_guard lock(mutex_);
+  // Idle buffers give way to the charge.
+  while (allocated_ + buffers > limit_ && !idle_.empty()) {
+    Free(idle_.back());
+    idle_.pop_back();
+    --allocated_;
+  }
+  if (allocated_ + buffers > limit_) return false;
+  allocated_ += buffers;
+  return true;
+}
+
+void BufferPool::Unreserve(size_t buffers) {
+  if (buffers == 0) return;
+  {
+    std::lock_guard lock(mutex_);
+    allocated_ -= buffers;
+  }
+  cv_.notify_all();
+}
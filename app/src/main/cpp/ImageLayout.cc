@@ -0,0 +1,264 @@
+#include "image_layout.h"
+
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "buffer_pool.h"
+#include "job.h"
+#include "log.h"
+#include "scheduler.h"
+#include "tools.h"
+
+namespace {
+constexpr uint32_t BOOT_IMAGE_HEADER_V3_PAGESIZE = 4096;
+// Copies are split so progress and cancellation are seen while they run.
+constexpr uint64_t COPY_CHUNK_SIZE = 8 << 20;
+
+uint64_t RoundUp(uint64_t size, uint64_t page_size) {
+  return (size + page_size - 1) / page_size * page_size;
+}
+
+bool CopyChunk(int in, off_t &in_pos, int out, off_t &out_pos, size_t size,
+               bool &kernel_copy) {
+  while (kernel_copy && size > 0) {
+    // Raw syscall: bionic only exposes copy_file_range from API 34.
+    auto n = syscall(__NR_copy_file_range, in, &in_pos, out, &out_pos, size, 0);
+    if (n <= 0) {
+      // Unavailable across filesystems on older kernels; not worth retrying
+      // for the rest of the file.
+      kernel_copy = false;
+      break;
+    }
+    size -= static_cast<size_t>(n);
+  }
+  if (size == 0) return true;
+
+  auto buffer = BufferPool::Shared().Acquire();
+  while (size > 0) {
+    const size_t length = std::min(size, buffer.size());
+    if (!ReadFullyAt(in, buffer.data(), length, in_pos) ||
+        !WriteFullyAt(out, buffer.data(), length, out_pos)) {
+      return false;
+    }
+    in_pos += static_cast<off_t>(length);
+    out_pos += static_cast<off_t>(length);
+    size -= length;
+  }
+  return true;
+}
+
+// Produces the image in offset order, the gaps as zeroes, handing it to
+// emit a buffer at a time. Only the pieces' sources are read.
+bool WalkImage(uint64_t size, const std::vector<ImagePiece> &pieces,
+               bool report_progress,
+               const std::function<bool(const uint8_t *, size_t)> &emit) {
+  std::vector<const ImagePiece *> order;
+  for (const auto &piece : pieces) order.push_back(&piece);
+  std::sort(order.begin(), order.end(),
+            [](const ImagePiece *a, const ImagePiece *b) {
+              return a->offset < b->offset;
+            });
+
+  auto buffer = BufferPool::Shared().Acquire();
+  uint64_t pos = 0;
+  auto advance = [&](const uint8_t *data, size_t length) {
+    pos += length;
+    return emit(data, length);
+  };
+  auto pad_to = [&](uint64_t end) {
+    std::fill_n(buffer.data(), std::min<uint64_t>(end - pos, buffer.size()), 0);
+    while (pos < end) {
+      const auto length =
+          static_cast<size_t>(std::min<uint64_t>(end - pos, buffer.size()));
+      if (!advance(reinterpret_cast<const uint8_t *>(buffer.data()), length)) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  for (const ImagePiece *piece : order) {
+    if (piece->offset < pos) {
+      LOGE("Overlapping sections at offset %llu",
+           static_cast<unsigned long long>(piece->offset));
+      return false;
+    }
+    if (!pad_to(piece->offset)) return false;
+    if (piece->path.empty()) {
+      if (!advance(reinterpret_cast<const uint8_t *>(piece->data.data()),
+                   piece->data.size())) {
+        return false;
+      }
+      continue;
+    }
+
+    int in = open(piece->path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+      LOGE("Failed to open %s", piece->path.filename().c_str());
+      return false;
+    }
+    bool ok = true;
+    for (uint64_t copied = 0; ok && copied < piece->size;) {
+      const auto length = static_cast<size_t>(
+          std::min<uint64_t>(piece->size - copied, buffer.size()));
+      ok = !JobCancelled() &&
+           ReadFullyAt(in, buffer.data(), length,
+                       static_cast<off_t>(copied)) &&
+           advance(reinterpret_cast<const uint8_t *>(buffer.data()), length);
+      copied += length;
+      if (report_progress) JobProgress(length);
+    }
+    close(in);
+    if (!ok) {
+      LOGE("Failed to copy %s", piece->path.filename().c_str());
+      return false;
+    }
+  }
+  return pad_to(size);
+}
+}  // namespace
+
+bool WriteImagePiece(int out, const ImagePiece &piece) {
+  if (piece.path.empty()) {
+    return WriteFullyAt(out, piece.data.data(), piece.data.size(),
+                        static_cast<off_t>(piece.offset));
+  }
+  int in = open(piece.path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    LOGE("Failed to open %s", piece.path.filename().c_str());
+    return false;
+  }
+  off_t in_pos = 0;
+  auto out_pos = static_cast<off_t>(piece.offset);
+  bool kernel_copy = true;
+  bool ok = true;
+  for (uint64_t copied = 0; ok && copied < piece.size;) {
+    if (JobCancelled()) {
+      ok = false;
+      break;
+    }
+    const auto length =
+        static_cast<size_t>(std::min(piece.size - copied, COPY_CHUNK_SIZE));
+    ok = CopyChunk(in, in_pos, out, out_pos, length, kernel_copy);
+    if (!ok) LOGE("Failed to copy %s", piece.path.filename().c_str());
+    copied += length;
+    JobProgress(length);
+  }
+  close(in);
+  return ok;
+}
+
+bool ObserveImage(
+    uint64_t size, const std::vector<ImagePiece> &pieces,
+    const std::function<void(const uint8_t *, size_t)> &observe) {
+  return WalkImage(size, pieces, false,
+                   [&](const uint8_t *data, size_t length) {
+                     observe(data, length);
+                     return true;
+                   });
+}
+
+ImageSection ImageLayout::Add(uint64_t size) {
+  const ImageSection section{size_, size};
+  size_ += RoundUp(size, page_size_);
+  return section;
+}
+
+BootImageLayout PlanBootImage(uint32_t header_version, uint32_t page_size,
+                              uint64_t kernel_size, uint64_t ramdisk_size,
+                              uint64_t second_size, uint64_t recovery_dtbo_size,
+                              uint64_t dtb_size) {
+  BootImageLayout plan;
+  const uint64_t header_page =
+      header_version >= 3 ? BOOT_IMAGE_HEADER_V3_PAGESIZE : page_size;
+  plan.header = {0, header_page};
+  ImageLayout layout(page_size, header_page);
+  plan.kernel = layout.Add(kernel_size);
+  plan.ramdisk = layout.Add(ramdisk_size);
+  if (header_version < 3) {
+    plan.second = layout.Add(second_size);
+  } else {
+    plan.second = {layout.size(), 0};
+  }
+  if (header_version > 0 && header_version < 3) {
+    plan.recovery_dtbo = layout.Add(recovery_dtbo_size);
+  }
+  if (header_version == 2) plan.dtb = layout.Add(dtb_size);
+  plan.size = layout.size();
+  return plan;
+}
+
+VendorBootImageLayout PlanVendorBootImage(uint32_t header_version,
+                                          uint32_t page_size,
+                                          uint32_t header_size,
+                                          uint64_t ramdisk_size,
+                                          uint64_t dtb_size,
+                                          uint64_t ramdisk_table_size,
+                                          uint64_t bootconfig_size) {
+  VendorBootImageLayout plan;
+  ImageLayout layout(page_size);
+  plan.header = layout.Add(header_size);
+  plan.ramdisk = layout.Add(ramdisk_size);
+  plan.dtb = layout.Add(dtb_size);
+  if (header_version > 3) {
+    plan.ramdisk_table = layout.Add(ramdisk_table_size);
+    plan.bootconfig = layout.Add(bootconfig_size);
+  }
+  plan.size = layout.size();
+  return plan;
+}
+
+bool AssembleImage(
+    int out, uint64_t size, const std::vector<ImagePiece> &pieces,
+    const std::function<void(const uint8_t *, size_t)> &observe) {
+  // The file may still hold an older, longer image. Not every filesystem
+  // can preallocate; a sparse file of the final size still zero-fills the
+  // padding.
+  if (ftruncate(out, static_cast<off_t>(size)) != 0) {
+    LOGE("Failed to allocate the image");
+    return false;
+  }
+  fallocate(out, 0, 0, static_cast<off_t>(size));
+  if (!observe) {
+    return ParallelFor(pieces.size(), TaskThreads(), [&](size_t i) {
+      return WriteImagePiece(out, pieces[i]);
+    });
+  }
+  // The image is observed from the same sources the writes copy, in layout
+  // order, as one more task beside them; it goes first, being the longest.
+  return ParallelFor(pieces.size() + 1, TaskThreads(), [&](size_t i) {
+    return i > 0 ? WriteImagePiece(out, pieces[i - 1])
+                 : ObserveImage(size, pieces, observe);
+  });
+}
+
+bool AssembleImage(
+    const std::filesystem::path &output, uint64_t size,
+    const std::vector<ImagePiece> &pieces,
+    const std::function<void(const uint8_t *, size_t)> &observe) {
+  int out = open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (out < 0) {
+    LOGE("Failed to open %s for writing", output.filename().c_str());
+    return false;
+  }
+  bool ok = AssembleImage(out, size, pieces, observe);
+  if (close(out) != 0) ok = false;
+  if (!ok) {
+    LOGE("Error writing %s", output.filename().c_str());
+    std::error_code ec;
+    std::filesystem::remove(output, ec);
+  }
+  return ok;
+}
+
+bool StreamImage(int out, uint64_t size, const std::vector<ImagePiece> &pieces,
+                 const std::function<void(const uint8_t *, size_t)> &observe) {
+  return WalkImage(size, pieces, true,
+                   [&](const uint8_t *data, size_t length) {
+                     if (observe) observe(data, length);
+                     return WriteFully(out, data, length);
+                   });
+}
@@ -1,135 +1,37 @@
-#include <android/log.h>
 #include <jni.h>
-#include <unistd.h>
 
-#include <csetjmp>
-#include <csignal>
-#include <filesystem>
-#include <functional>
-#include <random>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <optional>
 #include <string>
-#include <type_traits>
-
-#include "SHA1FileHelper.hpp"
-#include "bootconfig.h"
-#include "compressor.hpp"
-#include "cpio_build.hpp"
-#include "cpio_extract.hpp"
-#include "decompressor.hpp"
-#include "log.h"
-#include "mkbootimg/bootimg.h"
-#include "mkbootimg/vendorbootimg.h"
-#include "unpackbootimg/bootimg.h"
-#include "unpackbootimg/vendorbootimg.h"
-#include "vendorbootconfig.h"
-#include "config.h"
-
-constexpr std::string s_vendor_boot_magic = "VNDRBOOT";
-constexpr std::string s_boot_magic = "ANDROID!";
-namespace fs = std::filesystem;
-std::error_code ec;
-
-template <typename F, typename... Args>
-auto measure(F &&f, Args &&...args) {
-  using namespace std::chrono;
-  auto start = high_resolution_clock::now();
-
-  if constexpr (std::is_void_v<std::invoke_result_t<F, Args...>>) {
-    std::invoke(std::forward<F>(f), std::forward<Args>(args)...);
-    auto end = high_resolution_clock::now();
-    return duration<double>(end - start);
-  } else {
-    auto result = std::invoke(std::forward<F>(f), std::forward<Args>(args)...);
-    auto end = high_resolution_clock::now();
-    return std::make_pair(result, duration<double>(end - start));
-  }
-}
-
-bool BuildRamdisk(fs::path &ramdisk_in, fs::path &ramdisk_out,
-                  uint8_t compression_method) {
-  if (fs::is_directory(ramdisk_in)) {
-    fs::path ramdisk_tmp = ramdisk_out.string() + ".tmp";
-    LOG("Compressing %s using cpio", ramdisk_in.filename().c_str());
-    if (!BuildCPIO(ramdisk_in, ramdisk_out)) {
-      return false;
-    }
-
-    if (compression_method == FORMAT_LZ4) {
-      LOG("Compressing %s using LZ4", ramdisk_in.filename().c_str());
-      if (!CompressLZ4File(ramdisk_out, ramdisk_tmp)) {
-        return false;
-      }
-    } else if (compression_method == FORMAT_GZIP) {
-      LOG("Compressing %s using gzip", ramdisk_in.filename().c_str());
-      if (!CompressGzipFile(ramdisk_out, ramdisk_tmp)) {
-        return false;
-      }
-    } else if (compression_method == FORMAT_LZMA) {
-      LOG("Compressing %s using lzma", ramdisk_in.filename().c_str());
-      if (!CompressLZMAFile(ramdisk_out, ramdisk_tmp)) {
-        return false;
-      }
-    } else if (compression_method == FORMAT_OTHER) {
-      LOG("Compression method is unknown!");
-      LOG("%s will be kept uncompressed!", ramdisk_in.filename().c_str());
-    }
-  } else {
-    fs::copy_file(ramdisk_in, ramdisk_out, fs::copy_options::overwrite_existing,
-                  ec);
-  }
-  return true;
-}
-
-bool UnpackRamdisk(fs::path &ramdisk_in, uint8_t compression_method) {
-  fs::path ramdisk_tmp = ramdisk_in.string() + ".tmp";
-  if (compression_method == FORMAT_LZ4) {
-    LOG("Decompressing %s using LZ4", ramdisk_in.filename().c_str());
-    if (!DecompressLZ4File(ramdisk_in, ramdisk_tmp)) {
-      return false;
-    }
-  } else if (compression_method == FORMAT_GZIP) {
-    LOG("Decompressing %s using gzip", ramdisk_in.filename().c_str());
-    if (!DecompressGzipFile(ramdisk_in, ramdisk_tmp)) {
-      return false;
-    }
-  } else if (compression_method == FORMAT_LZMA) {
-    LOG("Decompressing %s using lzma", ramdisk_in.filename().c_str());
-    if (!DecompressLZMAFile(ramdisk_in, ramdisk_tmp)) {
-      return false;
-    }
-  } else if (compression_method == FORMAT_OTHER) {
-    LOG("Compression method is unknown!");
-    LOG("%s will be kept compressed!", ramdisk_in.filename().c_str());
-    return true;
-  } else {
-      fs::rename(ramdisk_in, ramdisk_tmp,ec);
-  }
-  LOG("Decompressing %s using cpio", ramdisk_in.filename().c_str());
-  if (!ExtractCPIO(ramdisk_tmp, ramdisk_in)) {
-    return false;
-  }
-  fs::remove_all(ramdisk_tmp, ec);
-  return true;
-}
-
-std::string GenRandomString(std::size_t length) {
-  const std::string charset =
-      "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
-  std::random_device rd;
-  std::mt19937 generator(rd());
-
-  std::uniform_int_distribution<> distribution(
-      0, static_cast<int>(charset.size() - 1));
+#include <vector>
 
-  std::string randomString;
-  randomString.reserve(length);
-
-  for (std::size_t i = 0; i < length; ++i) {
-    randomString += charset[distribution(generator)];
-  }
-
-  return randomString;
-}
+#include "abik.h"
+#include "avb/footer.h"
+#include "buffer_pool.h"
+#include "job.h"
+#include "jni_log_sink.h"
+#include "log.h"
+#include "log_ring.h"
+#include "ramdisk/ramdisk.h"
+#include "session.h"
+#include "unpackbootimg/inspect.h"
+
+namespace {
+std::atomic<bool> tracing{false};
+
+// Console of a background job. It is built on the calling JNI thread, where
+// FindClass sees the app's classes, and then handed to the job.
+class JniJobSink : public LogSink {
+ public:
+  explicit JniJobSink(JNIEnv *env) : jni_sink_(env), sink_(jni_sink_) {}
+  void Write(const char *line) override { sink_.Write(line); }
+
+ private:
+  JniLogSink jni_sink_;
+  AsyncLogSink sink_;
+};
 
 std::string ReadString(JNIEnv *env, jstring jStr) {
   if (!jStr) {
@@ -148,269 +50,254 @@ std::string ReadString(JNIEnv *env, jstring jStr) {
   return ret;
 }
 
-void try_clean(const fs::path &directory, const std::string &extension) {
-  try {
-    for (const auto &entry : fs::directory_iterator(directory)) {
-      if (entry.is_regular_file() && entry.path().extension() == extension) {
-        fs::remove(entry.path(), ec);
-      }
-    }
-  } catch (...) {
-  }
+// null reads as unset, for fields that are left alone unless given.
+std::optional<std::string> ReadOptionalString(JNIEnv *env, jstring jStr) {
+  if (!jStr) return std::nullopt;
+  return ReadString(env, jStr);
 }
 
-bool mkbootimg_wrapper(const std::string &workdir) {
-  fs::path config_file = fs::path(workdir) / CONFIG_FILE;
-  std::ifstream config(config_file.string(), std::ios::binary);
-  if (!config) {
-    LOGE("Configuration file does not exist.");
-    return false;
-  }
-
-  if (!ValidateSHA1(config_file)) {
-    LOGE("Configuration file is invalid.");
-    return false;
+std::vector<std::string> ReadStringArray(JNIEnv *env, jobjectArray array) {
+  std::vector<std::string> strings;
+  const jsize count = array ? env->GetArrayLength(array) : 0;
+  for (jsize i = 0; i < count; ++i) {
+    auto str = static_cast<jstring>(env->GetObjectArrayElement(array, i));
+    strings.push_back(ReadString(env, str));
+    if (str) env->DeleteLocalRef(str);
   }
+  return strings;
+}
 
-  string_size str_size = 8;
-  config.read(reinterpret_cast<char *>(&str_size), sizeof(str_size));
-  std::vector<uint8_t> magic(str_size);
-  config.read(reinterpret_cast<char *>(magic.data()),
-              static_cast<std::streamsize>(str_size));
-  if (config.gcount() != str_size) {
-    LOGE("Failed to read boot magic");
-    return false;
-  }
+BatchLimits ReadBatchLimits(jint max_jobs, jint max_threads,
+                            jint memory_budget_mb) {
+  BatchLimits limits;
+  limits.max_jobs = static_cast<unsigned>(std::max(0, max_jobs));
+  limits.max_threads = static_cast<unsigned>(std::max(0, max_threads));
+  limits.memory_budget =
+      static_cast<uint64_t>(std::max(0, memory_budget_mb)) * 1024 * 1024;
+  return limits;
+}
 
-  config.close();
-  bool ret = false;
-
-  if (std::string_view(reinterpret_cast<const char *>(magic.data()),
-                       str_size) == s_boot_magic) {
-    LOG("boot magic: %s", s_boot_magic.c_str());
-    BootImageInfo info;
-    BootConfig::Read(info, config_file.string());
-    auto ramdisk = fs::path(workdir) / fs::path("ramdisk");
-    auto ramdisk_build = fs::path(ramdisk.string() + ".build");
-    if (!BuildRamdisk(ramdisk, ramdisk_build, info.ramdisk_compression)) {
-      return false;
-    }
-    BootImageArgs args;
-    if (info.kernel_size > 0) {
-      args.kernel = fs::path(fs::path(workdir) / "kernel");
-      args.kernel_offset = info.kernel_load_address;
-    }
-    if (info.ramdisk_size > 0) {
-      args.ramdisk = ramdisk_build;
-      args.ramdisk_offset = info.ramdisk_load_address;
-    }
-    if (info.second_size > 0) {
-      args.second = fs::path(fs::path(workdir) / "second");
-      args.second_offset = info.second_load_address;
-    }
-    if (info.dtb_size > 0) {
-      args.dtb = fs::path(fs::path(workdir) / "dtb");
-      args.dtb_offset = info.dtb_load_address;
-    }
-    if (info.recovery_dtbo_size > 0) {
-      args.recovery_dtbo = fs::path(fs::path(workdir) / "recovery_dtbo");
-    }
-    args.tags_offset = info.tags_load_address;
-    args.os_version.patch_level_str = info.os_patch_level;
-    args.os_version.version_str = info.os_version;
-    args.header_version = info.header_version;
-    args.board = info.product_name;
-    args.base =
-        0x0;  // unpackbootimg returns offsets with base already being included
-    args.page_size = info.page_size;
-    args.cmdline = info.cmdline;
-    if (!info.extra_cmdline.empty()) args.cmdline += " " + info.extra_cmdline;
-    args.output = fs::path(workdir) / fs::path("image-new");
-    fs::remove_all(args.output, ec);
-    ret = WriteBootImage(args);
-    try_clean(workdir, ".build");
-  } else if (std::string_view(reinterpret_cast<const char *>(magic.data()),
-                              str_size) == s_vendor_boot_magic) {
-    LOG("boot magic: %s", s_vendor_boot_magic.c_str());
-    VendorBootImageInfo info;
-    VendorBootConfig::Read(info, config_file.string());
-    VendorBootArgs args;
-    if (info.dtb_size > 0) {
-      args.dtb = fs::path(fs::path(workdir) / "dtb");
-      args.dtb_offset = info.dtb_load_address;
-    }
-    args.tags_offset = info.tags_load_address;
-    args.page_size = info.page_size;
-    args.header_version = info.header_version;
-    args.kernel_offset = info.kernel_load_address;
-    args.ramdisk_offset = info.ramdisk_load_address;
-    args.board = info.product_name;
-    args.base =
-        0x0;  // unpackbootimg returns offsets with base already being included
-    if (info.vendor_bootconfig_size > 0) {
-      args.bootconfig = fs::path(fs::path(workdir) / "bootconfig");
-    }
-    args.vendor_cmdline = info.cmdline;
-    std::vector<VendorRamdiskEntry> rds;
-    if (info.header_version > 3) {
-        for (const auto &i: info.vendor_ramdisk_table) {
-            VendorRamdiskEntry entry;
-            auto ramdisk = fs::path(workdir) / fs::path(i.output_name);
-            auto ramdisk_build = fs::path(ramdisk.string() + ".build");
-            if (!BuildRamdisk(ramdisk, ramdisk_build, i.ramdisk_compression)) {
-                return false;
-            }
-            entry.path = ramdisk_build;
-            entry.type = i.type;
-            entry.name = i.name;
-            rds.push_back(entry);
-        }
-    } else {
-        auto ramdisk = fs::path(workdir) / fs::path("vendor_ramdisk");
-        auto ramdisk_build = fs::path(ramdisk.string() + ".build");
-        if (!BuildRamdisk(ramdisk, ramdisk_build, info.ramdisk_compression)) {
-            return false;
-        }
-        args.vendor_ramdisk = ramdisk_build;
-    }
-    args.ramdisks = rds;
-    args.output = fs::path(workdir) / fs::path("vendor_boot-new");
-    fs::remove_all(args.output, ec);
-    VendorBootBuilder builder(std::move(args));
-    ret = builder.Build();
-    try_clean(workdir, ".build");
-  } else {
-    LOGE("Invalid boot magic: %s",
-         utils::toHexString(
-             std::string_view(reinterpret_cast<const char *>(magic.data()),
-                              str_size))
-             .c_str());
+jbooleanArray ToBooleanArray(JNIEnv *env,
+                             const std::vector<BatchResult> &results) {
+  std::vector<jboolean> values;
+  values.reserve(results.size());
+  for (const auto &result : results) values.push_back(result.ok);
+  jbooleanArray array = env->NewBooleanArray(static_cast<jsize>(values.size()));
+  if (array) {
+    env->SetBooleanArrayRegion(array, 0, static_cast<jsize>(values.size()),
+                               values.data());
   }
+  return array;
+}
+}  // namespace
 
-  return ret;
+extern "C" JNIEXPORT jboolean JNICALL Java_com_oops_abik_ABIKBridge_jniExtract(
+    JNIEnv *env, jobject, jint input_fd, jstring input_name, jstring dir,
+    jboolean extract_ramdisk) {
+  JniLogSink jni_sink(env);
+  AsyncLogSink sink(jni_sink);
+  Session session(&sink, LEVEL_EXTRACT);
+  session.set_tracing(tracing);
+  Session::Scope scope(session);
+
+  return UnpackImage(input_fd, ReadString(env, dir),
+                     ReadString(env, input_name), extract_ramdisk);
 }
 
-bool unpackbootimg_wrapper(int fd, const std::string &workdir,
-                           bool dec_ramdisk) {
-  if (!utils::CreateDirectory(workdir)) {
-    LOGE("Could not create output directory");
-    return false;
-  }
+extern "C" JNIEXPORT jboolean JNICALL Java_com_oops_abik_ABIKBridge_jniBuild(
+    JNIEnv *env, jobject, jstring input_dir) {
+  JniLogSink jni_sink(env);
+  AsyncLogSink sink(jni_sink);
+  Session session(&sink, LEVEL_BUILD);
+  session.set_tracing(tracing);
+  Session::Scope scope(session);
 
-  char magic[8];
-  ssize_t bytes_read = read(fd, magic, sizeof(magic));
-  if (bytes_read != sizeof(magic)) {
-    LOGE("Failed to read boot magic");
-    return false;
-  }
+  return BuildImage(ReadString(env, input_dir));
+}
 
-  if (lseek(fd, 0, SEEK_SET) == (off_t)-1) {
-    LOGE("Failed to seek back to beginning of boot image");
-    return false;
-  }
+// output_fd may be a SAF document or a pipe; the caller keeps it open.
+extern "C" JNIEXPORT jboolean JNICALL Java_com_oops_abik_ABIKBridge_jniBuildTo(
+    JNIEnv *env, jobject, jstring input_dir, jint output_fd) {
+  JniLogSink jni_sink(env);
+  AsyncLogSink sink(jni_sink);
+  Session session(&sink, LEVEL_BUILD);
+  session.set_tracing(tracing);
+  Session::Scope scope(session);
 
-  std::optional<BootImageInfo> boot_info;
-  std::optional<VendorBootImageInfo> vendor_boot_info;
-
-  if (std::string_view(magic, 8) == s_boot_magic) {
-    LOG("boot magic: %s", s_boot_magic.c_str());
-    boot_info = UnpackBootImage(fd, workdir, dec_ramdisk);
-  } else if (std::string_view(magic, 8) == s_vendor_boot_magic) {
-    LOG("boot magic: %s", s_vendor_boot_magic.c_str());
-    vendor_boot_info = UnpackVendorBootImage(fd, workdir, dec_ramdisk);
-  } else {
-    LOGE("Invalid boot magic: %s",
-         utils::toHexString(std::string_view(magic, 8)).c_str());
-    return false;
-  }
+  return BuildImage(ReadString(env, input_dir), output_fd);
+}
 
-  auto config = fs::path(workdir) / fs::path(CONFIG_FILE);
-  if (!AppendSHA1(config)) {
-    LOGE("Error calculating SHA1");
-    return false;
-  }
+extern "C" JNIEXPORT jstring JNICALL Java_com_oops_abik_ABIKBridge_jniInspect(
+    JNIEnv *env, jobject, jint input_fd) {
+  if (input_fd < 0) return nullptr;
 
-  if (!boot_info && !vendor_boot_info) {
-    LOGE("Failed to unpack boot image");
-    return false;
-  }
+  auto json = InspectImage(input_fd);
+  if (!json) return nullptr;
+  return env->NewStringUTF(json->c_str());
+}
 
-  if (boot_info && dec_ramdisk &&
-      boot_info->ramdisk_compression != FORMAT_OTHER) {
-    fs::path ramdisk_in = fs::path(workdir) / "ramdisk";
-    if (!UnpackRamdisk(ramdisk_in, boot_info->ramdisk_compression)) {
-      return false;
-    }
-  } else if (vendor_boot_info && dec_ramdisk) {
-    if (vendor_boot_info->header_version > 3) {
-        for (const auto &i: vendor_boot_info->vendor_ramdisk_table) {
-            if (i.ramdisk_compression == FORMAT_OTHER) continue;
-            fs::path ramdisk_in = fs::path(workdir) / i.output_name;
-            if (!UnpackRamdisk(ramdisk_in, i.ramdisk_compression)) {
-                return false;
-            }
-        }
-    } else if (vendor_boot_info->ramdisk_compression != FORMAT_OTHER) {
-      fs::path ramdisk_in = fs::path(workdir) / "vendor_ramdisk";
-      if (!UnpackRamdisk(ramdisk_in, vendor_boot_info->ramdisk_compression)) {
-          return false;
-      }
-    }
-  }
+extern "C" JNIEXPORT jstring JNICALL
+Java_com_oops_abik_ABIKBridge_jniVerifyImage(JNIEnv *env, jobject,
+                                             jint input_fd, jstring key) {
+  if (input_fd < 0) return nullptr;
 
-  return true;
+  bool verified = false;
+  auto json = avb::VerifyImage(input_fd, ReadString(env, key), verified);
+  if (!json) return nullptr;
+  return env->NewStringUTF(json->c_str());
 }
 
-extern "C" JNIEXPORT jboolean JNICALL Java_com_oops_abik_ABIKBridge_jniExtract(
-    JNIEnv *env, jobject, jint input_fd, jstring input_name, jstring dir,
-    jboolean extract_ramdisk) {
-  initializeJNIReferences(env, LEVEL_EXTRACT);
+extern "C" JNIEXPORT jstring JNICALL
+Java_com_oops_abik_ABIKBridge_jniListRamdisks(JNIEnv *env, jobject,
+                                              jint input_fd) {
+  if (input_fd < 0) return nullptr;
+
+  auto json = ListRamdisks(input_fd);
+  if (!json) return nullptr;
+  return env->NewStringUTF(json->c_str());
+}
 
-  std::string directory = ReadString(env, dir);
-  std::string input = ReadString(env, input_name);
+extern "C" JNIEXPORT jboolean JNICALL
+Java_com_oops_abik_ABIKBridge_jniExtractEntries(JNIEnv *env, jobject,
+                                                jint input_fd,
+                                                jstring input_name, jstring dir,
+                                                jobjectArray patterns) {
+  JniLogSink jni_sink(env);
+  AsyncLogSink sink(jni_sink);
+  Session session(&sink, LEVEL_EXTRACT);
+  session.set_tracing(tracing);
+  Session::Scope scope(session);
+
+  return ExtractImageEntries(input_fd, ReadString(env, dir),
+                             ReadString(env, input_name),
+                             ReadStringArray(env, patterns));
+}
 
-  if (input_fd < 0) {
-    LOGE("Input file descriptor is invalid");
-    return false;
-  }
+extern "C" JNIEXPORT jboolean JNICALL
+Java_com_oops_abik_ABIKBridge_jniPatchRamdisk(JNIEnv *env, jobject,
+                                              jint input_fd, jstring ramdisk,
+                                              jstring spec, jstring output) {
+  JniLogSink jni_sink(env);
+  AsyncLogSink sink(jni_sink);
+  Session session(&sink, LEVEL_BUILD);
+  session.set_tracing(tracing);
+  Session::Scope scope(session);
+
+  return PatchImageRamdisk(input_fd, ReadString(env, ramdisk),
+                           ReadString(env, spec), ReadString(env, output));
+}
 
-  if (input.empty()) input = GenRandomString(16);
-  std::string workdir = directory + "/" + input;
+extern "C" JNIEXPORT jboolean JNICALL
+Java_com_oops_abik_ABIKBridge_jniPatchImage(
+    JNIEnv *env, jobject, jint input_fd, jstring cmdline, jstring os_version,
+    jstring os_patch_level, jstring board, jstring bootconfig, jstring avb_key,
+    jstring output) {
+  JniLogSink jni_sink(env);
+  AsyncLogSink sink(jni_sink);
+  Session session(&sink, LEVEL_BUILD);
+  session.set_tracing(tracing);
+  Session::Scope scope(session);
+
+  ImageHeaderPatch patch;
+  patch.cmdline = ReadOptionalString(env, cmdline);
+  patch.os_version = ReadOptionalString(env, os_version);
+  patch.os_patch_level = ReadOptionalString(env, os_patch_level);
+  patch.board = ReadOptionalString(env, board);
+  patch.bootconfig = ReadOptionalString(env, bootconfig);
+  patch.avb_key = ReadString(env, avb_key);
+  return PatchImageHeader(input_fd, patch, ReadString(env, output));
+}
 
-  try {
-    std::filesystem::create_directories(directory);
-  } catch (...) {
-    LOGE("Failed to create: %s", workdir.c_str());
-    return false;
+extern "C" JNIEXPORT jbooleanArray JNICALL
+Java_com_oops_abik_ABIKBridge_jniBatchExtract(
+    JNIEnv *env, jobject, jintArray input_fds, jobjectArray input_names,
+    jstring dir, jboolean extract_ramdisk, jint max_jobs, jint max_threads,
+    jint memory_budget_mb) {
+  JniLogSink jni_sink(env);
+  AsyncLogSink sink(jni_sink);
+  Session session(&sink, LEVEL_EXTRACT);
+  session.set_tracing(tracing);
+  Session::Scope scope(session);
+
+  std::vector<jint> fds(env->GetArrayLength(input_fds));
+  env->GetIntArrayRegion(input_fds, 0, static_cast<jsize>(fds.size()),
+                         fds.data());
+  auto names = ReadStringArray(env, input_names);
+  if (names.size() != fds.size()) {
+    LOGE("Mismatched batch arguments");
+    return nullptr;
   }
 
-  auto unique_work_dir = get_unique_path(workdir);
+  auto results = UnpackImages(
+      session, std::vector<int>(fds.begin(), fds.end()), names,
+      ReadString(env, dir), extract_ramdisk,
+      ReadBatchLimits(max_jobs, max_threads, memory_budget_mb));
+  return ToBooleanArray(env, results);
+}
 
-  auto [ret, elapsed] = measure(unpackbootimg_wrapper, input_fd,
-                                unique_work_dir, extract_ramdisk);
+extern "C" JNIEXPORT jbooleanArray JNICALL
+Java_com_oops_abik_ABIKBridge_jniBatchBuild(JNIEnv *env, jobject,
+                                            jobjectArray input_dirs,
+                                            jint max_jobs, jint max_threads,
+                                            jint memory_budget_mb) {
+  JniLogSink jni_sink(env);
+  AsyncLogSink sink(jni_sink);
+  Session session(&sink, LEVEL_BUILD);
+  session.set_tracing(tracing);
+  Session::Scope scope(session);
+
+  auto results =
+      BuildImages(session, ReadStringArray(env, input_dirs),
+                  ReadBatchLimits(max_jobs, max_threads, memory_budget_mb));
+  return ToBooleanArray(env, results);
+}
 
-  if (!ret) fs::remove_all(workdir, ec);
+extern "C" JNIEXPORT void JNICALL
+Java_com_oops_abik_ABIKBridge_jniSetTracing(JNIEnv *, jobject,
+                                            jboolean enabled) {
+  tracing = enabled;
+}
 
-  LOG(ret ? "Done in %.1fs!" : "Failed in %.1fs!", elapsed.count());
+extern "C" JNIEXPORT void JNICALL
+Java_com_oops_abik_ABIKBridge_jniSetMemoryBudget(JNIEnv *, jobject, jint mb) {
+  BufferPool::Shared().SetBudget(static_cast<size_t>(std::max(1, mb)) << 20);
+}
 
-  releaseJNIReferences();
-  return ret;
+extern "C" JNIEXPORT jlong JNICALL Java_com_oops_abik_ABIKBridge_jniStartExtract(
+    JNIEnv *env, jobject, jint input_fd, jstring input_name, jstring dir,
+    jboolean extract_ramdisk) {
+  return StartUnpackImage(std::make_unique<JniJobSink>(env), tracing,
+                          input_fd, ReadString(env, dir),
+                          ReadString(env, input_name), extract_ramdisk);
 }
 
-extern "C" JNIEXPORT jboolean JNICALL Java_com_oops_abik_ABIKBridge_jniBuild(
+extern "C" JNIEXPORT jlong JNICALL Java_com_oops_abik_ABIKBridge_jniStartBuild(
     JNIEnv *env, jobject, jstring input_dir) {
-  initializeJNIReferences(env, LEVEL_BUILD);
+  return StartBuildImage(std::make_unique<JniJobSink>(env), tracing,
+                         ReadString(env, input_dir));
+}
 
-  std::string input = ReadString(env, input_dir);
-  if (input.empty()) {
-    LOGE("Error reading jstring");
-    return false;
-  }
+extern "C" JNIEXPORT jlong JNICALL
+Java_com_oops_abik_ABIKBridge_jniStartBuildTo(JNIEnv *env, jobject,
+                                              jstring input_dir,
+                                              jint output_fd) {
+  return StartBuildImage(std::make_unique<JniJobSink>(env), tracing,
+                         ReadString(env, input_dir), output_fd);
+}
 
-  auto [ret, elapsed] = measure(mkbootimg_wrapper, input);
+extern "C" JNIEXPORT jstring JNICALL Java_com_oops_abik_ABIKBridge_jniPollJob(
+    JNIEnv *env, jobject, jlong job) {
+  auto json = PollJob(job);
+  if (!json) return nullptr;
+  return env->NewStringUTF(json->c_str());
+}
 
-  LOG(ret ? "Done in %.1fs!" : "Failed in %.1fs!", elapsed.count());
+extern "C" JNIEXPORT jboolean JNICALL
+Java_com_oops_abik_ABIKBridge_jniCancelJob(JNIEnv *, jobject, jlong job) {
+  return CancelJob(job);
+}
 
-  releaseJNIReferences();
-  return ret;
-}
\ No newline at end of file
+extern "C" JNIEXPORT jboolean JNICALL
+Java_com_oops_abik_ABIKBridge_jniReleaseJob(JNIEnv *, jobject, jlong job) {
+  return ReleaseJob(job);
+}
@@ -0,0 +1,89 @@
+#include "jni_log_sink.h"
+
+#include <android/log.h>
+
+#include <string>
+#include <string_view>
+
+#include "log.h"
+
+#define LOG_TAG "ABIK"
+#define ADLOG(...) __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
+
+namespace {
+// Detaches threads that GetEnv() attached once they exit.
+struct ThreadAttachment {
+  JavaVM *vm = nullptr;
+  ~ThreadAttachment() {
+    if (vm) vm->DetachCurrentThread();
+  }
+};
+thread_local ThreadAttachment attachment;
+
+JNIEnv *GetEnv(JavaVM *vm) {
+  JNIEnv *env = nullptr;
+  if (vm->GetEnv(reinterpret_cast<void **>(&env), JNI_VERSION_1_6) == JNI_OK) {
+    return env;
+  }
+  if (vm->AttachCurrentThread(&env, nullptr) != JNI_OK) return nullptr;
+  attachment.vm = vm;
+  return env;
+}
+}  // namespace
+
+JniLogSink::JniLogSink(JNIEnv *env) {
+  if (env->GetJavaVM(&vm_) != JNI_OK) {
+    ADLOG("JavaVM not available");
+    vm_ = nullptr;
+    return;
+  }
+
+  jclass local = env->FindClass("com/oops/abik/DataHelper");
+  if (local == nullptr) {
+    ADLOG("DataHelper class not found");
+    return;
+  }
+
+  update_console_text_ = env->GetStaticMethodID(local, "updateConsoleText",
+                                                "(Ljava/lang/String;)V");
+  if (update_console_text_ == nullptr) {
+    ADLOG("updateConsoleText method not found");
+    env->DeleteLocalRef(local);
+    return;
+  }
+
+  data_helper_ = static_cast<jclass>(env->NewGlobalRef(local));
+  env->DeleteLocalRef(local);
+}
+
+JniLogSink::~JniLogSink() {
+  if (vm_ == nullptr || data_helper_ == nullptr) return;
+  if (JNIEnv *env = GetEnv(vm_)) env->DeleteGlobalRef(data_helper_);
+}
+
+void JniLogSink::Write(const char *line) {
+  if (vm_ == nullptr || data_helper_ == nullptr ||
+      update_console_text_ == nullptr) {
+    ADLOG("JNI environment or class references not initialized");
+    return;
+  }
+
+  JNIEnv *env = GetEnv(vm_);
+  if (env == nullptr) {
+    ADLOG("Failed to attach thread");
+    return;
+  }
+
+  // NewStringUTF rejects a character cut short, as a line truncated
+  // elsewhere may end with.
+  const std::string_view text(line);
+  const std::string whole(text.substr(0, Utf8Prefix(text, text.size())));
+  jstring jString = env->NewStringUTF(whole.c_str());
+  if (jString == nullptr) {
+    ADLOG("Failed to create new jstring");
+    return;
+  }
+
+  env->CallStaticVoidMethod(data_helper_, update_console_text_, jString);
+  env->DeleteLocalRef(jString);
+}
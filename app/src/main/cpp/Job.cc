@@ -0,0 +1,159 @@
+#include "job.h"
+
+#include <map>
+#include <thread>
+
+#include "json_writer.hpp"
+#include "log.h"
+
+namespace {
+const char *StateName(Job::State state) {
+  switch (state) {
+    case Job::State::Running:
+      return "running";
+    case Job::State::Succeeded:
+      return "succeeded";
+    case Job::State::Failed:
+      return "failed";
+    case Job::State::Cancelled:
+      return "cancelled";
+  }
+  return "unknown";
+}
+
+// A started job. The thread running it shares ownership, so releasing a
+// handle never pulls the Job out from under it.
+struct Entry {
+  Job job;
+  std::unique_ptr<LogSink> sink;
+};
+
+std::mutex jobs_mutex;
+std::map<JobId, std::shared_ptr<Entry>> jobs;
+JobId next_id = 1;
+
+std::shared_ptr<Entry> FindJob(JobId id) {
+  std::lock_guard lock(jobs_mutex);
+  auto it = jobs.find(id);
+  return it == jobs.end() ? nullptr : it->second;
+}
+}  // namespace
+
+void Job::BeginStage(const char *stage, std::string_view detail,
+                     uint64_t total) {
+  std::lock_guard lock(mutex_);
+  stage_ = stage;
+  detail_ = detail;
+  ++stages_;
+  done_.store(0, std::memory_order_relaxed);
+  total_.store(total, std::memory_order_relaxed);
+}
+
+void Job::Finish(bool ok) {
+  std::lock_guard lock(mutex_);
+  state_ = ok ? State::Succeeded
+              : (cancelled() ? State::Cancelled : State::Failed);
+}
+
+Job::Progress Job::progress() const {
+  std::lock_guard lock(mutex_);
+  Progress progress;
+  progress.state = state_;
+  progress.stage = stage_;
+  progress.detail = detail_;
+  progress.done = done_.load(std::memory_order_relaxed);
+  progress.total = total_.load(std::memory_order_relaxed);
+  progress.stages = stages_;
+  return progress;
+}
+
+std::string Job::ProgressJson() const {
+  const Progress p = progress();
+  JsonWriter json;
+  json.BeginObject()
+      .Field("state", StateName(p.state))
+      .Field("cancel_requested", cancelled())
+      .Field("stage", p.stage)
+      .Field("detail", p.detail)
+      .Field("done", p.done)
+      .Field("total", p.total)
+      .Field("stages", static_cast<uint64_t>(p.stages))
+      .EndObject();
+  return json.str();
+}
+
+Job *CurrentJob() {
+  const Session *session = Session::Current();
+  return session ? session->job() : nullptr;
+}
+
+bool JobCancelled() {
+  const Job *job = CurrentJob();
+  return job != nullptr && job->cancelled();
+}
+
+void JobStage(const char *stage, std::string_view detail, uint64_t total) {
+  if (Job *job = CurrentJob()) job->BeginStage(stage, detail, total);
+}
+
+void JobProgress(uint64_t bytes) {
+  if (Job *job = CurrentJob()) job->Advance(bytes);
+}
+
+JobId StartJob(std::unique_ptr<LogSink> sink, std::string_view level,
+               bool tracing, std::function<bool()> fn) {
+  auto entry = std::make_shared<Entry>();
+  entry->sink = std::move(sink);
+
+  JobId id;
+  {
+    std::lock_guard lock(jobs_mutex);
+    id = next_id++;
+    jobs.emplace(id, entry);
+  }
+
+  std::thread([entry, level = std::string(level), tracing,
+               fn = std::move(fn)] {
+    bool ok = false;
+    {
+      Session session(entry->sink.get(), level);
+      session.set_tracing(tracing);
+      session.set_job(&entry->job);
+      Session::Scope scope(session);
+      try {
+        ok = fn();
+      } catch (const std::exception &e) {
+        LOGE("%s", e.what());
+      }
+      if (!ok && entry->job.cancelled()) LOG("Cancelled");
+    }
+    // Flush the console before pollers can see the job as finished.
+    entry->sink.reset();
+    entry->job.Finish(ok);
+  }).detach();
+  return id;
+}
+
+std::optional<std::string> PollJob(JobId id) {
+  auto entry = FindJob(id);
+  if (!entry) return std::nullopt;
+  return entry->job.ProgressJson();
+}
+
+bool CancelJob(JobId id) {
+  auto entry = FindJob(id);
+  if (!entry) return false;
+  entry->job.Cancel();
+  return true;
+}
+
+bool ReleaseJob(JobId id) {
+  std::lock_guard lock(jobs_mutex);
+  auto it = jobs.find(id);
+  if (it == jobs.end() ||
+      it->second->job.progress().state == Job::State::Running) {
+    return false;
+  }
+  jobs.erase(it);
+  return true;
+}
@@ -1,88 +1,65 @@
 #include "log.h"
 
-#include <android/log.h>
-#include <jni.h>
-
+#include <algorithm>
 #include <cstdarg>
+#include <cstdint>
 #include <cstdio>
-#include <cstring>
-#include <memory>
-#include <string>
-
-#define LOG_TAG "ABIK"
-JNIEnv *savedEnv = nullptr;
-jclass dataHelperClass = nullptr;
-jmethodID updateConsoleTextMethod = nullptr;
-std::string CURRENT_LEVEL = std::string(LEVEL_INFO);
-
-void initializeJNIReferences(JNIEnv *env, const std::string_view &level) {
-  savedEnv = env;
 
-  dataHelperClass = env->FindClass("com/oops/abik/DataHelper");
-  if (dataHelperClass == nullptr) {
-    ADLOG("DataHelper class not found");
-    return;
-  }
+#include "session.h"
 
-  updateConsoleTextMethod = env->GetStaticMethodID(
-      dataHelperClass, "updateConsoleText", "(Ljava/lang/String;)V");
-  if (updateConsoleTextMethod == nullptr) {
-    ADLOG("updateConsoleText method not found");
-    env->DeleteLocalRef(dataHelperClass);
-    dataHelperClass = nullptr;
+size_t Utf8Prefix(std::string_view text, size_t max) {
+  const size_t end = std::min(text.size(), max);
+  // Back up over continuation bytes to the lead byte of the last sequence.
+  size_t lead = end;
+  while (lead > 0 && end - lead < 3 &&
+         (static_cast<uint8_t>(text[lead - 1]) & 0xC0) == 0x80) {
+    --lead;
   }
-
-  CURRENT_LEVEL = level;
+  if (lead == 0) return end;
+  const auto byte = static_cast<uint8_t>(text[--lead]);
+  const size_t length = byte >= 0xF0   ? 4
+                        : byte >= 0xE0 ? 3
+                        : byte >= 0xC0 ? 2
+                                       : 1;
+  return end - lead < length ? lead : end;
 }
 
-void releaseJNIReferences() {
-  if (dataHelperClass != nullptr && savedEnv != nullptr) {
-    savedEnv->DeleteLocalRef(dataHelperClass);
-  }
-  savedEnv = nullptr;
-  dataHelperClass = nullptr;
-  updateConsoleTextMethod = nullptr;
-  CURRENT_LEVEL = LEVEL_INFO;
-}
-
-void logConsole(const char *message) {
-  if (savedEnv == nullptr || dataHelperClass == nullptr ||
-      updateConsoleTextMethod == nullptr) {
-    ADLOG("JNI environment or class references not initialized");
-    return;
+void logMessage(const char *level, const char *format, ...) {
+  const Session *session = Session::Current();
+  if (level == nullptr) {
+    level = session ? session->level().c_str() : LEVEL_INFO.data();
   }
 
-  jstring jString = savedEnv->NewStringUTF(message);
-  if (jString == nullptr) {
-    ADLOG("Failed to create new jstring");
+  // One pass into a fixed buffer: the line is a single log record, so there
+  // is nothing to size or allocate.
+  char line[LOG_LINE_SIZE];
+  int prefix = session && !session->tag().empty()
+                   ? std::snprintf(line, sizeof(line), "[%s] %s: ", level,
+                                   session->tag().c_str())
+                   : std::snprintf(line, sizeof(line), "[%s] ", level);
+  if (prefix < 0) {
+    std::fputs("Formatting error\n", stderr);
     return;
   }
+  prefix = std::min(prefix, static_cast<int>(sizeof(line)) - 1);
 
-  savedEnv->CallStaticVoidMethod(dataHelperClass, updateConsoleTextMethod,
-                                 jString);
-  savedEnv->DeleteLocalRef(jString);
-}
-
-void logMessage(const char *level, const char *format, ...) {
   va_list args;
   va_start(args, format);
-
-  int size =
-      vsnprintf(nullptr, 0, format, args) + 1;  // +1 for the null terminator
+  const int size =
+      std::vsnprintf(line + prefix, sizeof(line) - prefix, format, args);
   va_end(args);
 
-  if (size <= 0) {
-    __android_log_print(ANDROID_LOG_ERROR, "ErosX", "Formatting error");
+  if (size < 0) {
+    std::fputs("Formatting error\n", stderr);
     return;
   }
+  if (static_cast<size_t>(prefix + size) >= sizeof(line)) {
+    line[Utf8Prefix(line, sizeof(line) - 1)] = '\0';
+  }
 
-  std::unique_ptr<char[]> buffer(new char[size]);
-
-  va_start(args, format);
-  vsnprintf(buffer.get(), size, format, args);
-  va_end(args);
-
-  std::string finalMessage = "[" + std::string(level) + "] " + buffer.get();
-
-  logConsole(finalMessage.c_str());
+  if (session) {
+    session->Console(line);
+  } else {
+    std::fprintf(stderr, "%s\n", line);
+  }
 }
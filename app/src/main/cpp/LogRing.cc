@@ -0,0 +1,123 @@
+#include "log_ring.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <utility>
+
+namespace {
+bool IsError(std::string_view line) {
+  return line.starts_with("[") && line.substr(1).starts_with(LEVEL_ERROR);
+}
+}  // namespace
+
+LogRing::LogRing(size_t capacity)
+    : slots_(new Slot[std::bit_ceil(std::max<size_t>(capacity, 2))]),
+      mask_(std::bit_ceil(std::max<size_t>(capacity, 2)) - 1) {
+  for (size_t i = 0; i <= mask_; ++i) {
+    slots_[i].sequence.store(i, std::memory_order_relaxed);
+  }
+}
+
+bool LogRing::TryPush(std::string_view line) {
+  size_t pos = head_.load(std::memory_order_relaxed);
+  Slot *slot;
+  while (true) {
+    slot = &slots_[pos & mask_];
+    const size_t sequence = slot->sequence.load(std::memory_order_acquire);
+    const auto diff =
+        static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos);
+    if (diff == 0) {
+      if (head_.compare_exchange_weak(pos, pos + 1,
+                                      std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = head_.load(std::memory_order_relaxed);
+    }
+  }
+
+  const size_t length = Utf8Prefix(line, LOG_LINE_SIZE - 1);
+  std::memcpy(slot->text, line.data(), length);
+  slot->length = static_cast<uint32_t>(length);
+  slot->sequence.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+AsyncLogSink::AsyncLogSink(LogSink &downstream, Options options)
+    : downstream_(downstream),
+      options_(options),
+      ring_(options.capacity),
+      window_start_(std::chrono::steady_clock::now()),
+      thread_(&AsyncLogSink::Run, this) {}
+
+AsyncLogSink::~AsyncLogSink() {
+  {
+    std::lock_guard lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_one();
+  thread_.join();
+}
+
+void AsyncLogSink::Write(const char *line) {
+  if (ring_.TryPush(line)) return;
+  if (!IsError(line)) {
+    overflowed_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  // Errors wait for the drain thread to make room instead of being lost.
+  do {
+    cv_.notify_one();
+    std::this_thread::yield();
+  } while (!ring_.TryPush(line));
+}
+
+void AsyncLogSink::Run() {
+  std::unique_lock lock(mutex_);
+  while (true) {
+    cv_.wait_for(lock, options_.interval);
+    const bool stopping = stop_;
+    lock.unlock();
+    DrainOnce(std::chrono::steady_clock::now(), stopping);
+    lock.lock();
+    if (stopping) return;
+  }
+}
+
+void AsyncLogSink::DrainOnce(std::chrono::steady_clock::time_point now,
+                             bool last) {
+  uint64_t dropped = overflowed_.exchange(0, std::memory_order_relaxed);
+  if (now - window_start_ >= std::chrono::seconds(1)) {
+    window_start_ = now;
+    window_lines_ = 0;
+    dropped += std::exchange(suppressed_, 0);
+  }
+
+  batch_.clear();
+  auto append = [this](std::string_view line) {
+    if (!batch_.empty()) batch_ += '\n';
+    batch_ += line;
+  };
+  ring_.Drain([&](std::string_view line) {
+    const bool error = IsError(line);
+    if (!error && options_.errors_only) return;
+    if (!error && options_.max_lines_per_second != 0 &&
+        window_lines_ >= options_.max_lines_per_second) {
+      ++suppressed_;
+      return;
+    }
+    if (!error) ++window_lines_;
+    append(line);
+  });
+  if (last) dropped += std::exchange(suppressed_, 0);
+
+  if (dropped != 0) {
+    append("[" + std::string(LEVEL_INFO) + "] " + std::to_string(dropped) +
+           " log lines dropped");
+  }
+
+  if (!batch_.empty()) downstream_.Write(batch_.c_str());
+}
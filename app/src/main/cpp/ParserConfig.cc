@@ -0,0 +1,413 @@
+#include "parser_config.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <array>
+#include <cstring>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "SHA1FileHelper.hpp"
+#include "bootconfig.h"
+#include "log.h"
+#include "tools.h"
+#include "unpackbootimg/utils.h"
+#include "vendorbootconfig.h"
+#include "xxhash.h"
+
+namespace {
+constexpr std::string_view CONFIG_MAGIC{"ABIKCFG\0", 8};
+constexpr uint32_t CONFIG_VERSION = 2;
+constexpr size_t HEADER_SIZE = 32;
+constexpr size_t FIELD_SIZE = 16;
+constexpr size_t VALUE_ALIGN = 8;
+
+constexpr std::string_view BOOT_MAGIC = "ANDROID!";
+constexpr std::string_view VENDOR_BOOT_MAGIC = "VNDRBOOT";
+
+enum ConfigKind : uint32_t { KIND_BOOT = 0, KIND_VENDOR_BOOT = 1 };
+
+// The stored type of a field is the index of its alternative plus one.
+template <typename Info>
+using Member =
+    std::variant<uint8_t Info::*, uint32_t Info::*, uint64_t Info::*,
+                 std::string Info::*, std::array<uint32_t, 4> Info::*>;
+
+template <typename Info>
+struct FieldSpec {
+  uint16_t id;
+  Member<Info> member;
+};
+
+// Ids are part of the file format: append new ones, never renumber or reuse.
+constexpr FieldSpec<BootImageInfo> BOOT_FIELDS[] = {
+    {1, &BootImageInfo::boot_magic},
+    {2, &BootImageInfo::header_version},
+    {3, &BootImageInfo::kernel_size},
+    {4, &BootImageInfo::ramdisk_size},
+    {5, &BootImageInfo::ramdisk_compression},
+    {6, &BootImageInfo::page_size},
+    {7, &BootImageInfo::os_version},
+    {8, &BootImageInfo::os_patch_level},
+    {9, &BootImageInfo::cmdline},
+    {10, &BootImageInfo::kernel_load_address},
+    {11, &BootImageInfo::ramdisk_load_address},
+    {12, &BootImageInfo::second_size},
+    {13, &BootImageInfo::second_load_address},
+    {14, &BootImageInfo::tags_load_address},
+    {15, &BootImageInfo::product_name},
+    {16, &BootImageInfo::extra_cmdline},
+    {17, &BootImageInfo::recovery_dtbo_size},
+    {18, &BootImageInfo::recovery_dtbo_offset},
+    {19, &BootImageInfo::boot_header_size},
+    {20, &BootImageInfo::dtb_size},
+    {21, &BootImageInfo::dtb_load_address},
+    {22, &BootImageInfo::boot_signature_size},
+};
+
+constexpr FieldSpec<VendorBootImageInfo> VENDOR_BOOT_FIELDS[] = {
+    {1, &VendorBootImageInfo::boot_magic},
+    {2, &VendorBootImageInfo::header_version},
+    {3, &VendorBootImageInfo::page_size},
+    {4, &VendorBootImageInfo::kernel_load_address},
+    {5, &VendorBootImageInfo::ramdisk_load_address},
+    {6, &VendorBootImageInfo::vendor_ramdisk_size},
+    {7, &VendorBootImageInfo::cmdline},
+    {8, &VendorBootImageInfo::tags_load_address},
+    {9, &VendorBootImageInfo::product_name},
+    {10, &VendorBootImageInfo::header_size},
+    {11, &VendorBootImageInfo::dtb_size},
+    {12, &VendorBootImageInfo::dtb_load_address},
+    {13, &VendorBootImageInfo::ramdisk_compression},
+    {14, &VendorBootImageInfo::vendor_ramdisk_table_size},
+    {15, &VendorBootImageInfo::vendor_ramdisk_table_entry_num},
+    {16, &VendorBootImageInfo::vendor_ramdisk_table_entry_size},
+    {17, &VendorBootImageInfo::vendor_bootconfig_size},
+};
+
+constexpr FieldSpec<VendorRamdiskTableEntry> RAMDISK_ENTRY_FIELDS[] = {
+    {1, &VendorRamdiskTableEntry::output_name},
+    {2, &VendorRamdiskTableEntry::size},
+    {3, &VendorRamdiskTableEntry::offset},
+    {4, &VendorRamdiskTableEntry::type},
+    {5, &VendorRamdiskTableEntry::name},
+    {6, &VendorRamdiskTableEntry::board_id},
+    {7, &VendorRamdiskTableEntry::ramdisk_compression},
+};
+
+inline uint16_t LoadU16(const uint8_t *src) {
+  return static_cast<uint16_t>(src[0] | (src[1] << 8));
+}
+
+inline void StoreU16(uint8_t *dst, uint16_t value) {
+  dst[0] = static_cast<uint8_t>(value & 0xFF);
+  dst[1] = static_cast<uint8_t>(value >> 8);
+}
+
+// Collects the field table and data area in memory, so the checksum is
+// taken in the same pass that emits the file and nothing is read back.
+class ConfigWriter {
+ public:
+  template <typename Info>
+  void Add(uint16_t record, const Info &info,
+           std::span<const FieldSpec<Info>> fields) {
+    for (const auto &field : fields) {
+      const auto type = static_cast<uint8_t>(field.member.index() + 1);
+      std::visit(
+          [&](auto member) { Put(record, field.id, type, info.*member); },
+          field.member);
+    }
+  }
+
+  bool Write(ConfigKind kind, const fs::path &path) const {
+    std::vector<uint8_t> file(HEADER_SIZE + table_.size() + data_.size());
+    std::memcpy(file.data(), CONFIG_MAGIC.data(), CONFIG_MAGIC.size());
+    StoreU32(file.data() + 8, CONFIG_VERSION);
+    StoreU32(file.data() + 12, kind);
+    StoreU32(file.data() + 16, count_);
+    std::memcpy(file.data() + HEADER_SIZE, table_.data(), table_.size());
+    std::memcpy(file.data() + HEADER_SIZE + table_.size(), data_.data(),
+                data_.size());
+    StoreU64(file.data() + 24, XXH64(file.data() + HEADER_SIZE,
+                                     file.size() - HEADER_SIZE, 0));
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      LOGE("Failed to open config for writing");
+      return false;
+    }
+    bool ok = WriteFullyAt(fd, file.data(), file.size(), 0);
+    ok = close(fd) == 0 && ok;
+    if (!ok) LOGE("Error occurred while writing configuration");
+    return ok;
+  }
+
+ private:
+  void Put(uint16_t record, uint16_t id, uint8_t type, uint8_t value) {
+    Append(record, id, type, &value, 1);
+  }
+  void Put(uint16_t record, uint16_t id, uint8_t type, uint32_t value) {
+    uint8_t bytes[4];
+    StoreU32(bytes, value);
+    Append(record, id, type, bytes, sizeof(bytes));
+  }
+  void Put(uint16_t record, uint16_t id, uint8_t type, uint64_t value) {
+    uint8_t bytes[8];
+    StoreU64(bytes, value);
+    Append(record, id, type, bytes, sizeof(bytes));
+  }
+  void Put(uint16_t record, uint16_t id, uint8_t type,
+           const std::string &value) {
+    Append(record, id, type, value.data(), value.size());
+  }
+  void Put(uint16_t record, uint16_t id, uint8_t type,
+           const std::array<uint32_t, 4> &value) {
+    uint8_t bytes[16];
+    for (size_t i = 0; i < value.size(); ++i) StoreU32(bytes + 4 * i, value[i]);
+    Append(record, id, type, bytes, sizeof(bytes));
+  }
+
+  void Append(uint16_t record, uint16_t id, uint8_t type, const void *value,
+              size_t size) {
+    const size_t offset = data_.size();
+    uint8_t field[FIELD_SIZE]{};
+    StoreU16(field, record);
+    StoreU16(field + 2, id);
+    field[4] = type;
+    StoreU32(field + 8, static_cast<uint32_t>(size));
+    StoreU32(field + 12, static_cast<uint32_t>(offset));
+    table_.insert(table_.end(), field, field + FIELD_SIZE);
+
+    const auto *bytes = static_cast<const uint8_t *>(value);
+    data_.insert(data_.end(), bytes, bytes + size);
+    data_.resize((data_.size() + VALUE_ALIGN - 1) / VALUE_ALIGN * VALUE_ALIGN);
+    ++count_;
+  }
+
+  std::vector<uint8_t> table_;
+  std::vector<uint8_t> data_;
+  uint32_t count_ = 0;
+};
+
+// Read-only private mapping of a whole file.
+class MappedFile {
+ public:
+  explicit MappedFile(const fs::path &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st {};
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *map = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ,
+                       MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED) {
+        data_ = static_cast<const uint8_t *>(map);
+        size_ = static_cast<size_t>(st.st_size);
+      }
+    }
+    close(fd);
+  }
+  ~MappedFile() {
+    if (data_) munmap(const_cast<uint8_t *>(data_), size_);
+  }
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const uint8_t *data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  const uint8_t *data_ = nullptr;
+  size_t size_ = 0;
+};
+
+bool Load(uint8_t &out, const uint8_t *value, uint32_t size) {
+  if (size != 1) return false;
+  out = value[0];
+  return true;
+}
+bool Load(uint32_t &out, const uint8_t *value, uint32_t size) {
+  if (size != 4) return false;
+  out = LoadU32(value);
+  return true;
+}
+bool Load(uint64_t &out, const uint8_t *value, uint32_t size) {
+  if (size != 8) return false;
+  out = LoadU64(value);
+  return true;
+}
+bool Load(std::string &out, const uint8_t *value, uint32_t size) {
+  out.assign(reinterpret_cast<const char *>(value), size);
+  return true;
+}
+bool Load(std::array<uint32_t, 4> &out, const uint8_t *value, uint32_t size) {
+  if (size != 16) return false;
+  for (size_t i = 0; i < out.size(); ++i) out[i] = LoadU32(value + 4 * i);
+  return true;
+}
+
+template <typename Info>
+bool Decode(Info &info, std::span<const FieldSpec<Info>> fields, uint16_t id,
+            uint8_t type, const uint8_t *value, uint32_t size) {
+  for (const auto &field : fields) {
+    if (field.id != id) continue;
+    if (field.member.index() + 1 != type ||
+        !std::visit([&](auto member) { return Load(info.*member, value, size); },
+                    field.member)) {
+      LOGE("Invalid configuration field %u", id);
+      return false;
+    }
+    return true;
+  }
+  return true;  // written by a newer version
+}
+
+// Calls visit(record, id, type, value, size) for every field of a checked
+// v2 file.
+template <typename Visit>
+bool ForEachField(const uint8_t *data, size_t size, Visit &&visit) {
+  const uint32_t version = LoadU32(data + 8);
+  if (version != CONFIG_VERSION) {
+    LOGE("Unsupported configuration version %u", version);
+    return false;
+  }
+  const uint32_t count = LoadU32(data + 16);
+  if (count > (size - HEADER_SIZE) / FIELD_SIZE ||
+      XXH64(data + HEADER_SIZE, size - HEADER_SIZE, 0) !=
+          LoadU64(data + 24)) {
+    LOGE("Configuration file is invalid.");
+    return false;
+  }
+
+  const uint8_t *table = data + HEADER_SIZE;
+  const uint8_t *values = table + static_cast<size_t>(count) * FIELD_SIZE;
+  const size_t values_size = size - (values - data);
+  for (uint32_t i = 0; i < count; ++i) {
+    const uint8_t *field = table + static_cast<size_t>(i) * FIELD_SIZE;
+    const uint32_t value_size = LoadU32(field + 8);
+    const uint32_t offset = LoadU32(field + 12);
+    if (offset > values_size || value_size > values_size - offset) {
+      LOGE("Configuration file is invalid.");
+      return false;
+    }
+    if (!visit(LoadU16(field), LoadU16(field + 2), field[4], values + offset,
+               value_size)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::optional<ImageConfig> ReadV2(const uint8_t *data, size_t size) {
+  if (size < HEADER_SIZE) {
+    LOGE("Configuration file is invalid.");
+    return std::nullopt;
+  }
+  const uint32_t kind = LoadU32(data + 12);
+  if (kind == KIND_BOOT) {
+    BootImageInfo info;
+    auto visit = [&](uint16_t record, uint16_t id, uint8_t type,
+                     const uint8_t *value, uint32_t value_size) {
+      if (record != 0) return true;
+      return Decode<BootImageInfo>(info, BOOT_FIELDS, id, type, value,
+                                   value_size);
+    };
+    if (!ForEachField(data, size, visit)) return std::nullopt;
+    return info;
+  }
+  if (kind == KIND_VENDOR_BOOT) {
+    VendorBootImageInfo info;
+    const uint32_t count = LoadU32(data + 16);
+    auto visit = [&](uint16_t record, uint16_t id, uint8_t type,
+                     const uint8_t *value, uint32_t value_size) {
+      if (record == 0) {
+        return Decode<VendorBootImageInfo>(info, VENDOR_BOOT_FIELDS, id, type,
+                                           value, value_size);
+      }
+      if (record > count) return false;  // cannot have that many entries
+      auto &table = info.vendor_ramdisk_table;
+      if (table.size() < record) table.resize(record);
+      return Decode<VendorRamdiskTableEntry>(table[record - 1],
+                                             RAMDISK_ENTRY_FIELDS, id, type,
+                                             value, value_size);
+    };
+    if (!ForEachField(data, size, visit)) return std::nullopt;
+    if (info.vendor_ramdisk_table.size() !=
+        info.vendor_ramdisk_table_entry_num) {
+      LOGE("Mismatch between vendor_ramdisk_table size and entry_num");
+      return std::nullopt;
+    }
+    return info;
+  }
+  LOGE("Unknown configuration kind %u", kind);
+  return std::nullopt;
+}
+
+std::optional<ImageConfig> ReadV1(const fs::path &path, const uint8_t *data,
+                                  size_t size) {
+  fs::path config = path;
+  string_size magic_size = 0;
+  if (size < sizeof(magic_size) || !ValidateSHA1(config)) {
+    LOGE("Configuration file is invalid.");
+    return std::nullopt;
+  }
+  std::memcpy(&magic_size, data, sizeof(magic_size));
+  const std::string_view magic(
+      reinterpret_cast<const char *>(data + sizeof(magic_size)),
+      std::min<size_t>(magic_size, size - sizeof(magic_size)));
+
+  if (magic == BOOT_MAGIC) {
+    BootImageInfo info;
+    if (!BootConfig::Read(info, path.string())) return std::nullopt;
+    return info;
+  }
+  if (magic == VENDOR_BOOT_MAGIC) {
+    VendorBootImageInfo info;
+    if (!VendorBootConfig::Read(info, path.string())) return std::nullopt;
+    return info;
+  }
+  LOGE("Invalid boot magic: %s", utils::toHexString(magic).c_str());
+  return std::nullopt;
+}
+}  // namespace
+
+bool WriteParserConfig(const BootImageInfo &info, const fs::path &path) {
+  ConfigWriter writer;
+  writer.Add<BootImageInfo>(0, info, BOOT_FIELDS);
+  return writer.Write(KIND_BOOT, path);
+}
+
+bool WriteParserConfig(const VendorBootImageInfo &info, const fs::path &path) {
+  if (info.vendor_ramdisk_table.size() != info.vendor_ramdisk_table_entry_num) {
+    LOGE("Mismatch between vendor_ramdisk_table size and entry_num");
+    return false;
+  }
+  ConfigWriter writer;
+  writer.Add<VendorBootImageInfo>(0, info, VENDOR_BOOT_FIELDS);
+  for (size_t i = 0; i < info.vendor_ramdisk_table.size(); ++i) {
+    writer.Add<VendorRamdiskTableEntry>(static_cast<uint16_t>(i + 1),
+                                        info.vendor_ramdisk_table[i],
+                                        RAMDISK_ENTRY_FIELDS);
+  }
+  return writer.Write(KIND_VENDOR_BOOT, path);
+}
+
+std::optional<ImageConfig> ReadParserConfig(const fs::path &path) {
+  MappedFile file(path);
+  if (!file.data()) {
+    std::error_code ec;
+    LOGE("%s", fs::exists(path, ec) ? "Configuration file is invalid."
+                                    : "Configuration file does not exist.");
+    return std::nullopt;
+  }
+  if (file.size() >= CONFIG_MAGIC.size() &&
+      std::memcmp(file.data(), CONFIG_MAGIC.data(), CONFIG_MAGIC.size()) ==
+          0) {
+    return ReadV2(file.data(), file.size());
+  }
+  return ReadV1(path, file.data(), file.size());
+}
@@ -0,0 +1,187 @@
+#include "scheduler.h"
+
+#include <exception>
+#include <utility>
+
+#include "log.h"
+#include "session.h"
+
+struct Scheduler::Task {
+  std::function<void()> fn;
+  Session *session = nullptr;
+  TaskPriority priority = TaskPriority::Normal;
+  TaskGroup *group = nullptr;
+  // Set by whoever runs the task: a worker, or the group's owner in Wait.
+  // Queues may still hold a task after it ran elsewhere; takers skip it.
+  std::atomic<bool> claimed{false};
+};
+
+namespace {
+thread_local Scheduler *current_scheduler = nullptr;
+thread_local size_t current_worker = 0;
+
+// Runs fn, returning false if it threw: an exception must not take a worker
+// down, nor leave a group before its other tasks are done.
+bool Invoke(const std::function<void()> &fn) {
+  try {
+    fn();
+    return true;
+  } catch (const std::exception &e) {
+    LOGE("%s", e.what());
+  } catch (...) {
+    LOGE("Task failed with an unknown exception");
+  }
+  return false;
+}
+}  // namespace
+
+void Scheduler::Run(Task &task) {
+  bool ok;
+  if (task.session != nullptr) {
+    Session::Scope scope(*task.session);
+    ok = Invoke(task.fn);
+  } else {
+    ok = Invoke(task.fn);
+  }
+  // Drops whatever the closure captured before the group can go away.
+  task.fn = nullptr;
+  task.group->Finished(ok);
+}
+
+Scheduler &Scheduler::Shared() {
+  static Scheduler scheduler(std::max(1u, std::thread::hardware_concurrency()));
+  return scheduler;
+}
+
+Scheduler::Scheduler(unsigned workers) {
+  for (unsigned i = 0; i < workers; ++i) {
+    queues_.push_back(std::make_unique<Queue>());
+  }
+  workers_.reserve(workers);
+  for (unsigned i = 0; i < workers; ++i) {
+    workers_.emplace_back([this, i] { Work(i); });
+  }
+}
+
+Scheduler::~Scheduler() {
+  {
+    std::lock_guard lock(sleep_mutex_);
+    stop_ = true;
+  }
+  sleep_cv_.notify_all();
+  for (auto &worker : workers_) worker.join();
+}
+
+void Scheduler::Submit(std::shared_ptr<Task> task) {
+  Queue &queue =
+      current_scheduler == this ? *queues_[current_worker] : shared_;
+  {
+    std::lock_guard lock(queue.mutex);
+    queue.tasks[static_cast<size_t>(task->priority)].push_back(
+        std::move(task));
+  }
+  queued_.fetch_add(1);
+  { std::lock_guard lock(sleep_mutex_); }
+  sleep_cv_.notify_one();
+}
+
+std::shared_ptr<Scheduler::Task> Scheduler::Take(size_t self) {
+  auto pop = [this](Queue &queue, size_t priority, bool newest) {
+    std::shared_ptr<Task> task;
+    std::lock_guard lock(queue.mutex);
+    auto &tasks = queue.tasks[priority];
+    if (!tasks.empty()) {
+      if (newest) {
+        task = std::move(tasks.back());
+        tasks.pop_back();
+      } else {
+        task = std::move(tasks.front());
+        tasks.pop_front();
+      }
+      queued_.fetch_sub(1);
+    }
+    return task;
+  };
+  const size_t count = queues_.size();
+  for (size_t priority = 0; priority < TASK_PRIORITIES; ++priority) {
+    if (auto task = pop(*queues_[self], priority, true)) return task;
+    if (auto task = pop(shared_, priority, false)) return task;
+    for (size_t i = 1; i < count; ++i) {
+      if (auto task = pop(*queues_[(self + i) % count], priority, false)) {
+        return task;
+      }
+    }
+  }
+  return nullptr;
+}
+
+void Scheduler::Work(size_t self) {
+  current_scheduler = this;
+  current_worker = self;
+  while (true) {
+    if (auto task = Take(self)) {
+      if (!task->claimed.exchange(true)) {
+        Run(*task);
+      }
+      continue;
+    }
+    std::unique_lock lock(sleep_mutex_);
+    sleep_cv_.wait(lock, [&] { return stop_ || queued_.load() > 0; });
+    if (stop_) return;
+  }
+}
+
+TaskGroup::TaskGroup(Scheduler &scheduler) : scheduler_(scheduler) {}
+
+TaskGroup::~TaskGroup() { Wait(); }
+
+void TaskGroup::RunHere(const std::function<void()> &fn) {
+  if (!Invoke(fn)) {
+    std::lock_guard lock(mutex_);
+    failed_ = true;
+  }
+}
+
+void TaskGroup::Run(std::function<void()> fn) {
+  auto task = std::make_shared<Scheduler::Task>();
+  task->fn = std::move(fn);
+  task->session = Session::Current();
+  if (task->session != nullptr) task->priority = task->session->priority();
+  task->group = this;
+  {
+    std::lock_guard lock(mutex_);
+    ++pending_;
+    tasks_.push_back(task);
+  }
+  cv_.notify_all();
+  scheduler_.Submit(std::move(task));
+}
+
+bool TaskGroup::Wait() {
+  std::unique_lock lock(mutex_);
+  while (pending_ > 0) {
+    if (next_ == tasks_.size()) {
+      cv_.wait(lock);
+      continue;
+    }
+    auto task = tasks_[next_++];
+    if (task->claimed.exchange(true)) continue;
+    lock.unlock();
+    Scheduler::Run(*task);
+    lock.lock();
+  }
+  tasks_.clear();
+  next_ = 0;
+  return !std::exchange(failed_, false);
+}
+
+void TaskGroup::Finished(bool ok) {
+  std::lock_guard lock(mutex_);
+  failed_ |= !ok;
+  if (--pending_ == 0) cv_.notify_all();
+}
+
+unsigned TaskThreads() {
+  const Session *session = Session::Current();
+  return session ? session->threads() : 1;
+}
@@ -0,0 +1,40 @@
+#include "session.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <thread>
+
+namespace {
+thread_local Session *current_session = nullptr;
+}  // namespace
+
+Session::Session(LogSink *sink, std::string_view level)
+    : sink_(sink),
+      level_(level),
+      threads_(std::max(1u, std::thread::hardware_concurrency())) {}
+
+Session::Session(const Session &parent, std::string tag, unsigned threads)
+    : sink_(parent.sink_),
+      level_(parent.level_),
+      tag_(std::move(tag)),
+      threads_(std::max(1u, threads)),
+      tracing_(parent.tracing_),
+      seek_index_(parent.seek_index_),
+      priority_(parent.priority_),
+      job_(parent.job_) {}
+
+void Session::Console(const char *message) const {
+  if (sink_ != nullptr) {
+    sink_->Write(message);
+  } else {
+    std::fprintf(stderr, "%s\n", message);
+  }
+}
+
+Session *Session::Current() { return current_session; }
+
+Session::Scope::Scope(Session &session) : previous_(current_session) {
+  current_session = &session;
+}
+
+Session::Scope::~Scope() { current_session = previous_; }
@@ -0,0 +1,227 @@
+#include "sha1_engine.h"
+
+#include <atomic>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <sys/auxv.h>
+#endif
+
+namespace sha1 {
+
+#if defined(__aarch64__)
+// Sha1ArmCe.cc, built with the crypto extension enabled.
+void ProcessBlocksArmCe(uint32_t state[5], const uint8_t *data, size_t blocks);
+#endif
+
+namespace {
+using BlockFn = void (*)(uint32_t *, const uint8_t *, size_t);
+
+inline uint32_t Rotl(uint32_t value, int count) {
+  return (value << count) | (value >> (32 - count));
+}
+
+inline uint32_t LoadBe32(const uint8_t *p) {
+  return (static_cast<uint32_t>(p[0]) << 24) |
+         (static_cast<uint32_t>(p[1]) << 16) |
+         (static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+}
+
+// Keeps only a 16-word window of the message schedule so it stays in
+// registers instead of expanding all 80 words up front.
+void ProcessBlocksPortable(uint32_t *state, const uint8_t *data,
+                           size_t blocks) {
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+           e = state[4];
+  for (; blocks > 0; --blocks, data += 64) {
+    uint32_t w[16];
+    for (int i = 0; i < 16; ++i) w[i] = LoadBe32(data + 4 * i);
+
+    const uint32_t sa = a, sb = b, sc = c, sd = d, se = e;
+    for (int i = 0; i < 80; ++i) {
+      if (i >= 16) {
+        w[i & 15] = Rotl(w[(i - 3) & 15] ^ w[(i - 8) & 15] ^
+                             w[(i - 14) & 15] ^ w[i & 15],
+                         1);
+      }
+      uint32_t f, k;
+      if (i < 20) {
+        f = d ^ (b & (c ^ d));
+        k = 0x5A827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ED9EBA1;
+      } else if (i < 60) {
+        f = (b & c) | (d & (b | c));
+        k = 0x8F1BBCDC;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xCA62C1D6;
+      }
+      const uint32_t temp = Rotl(a, 5) + f + e + k + w[i & 15];
+      e = d;
+      d = c;
+      c = Rotl(b, 30);
+      b = a;
+      a = temp;
+    }
+    a += sa;
+    b += sb;
+    c += sc;
+    d += sd;
+    e += se;
+  }
+  state[0] = a;
+  state[1] = b;
+  state[2] = c;
+  state[3] = d;
+  state[4] = e;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA_NI_TARGET __attribute__((target("sha,ssse3,sse4.1")))
+
+// Rounds 20F to 20F+19 in groups of four. The instruction takes the round
+// function as an immediate, hence the template; group 0 is done by the
+// caller.
+template <int F>
+SHA_NI_TARGET inline void ShaNiGroup(__m128i &abcd, __m128i &abcd_prev,
+                                     __m128i msg[4]) {
+  for (int i = F == 0 ? 1 : 5 * F; i < 5 * F + 5; ++i) {
+    if (i >= 4) {
+      // W[i] = msg2(msg1(W[i-4], W[i-3]) ^ W[i-2], W[i-1])
+      msg[i & 3] = _mm_sha1msg2_epu32(
+          _mm_xor_si128(_mm_sha1msg1_epu32(msg[i & 3], msg[(i + 1) & 3]),
+                        msg[(i + 2) & 3]),
+          msg[(i + 3) & 3]);
+    }
+    const __m128i e = _mm_sha1nexte_epu32(abcd_prev, msg[i & 3]);
+    abcd_prev = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e, F);
+  }
+}
+
+SHA_NI_TARGET void ProcessBlocksShaNi(uint32_t *state, const uint8_t *data,
+                                      size_t blocks) {
+  const __m128i byte_swap =
+      _mm_set_epi64x(0x0001020304050607LL, 0x08090a0b0c0d0e0fLL);
+  __m128i abcd = _mm_shuffle_epi32(
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(state)), 0x1B);
+  __m128i e0 = _mm_set_epi32(static_cast<int>(state[4]), 0, 0, 0);
+
+  for (; blocks > 0; --blocks, data += 64) {
+    const __m128i abcd_save = abcd;
+    const __m128i e0_save = e0;
+    __m128i msg[4];
+    for (int i = 0; i < 4; ++i) {
+      msg[i] = _mm_shuffle_epi8(
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 16 * i)),
+          byte_swap);
+    }
+
+    // The first group takes e straight from the state; every later one
+    // derives it from the abcd of the group before.
+    __m128i abcd_prev = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, _mm_add_epi32(e0, msg[0]), 0);
+    ShaNiGroup<0>(abcd, abcd_prev, msg);
+    ShaNiGroup<1>(abcd, abcd_prev, msg);
+    ShaNiGroup<2>(abcd, abcd_prev, msg);
+    ShaNiGroup<3>(abcd, abcd_prev, msg);
+
+    e0 = _mm_sha1nexte_epu32(abcd_prev, e0_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+  }
+
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(state),
+                   _mm_shuffle_epi32(abcd, 0x1B));
+  state[4] = static_cast<uint32_t>(_mm_extract_epi32(e0, 3));
+}
+#undef SHA_NI_TARGET
+#endif
+
+bool Supported(Engine engine) {
+  switch (engine) {
+    case Engine::Portable:
+      return true;
+    case Engine::ShaNi: {
+#if defined(__x86_64__) || defined(__i386__)
+      unsigned eax, ebx, ecx, edx;
+      if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+      const bool ssse3 = ecx & (1u << 9), sse41 = ecx & (1u << 19);
+      if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return false;
+      return ssse3 && sse41 && (ebx & (1u << 29));
+#else
+      return false;
+#endif
+    }
+    case Engine::ArmCrypto:
+#if defined(__aarch64__)
+      // HWCAP_SHA1; spelled out because not every libc header defines it.
+      return getauxval(AT_HWCAP) & (1ul << 5);
+#else
+      return false;
+#endif
+  }
+  return false;
+}
+
+BlockFn Function(Engine engine) {
+  switch (engine) {
+#if defined(__x86_64__) || defined(__i386__)
+    case Engine::ShaNi:
+      return ProcessBlocksShaNi;
+#endif
+#if defined(__aarch64__)
+    case Engine::ArmCrypto:
+      return ProcessBlocksArmCe;
+#endif
+    default:
+      return ProcessBlocksPortable;
+  }
+}
+
+Engine Detect() {
+  for (Engine engine : {Engine::ArmCrypto, Engine::ShaNi}) {
+    if (Supported(engine)) return engine;
+  }
+  return Engine::Portable;
+}
+
+struct Dispatch {
+  std::atomic<Engine> engine{Detect()};
+  std::atomic<BlockFn> fn{Function(engine.load())};
+};
+
+Dispatch &Active() {
+  static Dispatch dispatch;
+  return dispatch;
+}
+}  // namespace
+
+void ProcessBlocks(uint32_t state[5], const uint8_t *data, size_t blocks) {
+  Active().fn.load(std::memory_order_relaxed)(state, data, blocks);
+}
+
+Engine ActiveEngine() { return Active().engine.load(); }
+
+const char *EngineName(Engine engine) {
+  switch (engine) {
+    case Engine::ShaNi:
+      return "sha-ni";
+    case Engine::ArmCrypto:
+      return "armv8-crypto";
+    default:
+      return "portable";
+  }
+}
+
+bool UseEngine(Engine engine) {
+  if (!Supported(engine)) return false;
+  Active().engine = engine;
+  Active().fn = Function(engine);
+  return true;
+}
+
+}  // namespace sha1
@@ -0,0 +1,55 @@
+// SHA1 block compression with the ARMv8 Crypto Extensions. Only this file is
+// built with +crypto, so the rest of the library still runs on cores without
+// it; Sha1.cc checks HWCAP_SHA1 before dispatching here.
+
+#include <arm_neon.h>
+
+#include "sha1_engine.h"
+
+namespace sha1 {
+
+void ProcessBlocksArmCe(uint32_t state[5], const uint8_t *data,
+                        size_t blocks) {
+  const uint32x4_t k[4] = {vdupq_n_u32(0x5A827999), vdupq_n_u32(0x6ED9EBA1),
+                           vdupq_n_u32(0x8F1BBCDC), vdupq_n_u32(0xCA62C1D6)};
+  uint32x4_t abcd = vld1q_u32(state);
+  uint32_t e0 = state[4];
+
+  for (; blocks > 0; --blocks, data += 64) {
+    const uint32x4_t abcd_save = abcd;
+    const uint32_t e0_save = e0;
+    uint32x4_t msg[4];
+    for (int i = 0; i < 4; ++i) {
+      msg[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * i)));
+    }
+
+    // Twenty groups of four rounds; W[i] for i >= 4 is
+    // su1(su0(W[i-4], W[i-3], W[i-2]), W[i-1]).
+    uint32_t e = e0;
+    for (int i = 0; i < 20; ++i) {
+      if (i >= 4) {
+        msg[i & 3] = vsha1su1q_u32(
+            vsha1su0q_u32(msg[i & 3], msg[(i + 1) & 3], msg[(i + 2) & 3]),
+            msg[(i + 3) & 3]);
+      }
+      const uint32x4_t wk = vaddq_u32(msg[i & 3], k[i / 5]);
+      const uint32_t e_next = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+      if (i < 5) {
+        abcd = vsha1cq_u32(abcd, e, wk);
+      } else if (i < 10 || i >= 15) {
+        abcd = vsha1pq_u32(abcd, e, wk);
+      } else {
+        abcd = vsha1mq_u32(abcd, e, wk);
+      }
+      e = e_next;
+    }
+
+    e0 = e + e0_save;
+    abcd = vaddq_u32(abcd, abcd_save);
+  }
+
+  vst1q_u32(state, abcd);
+  state[4] = e0;
+}
+
+}  // namespace sha1
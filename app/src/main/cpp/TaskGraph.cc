@@ -0,0 +1,132 @@
+#include "task_graph.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <queue>
+
+#include "job.h"
+#include "scheduler.h"
+
+TaskGraph::Node TaskGraph::Add(std::string name, uint64_t cost,
+                               std::function<bool()> fn,
+                               std::vector<Node> deps) {
+  const Node node = steps_.size();
+  for (Node dep : deps) steps_[dep].next.push_back(node);
+  steps_.push_back({std::move(name), cost, std::move(fn), std::move(deps), {}});
+  return node;
+}
+
+bool TaskGraph::Run() {
+  // Steps only depend on earlier ones, so walking backwards sees every
+  // successor before the step itself.
+  for (size_t i = steps_.size(); i-- > 0;) {
+    Step &step = steps_[i];
+    step.rank = 0;
+    for (Node next : step.next) {
+      step.rank = std::max(step.rank, steps_[next].rank);
+    }
+    step.rank += step.cost;
+    step.gate = NONE;
+    step.done = false;
+  }
+
+  using Clock = std::chrono::steady_clock;
+  const auto begin = Clock::now();
+  auto seconds = [&] {
+    return std::chrono::duration<double>(Clock::now() - begin).count();
+  };
+
+  // Highest rank first; ties go to the step added first.
+  auto later = [&](Node a, Node b) {
+    return steps_[a].rank != steps_[b].rank ? steps_[a].rank < steps_[b].rank
+                                            : a > b;
+  };
+  std::priority_queue<Node, std::vector<Node>, decltype(later)> ready(later);
+  std::vector<size_t> waiting(steps_.size());
+  for (Node node = 0; node < steps_.size(); ++node) {
+    waiting[node] = steps_[node].deps.size();
+    if (waiting[node] == 0) ready.push(node);
+  }
+
+  std::mutex mutex;
+  size_t running = 0;
+  bool failed = false;
+  // No more steps are handed to the pool than it can start right away, the
+  // waiting caller included, so ready ones queue here in rank order rather
+  // than in worker deques.
+  TaskGroup group;
+  const unsigned threads =
+      std::min(TaskThreads(), Scheduler::Shared().workers() + 1);
+  std::function<void(Node)> dispatch;
+  auto run = [&](Node node) {
+    Step &step = steps_[node];
+    step.start = seconds();
+    const bool ok = !JobCancelled() && step.fn();
+    step.end = seconds();
+    std::lock_guard lock(mutex);
+    --running;
+    if (!ok) {
+      failed = true;
+      return;
+    }
+    step.done = true;
+    for (Node next : step.next) {
+      if (--waiting[next] == 0) ready.push(next);
+    }
+    dispatch(node);
+  };
+  // Called with mutex held by the step gate as it ends. Steps hand out their
+  // successors before they finish, so the group never runs dry while work
+  // is left.
+  dispatch = [&](Node gate) {
+    while (!failed && running < threads && !ready.empty()) {
+      const Node node = ready.top();
+      ready.pop();
+      steps_[node].gate = gate;
+      ++running;
+      group.Run([&run, node] { run(node); });
+    }
+  };
+  {
+    std::lock_guard lock(mutex);
+    dispatch(NONE);
+  }
+  // A step that threw never finished, so it is left not done.
+  group.Wait();
+  elapsed_ = seconds();
+
+  for (const Step &step : steps_) {
+    if (!step.done) return false;
+  }
+  return true;
+}
+
+std::string TaskGraph::CriticalPath() const {
+  const Step *last = nullptr;
+  for (const Step &step : steps_) {
+    if (step.done && (last == nullptr || step.end > last->end)) last = &step;
+  }
+  if (last == nullptr) return {};
+
+  std::vector<const Step *> path;
+  for (const Step *step = last;;) {
+    path.push_back(step);
+    if (step->gate == NONE) break;
+    step = &steps_[step->gate];
+  }
+
+  std::string out;
+  double total = 0;
+  char buffer[64];
+  for (auto it = path.rbegin(); it != path.rend(); ++it) {
+    const double took = (*it)->end - (*it)->start;
+    total += took;
+    if (!out.empty()) out += " > ";
+    std::snprintf(buffer, sizeof(buffer), " %.2fs", took);
+    out += (*it)->name + buffer;
+  }
+  std::snprintf(buffer, sizeof(buffer), " (%.2fs of %.2fs)", total, elapsed_);
+  return out + buffer;
+}
@@ -1,5 +1,19 @@
 #include "tools.h"
 
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#include "ramdisk/codec.h"
+
 namespace fs = std::filesystem;
 
 fs::path get_unique_path(const fs::path& output_dir) {
@@ -19,6 +33,83 @@ fs::path get_unique_path(const fs::path& output_dir) {
   }
 }
 
+bool ReadFullyAt(int fd, void* buf, size_t size, off_t offset) {
+  auto* out = static_cast<uint8_t*>(buf);
+  while (size > 0) {
+    ssize_t n = pread(fd, out, size, offset);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    out += n;
+    size -= static_cast<size_t>(n);
+    offset += n;
+  }
+  return true;
+}
+
+bool WriteFullyAt(int fd, const void* buf, size_t size, off_t offset) {
+  const auto* in = static_cast<const uint8_t*>(buf);
+  while (size > 0) {
+    ssize_t n = pwrite(fd, in, size, offset);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    in += n;
+    size -= static_cast<size_t>(n);
+    offset += n;
+  }
+  return true;
+}
+
+bool WriteFully(int fd, const void* buf, size_t size) {
+  const auto* in = static_cast<const uint8_t*>(buf);
+  while (size > 0) {
+    ssize_t n = write(fd, in, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    in += n;
+    size -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+bool WriteZeros(int fd, uint64_t size) {
+  static constexpr uint8_t zeros[64 << 10] = {};
+  while (size > 0) {
+    const size_t length = std::min<uint64_t>(size, sizeof(zeros));
+    if (!WriteFully(fd, zeros, length)) return false;
+    size -= length;
+  }
+  return true;
+}
+
+bool IsSeekable(int fd) { return lseek(fd, 0, SEEK_CUR) >= 0; }
+
+// Shares the input's extents when the filesystem supports reflinks, otherwise
+// lets the kernel copy the data without bouncing it through userspace.
+bool CloneFile(int in, int out) {
+  if (ioctl(out, FICLONE, in) == 0) return true;
+
+  off_t size = lseek(in, 0, SEEK_END);
+  off_t pos = 0;
+  bool ok = size >= 0;
+  while (ok && pos < size) {
+    // Raw syscall: bionic only exposes copy_file_range from API 34.
+    auto n = syscall(__NR_copy_file_range, in, &pos, out, nullptr,
+                     static_cast<size_t>(size - pos), 0);
+    if (n <= 0) break;
+  }
+  if (ok && pos < size) {
+    // copy_file_range is unavailable across filesystems on older kernels.
+    std::vector<uint8_t> buffer(1 << 20);
+    while (ok && pos < size) {
+      size_t chunk = std::min<size_t>(buffer.size(), size - pos);
+      ok = ReadFullyAt(in, buffer.data(), chunk, pos) &&
+           WriteFullyAt(out, buffer.data(), chunk, pos);
+      pos += static_cast<off_t>(chunk);
+    }
+  }
+  return ok;
+}
+
 bool isCpioNewcHeader(const uint8_t* data, size_t size) {
   if (size < 6) {
     return false;
@@ -87,14 +178,46 @@ bool isLzmaHeader(const uint8_t* data, size_t size) {
 }
 
 uint8_t getHeaderFormat(const uint8_t* data, size_t size) {
-  if (isCpioNewcHeader(data, size)) {
-    return FORMAT_NONE;
-  } else if (isLz4LegacyHeader(data, size)) {
-    return FORMAT_LZ4;
-  } else if (isGzipHeader(data, size)) {
-    return FORMAT_GZIP;
-  } else if (isLzmaHeader(data, size)) {
-    return FORMAT_LZMA;
-  }
-  return FORMAT_OTHER;
-}
\ No newline at end of file
+  const Codec* codec = DetectCodec(data, size);
+  return codec ? codec->format : FORMAT_OTHER;
+}
+
+std::string_view getFormatName(uint8_t format) {
+  const Codec* codec = FindCodec(format);
+  return codec ? codec->name : "unknown";
+}
+
+bool ParseConfigLine(const std::string& line,
+                     std::map<std::string, std::string>& entry) {
+  size_t pos = 0;
+  while (pos < line.size()) {
+    while (pos < line.size() && std::isspace(line[pos])) {
+      pos++;
+    }
+    if (pos >= line.size()) break;
+
+    size_t eq_pos = line.find('=', pos);
+    if (eq_pos == std::string::npos) break;
+    std::string key = line.substr(pos, eq_pos - pos);
+    pos = eq_pos + 1;
+
+    if (pos < line.size() && line[pos] == '"') {
+      pos++;
+      size_t end_quote = line.find('"', pos);
+      if (end_quote == std::string::npos) {
+        LOGE("Error: Unterminated quote in config line.");
+        return false;
+      }
+      entry[key] = line.substr(pos, end_quote - pos);
+      pos = end_quote + 1;
+    } else {
+      size_t value_end = line.find_first_of(" \t", pos);
+      if (value_end == std::string::npos) {
+        value_end = line.size();
+      }
+      entry[key] = line.substr(pos, value_end - pos);
+      pos = value_end;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,90 @@
+#include "trace.h"
+
+#include <unistd.h>
+
+#include <fstream>
+
+#include "json_writer.hpp"
+#include "session.h"
+
+namespace {
+uint64_t Micros(std::chrono::steady_clock::duration d) {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::microseconds>(d).count());
+}
+
+uint64_t FileSize(const std::filesystem::path &path) {
+  std::error_code ec;
+  const auto size = std::filesystem::file_size(path, ec);
+  return ec ? 0 : size;
+}
+}  // namespace
+
+Trace::Trace() : epoch_(std::chrono::steady_clock::now()) {}
+
+void Trace::Record(Event event) {
+  std::lock_guard lock(mutex_);
+  events_.push_back(std::move(event));
+}
+
+bool Trace::WriteChromeJson(const std::filesystem::path &path) const {
+  JsonWriter json;
+  json.BeginObject().Field("displayTimeUnit", "ms").Key("traceEvents");
+  json.BeginArray();
+  const auto pid = static_cast<uint32_t>(getpid());
+  {
+    std::lock_guard lock(mutex_);
+    for (const auto &event : events_) {
+      json.BeginObject()
+          .Field("name", event.name)
+          .Field("cat", "abik")
+          .Field("ph", "X")
+          .Field("ts", event.start_us)
+          .Field("dur", event.duration_us)
+          .Field("pid", pid)
+          .Field("tid", event.tid)
+          .Key("args")
+          .BeginObject();
+      if (!event.detail.empty()) json.Field("detail", event.detail);
+      json.Field("bytes_in", event.bytes_in)
+          .Field("bytes_out", event.bytes_out)
+          .EndObject()
+          .EndObject();
+    }
+  }
+  json.EndArray().EndObject();
+
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  out << json.str();
+  return out.good();
+}
+
+TraceSpan::TraceSpan(const char *name, std::string_view detail)
+    : trace_(nullptr), name_(name) {
+  if (const Session *session = Session::Current()) trace_ = session->trace();
+  if (trace_ == nullptr) return;
+  detail_ = detail;
+  start_ = std::chrono::steady_clock::now();
+}
+
+TraceSpan::~TraceSpan() {
+  if (trace_ == nullptr) return;
+  const auto end = std::chrono::steady_clock::now();
+  trace_->Record(Trace::Event{name_, std::move(detail_),
+                              Micros(start_ - trace_->epoch()),
+                              Micros(end - start_), bytes_in_, bytes_out_,
+                              static_cast<uint32_t>(gettid())});
+}
+
+void TraceSpan::SetBytes(uint64_t in, uint64_t out) {
+  bytes_in_ = in;
+  bytes_out_ = out;
+}
+
+void TraceSpan::SetInput(const std::filesystem::path &path) {
+  if (trace_ != nullptr) bytes_in_ = FileSize(path);
+}
+
+void TraceSpan::SetOutput(const std::filesystem::path &path) {
+  if (trace_ != nullptr) bytes_out_ = FileSize(path);
+}
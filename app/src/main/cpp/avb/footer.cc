@@ -0,0 +1,740 @@
+#include "footer.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <random>
+
+#include "buffer_pool.h"
+#include "json_writer.hpp"
+#include "log.h"
+#include "rsa.h"
+#include "sha256.h"
+#include "tools.h"
+
+namespace avb {
+namespace {
+constexpr std::string_view FOOTER_MAGIC = "AVBf";
+constexpr std::string_view VBMETA_MAGIC = "AVB0";
+constexpr uint64_t FOOTER_SIZE = 64;
+constexpr uint64_t VBMETA_HEADER_SIZE = 256;
+constexpr uint64_t BLOCK_SIZE = 4096;
+// avbtool reserves this much at the end of the partition for vbmeta and the
+// footer block.
+constexpr uint64_t MAX_VBMETA_SIZE = 64 * 1024;
+constexpr uint64_t MAX_FOOTER_SIZE = 4096;
+constexpr uint64_t DESCRIPTOR_TAG_PROPERTY = 0;
+constexpr uint64_t DESCRIPTOR_TAG_HASH = 2;
+constexpr size_t HASH_ALGORITHM_SIZE = 32;
+constexpr size_t HASH_DESCRIPTOR_RESERVED_SIZE = 60;
+constexpr size_t RELEASE_STRING_SIZE = 48;
+constexpr size_t VBMETA_RESERVED_SIZE = 80;
+constexpr size_t DEFAULT_SALT_SIZE = 32;
+constexpr std::string_view RELEASE_STRING = "abik";
+
+// Indexed by AvbAlgorithmType.
+constexpr const char *ALGORITHMS[] = {
+    "NONE",           "SHA256_RSA2048", "SHA256_RSA4096", "SHA256_RSA8192",
+    "SHA512_RSA2048", "SHA512_RSA4096", "SHA512_RSA8192"};
+constexpr uint32_t ALGORITHM_NONE = 0;
+
+uint64_t RoundUp(uint64_t value, uint64_t multiple) {
+  return (value + multiple - 1) / multiple * multiple;
+}
+
+bool InRange(uint64_t offset, uint64_t size, uint64_t limit) {
+  return offset <= limit && size <= limit - offset;
+}
+
+std::string ToHex(const std::vector<uint8_t> &bytes) {
+  static constexpr char digits[] = "0123456789abcdef";
+  std::string hex;
+  for (uint8_t b : bytes) {
+    hex += digits[b >> 4];
+    hex += digits[b & 0x0F];
+  }
+  return hex;
+}
+
+std::optional<std::vector<uint8_t>> FromHex(std::string_view hex) {
+  if (hex.size() % 2 != 0) return std::nullopt;
+  std::vector<uint8_t> bytes;
+  for (size_t i = 0; i < hex.size(); i += 2) {
+    char *end = nullptr;
+    const std::string pair(hex.substr(i, 2));
+    const unsigned long value = std::strtoul(pair.c_str(), &end, 16);
+    if (end != pair.c_str() + 2) return std::nullopt;
+    bytes.push_back(static_cast<uint8_t>(value));
+  }
+  return bytes;
+}
+
+// Big-endian encoder for the vbmeta structures.
+class Writer {
+ public:
+  Writer &U32(uint32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+      bytes_.push_back(static_cast<uint8_t>(value >> shift));
+    }
+    return *this;
+  }
+  Writer &U64(uint64_t value) {
+    return U32(static_cast<uint32_t>(value >> 32))
+        .U32(static_cast<uint32_t>(value));
+  }
+  Writer &Bytes(const void *data, size_t size) {
+    const auto *p = static_cast<const uint8_t *>(data);
+    bytes_.insert(bytes_.end(), p, p + size);
+    return *this;
+  }
+  Writer &Field(std::string_view value, size_t size) {
+    const size_t length = std::min(value.size(), size);
+    Bytes(value.data(), length);
+    return Zeros(size - length);
+  }
+  Writer &Zeros(size_t count) {
+    bytes_.insert(bytes_.end(), count, 0);
+    return *this;
+  }
+  Writer &PadTo(size_t multiple) {
+    return Zeros(RoundUp(bytes_.size(), multiple) - bytes_.size());
+  }
+
+  size_t size() const { return bytes_.size(); }
+  std::vector<uint8_t> &bytes() { return bytes_; }
+
+ private:
+  std::vector<uint8_t> bytes_;
+};
+
+// Big-endian decoder; a read past the end latches failure and yields zeros.
+class Reader {
+ public:
+  Reader(const uint8_t *data, size_t size) : data_(data), size_(size) {}
+
+  bool ok() const { return ok_; }
+  size_t remaining() const { return size_ - pos_; }
+
+  const uint8_t *Take(size_t count) {
+    if (!ok_ || count > remaining()) {
+      ok_ = false;
+      return nullptr;
+    }
+    const uint8_t *p = data_ + pos_;
+    pos_ += count;
+    return p;
+  }
+  uint32_t U32() {
+    const uint8_t *p = Take(4);
+    if (p == nullptr) return 0;
+    return (static_cast<uint32_t>(p[0]) << 24) |
+           (static_cast<uint32_t>(p[1]) << 16) |
+           (static_cast<uint32_t>(p[2]) << 8) | p[3];
+  }
+  uint64_t U64() {
+    const uint64_t high = U32();
+    return (high << 32) | U32();
+  }
+  std::string String(size_t count) {
+    const uint8_t *p = Take(count);
+    if (p == nullptr) return {};
+    std::string value(reinterpret_cast<const char *>(p), count);
+    value.resize(value.find('\0') == std::string::npos ? count
+                                                       : value.find('\0'));
+    return value;
+  }
+
+ private:
+  const uint8_t *data_;
+  size_t size_;
+  size_t pos_ = 0;
+  bool ok_ = true;
+};
+
+struct VbmetaHeader {
+  uint32_t required_major = 0;
+  uint32_t required_minor = 0;
+  uint64_t auth_size = 0;
+  uint64_t aux_size = 0;
+  uint32_t algorithm = 0;
+  uint64_t hash_offset = 0;
+  uint64_t hash_size = 0;
+  uint64_t signature_offset = 0;
+  uint64_t signature_size = 0;
+  uint64_t public_key_offset = 0;
+  uint64_t public_key_size = 0;
+  uint64_t descriptors_offset = 0;
+  uint64_t descriptors_size = 0;
+  uint64_t rollback_index = 0;
+  uint32_t flags = 0;
+  uint32_t rollback_index_location = 0;
+};
+
+// A footer and its vbmeta, read and bounds-checked.
+struct ParsedFooter {
+  HashFooterInfo info;
+  VbmetaHeader header;
+  std::vector<uint8_t> vbmeta;
+
+  const uint8_t *auth() const { return vbmeta.data() + VBMETA_HEADER_SIZE; }
+  const uint8_t *aux() const { return auth() + header.auth_size; }
+};
+
+bool ParseDescriptors(const uint8_t *data, size_t size, HashFooterInfo &info) {
+  bool found_hash = false;
+  Reader reader(data, size);
+  while (reader.remaining() > 0) {
+    const uint64_t tag = reader.U64();
+    const uint64_t length = reader.U64();
+    if (!reader.ok() || length % 8 != 0 || length > reader.remaining()) {
+      return false;
+    }
+    Reader body(reader.Take(length), length);
+
+    if (tag == DESCRIPTOR_TAG_PROPERTY) {
+      const uint64_t key_size = body.U64();
+      const uint64_t value_size = body.U64();
+      // Both are followed by a NUL.
+      if (key_size >= body.remaining() ||
+          value_size >= body.remaining() - key_size - 1) {
+        return false;
+      }
+      std::string key = body.String(key_size + 1);
+      const uint8_t *value = body.Take(value_size);
+      info.args.properties.emplace_back(
+          std::move(key),
+          std::string(reinterpret_cast<const char *>(value), value_size));
+    } else if (tag == DESCRIPTOR_TAG_HASH && !found_hash) {
+      info.image_size = body.U64();
+      info.hash_algorithm = body.String(HASH_ALGORITHM_SIZE);
+      const uint32_t name_size = body.U32();
+      const uint32_t salt_size = body.U32();
+      const uint32_t digest_size = body.U32();
+      body.U32();  // flags
+      body.Take(HASH_DESCRIPTOR_RESERVED_SIZE);
+      const uint8_t *name = body.Take(name_size);
+      const uint8_t *salt = body.Take(salt_size);
+      const uint8_t *digest = body.Take(digest_size);
+      if (!body.ok()) return false;
+      info.args.partition_name.assign(reinterpret_cast<const char *>(name),
+                                      name_size);
+      info.args.salt.assign(salt, salt + salt_size);
+      info.digest.assign(digest, digest + digest_size);
+      found_hash = true;
+    } else {
+      LOG("Ignoring AVB descriptor with tag %llu",
+          static_cast<unsigned long long>(tag));
+    }
+  }
+  return found_hash;
+}
+
+std::optional<ParsedFooter> ParseFooter(int fd) {
+  struct stat st {};
+  if (fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < FOOTER_SIZE) {
+    return std::nullopt;
+  }
+  const auto file_size = static_cast<uint64_t>(st.st_size);
+
+  uint8_t raw_footer[FOOTER_SIZE];
+  if (!ReadFullyAt(fd, raw_footer, FOOTER_SIZE,
+                   static_cast<off_t>(file_size - FOOTER_SIZE)) ||
+      std::string_view(reinterpret_cast<const char *>(raw_footer), 4) !=
+          FOOTER_MAGIC) {
+    return std::nullopt;
+  }
+
+  ParsedFooter parsed;
+  HashFooterInfo &info = parsed.info;
+  Reader footer(raw_footer + 4, FOOTER_SIZE - 4);
+  footer.U32();  // version_major
+  footer.U32();  // version_minor
+  const uint64_t original_size = footer.U64();
+  info.vbmeta_offset = footer.U64();
+  info.vbmeta_size = footer.U64();
+  info.args.partition_size = file_size;
+  if (info.vbmeta_size < VBMETA_HEADER_SIZE ||
+      !InRange(info.vbmeta_offset, info.vbmeta_size,
+               file_size - FOOTER_SIZE)) {
+    LOGE("AVB footer points outside the image");
+    return std::nullopt;
+  }
+
+  parsed.vbmeta.resize(info.vbmeta_size);
+  if (!ReadFullyAt(fd, parsed.vbmeta.data(), parsed.vbmeta.size(),
+                   static_cast<off_t>(info.vbmeta_offset))) {
+    LOGE("Error reading vbmeta");
+    return std::nullopt;
+  }
+
+  Reader reader(parsed.vbmeta.data(), parsed.vbmeta.size());
+  VbmetaHeader &header = parsed.header;
+  const std::string magic = reader.String(VBMETA_MAGIC.size());
+  header.required_major = reader.U32();
+  header.required_minor = reader.U32();
+  header.auth_size = reader.U64();
+  header.aux_size = reader.U64();
+  header.algorithm = reader.U32();
+  header.hash_offset = reader.U64();
+  header.hash_size = reader.U64();
+  header.signature_offset = reader.U64();
+  header.signature_size = reader.U64();
+  header.public_key_offset = reader.U64();
+  header.public_key_size = reader.U64();
+  reader.U64();  // public_key_metadata_offset
+  reader.U64();  // public_key_metadata_size
+  header.descriptors_offset = reader.U64();
+  header.descriptors_size = reader.U64();
+  header.rollback_index = reader.U64();
+  header.flags = reader.U32();
+  header.rollback_index_location = reader.U32();
+
+  const uint64_t blocks_size = info.vbmeta_size - VBMETA_HEADER_SIZE;
+  if (magic != VBMETA_MAGIC ||
+      !InRange(header.auth_size, header.aux_size, blocks_size) ||
+      !InRange(header.hash_offset, header.hash_size, header.auth_size) ||
+      !InRange(header.signature_offset, header.signature_size,
+               header.auth_size) ||
+      !InRange(header.public_key_offset, header.public_key_size,
+               header.aux_size) ||
+      !InRange(header.descriptors_offset, header.descriptors_size,
+               header.aux_size) ||
+      header.algorithm >= std::size(ALGORITHMS)) {
+    LOGE("Invalid vbmeta header");
+    return std::nullopt;
+  }
+
+  info.algorithm = ALGORITHMS[header.algorithm];
+  info.args.rollback_index = header.rollback_index;
+  info.args.rollback_index_location = header.rollback_index_location;
+  info.args.flags = header.flags;
+  if (!ParseDescriptors(parsed.aux() + header.descriptors_offset,
+                        header.descriptors_size, info)) {
+    LOGE("Invalid vbmeta descriptors");
+    return std::nullopt;
+  }
+  if (info.image_size != original_size) {
+    LOGE("AVB footer and hash descriptor disagree on the image size");
+    return std::nullopt;
+  }
+  return parsed;
+}
+
+std::vector<uint8_t> HashDescriptor(const HashFooterArgs &args,
+                                    uint64_t image_size,
+                                    const std::vector<uint8_t> &salt,
+                                    const Sha256Digest &digest) {
+  const size_t payload = args.partition_name.size() + salt.size() +
+                         digest.size();
+  const size_t fixed = 8 + HASH_ALGORITHM_SIZE + 4 * 4 +
+                       HASH_DESCRIPTOR_RESERVED_SIZE;
+  Writer w;
+  w.U64(DESCRIPTOR_TAG_HASH)
+      .U64(RoundUp(fixed + payload, 8))
+      .U64(image_size)
+      .Field("sha256", HASH_ALGORITHM_SIZE)
+      .U32(static_cast<uint32_t>(args.partition_name.size()))
+      .U32(static_cast<uint32_t>(salt.size()))
+      .U32(static_cast<uint32_t>(digest.size()))
+      .U32(0)
+      .Zeros(HASH_DESCRIPTOR_RESERVED_SIZE)
+      .Bytes(args.partition_name.data(), args.partition_name.size())
+      .Bytes(salt.data(), salt.size())
+      .Bytes(digest.data(), digest.size())
+      .PadTo(8);
+  return std::move(w.bytes());
+}
+
+std::vector<uint8_t> PropertyDescriptor(const std::string &key,
+                                        const std::string &value) {
+  Writer w;
+  w.U64(DESCRIPTOR_TAG_PROPERTY)
+      .U64(RoundUp(16 + key.size() + 1 + value.size() + 1, 8))
+      .U64(key.size())
+      .U64(value.size())
+      .Bytes(key.c_str(), key.size() + 1)
+      .Bytes(value.c_str(), value.size() + 1)
+      .PadTo(8);
+  return std::move(w.bytes());
+}
+
+// header || authentication block || auxiliary block, as in avbtool.
+std::optional<std::vector<uint8_t>> BuildVbmeta(
+    const HashFooterArgs &args, uint64_t image_size,
+    const std::vector<uint8_t> &salt, const Sha256Digest &digest) {
+  std::optional<RsaKey> key;
+  uint32_t algorithm = ALGORITHM_NONE;
+  if (!args.key.empty()) {
+    key = LoadRsaKey(args.key);
+    if (!key) return std::nullopt;
+    algorithm = key->bits() == 2048 ? 1 : key->bits() == 4096 ? 2 : 3;
+  }
+
+  Writer aux;
+  const auto hash = HashDescriptor(args, image_size, salt, digest);
+  aux.Bytes(hash.data(), hash.size());
+  for (const auto &[name, value] : args.properties) {
+    const auto property = PropertyDescriptor(name, value);
+    aux.Bytes(property.data(), property.size());
+  }
+  const uint64_t descriptors_size = aux.size();
+  std::vector<uint8_t> public_key;
+  if (key) public_key = EncodeAvbPublicKey(*key);
+  aux.Bytes(public_key.data(), public_key.size()).PadTo(64);
+
+  const uint64_t hash_size = key ? SHA256_DIGEST_SIZE : 0;
+  const uint64_t signature_size = key ? key->bits() / 8 : 0;
+  const uint64_t auth_size = RoundUp(hash_size + signature_size, 64);
+
+  Writer header;
+  header.Bytes(VBMETA_MAGIC.data(), VBMETA_MAGIC.size())
+      .U32(1)
+      .U32(args.rollback_index_location > 0 ? 2 : 0)
+      .U64(auth_size)
+      .U64(aux.size())
+      .U32(algorithm)
+      .U64(0)
+      .U64(hash_size)
+      .U64(hash_size)
+      .U64(signature_size)
+      .U64(descriptors_size)
+      .U64(public_key.size())
+      .U64(descriptors_size + public_key.size())
+      .U64(0)
+      .U64(0)
+      .U64(descriptors_size)
+      .U64(args.rollback_index)
+      .U32(args.flags)
+      .U32(args.rollback_index_location)
+      .Field(RELEASE_STRING, RELEASE_STRING_SIZE)
+      .Zeros(VBMETA_RESERVED_SIZE);
+
+  Writer auth;
+  if (key) {
+    Sha256 sha;
+    sha.Update(header.bytes().data(), header.size());
+    sha.Update(aux.bytes().data(), aux.size());
+    const Sha256Digest vbmeta_digest = sha.Final();
+    auto signature = SignSha256(*key, vbmeta_digest);
+    if (!signature) return std::nullopt;
+    auth.Bytes(vbmeta_digest.data(), vbmeta_digest.size())
+        .Bytes(signature->data(), signature->size());
+  }
+  auth.PadTo(64);
+
+  std::vector<uint8_t> vbmeta = std::move(header.bytes());
+  vbmeta.insert(vbmeta.end(), auth.bytes().begin(), auth.bytes().end());
+  vbmeta.insert(vbmeta.end(), aux.bytes().begin(), aux.bytes().end());
+  return vbmeta;
+}
+
+bool ValidPartitionSize(const HashFooterArgs &args) {
+  if (args.partition_size % BLOCK_SIZE != 0 ||
+      args.partition_size < MAX_VBMETA_SIZE + MAX_FOOTER_SIZE) {
+    LOGE("Invalid AVB partition size %llu",
+         static_cast<unsigned long long>(args.partition_size));
+    return false;
+  }
+  return true;
+}
+
+std::vector<uint8_t> FooterSalt(const HashFooterArgs &args) {
+  std::vector<uint8_t> salt = args.salt;
+  if (salt.empty()) {
+    std::random_device random;
+    salt.resize(DEFAULT_SALT_SIZE);
+    for (auto &b : salt) b = static_cast<uint8_t>(random());
+  }
+  return salt;
+}
+
+// What follows the image in the partition: vbmeta right after the
+// block-aligned image and the footer in the last 64 bytes; everything in
+// between reads as zeros.
+struct FooterTail {
+  uint64_t vbmeta_offset = 0;
+  std::vector<uint8_t> vbmeta;
+  std::vector<uint8_t> footer;
+};
+
+std::optional<FooterTail> BuildFooterTail(uint64_t image_size,
+                                          const std::vector<uint8_t> &salt,
+                                          const Sha256Digest &digest,
+                                          const HashFooterArgs &args) {
+  if (image_size > args.partition_size - MAX_VBMETA_SIZE - MAX_FOOTER_SIZE) {
+    LOGE("Image is %llu bytes, too big for a %llu byte partition",
+         static_cast<unsigned long long>(image_size),
+         static_cast<unsigned long long>(args.partition_size));
+    return std::nullopt;
+  }
+  auto vbmeta = BuildVbmeta(args, image_size, salt, digest);
+  if (!vbmeta) return std::nullopt;
+
+  FooterTail tail;
+  tail.vbmeta_offset = RoundUp(image_size, BLOCK_SIZE);
+  Writer footer;
+  footer.Bytes(FOOTER_MAGIC.data(), FOOTER_MAGIC.size())
+      .U32(1)
+      .U32(0)
+      .U64(image_size)
+      .U64(tail.vbmeta_offset)
+      .U64(vbmeta->size())
+      .Zeros(FOOTER_SIZE - 4 - 2 * 4 - 3 * 8);
+  tail.vbmeta = std::move(*vbmeta);
+  tail.footer = std::move(footer.bytes());
+  return tail;
+}
+
+void LogFooterAdded(const HashFooterArgs &args) {
+  LOG("AVB hash footer added (%s, partition size %llu)",
+      args.key.empty() ? "unsigned" : args.key.filename().c_str(),
+      static_cast<unsigned long long>(args.partition_size));
+}
+
+std::optional<Sha256Digest> HashImage(int fd, const std::vector<uint8_t> &salt,
+                                      uint64_t size) {
+  Sha256 sha;
+  sha.Update(salt.data(), salt.size());
+  auto buffer = BufferPool::Shared().Acquire();
+  for (uint64_t done = 0; done < size;) {
+    const size_t length =
+        static_cast<size_t>(std::min<uint64_t>(buffer.size(), size - done));
+    if (!ReadFullyAt(fd, buffer.data(), length, static_cast<off_t>(done))) {
+      return std::nullopt;
+    }
+    sha.Update(buffer.data(), length);
+    done += length;
+  }
+  return sha.Final();
+}
+
+// Grows fd to the partition and places vbmeta and the footer in it.
+bool WriteFooterTail(int fd, const FooterTail &tail,
+                     const HashFooterArgs &args) {
+  if (ftruncate(fd, static_cast<off_t>(args.partition_size)) != 0 ||
+      !WriteFullyAt(fd, tail.vbmeta.data(), tail.vbmeta.size(),
+                    static_cast<off_t>(tail.vbmeta_offset)) ||
+      !WriteFullyAt(fd, tail.footer.data(), tail.footer.size(),
+                    static_cast<off_t>(args.partition_size - FOOTER_SIZE))) {
+    LOGE("Error writing AVB footer");
+    return false;
+  }
+  LogFooterAdded(args);
+  return true;
+}
+}  // namespace
+
+std::optional<HashFooterInfo> ReadHashFooter(int fd) {
+  auto parsed = ParseFooter(fd);
+  if (!parsed) return std::nullopt;
+  return std::move(parsed->info);
+}
+
+bool HasFooterMagic(int fd) {
+  struct stat st {};
+  char magic[4];
+  return fstat(fd, &st) == 0 &&
+         static_cast<uint64_t>(st.st_size) >= FOOTER_SIZE &&
+         ReadFullyAt(fd, magic, sizeof(magic),
+                     static_cast<off_t>(st.st_size - FOOTER_SIZE)) &&
+         std::string_view(magic, sizeof(magic)) == FOOTER_MAGIC;
+}
+
+bool WriteFooterConfig(const HashFooterInfo &info,
+                       const std::filesystem::path &path) {
+  std::ofstream config(path);
+  if (!config) {
+    LOGE("Error creating %s", path.filename().c_str());
+    return false;
+  }
+  const HashFooterArgs &args = info.args;
+  config << "type=footer partition_size=" << args.partition_size
+         << " partition_name=\"" << args.partition_name << "\" salt="
+         << ToHex(args.salt) << " rollback_index=" << args.rollback_index
+         << " rollback_index_location=" << args.rollback_index_location
+         << " flags=" << args.flags << " algorithm=" << info.algorithm
+         << " key=\"\"\n";
+  for (const auto &[key, value] : args.properties) {
+    const bool printable = std::all_of(value.begin(), value.end(), [](char c) {
+      return c >= 0x20 && c != '"' && c != 0x7f;
+    });
+    if (!printable) {
+      LOG("Dropping AVB property %s: value is not plain text", key.c_str());
+      continue;
+    }
+    config << "type=prop key=\"" << key << "\" value=\"" << value << "\"\n";
+  }
+  return config.good();
+}
+
+std::optional<HashFooterArgs> ReadFooterConfig(
+    const std::filesystem::path &path) {
+  std::ifstream config(path);
+  if (!config) {
+    LOGE("Error opening %s", path.filename().c_str());
+    return std::nullopt;
+  }
+
+  HashFooterArgs args;
+  std::string algorithm;
+  std::string line;
+  while (std::getline(config, line)) {
+    std::map<std::string, std::string> entry;
+    if (!ParseConfigLine(line, entry)) return std::nullopt;
+    if (entry["type"] == "footer") {
+      args.partition_size = std::strtoull(entry["partition_size"].c_str(),
+                                          nullptr, 10);
+      args.partition_name = entry["partition_name"];
+      args.rollback_index = std::strtoull(entry["rollback_index"].c_str(),
+                                          nullptr, 10);
+      args.rollback_index_location = static_cast<uint32_t>(
+          std::strtoul(entry["rollback_index_location"].c_str(), nullptr, 10));
+      args.flags = static_cast<uint32_t>(
+          std::strtoul(entry["flags"].c_str(), nullptr, 10));
+      algorithm = entry["algorithm"];
+      auto salt = FromHex(entry["salt"]);
+      if (!salt) {
+        LOGE("Invalid AVB salt");
+        return std::nullopt;
+      }
+      args.salt = std::move(*salt);
+      if (!entry["key"].empty()) {
+        args.key = path.parent_path() / entry["key"];
+      }
+    } else if (entry["type"] == "prop") {
+      args.properties.emplace_back(entry["key"], entry["value"]);
+    }
+  }
+
+  if (args.partition_size == 0 || args.partition_size % BLOCK_SIZE != 0) {
+    LOGE("Invalid AVB partition size");
+    return std::nullopt;
+  }
+  if (args.key.empty() && !algorithm.empty() &&
+      algorithm != ALGORITHMS[ALGORITHM_NONE]) {
+    LOG("The original footer was signed with %s; set key= in %s to sign the "
+        "new one", algorithm.c_str(), path.filename().c_str());
+  }
+  return args;
+}
+
+bool AddHashFooter(int fd, uint64_t image_size, const HashFooterArgs &footer) {
+  if (!ValidPartitionSize(footer)) return false;
+  const std::vector<uint8_t> salt = FooterSalt(footer);
+  auto digest = HashImage(fd, salt, image_size);
+  if (!digest) {
+    LOGE("Error reading back the image");
+    return false;
+  }
+  auto tail = BuildFooterTail(image_size, salt, *digest, footer);
+  return tail && WriteFooterTail(fd, *tail, footer);
+}
+
+bool AddHashFooter(const std::filesystem::path &output, uint64_t image_size,
+                   const HashFooterArgs &footer) {
+  int fd = open(output.c_str(), O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    LOGE("Error opening %s", output.filename().c_str());
+    return false;
+  }
+  bool ok = AddHashFooter(fd, image_size, footer);
+  if (close(fd) != 0) ok = false;
+  return ok;
+}
+
+HashFooterStream::HashFooterStream(const HashFooterArgs &args)
+    : args_(args), salt_(FooterSalt(args)) {
+  sha_.Update(salt_.data(), salt_.size());
+}
+
+bool HashFooterStream::Finish(int out, uint64_t image_size) {
+  if (!ValidPartitionSize(args_)) return false;
+  auto tail = BuildFooterTail(image_size, salt_, sha_.Final(), args_);
+  if (!tail) return false;
+  const uint64_t footer_offset = args_.partition_size - FOOTER_SIZE;
+  const uint64_t vbmeta_end = tail->vbmeta_offset + tail->vbmeta.size();
+  if (!WriteZeros(out, tail->vbmeta_offset - image_size) ||
+      !WriteFully(out, tail->vbmeta.data(), tail->vbmeta.size()) ||
+      !WriteZeros(out, footer_offset - vbmeta_end) ||
+      !WriteFully(out, tail->footer.data(), tail->footer.size())) {
+    LOGE("Error writing AVB footer");
+    return false;
+  }
+  LogFooterAdded(args_);
+  return true;
+}
+
+bool HashFooterStream::FinishAt(int fd, uint64_t image_size) {
+  if (!ValidPartitionSize(args_)) return false;
+  auto tail = BuildFooterTail(image_size, salt_, sha_.Final(), args_);
+  return tail && WriteFooterTail(fd, *tail, args_);
+}
+
+std::optional<std::string> VerifyImage(int fd,
+                                       const std::filesystem::path &key,
+                                       bool &verified) {
+  verified = false;
+  auto parsed = ParseFooter(fd);
+  if (!parsed) return std::nullopt;
+  const HashFooterInfo &info = parsed->info;
+  const VbmetaHeader &header = parsed->header;
+
+  JsonWriter json;
+  json.BeginObject()
+      .Field("partition_name", info.args.partition_name)
+      .Field("partition_size", info.args.partition_size)
+      .Field("image_size", info.image_size)
+      .Field("algorithm", info.algorithm)
+      .Field("rollback_index", info.args.rollback_index)
+      .Field("hash_algorithm", info.hash_algorithm);
+
+  // vbmeta is only as trustworthy as its signature.
+  bool vbmeta_ok = header.algorithm == ALGORITHM_NONE;
+  std::optional<RsaKey> embedded;
+  if (header.algorithm != ALGORITHM_NONE) {
+    const bool sha256 = info.algorithm.starts_with("SHA256");
+    embedded = DecodeAvbPublicKey(parsed->aux() + header.public_key_offset,
+                                  header.public_key_size);
+    Sha256 sha;
+    sha.Update(parsed->vbmeta.data(), VBMETA_HEADER_SIZE);
+    sha.Update(parsed->aux(), header.aux_size);
+    const Sha256Digest digest = sha.Final();
+    const bool hash_ok =
+        sha256 && header.hash_size == digest.size() &&
+        std::equal(digest.begin(), digest.end(),
+                   parsed->auth() + header.hash_offset);
+    const std::vector<uint8_t> signature(
+        parsed->auth() + header.signature_offset,
+        parsed->auth() + header.signature_offset + header.signature_size);
+    vbmeta_ok = hash_ok && embedded &&
+                VerifySha256(*embedded, signature, digest);
+    json.Field("vbmeta_hash_ok", hash_ok).Field("signature_ok", vbmeta_ok);
+  }
+
+  bool key_ok = true;
+  if (!key.empty()) {
+    auto expected = LoadRsaKey(key);
+    key_ok = expected && embedded && expected->modulus == embedded->modulus;
+    json.Field("key_matches", key_ok);
+  }
+
+  bool digest_ok = false;
+  if (info.hash_algorithm == "sha256") {
+    auto digest = HashImage(fd, info.args.salt, info.image_size);
+    digest_ok = digest && info.digest.size() == digest->size() &&
+                std::equal(digest->begin(), digest->end(), info.digest.begin());
+  }
+  json.Field("digest_ok", digest_ok);
+
+  verified = vbmeta_ok && key_ok && digest_ok;
+  json.Field("verified", verified).EndObject();
+  return json.str();
+}
+
+}  // namespace avb
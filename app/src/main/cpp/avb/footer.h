@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "sha256.h"
+
+// Android Verified Boot hash footers, the trailer avbtool add_hash_footer
+// puts on boot and vendor_boot partitions: a vbmeta struct with one hash
+// descriptor for the image, followed by a footer at the very end of the
+// partition pointing back at it.
+namespace avb {
+
+// Per-project settings written on unpack and read back on build.
+constexpr std::string_view AVB_FOOTER_CONFIG = "avb_footer";
+
+struct HashFooterArgs {
+  uint64_t partition_size = 0;
+  std::string partition_name;
+  std::vector<uint8_t> salt;  // random when empty
+  uint64_t rollback_index = 0;
+  uint32_t rollback_index_location = 0;
+  uint32_t flags = 0;
+  std::vector<std::pair<std::string, std::string>> properties;
+  std::filesystem::path key;  // PEM RSA key; unsigned when empty
+};
+
+// An existing footer, with the settings needed to rebuild it.
+struct HashFooterInfo {
+  HashFooterArgs args;
+  uint64_t image_size = 0;
+  uint64_t vbmeta_offset = 0;
+  uint64_t vbmeta_size = 0;
+  std::string algorithm;
+  std::string hash_algorithm;
+  std::vector<uint8_t> digest;
+};
+
+// Returns nullopt when fd has no footer; corrupt footers are logged.
+std::optional<HashFooterInfo> ReadHashFooter(int fd);
+// Whether fd ends in a footer magic, even one ReadHashFooter rejects.
+bool HasFooterMagic(int fd);
+
+bool WriteFooterConfig(const HashFooterInfo &info,
+                       const std::filesystem::path &path);
+// A relative key= path is taken relative to the config's directory.
+std::optional<HashFooterArgs> ReadFooterConfig(
+    const std::filesystem::path &path);
+
+// Appends a footer for the first image_size bytes of output, an image
+// already on disk such as one patched in place. Its digest is read back
+// from the file; builders hash with HashFooterStream instead.
+bool AddHashFooter(const std::filesystem::path &output, uint64_t image_size,
+                   const HashFooterArgs &footer);
+// The same for an image in fd, which must be a regular file open for
+// reading and writing.
+bool AddHashFooter(int fd, uint64_t image_size, const HashFooterArgs &footer);
+
+// Hashes an image as it is produced, so it is never read back. Finish
+// writes the padding, vbmeta and footer right after its image_size bytes,
+// filling the partition, for sinks that cannot seek. FinishAt places them
+// at their offsets in fd, a regular file holding the image.
+class HashFooterStream {
+ public:
+  explicit HashFooterStream(const HashFooterArgs &args);
+
+  void Update(const uint8_t *data, size_t size) { sha_.Update(data, size); }
+  bool Finish(int out, uint64_t image_size);
+  bool FinishAt(int fd, uint64_t image_size);
+
+ private:
+  HashFooterArgs args_;
+  std::vector<uint8_t> salt_;
+  Sha256 sha_;
+};
+
+// Checks the vbmeta hash and signature and the image digest. key, if set,
+// must match the embedded public key. Returns a JSON report, or nullopt
+// when fd has no footer.
+std::optional<std::string> VerifyImage(int fd,
+                                       const std::filesystem::path &key,
+                                       bool &verified);
+
+}  // namespace avb
@@ -0,0 +1,405 @@
+#include "rsa.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <string_view>
+
+#include "log.h"
+
+namespace avb {
+namespace {
+// DigestInfo prefix for SHA256 (RFC 8017 section 9.2).
+constexpr uint8_t SHA256_DIGEST_INFO[] = {0x30, 0x31, 0x30, 0x0d, 0x06, 0x09,
+                                          0x60, 0x86, 0x48, 0x01, 0x65, 0x03,
+                                          0x04, 0x02, 0x01, 0x05, 0x00, 0x04,
+                                          0x20};
+constexpr uint8_t RSA_ENCRYPTION_OID[] = {0x2a, 0x86, 0x48, 0x86, 0xf7,
+                                          0x0d, 0x01, 0x01, 0x01};
+
+// Fixed-width little-endian limbs of a number below the modulus.
+using Limbs = std::vector<uint32_t>;
+
+std::vector<uint8_t> StripZeros(std::vector<uint8_t> bytes) {
+  const auto first = std::find_if(bytes.begin(), bytes.end(),
+                                  [](uint8_t b) { return b != 0; });
+  bytes.erase(bytes.begin(), first);
+  return bytes;
+}
+
+Limbs ToLimbs(const std::vector<uint8_t> &bytes, size_t count) {
+  Limbs limbs(count, 0);
+  for (size_t i = 0; i < bytes.size() && i / 4 < count; ++i) {
+    limbs[i / 4] |= static_cast<uint32_t>(bytes[bytes.size() - 1 - i])
+                    << (8 * (i % 4));
+  }
+  return limbs;
+}
+
+std::vector<uint8_t> ToBytes(const Limbs &limbs) {
+  std::vector<uint8_t> bytes(limbs.size() * 4);
+  for (size_t i = 0; i < bytes.size(); ++i) {
+    bytes[bytes.size() - 1 - i] =
+        static_cast<uint8_t>(limbs[i / 4] >> (8 * (i % 4)));
+  }
+  return bytes;
+}
+
+bool GreaterOrEqual(const Limbs &a, const Limbs &b) {
+  for (size_t i = a.size(); i-- > 0;) {
+    if (a[i] != b[i]) return a[i] > b[i];
+  }
+  return true;
+}
+
+void Subtract(Limbs &a, const Limbs &b) {
+  int64_t borrow = 0;
+  for (size_t i = 0; i < a.size(); ++i) {
+    const int64_t diff = static_cast<int64_t>(a[i]) - b[i] - borrow;
+    a[i] = static_cast<uint32_t>(diff);
+    borrow = diff < 0;
+  }
+}
+
+// Montgomery arithmetic modulo an odd n, with R = 2^(32 * limbs).
+class Montgomery {
+ public:
+  explicit Montgomery(Limbs n) : n_(std::move(n)) {
+    // Newton's iteration doubles the correct low bits of 1/n[0] each step.
+    uint32_t inv = n_[0];
+    for (int i = 0; i < 4; ++i) inv *= 2 - n_[0] * inv;
+    n0inv_ = 0 - inv;
+
+    rr_.assign(n_.size(), 0);
+    rr_[0] = 1;
+    for (size_t i = 0; i < 64 * n_.size(); ++i) Double(rr_);
+  }
+
+  uint32_t n0inv() const { return n0inv_; }
+  const Limbs &rr() const { return rr_; }
+
+  // a * b / R mod n, with a and b below n.
+  Limbs Multiply(const Limbs &a, const Limbs &b) const {
+    const size_t k = n_.size();
+    std::vector<uint32_t> t(k + 2, 0);
+    for (size_t i = 0; i < k; ++i) {
+      uint64_t carry = 0;
+      for (size_t j = 0; j < k; ++j) {
+        carry += t[j] + static_cast<uint64_t>(a[i]) * b[j];
+        t[j] = static_cast<uint32_t>(carry);
+        carry >>= 32;
+      }
+      carry += t[k];
+      t[k] = static_cast<uint32_t>(carry);
+      t[k + 1] = static_cast<uint32_t>(carry >> 32);
+
+      const uint32_t m = t[0] * n0inv_;
+      carry = (t[0] + static_cast<uint64_t>(m) * n_[0]) >> 32;
+      for (size_t j = 1; j < k; ++j) {
+        carry += t[j] + static_cast<uint64_t>(m) * n_[j];
+        t[j - 1] = static_cast<uint32_t>(carry);
+        carry >>= 32;
+      }
+      carry += t[k];
+      t[k - 1] = static_cast<uint32_t>(carry);
+      t[k] = t[k + 1] + static_cast<uint32_t>(carry >> 32);
+    }
+
+    Limbs result(t.begin(), t.begin() + static_cast<std::ptrdiff_t>(k));
+    if (t[k] != 0 || GreaterOrEqual(result, n_)) Subtract(result, n_);
+    return result;
+  }
+
+  // base^exponent mod n.
+  Limbs Power(const Limbs &base, const std::vector<uint8_t> &exponent) const {
+    Limbs one(n_.size(), 0);
+    one[0] = 1;
+    const Limbs base_m = Multiply(base, rr_);
+    Limbs x = Multiply(one, rr_);
+    for (uint8_t byte : exponent) {
+      for (int bit = 7; bit >= 0; --bit) {
+        x = Multiply(x, x);
+        if ((byte >> bit) & 1) x = Multiply(x, base_m);
+      }
+    }
+    return Multiply(x, one);
+  }
+
+ private:
+  void Double(Limbs &a) const {
+    uint32_t carry = 0;
+    for (auto &limb : a) {
+      const uint32_t next = limb >> 31;
+      limb = (limb << 1) | carry;
+      carry = next;
+    }
+    if (carry != 0 || GreaterOrEqual(a, n_)) Subtract(a, n_);
+  }
+
+  Limbs n_;
+  uint32_t n0inv_;
+  Limbs rr_;
+};
+
+// The encoded message of RFC 8017 section 9.2 for a key of size bytes.
+std::optional<std::vector<uint8_t>> EncodeMessage(size_t size,
+                                                  const Sha256Digest &digest) {
+  const size_t tail = sizeof(SHA256_DIGEST_INFO) + digest.size();
+  if (size < tail + 11) return std::nullopt;
+  std::vector<uint8_t> message(size, 0xff);
+  message[0] = 0x00;
+  message[1] = 0x01;
+  message[size - tail - 1] = 0x00;
+  std::copy(std::begin(SHA256_DIGEST_INFO), std::end(SHA256_DIGEST_INFO),
+            message.end() - static_cast<std::ptrdiff_t>(tail));
+  std::copy(digest.begin(), digest.end(),
+            message.end() - static_cast<std::ptrdiff_t>(digest.size()));
+  return message;
+}
+
+bool UsableModulus(const RsaKey &key) {
+  const size_t bits = key.bits();
+  if ((bits != 2048 && bits != 4096 && bits != 8192) ||
+      (key.modulus.back() & 1) == 0) {
+    LOGE("Unsupported RSA key size %zu", bits);
+    return false;
+  }
+  return true;
+}
+
+// Just enough DER to walk the key structures.
+class DerReader {
+ public:
+  DerReader(const uint8_t *data, size_t size) : data_(data), size_(size) {}
+
+  bool empty() const { return pos_ >= size_; }
+
+  // Reads one element with the given tag and returns its contents.
+  std::optional<DerReader> Element(uint8_t tag) {
+    if (pos_ + 2 > size_ || data_[pos_] != tag) return std::nullopt;
+    ++pos_;
+    size_t length = data_[pos_++];
+    if (length & 0x80) {
+      const size_t count = length & 0x7f;
+      if (count == 0 || count > sizeof(size_t) || pos_ + count > size_) {
+        return std::nullopt;
+      }
+      length = 0;
+      for (size_t i = 0; i < count; ++i) length = (length << 8) | data_[pos_++];
+    }
+    if (length > size_ - pos_) return std::nullopt;
+    DerReader contents(data_ + pos_, length);
+    pos_ += length;
+    return contents;
+  }
+
+  std::optional<std::vector<uint8_t>> Integer() {
+    auto element = Element(0x02);
+    if (!element) return std::nullopt;
+    return StripZeros(element->Bytes());
+  }
+
+  std::vector<uint8_t> Bytes() const {
+    return std::vector<uint8_t>(data_ + pos_, data_ + size_);
+  }
+
+ private:
+  const uint8_t *data_;
+  size_t size_;
+  size_t pos_ = 0;
+};
+
+std::optional<RsaKey> ParseRsaPrivateKey(DerReader der) {
+  auto sequence = der.Element(0x30);
+  if (!sequence || !sequence->Integer()) return std::nullopt;
+  RsaKey key;
+  auto n = sequence->Integer();
+  auto e = sequence->Integer();
+  auto d = sequence->Integer();
+  if (!n || !e || !d) return std::nullopt;
+  key.modulus = std::move(*n);
+  key.public_exponent = std::move(*e);
+  key.private_exponent = std::move(*d);
+  return key;
+}
+
+bool IsRsaAlgorithm(DerReader &der) {
+  auto algorithm = der.Element(0x30);
+  if (!algorithm) return false;
+  auto oid = algorithm->Element(0x06);
+  return oid && oid->Bytes() == std::vector<uint8_t>(
+                                    std::begin(RSA_ENCRYPTION_OID),
+                                    std::end(RSA_ENCRYPTION_OID));
+}
+
+std::optional<RsaKey> ParsePrivateKeyInfo(DerReader der) {
+  auto sequence = der.Element(0x30);
+  if (!sequence || !sequence->Integer() || !IsRsaAlgorithm(*sequence)) {
+    return std::nullopt;
+  }
+  auto octets = sequence->Element(0x04);
+  if (!octets) return std::nullopt;
+  return ParseRsaPrivateKey(*octets);
+}
+
+std::optional<RsaKey> ParsePublicKeyInfo(DerReader der) {
+  auto sequence = der.Element(0x30);
+  if (!sequence || !IsRsaAlgorithm(*sequence)) return std::nullopt;
+  auto bits = sequence->Element(0x03);
+  if (!bits) return std::nullopt;
+  const auto bytes = bits->Bytes();
+  if (bytes.empty() || bytes[0] != 0) return std::nullopt;
+  DerReader inner(bytes.data() + 1, bytes.size() - 1);
+  auto key_sequence = inner.Element(0x30);
+  if (!key_sequence) return std::nullopt;
+  RsaKey key;
+  auto n = key_sequence->Integer();
+  auto e = key_sequence->Integer();
+  if (!n || !e) return std::nullopt;
+  key.modulus = std::move(*n);
+  key.public_exponent = std::move(*e);
+  return key;
+}
+
+std::optional<std::vector<uint8_t>> DecodeBase64(std::string_view text) {
+  std::vector<uint8_t> out;
+  uint32_t accumulator = 0;
+  int bits = 0;
+  for (char c : text) {
+    int value;
+    if (c >= 'A' && c <= 'Z') {
+      value = c - 'A';
+    } else if (c >= 'a' && c <= 'z') {
+      value = c - 'a' + 26;
+    } else if (c >= '0' && c <= '9') {
+      value = c - '0' + 52;
+    } else if (c == '+') {
+      value = 62;
+    } else if (c == '/') {
+      value = 63;
+    } else if (c == '=' || c == '\n' || c == '\r' || c == ' ') {
+      continue;
+    } else {
+      return std::nullopt;
+    }
+    accumulator = (accumulator << 6) | static_cast<uint32_t>(value);
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      out.push_back(static_cast<uint8_t>(accumulator >> bits));
+    }
+  }
+  return out;
+}
+}  // namespace
+
+size_t RsaKey::bits() const {
+  if (modulus.empty()) return 0;
+  size_t bits = modulus.size() * 8;
+  for (uint8_t top = modulus[0]; (top & 0x80) == 0; top <<= 1) --bits;
+  return bits;
+}
+
+std::optional<RsaKey> LoadRsaKey(const std::filesystem::path &pem) {
+  std::ifstream file(pem);
+  if (!file) {
+    LOGE("Failed to open key %s", pem.filename().c_str());
+    return std::nullopt;
+  }
+  std::stringstream contents;
+  contents << file.rdbuf();
+  const std::string text = contents.str();
+
+  const size_t begin = text.find("-----BEGIN ");
+  const size_t label_end = text.find("-----", begin + 11);
+  if (begin == std::string::npos || label_end == std::string::npos) {
+    LOGE("%s is not a PEM file", pem.filename().c_str());
+    return std::nullopt;
+  }
+  const std::string label = text.substr(begin + 11, label_end - begin - 11);
+  const size_t body = label_end + 5;
+  const size_t end = text.find("-----END " + label + "-----", body);
+  auto der = end == std::string::npos
+                 ? std::nullopt
+                 : DecodeBase64(std::string_view(text).substr(body, end - body));
+  if (!der) {
+    LOGE("%s is not a PEM file", pem.filename().c_str());
+    return std::nullopt;
+  }
+
+  DerReader reader(der->data(), der->size());
+  std::optional<RsaKey> key;
+  if (label == "RSA PRIVATE KEY") {
+    key = ParseRsaPrivateKey(reader);
+  } else if (label == "PRIVATE KEY") {
+    key = ParsePrivateKeyInfo(reader);
+  } else if (label == "PUBLIC KEY") {
+    key = ParsePublicKeyInfo(reader);
+  }
+  if (!key || !UsableModulus(*key)) {
+    LOGE("%s is not a supported RSA key", pem.filename().c_str());
+    return std::nullopt;
+  }
+  return key;
+}
+
+std::optional<std::vector<uint8_t>> SignSha256(const RsaKey &key,
+                                               const Sha256Digest &digest) {
+  if (key.private_exponent.empty()) {
+    LOGE("Signing needs a private key");
+    return std::nullopt;
+  }
+  const size_t limbs = key.bits() / 32;
+  auto message = EncodeMessage(limbs * 4, digest);
+  if (!message) return std::nullopt;
+  Montgomery mont(ToLimbs(key.modulus, limbs));
+  return ToBytes(
+      mont.Power(ToLimbs(*message, limbs), key.private_exponent));
+}
+
+bool VerifySha256(const RsaKey &key, const std::vector<uint8_t> &signature,
+                  const Sha256Digest &digest) {
+  const size_t limbs = key.bits() / 32;
+  if (limbs == 0 || signature.size() != limbs * 4) return false;
+  const Limbs n = ToLimbs(key.modulus, limbs);
+  const Limbs s = ToLimbs(signature, limbs);
+  if (GreaterOrEqual(s, n)) return false;
+  auto message = EncodeMessage(limbs * 4, digest);
+  return message &&
+         ToBytes(Montgomery(n).Power(s, key.public_exponent)) == *message;
+}
+
+std::vector<uint8_t> EncodeAvbPublicKey(const RsaKey &key) {
+  const size_t limbs = key.bits() / 32;
+  Montgomery mont(ToLimbs(key.modulus, limbs));
+  std::vector<uint8_t> out;
+  auto put_u32 = [&out](uint32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+      out.push_back(static_cast<uint8_t>(value >> shift));
+    }
+  };
+  put_u32(static_cast<uint32_t>(key.bits()));
+  put_u32(mont.n0inv());
+  const auto n = ToBytes(ToLimbs(key.modulus, limbs));
+  const auto rr = ToBytes(mont.rr());
+  out.insert(out.end(), n.begin(), n.end());
+  out.insert(out.end(), rr.begin(), rr.end());
+  return out;
+}
+
+std::optional<RsaKey> DecodeAvbPublicKey(const uint8_t *data, size_t size) {
+  if (size < 8) return std::nullopt;
+  const uint32_t bits = (static_cast<uint32_t>(data[0]) << 24) |
+                        (static_cast<uint32_t>(data[1]) << 16) |
+                        (static_cast<uint32_t>(data[2]) << 8) | data[3];
+  const size_t bytes = bits / 8;
+  if (bits % 32 != 0 || size < 8 + 2 * bytes) return std::nullopt;
+  RsaKey key;
+  key.modulus = StripZeros(std::vector<uint8_t>(data + 8, data + 8 + bytes));
+  key.public_exponent = {0x01, 0x00, 0x01};
+  if (key.bits() != bits || !UsableModulus(key)) return std::nullopt;
+  return key;
+}
+
+}  // namespace avb
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <vector>
+
+#include "sha256.h"
+
+namespace avb {
+
+// An RSA key read from PEM. Numbers are big endian without leading zeros;
+// private_exponent is empty for public keys.
+struct RsaKey {
+  std::vector<uint8_t> modulus;
+  std::vector<uint8_t> public_exponent;
+  std::vector<uint8_t> private_exponent;
+
+  size_t bits() const;
+};
+
+// Accepts PKCS#1 and PKCS#8 private keys and SubjectPublicKeyInfo public
+// keys, e.g. the AOSP testkey_rsa*.pem files.
+std::optional<RsaKey> LoadRsaKey(const std::filesystem::path &pem);
+
+// RSASSA-PKCS1-v1_5 over a SHA256 digest, as libavb checks it.
+std::optional<std::vector<uint8_t>> SignSha256(const RsaKey &key,
+                                               const Sha256Digest &digest);
+bool VerifySha256(const RsaKey &key, const std::vector<uint8_t> &signature,
+                  const Sha256Digest &digest);
+
+// The AvbRSAPublicKeyHeader form embedded in vbmeta: bit count, n0inv, the
+// modulus and R^2 mod n, so the bootloader needs no bignum division.
+std::vector<uint8_t> EncodeAvbPublicKey(const RsaKey &key);
+std::optional<RsaKey> DecodeAvbPublicKey(const uint8_t *data, size_t size);
+
+}  // namespace avb
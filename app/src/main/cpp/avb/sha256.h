@@ -0,0 +1,31 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace avb {
+
+constexpr size_t SHA256_DIGEST_SIZE = 32;
+using Sha256Digest = std::array<uint8_t, SHA256_DIGEST_SIZE>;
+
+// Streaming SHA256 for the AVB image and vbmeta digests.
+class Sha256 {
+ public:
+  Sha256();
+
+  void Update(const void *data, size_t size);
+  Sha256Digest Final();
+
+  static Sha256Digest Hash(const void *data, size_t size);
+
+ private:
+  void Compress(const uint8_t *blocks, size_t count);
+
+  uint32_t state_[8];
+  uint8_t block_[64];
+  size_t pending_ = 0;
+  uint64_t total_ = 0;
+};
+
+}  // namespace avb
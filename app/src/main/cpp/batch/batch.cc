@@ -0,0 +1,79 @@
+#include "batch.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "log.h"
+#include "scheduler.h"
+
+std::vector<BatchResult> RunBatch(const Session &parent,
+                                  const std::vector<BatchJob> &jobs,
+                                  const BatchLimits &limits) {
+  std::vector<BatchResult> results(jobs.size());
+  if (jobs.empty()) return results;
+
+  const unsigned cores = Scheduler::Shared().workers();
+  const unsigned max_threads = limits.max_threads ? limits.max_threads : cores;
+  const unsigned max_jobs = limits.max_jobs ? limits.max_jobs : cores;
+  const auto workers = static_cast<unsigned>(
+      std::min<size_t>({max_jobs, max_threads, jobs.size()}));
+  const unsigned threads_per_job = std::max(1u, max_threads / workers);
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t next = 0;
+  unsigned running = 0;
+  uint64_t reserved = 0;
+
+  // Whether the next job may start now. Called with mutex held.
+  auto admissible = [&] {
+    if (next >= jobs.size() || running == 0 || limits.memory_budget == 0) {
+      return true;
+    }
+    return reserved + jobs[next].memory_cost <= limits.memory_budget;
+  };
+
+  auto worker = [&] {
+    while (true) {
+      std::unique_lock lock(mutex);
+      cv.wait(lock, admissible);
+      if (next >= jobs.size()) return;
+      const size_t index = next++;
+      const BatchJob &job = jobs[index];
+      reserved += job.memory_cost;
+      ++running;
+      lock.unlock();
+
+      Session session(parent, job.name, threads_per_job);
+      // A batch runs in the background of whatever job the user starts next.
+      session.set_priority(TaskPriority::Low);
+      Session::Scope scope(session);
+      const auto start = std::chrono::steady_clock::now();
+      bool ok = false;
+      try {
+        ok = job.run();
+      } catch (const std::exception &e) {
+        LOGE("%s", e.what());
+      }
+      results[index].ok = ok;
+      results[index].seconds = std::chrono::duration<double>(
+                                   std::chrono::steady_clock::now() - start)
+                                   .count();
+      LOG(ok ? "Done in %.1fs!" : "Failed in %.1fs!", results[index].seconds);
+
+      lock.lock();
+      reserved -= job.memory_cost;
+      --running;
+      cv.notify_all();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  threads.reserve(workers);
+  for (unsigned i = 0; i < workers; ++i) threads.emplace_back(worker);
+  for (auto &thread : threads) thread.join();
+  return results;
+}
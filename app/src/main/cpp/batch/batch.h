@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "session.h"
+
+// One unit of work for RunBatch, e.g. unpacking or building one image.
+struct BatchJob {
+  std::string name;          // tags the job's console lines
+  uint64_t memory_cost = 0;  // estimated peak bytes, reserved while it runs
+  std::function<bool()> run;
+};
+
+struct BatchLimits {
+  unsigned max_jobs = 0;       // jobs running at once, 0 for one per core
+  unsigned max_threads = 0;    // shared by all jobs and their codec workers,
+                               // 0 for one per core
+  uint64_t memory_budget = 0;  // bytes, 0 for unlimited
+};
+
+struct BatchResult {
+  bool ok = false;
+  double seconds = 0;
+};
+
+// Runs jobs concurrently, each under its own Session derived from parent.
+// Jobs start in order, as soon as both a job slot and their memory cost fit
+// the limits; a job larger than the whole budget still runs, alone. Every
+// job gets an equal share of the thread budget for its codec workers, and
+// its tasks queue behind those of other jobs at TaskPriority::Low.
+std::vector<BatchResult> RunBatch(const Session &parent,
+                                  const std::vector<BatchJob> &jobs,
+                                  const BatchLimits &limits);
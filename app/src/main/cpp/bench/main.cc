@@ -0,0 +1,376 @@
+// Per-stage microbenchmarks for the hot paths of abik_core. Every stage runs
+// in isolation on synthetic inputs and reports one JSON object per line, so
+// runs can be diffed over time.
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "SHA1FileHelper.hpp"
+#include "cpio_build.hpp"
+#include "cpio_extract.hpp"
+#include "json_writer.hpp"
+#include "log.h"
+#include "mkbootimg/bootimg.h"
+#include "mkbootimg/vendorbootimg.h"
+#include "ramdisk/codec.h"
+#include "session.h"
+#include "unpackbootimg/bootimg.h"
+#include "unpackbootimg/utils.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+constexpr uint32_t PAGE_SIZE = 4096;
+constexpr int HEADER_PARSES = 1000;
+
+struct Params {
+  uint64_t size = 8 * 1024 * 1024;  // ramdisk payload bytes
+  unsigned files = 256;             // regular files in the ramdisk tree
+  unsigned iterations = 3;
+  std::string pattern = "text";     // text, random or zeros
+  std::string filter;               // run only stages containing this
+  uint32_t seed = 1;
+  fs::path library;                 // shared library to time loading, if any
+  fs::path scratch;
+};
+
+// Drops everything but errors; the stages log progress lines we don't want
+// in the timing output.
+class ErrorSink : public LogSink {
+ public:
+  void Write(const char *line) override {
+    if (std::strncmp(line, "[ERROR]", 7) == 0) std::fprintf(stderr, "%s\n", line);
+  }
+};
+
+std::string MakePayload(const Params &params, uint64_t size, std::mt19937 &rng) {
+  std::string data(size, '\0');
+  if (params.pattern == "random") {
+    for (auto &c : data) c = static_cast<char>(rng());
+  } else if (params.pattern == "text") {
+    // Words over a small alphabet: compresses roughly like config and
+    // script files do.
+    static constexpr char alphabet[] = "etaoinshrdlucmfw";
+    for (size_t i = 0; i < data.size(); ++i) {
+      const uint32_t r = rng();
+      data[i] = (r & 0x70) == 0 ? (r & 0x80 ? '\n' : ' ') : alphabet[r & 0x0F];
+    }
+  }
+  return data;
+}
+
+bool WriteFile(const fs::path &path, const std::string &data) {
+  std::ofstream out(path, std::ios::binary);
+  out.write(data.data(), static_cast<std::streamsize>(data.size()));
+  return out.good();
+}
+
+bool CopyFile(const fs::path &from, const fs::path &to) {
+  std::error_code ec;
+  fs::copy_file(from, to, fs::copy_options::overwrite_existing, ec);
+  return !ec;
+}
+
+// Lays out params.files files under dirs of 64, with a .parserconfig.
+bool MakeTree(const Params &params, const fs::path &root) {
+  std::mt19937 rng(params.seed);
+  std::ofstream config(root / CONFIG_FILE);
+  const uint64_t file_size = params.size / std::max(1u, params.files);
+  for (unsigned i = 0; i < params.files; ++i) {
+    const std::string dir = "d" + std::to_string(i / 64);
+    if (i % 64 == 0) {
+      fs::create_directories(root / dir);
+      config << "path=\"" << dir << "\" type=dir mode=0755 uid=0 gid=0\n";
+    }
+    const std::string path = dir + "/f" + std::to_string(i);
+    if (!WriteFile(root / path, MakePayload(params, file_size, rng))) {
+      return false;
+    }
+    config << "path=\"" << path << "\" type=file mode=0644 uid=0 gid=0\n";
+  }
+  return config.good();
+}
+
+class Runner {
+ public:
+  explicit Runner(const Params &params) : params_(params) {}
+
+  // Times body params.iterations times after one warm-up run; setup runs
+  // untimed before each call.
+  void Run(std::string_view stage, uint64_t bytes, uint64_t entries,
+           const std::function<bool()> &setup,
+           const std::function<bool()> &body) {
+    if (!params_.filter.empty() &&
+        stage.find(params_.filter) == std::string_view::npos) {
+      return;
+    }
+
+    std::vector<double> samples;
+    bool ok = true;
+    for (unsigned i = 0; i <= params_.iterations && ok; ++i) {
+      if (setup && !setup()) {
+        ok = false;
+        break;
+      }
+      const auto start = std::chrono::steady_clock::now();
+      ok = body();
+      const double seconds = std::chrono::duration<double>(
+                                 std::chrono::steady_clock::now() - start)
+                                 .count();
+      if (i > 0) samples.push_back(seconds);
+    }
+
+    JsonWriter json;
+    json.BeginObject()
+        .Field("stage", stage)
+        .Field("ok", ok)
+        .Field("pattern", params_.pattern)
+        .Field("bytes", bytes)
+        .Field("entries", entries)
+        .Field("iterations", static_cast<uint64_t>(samples.size()));
+    if (ok && !samples.empty()) {
+      std::sort(samples.begin(), samples.end());
+      const double median = samples[samples.size() / 2];
+      json.Field("min_s", samples.front())
+          .Field("median_s", median)
+          .Field("mb_per_s", static_cast<double>(bytes) / 1e6 / median)
+          .Field("entries_per_s", static_cast<double>(entries) / median);
+    }
+    json.EndObject();
+    std::printf("%s\n", json.str().c_str());
+    std::fflush(stdout);
+  }
+
+ private:
+  const Params &params_;
+};
+
+int Usage() {
+  std::fputs(
+      "usage: abik_bench [--size <MiB>] [--files <n>] [--iterations <n>]\n"
+      "                  [--pattern text|random|zeros] [--filter <stage>]\n"
+      "                  [--seed <n>] [--library <path>]\n",
+      stderr);
+  return 2;
+}
+
+bool ParseParams(int argc, char **argv, Params &params) {
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (i + 1 >= argc) return false;
+    const char *value = argv[++i];
+    if (arg == "--size") {
+      params.size = std::strtoull(value, nullptr, 10) * 1024 * 1024;
+    } else if (arg == "--files") {
+      params.files = static_cast<unsigned>(std::max(1, std::atoi(value)));
+    } else if (arg == "--iterations") {
+      params.iterations = static_cast<unsigned>(std::max(1, std::atoi(value)));
+    } else if (arg == "--pattern") {
+      params.pattern = value;
+    } else if (arg == "--filter") {
+      params.filter = value;
+    } else if (arg == "--seed") {
+      params.seed = static_cast<uint32_t>(std::strtoul(value, nullptr, 10));
+    } else if (arg == "--library") {
+      params.library = value;
+    } else {
+      return false;
+    }
+  }
+  return params.pattern == "text" || params.pattern == "random" ||
+         params.pattern == "zeros";
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  Params params;
+  if (!ParseParams(argc, argv, params)) return Usage();
+
+  ErrorSink sink;
+  Session session(&sink, LEVEL_INFO);
+  Session::Scope scope(session);
+
+  params.scratch = fs::temp_directory_path() /
+                   ("abik-bench-" + std::to_string(getpid()));
+  const fs::path &dir = params.scratch;
+  std::error_code ec;
+  fs::remove_all(dir, ec);
+  fs::create_directories(dir / "tree");
+
+  // Fixtures shared by the stages.
+  const fs::path tree = dir / "tree";
+  const fs::path cpio = dir / "ramdisk.cpio";
+  const fs::path kernel = dir / "kernel";
+  const fs::path boot = dir / "boot.img";
+  std::mt19937 rng(params.seed + 1);
+  if (!MakeTree(params, tree) || !BuildCPIO(tree, cpio) ||
+      !WriteFile(kernel, MakePayload(params, params.size / 2, rng))) {
+    std::fputs("abik_bench: failed to create fixtures\n", stderr);
+    return 1;
+  }
+  const uint64_t cpio_size = fs::file_size(cpio);
+  const uint64_t kernel_size = fs::file_size(kernel);
+
+  BootImageArgs boot_args;
+  boot_args.kernel = kernel;
+  boot_args.ramdisk = cpio;
+  boot_args.page_size = PAGE_SIZE;
+  boot_args.header_version = 4;
+  boot_args.output = boot;
+  if (!WriteBootImage(boot_args)) {
+    std::fputs("abik_bench: failed to create boot image\n", stderr);
+    return 1;
+  }
+
+  Runner runner(params);
+  const unsigned entries = params.files + (params.files + 63) / 64;
+
+  // Load of a build of the app library: mapping, relocating and running its
+  // initialisers, as System.loadLibrary would. Each run loads a fresh copy,
+  // since a library that cannot be unloaded (e.g. one with unique symbols)
+  // would otherwise only be looked up again. bytes is the size of the file.
+  if (!params.library.empty()) {
+    std::error_code size_ec;
+    const uint64_t library_size = fs::file_size(params.library, size_ec);
+    const fs::path copies = dir / "library";
+    fs::create_directories(copies, size_ec);
+    unsigned copy = 0;
+    fs::path loaded;
+    runner.Run(
+        "library_load", size_ec ? 0 : library_size, 1,
+        [&] {
+          loaded = copies / ("lib" + std::to_string(copy++) + ".so");
+          std::error_code ec;
+          return fs::copy_file(params.library, loaded, ec);
+        },
+        [&] {
+          void *handle = dlopen(loaded.c_str(), RTLD_NOW | RTLD_LOCAL);
+          if (handle == nullptr) {
+            std::fprintf(stderr, "abik_bench: %s\n", dlerror());
+            return false;
+          }
+          return dlclose(handle) == 0;
+        });
+  }
+
+  {
+    int fd = open(boot.c_str(), O_RDONLY);
+    runner.Run("header_parse", 0, HEADER_PARSES, nullptr, [fd] {
+      for (int i = 0; i < HEADER_PARSES; ++i) {
+        if (!InspectBootImage(fd)) return false;
+      }
+      return true;
+    });
+
+    const uint64_t ramdisk_offset =
+        PAGE_SIZE + GetNumberOfPages(kernel_size, PAGE_SIZE) * PAGE_SIZE;
+    runner.Run("extract_image", cpio_size, 1, nullptr, [&, fd] {
+      return utils::ExtractImage(fd, ramdisk_offset, cpio_size,
+                                 dir / "extracted");
+    });
+    close(fd);
+  }
+
+  for (const auto &codec : Codecs()) {
+    if (codec.format == FORMAT_NONE) continue;
+    const std::string name(codec.name);
+    const fs::path work = dir / ("work." + name);
+    const fs::path packed = dir / ("ramdisk.cpio." + name);
+    runner.Run(name + "_compress", cpio_size, 1,
+               [&] { return CopyFile(cpio, work); },
+               [&] { return EncodeFile(codec, work, packed); });
+
+    // The codecs consume their input.
+    if (!fs::exists(packed)) continue;
+    runner.Run(name + "_decompress", cpio_size, 1,
+               [&] { return CopyFile(packed, work); },
+               [&] { return DecodeFile(codec, work, dir / "work.out"); });
+  }
+
+  runner.Run("build_cpio", cpio_size, entries, nullptr,
+             [&] { return BuildCPIO(tree, dir / "built.cpio"); });
+
+  const fs::path extracted_tree = dir / "extracted_tree";
+  runner.Run(
+      "extract_cpio", cpio_size, entries,
+      [&] {
+        std::error_code ec;
+        fs::remove_all(extracted_tree, ec);
+        return true;
+      },
+      [&] { return ExtractCPIO(cpio, extracted_tree); });
+
+  fs::path signed_file = dir / "signed";
+  runner.Run("sha1_append", cpio_size, 1,
+             [&] { return CopyFile(cpio, signed_file); },
+             [&] { return AppendSHA1(signed_file); });
+  runner.Run("sha1_validate", cpio_size, 1, nullptr,
+             [&] { return ValidateSHA1(signed_file); });
+
+  // Raw hashing throughput of each SHA1 engine on an in-memory payload.
+  // sha1_bytewise feeds the portable engine one byte at a time, the way
+  // every caller did before the block API.
+  {
+    const std::string payload = MakePayload(params, params.size, rng);
+    const auto *bytes = reinterpret_cast<const uint8_t *>(payload.data());
+    const sha1::Engine detected = sha1::ActiveEngine();
+    sha1::UseEngine(sha1::Engine::Portable);
+    runner.Run("sha1_bytewise", payload.size(), 1, nullptr, [&] {
+      sha1::SHA1 sha;
+      for (size_t i = 0; i < payload.size(); ++i) sha.processByte(bytes[i]);
+      uint32_t digest[5];
+      sha.getDigest(digest);
+      return true;
+    });
+    for (sha1::Engine engine : {sha1::Engine::Portable, sha1::Engine::ShaNi,
+                                sha1::Engine::ArmCrypto}) {
+      if (!sha1::UseEngine(engine)) continue;
+      runner.Run(std::string("sha1_") + sha1::EngineName(engine),
+                 payload.size(), 1, nullptr, [&] {
+                   sha1::SHA1 sha;
+                   sha.processBytes(bytes, payload.size());
+                   uint32_t digest[5];
+                   sha.getDigest(digest);
+                   return true;
+                 });
+    }
+    sha1::UseEngine(detected);
+  }
+
+  boot_args.output = dir / "boot-new.img";
+  runner.Run("write_boot_image", cpio_size + kernel_size, 1, nullptr,
+             [&] { return WriteBootImage(boot_args); });
+
+  runner.Run("vendor_boot_build", 2 * cpio_size, 2, nullptr, [&] {
+    VendorBootArgs args;
+    args.header_version = 4;
+    args.page_size = PAGE_SIZE;
+    args.output = dir / "vendor_boot-new.img";
+    for (const char *name : {"platform", "dlkm"}) {
+      VendorRamdiskEntry entry;
+      entry.path = cpio;
+      entry.type = VENDOR_RAMDISK_TYPE_PLATFORM;
+      entry.name = name;
+      args.ramdisks.push_back(entry);
+    }
+    VendorBootBuilder builder(std::move(args));
+    return builder.Build();
+  });
+
+  fs::remove_all(dir, ec);
+  return 0;
+}
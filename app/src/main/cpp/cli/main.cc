@@ -0,0 +1,288 @@
+// Host front end for abik_core, so the device code paths can be run and
+// timed on a Linux machine.
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "abik.h"
+#include "avb/footer.h"
+#include "buffer_pool.h"
+#include "log.h"
+#include "ramdisk/ramdisk.h"
+#include "session.h"
+#include "unpackbootimg/inspect.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+class StderrSink : public LogSink {
+ public:
+  explicit StderrSink(bool quiet) : quiet_(quiet) {}
+
+  void Write(const char *line) override {
+    if (quiet_ && std::strncmp(line, "[ERROR]", 7) != 0) return;
+    std::lock_guard lock(mutex_);
+    std::fprintf(stderr, "%s\n", line);
+  }
+
+ private:
+  std::mutex mutex_;
+  bool quiet_;
+};
+
+int Usage() {
+  std::fputs(
+      "usage: abik unpack <image>|- [-o <dir>] [--no-ramdisk] [--seek-index]\n"
+      "                   [--trace]\n"
+      "       abik build <workdir> [-o <image>|-] [--trace]\n"
+      "       abik list <image> [--index <file>]\n"
+      "       abik extract <image> --entry <path> ... [-o <dir>]\n"
+      "                    [--index <file>]\n"
+      "       abik patch <image> -o <image> [--cmdline <s>] [--board <s>]\n"
+      "                  [--os-version <a.b.c>] [--os-patch-level <YYYY-MM>]\n"
+      "                  [--bootconfig <file>] [--key <pem>]\n"
+      "       (any command) [--memory-budget <MiB>]\n"
+      "       abik inspect <image>\n"
+      "       abik verify <image> [--key <pem>]\n"
+      "       abik bench <image> [-n <runs>] [--no-ramdisk]\n",
+      stderr);
+  return 2;
+}
+
+// "-" is standard input, which may be a pipe.
+int OpenImage(const std::string &path) {
+  if (path == "-") return STDIN_FILENO;
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) std::fprintf(stderr, "abik: cannot open %s\n", path.c_str());
+  return fd;
+}
+
+struct Options {
+  std::vector<std::string> positional;
+  std::string output;  // unset: "." to unpack into, workdir to build into
+  std::string key;
+  std::string index;
+  std::vector<std::string> entries;
+  ImageHeaderPatch patch;
+  bool extract_ramdisk = true;
+  bool seek_index = false;
+  bool trace = false;
+  int runs = 5;
+  int memory_budget_mb = 0;
+};
+
+bool ParseOptions(int argc, char **argv, Options &options) {
+  for (int i = 2; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "-o" && i + 1 < argc) {
+      options.output = argv[++i];
+    } else if (arg == "--key" && i + 1 < argc) {
+      options.key = argv[++i];
+    } else if (arg == "-n" && i + 1 < argc) {
+      options.runs = std::max(1, std::atoi(argv[++i]));
+    } else if (arg == "--index" && i + 1 < argc) {
+      options.index = argv[++i];
+    } else if (arg == "--entry" && i + 1 < argc) {
+      options.entries.push_back(argv[++i]);
+    } else if (arg == "--cmdline" && i + 1 < argc) {
+      options.patch.cmdline = argv[++i];
+    } else if (arg == "--board" && i + 1 < argc) {
+      options.patch.board = argv[++i];
+    } else if (arg == "--os-version" && i + 1 < argc) {
+      options.patch.os_version = argv[++i];
+    } else if (arg == "--os-patch-level" && i + 1 < argc) {
+      options.patch.os_patch_level = argv[++i];
+    } else if (arg == "--bootconfig" && i + 1 < argc) {
+      options.patch.bootconfig = argv[++i];
+    } else if (arg == "--no-ramdisk") {
+      options.extract_ramdisk = false;
+    } else if (arg == "--seek-index") {
+      options.seek_index = true;
+    } else if (arg == "--memory-budget" && i + 1 < argc) {
+      options.memory_budget_mb = std::max(1, std::atoi(argv[++i]));
+    } else if (arg == "--trace") {
+      options.trace = true;
+    } else if (arg.starts_with("-") && arg != "-") {
+      return false;
+    } else {
+      options.positional.push_back(std::move(arg));
+    }
+  }
+  return options.positional.size() == 1;
+}
+
+struct Stats {
+  double min = 0;
+  double median = 0;
+  double mean = 0;
+};
+
+Stats Summarise(std::vector<double> samples) {
+  std::sort(samples.begin(), samples.end());
+  Stats stats;
+  stats.min = samples.front();
+  stats.median = samples[samples.size() / 2];
+  for (double s : samples) stats.mean += s;
+  stats.mean /= static_cast<double>(samples.size());
+  return stats;
+}
+
+void PrintStats(const char *stage, const Stats &stats, uint64_t bytes) {
+  std::printf("%-7s min %8.2f ms  median %8.2f ms  mean %8.2f ms  %8.1f MB/s\n",
+              stage, stats.min * 1e3, stats.median * 1e3, stats.mean * 1e3,
+              static_cast<double>(bytes) / (1024.0 * 1024.0) / stats.min);
+}
+
+// Unpacks and rebuilds the image runs times in a scratch directory and reports
+// wall time per stage.
+int Bench(const Options &options) {
+  int fd = OpenImage(options.positional[0]);
+  if (fd < 0) return 1;
+  struct stat st {};
+  fstat(fd, &st);
+
+  const fs::path scratch =
+      fs::temp_directory_path() / ("abik-bench-" + GenRandomString(8));
+  std::vector<double> unpack, build;
+  bool ok = true;
+  for (int i = 0; i < options.runs && ok; ++i) {
+    std::error_code ec;
+    fs::remove_all(scratch, ec);
+    const std::string workdir = (scratch / "image").string();
+
+    auto [unpacked, unpack_time] = measure(unpackbootimg_wrapper, fd, workdir,
+                                           options.extract_ramdisk);
+    auto [built, build_time] = measure(mkbootimg_wrapper, workdir, -1, "");
+    ok = unpacked && built;
+    unpack.push_back(unpack_time.count());
+    build.push_back(build_time.count());
+  }
+  std::error_code ec;
+  fs::remove_all(scratch, ec);
+  close(fd);
+
+  if (!ok) {
+    std::fputs("abik: bench run failed\n", stderr);
+    return 1;
+  }
+  PrintStats("unpack", Summarise(unpack), static_cast<uint64_t>(st.st_size));
+  PrintStats("build", Summarise(build), static_cast<uint64_t>(st.st_size));
+  return 0;
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 2) return Usage();
+  const std::string command = argv[1];
+
+  Options options;
+  if (!ParseOptions(argc, argv, options)) return Usage();
+  const std::string &target = options.positional[0];
+  if (options.output.empty() && command != "build" && command != "patch") {
+    options.output = ".";
+  }
+  if (options.memory_budget_mb > 0) {
+    BufferPool::Shared().SetBudget(static_cast<size_t>(options.memory_budget_mb)
+                                   << 20);
+  }
+
+  StderrSink sink(command == "bench");
+  Session session(&sink, command == "build" || command == "patch"
+                             ? LEVEL_BUILD
+                             : LEVEL_EXTRACT);
+  session.set_tracing(options.trace);
+  session.set_seek_index(options.seek_index);
+  Session::Scope scope(session);
+
+  if (command == "unpack") {
+    int fd = OpenImage(target);
+    if (fd < 0) return 1;
+    bool ok = UnpackImage(
+        fd, options.output,
+        target == "-" ? "stdin" : fs::path(target).filename().string(),
+        options.extract_ramdisk);
+    if (fd != STDIN_FILENO) close(fd);
+    return ok ? 0 : 1;
+  }
+  if (command == "build") {
+    if (options.output.empty()) return BuildImage(target) ? 0 : 1;
+    // "-" streams the image to standard output; the console is on stderr.
+    int fd = options.output == "-"
+                 ? STDOUT_FILENO
+                 : open(options.output.c_str(),
+                        O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      std::fprintf(stderr, "abik: cannot create %s\n", options.output.c_str());
+      return 1;
+    }
+    bool ok = BuildImage(target, fd,
+                         options.output == "-"
+                             ? "stdout"
+                             : fs::path(options.output).filename().string());
+    if (fd != STDOUT_FILENO && close(fd) != 0) ok = false;
+    return ok ? 0 : 1;
+  }
+  if (command == "list") {
+    int fd = OpenImage(target);
+    if (fd < 0) return 1;
+    auto json = ListRamdisks(fd, options.index);
+    close(fd);
+    if (!json) return 1;
+    std::printf("%s\n", json->c_str());
+    return 0;
+  }
+  if (command == "extract") {
+    int fd = OpenImage(target);
+    if (fd < 0) return 1;
+    bool ok = ExtractImageEntries(fd, options.output,
+                                  fs::path(target).filename().string(),
+                                  options.entries, options.index);
+    close(fd);
+    return ok ? 0 : 1;
+  }
+  if (command == "patch") {
+    if (options.output.empty()) return Usage();
+    int fd = OpenImage(target);
+    if (fd < 0) return 1;
+    options.patch.avb_key = options.key;
+    bool ok = PatchImageHeader(fd, options.patch, options.output);
+    close(fd);
+    return ok ? 0 : 1;
+  }
+  if (command == "inspect") {
+    int fd = OpenImage(target);
+    if (fd < 0) return 1;
+    auto json = InspectImage(fd);
+    close(fd);
+    if (!json) return 1;
+    std::printf("%s\n", json->c_str());
+    return 0;
+  }
+  if (command == "verify") {
+    int fd = OpenImage(target);
+    if (fd < 0) return 1;
+    bool verified = false;
+    auto json = avb::VerifyImage(fd, options.key, verified);
+    close(fd);
+    if (!json) {
+      std::fprintf(stderr, "abik: %s has no AVB footer\n", target.c_str());
+      return 1;
+    }
+    std::printf("%s\n", json->c_str());
+    return verified ? 0 : 1;
+  }
+  if (command == "bench") {
+    return Bench(options);
+  }
+  return Usage();
+}
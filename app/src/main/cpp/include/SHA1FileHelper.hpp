@@ -12,7 +12,7 @@
 namespace fs = std::filesystem;
 constexpr std::size_t SHA1_DIGEST_SIZE = 20;
 
-bool AppendSHA1(fs::path& filename) noexcept {
+inline bool AppendSHA1(fs::path& filename) noexcept {
   std::ifstream infile(filename, std::ios::binary);
   if (!infile) return false;
 
@@ -34,7 +34,7 @@ bool AppendSHA1(fs::path& filename) noexcept {
   return outfile.good();
 }
 
-bool ValidateSHA1(fs::path& filename) noexcept {
+inline bool ValidateSHA1(fs::path& filename) noexcept {
   std::ifstream file(filename, std::ios::binary | std::ios::ate);
   if (!file) return false;
 
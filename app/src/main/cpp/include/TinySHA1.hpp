@@ -26,6 +26,8 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+
+#include "sha1_engine.h"
 namespace sha1 {
 class SHA1 {
  public:
@@ -66,15 +68,30 @@ class SHA1 {
   SHA1& processBlock(const void* const start, const void* const end) {
     const uint8_t* begin = static_cast<const uint8_t*>(start);
     const uint8_t* finish = static_cast<const uint8_t*>(end);
-    while (begin != finish) {
-      processByte(*begin);
-      begin++;
-    }
-    return *this;
+    return processBytes(begin, static_cast<size_t>(finish - begin));
   }
+  // Tops up a pending partial block, then hands every whole block to the
+  // block engine straight from the caller's buffer.
   SHA1& processBytes(const void* const data, size_t len) {
-    const uint8_t* block = static_cast<const uint8_t*>(data);
-    processBlock(block, block + len);
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    m_byteCount += len;
+    if (m_blockByteIndex > 0) {
+      const size_t take = len < 64 - m_blockByteIndex ? len : 64 - m_blockByteIndex;
+      memcpy(m_block + m_blockByteIndex, bytes, take);
+      m_blockByteIndex += take;
+      bytes += take;
+      len -= take;
+      if (m_blockByteIndex < 64) return *this;
+      m_blockByteIndex = 0;
+      processBlock();
+    }
+    if (const size_t blocks = len / 64) {
+      ProcessBlocks(m_digest, bytes, blocks);
+      bytes += blocks * 64;
+      len -= blocks * 64;
+    }
+    memcpy(m_block, bytes, len);
+    m_blockByteIndex = len;
     return *this;
   }
   const uint32_t* getDigest(digest32_t digest) {
@@ -136,55 +153,7 @@ class SHA1 {
   }
 
  protected:
-  void processBlock() {
-    uint32_t w[80];
-    for (size_t i = 0; i < 16; i++) {
-      w[i] = (m_block[i * 4 + 0] << 24);
-      w[i] |= (m_block[i * 4 + 1] << 16);
-      w[i] |= (m_block[i * 4 + 2] << 8);
-      w[i] |= (m_block[i * 4 + 3]);
-    }
-    for (size_t i = 16; i < 80; i++) {
-      w[i] = LeftRotate((w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16]), 1);
-    }
-
-    uint32_t a = m_digest[0];
-    uint32_t b = m_digest[1];
-    uint32_t c = m_digest[2];
-    uint32_t d = m_digest[3];
-    uint32_t e = m_digest[4];
-
-    for (std::size_t i = 0; i < 80; ++i) {
-      uint32_t f = 0;
-      uint32_t k = 0;
-
-      if (i < 20) {
-        f = (b & c) | (~b & d);
-        k = 0x5A827999;
-      } else if (i < 40) {
-        f = b ^ c ^ d;
-        k = 0x6ED9EBA1;
-      } else if (i < 60) {
-        f = (b & c) | (b & d) | (c & d);
-        k = 0x8F1BBCDC;
-      } else {
-        f = b ^ c ^ d;
-        k = 0xCA62C1D6;
-      }
-      uint32_t temp = LeftRotate(a, 5) + f + e + k + w[i];
-      e = d;
-      d = c;
-      c = LeftRotate(b, 30);
-      b = a;
-      a = temp;
-    }
-
-    m_digest[0] += a;
-    m_digest[1] += b;
-    m_digest[2] += c;
-    m_digest[3] += d;
-    m_digest[4] += e;
-  }
+  void processBlock() { ProcessBlocks(m_digest, m_block, 1); }
 
  private:
   digest32_t m_digest;
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "batch/batch.h"
+#include "job.h"
+#include "session.h"
+
+// Front door of abik_core, shared by the JNI bridge and the host CLI. Every
+// call logs through the Session bound to the calling thread.
+
+template <typename F, typename... Args>
+auto measure(F &&f, Args &&...args) {
+  using namespace std::chrono;
+  auto start = high_resolution_clock::now();
+
+  if constexpr (std::is_void_v<std::invoke_result_t<F, Args...>>) {
+    std::invoke(std::forward<F>(f), std::forward<Args>(args)...);
+    auto end = high_resolution_clock::now();
+    return duration<double>(end - start);
+  } else {
+    auto result = std::invoke(std::forward<F>(f), std::forward<Args>(args)...);
+    auto end = high_resolution_clock::now();
+    return std::make_pair(result, duration<double>(end - start));
+  }
+}
+
+std::string GenRandomString(std::size_t length);
+
+// Unpacks the image behind fd into workdir, decompressing the ramdisks when
+// dec_ramdisk is set. fd may be a pipe or socket: the sections are then read
+// in one forward pass, and no seek index is written.
+bool unpackbootimg_wrapper(int fd, const std::string &workdir,
+                           bool dec_ramdisk);
+// Rebuilds the image described by workdir's .parserconfig, into output_fd
+// when that is set. Pipes and other forward-only sinks are written in one
+// pass; output_fd stays open. output_name is what the log calls output_fd,
+// e.g. the path it was opened from.
+bool mkbootimg_wrapper(const std::string &workdir, int output_fd = -1,
+                       const std::string &output_name = {});
+
+// The jobs behind ABIKBridge. Unpack-style calls work in a fresh
+// directory/input_name (random when empty) and remove it again on failure.
+bool UnpackImage(int fd, const std::string &directory, std::string input_name,
+                 bool extract_ramdisk);
+bool BuildImage(const std::string &workdir, int output_fd = -1,
+                const std::string &output_name = {});
+// index, when not empty, is the seek index of an earlier unpack of the image.
+bool ExtractImageEntries(int fd, const std::string &directory,
+                         std::string input_name,
+                         const std::vector<std::string> &patterns,
+                         const std::string &index = {});
+bool PatchImageRamdisk(int fd, const std::string &ramdisk,
+                       const std::string &spec, const std::string &output);
+
+// Header fields for PatchImageHeader; unset ones keep their value. On
+// vendor_boot, cmdline is the vendor cmdline and bootconfig (v4 only) names
+// a file that replaces the bootconfig section. avb_key re-signs a signed
+// AVB footer, which is refused without it.
+struct ImageHeaderPatch {
+  std::optional<std::string> cmdline;
+  std::optional<std::string> os_version;
+  std::optional<std::string> os_patch_level;
+  std::optional<std::string> board;
+  std::optional<std::string> bootconfig;
+  std::string avb_key;
+};
+// Writes a copy of the boot or vendor_boot image in fd to output with only
+// its header (and bootconfig) rewritten.
+bool PatchImageHeader(int fd, const ImageHeaderPatch &patch,
+                      const std::string &output);
+
+// Background variants for the app: they return at once with an id for
+// PollJob/CancelJob/ReleaseJob, and the job's console goes to sink. fd is
+// duplicated, so the caller may close its own right away.
+JobId StartUnpackImage(std::unique_ptr<LogSink> sink, bool tracing, int fd,
+                       std::string directory, std::string input_name,
+                       bool extract_ramdisk);
+JobId StartBuildImage(std::unique_ptr<LogSink> sink, bool tracing,
+                      std::string workdir, int output_fd = -1);
+
+std::vector<BatchResult> UnpackImages(const Session &session,
+                                      const std::vector<int> &fds,
+                                      const std::vector<std::string> &names,
+                                      const std::string &directory,
+                                      bool extract_ramdisk,
+                                      const BatchLimits &limits);
+std::vector<BatchResult> BuildImages(const Session &session,
+                                     const std::vector<std::string> &workdirs,
+                                     const BatchLimits &limits);
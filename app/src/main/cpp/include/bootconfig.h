@@ -3,49 +3,9 @@
 #include "log.h"
 #include "config.h"
 
+// Reader for version 1 .parserconfig files; see parser_config.h.
 class BootConfig {
  public:
-  static bool Write(const BootImageInfo& info, const std::string& filename) {
-    std::ofstream file(filename, std::ios::binary);
-    if (!file.is_open()) {
-      LOGE("Failed to open config for writing");
-      return false;
-    }
-
-    WriteString(file, info.boot_magic);
-    WriteU32(file, info.header_version);
-    WriteU32(file, info.kernel_size);
-    WriteU32(file, info.ramdisk_size);
-    WriteU8(file, info.ramdisk_compression);
-    WriteU32(file, info.page_size);
-    WriteString(file, info.os_version);
-    WriteString(file, info.os_patch_level);
-    WriteString(file, info.cmdline);
-
-    WriteU32(file, info.kernel_load_address);
-    WriteU32(file, info.ramdisk_load_address);
-    WriteU32(file, info.second_size);
-    WriteU32(file, info.second_load_address);
-    WriteU32(file, info.tags_load_address);
-
-    WriteString(file, info.product_name);
-    WriteString(file, info.extra_cmdline);
-
-    WriteU32(file, info.recovery_dtbo_size);
-    WriteU64(file, info.recovery_dtbo_offset);
-    WriteU32(file, info.boot_header_size);
-
-    WriteU32(file, info.dtb_size);
-    WriteU64(file, info.dtb_load_address);
-    WriteU32(file, info.boot_signature_size);
-
-    if (!file.good()) {
-      LOGE("Error occurred while writing configuration");
-      return false;
-    }
-    return true;
-  }
-
   static bool Read(BootImageInfo& info, const std::string& filename) {
     std::ifstream file(filename, std::ios::binary);
     if (!file.is_open()) {
@@ -88,33 +48,6 @@ class BootConfig {
   }
 
  private:
-  static void WriteU8(std::ostream& os, uint8_t value) {
-    os.write(reinterpret_cast<const char*>(&value), sizeof(value));
-  }
-
-  static void WriteU16(std::ostream& os, uint16_t value) {
-      os.write(reinterpret_cast<const char*>(&value), sizeof(value));
-  }
-
-  static void WriteU32(std::ostream& os, uint32_t value) {
-    os.write(reinterpret_cast<const char*>(&value), sizeof(value));
-  }
-
-  static void WriteU64(std::ostream& os, uint64_t value) {
-    os.write(reinterpret_cast<const char *>(&value), sizeof(value));
-  }
-
-  template <typename T, typename = std::enable_if_t<std::is_trivially_copyable_v<T>>>
-  static void WriteUnsignedAny(std::ostream& os, T& value) {
-    os.write(reinterpret_cast<const char*>(&value), sizeof(T));
-  }
-
-  static void WriteString(std::ostream& os, const std::string& s) {
-    auto size = static_cast<string_size>(s.size());
-    WriteUnsignedAny(os, size);
-    os.write(s.data(), static_cast<std::streamsize>(size));
-  }
-
   static void ReadU8(std::istream& is, uint8_t& value) {
     is.read(reinterpret_cast<char*>(&value), sizeof(value));
   }
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+// Size and alignment of every pooled buffer. Stages stream their data
+// through buffers of this size instead of allocating whole sections.
+constexpr size_t POOL_BUFFER_SIZE = 1 << 20;
+constexpr size_t POOL_BUFFER_ALIGNMENT = 4096;
+
+// Process-wide pool of large aligned buffers under a memory budget. At most
+// budget / POOL_BUFFER_SIZE buffers exist at any time; Acquire blocks until
+// one is free, so peak memory no longer depends on the input. A thread may
+// hold only one buffer at a time, or concurrent jobs could deadlock.
+class BufferPool {
+ public:
+  class Buffer {
+   public:
+    Buffer(Buffer &&other) noexcept;
+    Buffer &operator=(Buffer &&other) noexcept;
+    ~Buffer();
+
+    char *data() const { return data_; }
+    size_t size() const { return POOL_BUFFER_SIZE; }
+
+   private:
+    friend class BufferPool;
+    Buffer(BufferPool *pool, char *data) : pool_(pool), data_(data) {}
+
+    BufferPool *pool_;
+    char *data_;
+  };
+
+  // Memory a caller allocates itself, counted against the budget in whole
+  // buffers until the charge goes.
+  class Charge {
+   public:
+    Charge() = default;
+    Charge(Charge &&other) noexcept;
+    Charge &operator=(Charge &&other) noexcept;
+    ~Charge();
+
+    size_t bytes() const { return bytes_; }
+    // Sets the charge to bytes in all. Raising it needs room in the budget
+    // now and fails without; it never waits.
+    bool Set(size_t bytes);
+
+   private:
+    friend class BufferPool;
+    explicit Charge(BufferPool *pool) : pool_(pool) {}
+
+    BufferPool *pool_ = nullptr;
+    size_t buffers_ = 0;
+    size_t bytes_ = 0;
+  };
+
+  static BufferPool &Shared();
+
+  explicit BufferPool(size_t budget);
+  ~BufferPool();
+
+  BufferPool(const BufferPool &) = delete;
+  BufferPool &operator=(const BufferPool &) = delete;
+
+  // Rounded down to whole buffers, at least one. Lowering the budget frees
+  // idle buffers at once and busy ones as they come back.
+  void SetBudget(size_t bytes);
+  size_t budget() const;
+
+  Buffer Acquire();
+  // Charges bytes if the budget has room for them now, else nullopt. Unlike
+  // Acquire it never waits, so speculative work can give up instead, and a
+  // thread may hold charges along with a buffer.
+  std::optional<Charge> TryCharge(size_t bytes);
+
+ private:
+  void Release(char *data);
+  bool Reserve(size_t buffers);
+  void Unreserve(size_t buffers);
+
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  size_t limit_;          // buffers allowed
+  size_t allocated_ = 0;  // buffers in existence, idle or lent out, or charged
+  std::vector<char *> idle_;
+};
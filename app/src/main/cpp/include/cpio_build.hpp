@@ -2,22 +2,31 @@
 
 #include <sys/stat.h>
 
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <map>
+#include <optional>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#include "buffer_pool.h"
+#include "cpio_newc.h"
+#include "job.h"
 #include "log.h"
 #include "tools.h"
 
 namespace fs = std::filesystem;
 
-bool BuildCPIO(const std::filesystem::path &input,
-               const std::filesystem::path &output) noexcept {
+// Archives the entries listed in input's CONFIG_FILE into output. With
+// segment set, only those tagged with it are, untagged ones for "".
+inline bool BuildCPIO(
+    const std::filesystem::path &input, const std::filesystem::path &output,
+    std::optional<std::string_view> segment = std::nullopt) noexcept {
   fs::path config_path = input / CONFIG_FILE;
   std::ifstream config(config_path);
   if (!config) {
@@ -30,44 +39,16 @@ bool BuildCPIO(const std::filesystem::path &input,
     LOGE("Error creating output file: %s", output.c_str());
     return false;
   }
+  auto buffer = BufferPool::Shared().Acquire();
 
   std::error_code ec;
   errno = 0;
   std::string line;
   while (std::getline(config, line)) {
+    if (JobCancelled()) return false;
     std::map<std::string, std::string> entry;
-    size_t pos = 0;
-    while (pos < line.size()) {
-      while (pos < line.size() && std::isspace(line[pos])) {
-        pos++;
-      }
-      if (pos >= line.size()) break;
-
-      size_t eq_pos = line.find('=', pos);
-      if (eq_pos == std::string::npos) break;
-      std::string key = line.substr(pos, eq_pos - pos);
-      pos = eq_pos + 1;
-
-      if (pos < line.size() && line[pos] == '"') {
-        pos++;
-        size_t end_quote = line.find('"', pos);
-        if (end_quote == std::string::npos) {
-          LOGE("Error: Unterminated quote in config line.");
-          return false;
-        }
-        std::string value = line.substr(pos, end_quote - pos);
-        entry[key] = value;
-        pos = end_quote + 1;
-      } else {
-        size_t value_end = line.find_first_of(" \t", pos);
-        if (value_end == std::string::npos) {
-          value_end = line.size();
-        }
-        std::string value = line.substr(pos, value_end - pos);
-        entry[key] = value;
-        pos = value_end;
-      }
-    }
+    if (!ParseConfigLine(line, entry)) return false;
+    if (segment && entry["segment"] != *segment) continue;
 
     std::string path = entry["path"];
     std::string type = entry["type"];
@@ -106,32 +87,19 @@ bool BuildCPIO(const std::filesystem::path &input,
 
     mode_t mode = file_type | (permissions & 07777);
 
-    char header[110] = {};
-    std::memcpy(header, "070701", 6);  // Magic
-
     unsigned long namesize = path.size() + 1;  // +1 for null terminator
 
-    auto write_field = [&](int offset, unsigned long value) {
-      char temp[9];
-      std::snprintf(temp, sizeof(temp), "%08lX", value);
-      std::memcpy(header + offset, temp, 8);
-    };
-
-    write_field(6, 0);       // ino
-    write_field(14, mode);   // mode
-    write_field(22, uid);    // uid
-    write_field(30, gid);    // gid
-    write_field(38, nlink);  // nlink
-    write_field(46, 0);      // mtime (not stored)
-    write_field(54, filesize);
-    write_field(62, 0);  // devmajor
-    write_field(70, 0);  // devminor
-    write_field(78, 0);  // rdevmajor
-    write_field(86, 0);  // rdevminor
-    write_field(94, namesize);
-    write_field(102, 0);  // check
-
-    cpio_out.write(header, 110);
+    CpioNewcHeader fields;
+    fields.mode = mode;
+    fields.uid = uid;
+    fields.gid = gid;
+    fields.nlink = nlink;
+    fields.filesize = filesize;
+    fields.namesize = namesize;
+
+    char header[CPIO_NEWC_HEADER_SIZE];
+    FormatCpioNewcHeader(fields, header);
+    cpio_out.write(header, CPIO_NEWC_HEADER_SIZE);
 
     cpio_out.write(path.c_str(), static_cast<std::streamsize>(path.size()));
     cpio_out.put('\0');
@@ -141,30 +109,34 @@ bool BuildCPIO(const std::filesystem::path &input,
 
     if (type == "file") {
       std::ifstream file(input / path, std::ios::binary);
-      std::vector<char> data(filesize);
-      file.read(data.data(), static_cast<std::streamsize>(filesize));
-      cpio_out.write(data.data(), static_cast<std::streamsize>(filesize));
+      for (unsigned long copied = 0; copied < filesize;) {
+        const size_t length =
+            std::min<size_t>(filesize - copied, buffer.size());
+        if (!file.read(buffer.data(), static_cast<std::streamsize>(length))) {
+          LOGE("Error reading file: %s", path.c_str());
+          return false;
+        }
+        cpio_out.write(buffer.data(), static_cast<std::streamsize>(length));
+        copied += length;
+      }
     } else if (type == "symlink") {
       cpio_out.write(target.c_str(), static_cast<std::streamsize>(target.size()));
     }
 
     size_t data_pad = (4 - (filesize % 4)) % 4;
     cpio_out.write("\0\0\0", static_cast<std::streamsize>(data_pad));
+    JobProgress(filesize);
   }
 
-  char trailer_header[110] = {};
-  std::memcpy(trailer_header, "070701", 6);
-  std::string trailer_name = "TRAILER!!!";
+  std::string trailer_name = CPIO_TRAILER_NAME;
   unsigned long trailer_namesize = trailer_name.size() + 1;
 
-  auto write_field = [&](int offset, unsigned long value) {
-    char temp[9];
-    std::snprintf(temp, sizeof(temp), "%08lX", value);
-    std::memcpy(trailer_header + offset, temp, 8);
-  };
+  CpioNewcHeader trailer;
+  trailer.namesize = trailer_namesize;
 
-  write_field(94, trailer_namesize);  // namesize
-  cpio_out.write(trailer_header, 110);
+  char trailer_header[CPIO_NEWC_HEADER_SIZE];
+  FormatCpioNewcHeader(trailer, trailer_header);
+  cpio_out.write(trailer_header, CPIO_NEWC_HEADER_SIZE);
   cpio_out.write(trailer_name.c_str(), static_cast<std::streamsize>(trailer_name.size()));
   cpio_out.put('\0');
 
@@ -3,23 +3,44 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iomanip>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <system_error>
+#include <unordered_set>
 #include <vector>
 
+#include "buffer_pool.h"
+#include "cpio_newc.h"
+#include "job.h"
 #include "log.h"
+#include "scheduler.h"
 #include "tools.h"
 
 namespace fs = std::filesystem;
 
-bool ExtractCPIO(const std::filesystem::path &input,
-                 const std::filesystem::path &output) noexcept {
+// Files up to this size are written by scheduler tasks while the archive is
+// read on, at most CPIO_DEFERRED_BYTES of them at a time and no more than the
+// memory budget has room for. Ramdisks are mostly small files, where creating
+// them costs more than the copy.
+constexpr size_t CPIO_DEFERRED_FILE_SIZE = POOL_BUFFER_SIZE;
+constexpr size_t CPIO_DEFERRED_BYTES = 16 * POOL_BUFFER_SIZE;
+
+// Extracts input into the directory output, recording every entry in its
+// CONFIG_FILE. With segment set, the archive is one segment of a ramdisk:
+// output may already hold earlier ones, whose entries it overrides, and a
+// non-empty segment tags the config lines it appends.
+inline bool ExtractCPIO(
+    const std::filesystem::path &input, const std::filesystem::path &output,
+    std::optional<std::string_view> segment = std::nullopt) noexcept {
   std::ifstream in(input.string(), std::ios::binary);
   if (!in) {
     LOGE("Error opening input file: %s", input.string().c_str());
@@ -27,57 +48,86 @@ bool ExtractCPIO(const std::filesystem::path &input,
   }
 
   std::error_code ec;
-  if (!fs::create_directory(output, ec)) {
+  if (!fs::create_directory(output, ec) && !(segment && !ec)) {
     return false;
   }
 
   fs::path config_path = fs::path(output.string()) / CONFIG_FILE;
-  std::ofstream config(config_path);
+  std::ofstream config(config_path, segment ? std::ios::app : std::ios::out);
+  std::string tag;
+  if (segment && !segment->empty()) tag = " segment=" + std::string(*segment);
   if (!config) {
     LOGE("Error creating config file");
     return false;
   }
 
+  // Sizes in the headers are checked against what is actually left of the
+  // archive, so a corrupt entry cannot make us allocate or copy past it.
+  const std::streamoff input_size =
+      static_cast<std::streamoff>(fs::file_size(input, ec));
+  if (ec) {
+    LOGE("Error reading size of %s", input.string().c_str());
+    return false;
+  }
+  auto buffer = BufferPool::Shared().Acquire();
+
+  std::atomic<bool> write_failed{false};
+  size_t deferred_bytes = 0;
+  auto deferred_charge = *BufferPool::Shared().TryCharge(0);
+  std::unordered_set<std::string> deferred;
+  TaskGroup writers;
+  auto wait_writers = [&] {
+    const bool ok = writers.Wait();
+    deferred_bytes = 0;
+    deferred_charge.Set(0);
+    deferred.clear();
+    return ok && !write_failed;
+  };
+
+  std::streamoff consumed = 0;
   while (true) {
-    char header[110];
-    if (!in.read(header, 110)) break;
+    const std::streamoff offset = in.tellg();
+    JobProgress(static_cast<uint64_t>(offset - consumed));
+    consumed = offset;
+    if (JobCancelled() || write_failed) return false;
+
+    char header[CPIO_NEWC_HEADER_SIZE];
+    if (!in.read(header, CPIO_NEWC_HEADER_SIZE)) break;
 
-    std::string magic(header, 6);
-    if (magic != "070701") {
+    CpioNewcHeader hdr;
+    if (!ParseCpioNewcHeader(header, hdr)) {
       LOGE("Unsupported format");
       return false;
     }
 
-    auto read_field = [&](int offset) -> unsigned long {
-      std::string field(header + offset, 8);
-      return std::strtoul(field.c_str(), nullptr, 16);
-    };
-
-    unsigned long ino = read_field(6);
-    unsigned long mode = read_field(14);
-    unsigned long uid = read_field(22);
-    unsigned long gid = read_field(30);
-    unsigned long nlink = read_field(38);
-    unsigned long mtime = read_field(46);
-    unsigned long filesize = read_field(54);
-    unsigned long devmajor = read_field(62);
-    unsigned long devminor = read_field(70);
-    unsigned long rdevmajor = read_field(78);
-    unsigned long rdevminor = read_field(86);
-    unsigned long namesize = read_field(94);
-    unsigned long check = read_field(102);
-
-    std::vector<char> namebuf(namesize);
-    in.read(namebuf.data(), static_cast<std::streamsize>(namesize));
-    std::string filename(namebuf.data(), namesize - 1);
-
-    int header_and_name = static_cast<int>(110 + namesize);
-    int pad = (4 - (header_and_name % 4)) % 4;
-    in.ignore(pad);
-
-    if (filename == "TRAILER!!!") break;
+    unsigned long mode = hdr.mode;
+    unsigned long uid = hdr.uid;
+    unsigned long gid = hdr.gid;
+    unsigned long filesize = hdr.filesize;
+    unsigned long namesize = hdr.namesize;
+
+    const std::streamoff remaining = input_size - in.tellg();
+    if (namesize == 0 || namesize > CPIO_MAX_NAME_SIZE ||
+        static_cast<std::streamoff>(namesize + filesize) > remaining) {
+      LOGE("Corrupt cpio entry at offset %lld", static_cast<long long>(offset));
+      return false;
+    }
+
+    std::string filename(namesize, '\0');
+    if (!in.read(filename.data(), static_cast<std::streamsize>(namesize))) {
+      LOGE("Truncated cpio archive");
+      return false;
+    }
+    filename.resize(namesize - 1);
+
+    in.ignore(static_cast<std::streamsize>(
+        CpioPad4(CPIO_NEWC_HEADER_SIZE + namesize)));
+
+    if (filename == CPIO_TRAILER_NAME) break;
 
     fs::path outpath = output / filename;
+    // A later entry for the same path must not race the earlier write.
+    if (deferred.contains(filename) && !wait_writers()) return false;
 
     fs::create_directories(outpath.parent_path(), ec);
 
@@ -88,36 +138,73 @@ bool ExtractCPIO(const std::filesystem::path &input,
     std::snprintf(mode_str, sizeof(mode_str), "0%03o",
                   static_cast<unsigned int>(file_mode));
 
+    bool defer = file_type == S_IFREG && filesize <= CPIO_DEFERRED_FILE_SIZE;
+    if (defer && (deferred_bytes + filesize > CPIO_DEFERRED_BYTES ||
+                  !deferred_charge.Set(deferred_bytes + filesize))) {
+      if (!wait_writers()) return false;
+      // Nothing of ours is deferred now; if the budget is still spent by
+      // other jobs, the file is copied here through the pooled buffer.
+      defer = deferred_charge.Set(filesize);
+    }
+
     if (file_type == S_IFDIR) {
       fs::create_directory(outpath, ec);
       config << "path=\"" << filename << "\" type=dir mode=" << mode_str
-             << " uid=" << uid << " gid=" << gid << "\n";
+             << " uid=" << uid << " gid=" << gid << tag << "\n";
+    } else if (defer) {
+      std::vector<char> data(filesize);
+      if (!in.read(data.data(), static_cast<std::streamsize>(filesize))) {
+        LOGE("Truncated cpio archive");
+        return false;
+      }
+      deferred_bytes += filesize;
+      deferred.insert(filename);
+      writers.Run([outpath, data = std::move(data), &write_failed] {
+        std::ofstream outfile(outpath, std::ios::binary);
+        if (!outfile.write(data.data(), static_cast<std::streamsize>(data.size()))
+                 .flush()) {
+          LOGE("Error writing file: %s", outpath.string().c_str());
+          write_failed = true;
+        }
+      });
+      config << "path=\"" << filename << "\" type=file mode=" << mode_str
+             << " uid=" << uid << " gid=" << gid << tag << "\n";
     } else if (file_type == S_IFREG) {
       std::ofstream outfile(outpath, std::ios::binary);
       if (!outfile) {
         LOGE("Error creating file: %s", outpath.string().c_str());
         return false;
       }
-      std::vector<char> filedata(filesize);
-      in.read(filedata.data(), static_cast<std::streamsize>(filesize));
-      outfile.write(filedata.data(), static_cast<std::streamsize>(filesize));
+      for (unsigned long copied = 0; copied < filesize;) {
+        const size_t length =
+            std::min<size_t>(filesize - copied, buffer.size());
+        if (!in.read(buffer.data(), static_cast<std::streamsize>(length)) ||
+            !outfile.write(buffer.data(),
+                           static_cast<std::streamsize>(length))) {
+          LOGE("Error writing file: %s", outpath.string().c_str());
+          return false;
+        }
+        copied += length;
+      }
       outfile.close();
       config << "path=\"" << filename << "\" type=file mode=" << mode_str
-             << " uid=" << uid << " gid=" << gid << "\n";
+             << " uid=" << uid << " gid=" << gid << tag << "\n";
     } else if (file_type == S_IFLNK) {
-      std::vector<char> linkdata(filesize);
-      in.read(linkdata.data(), static_cast<std::streamsize>(filesize));
-      std::string target(linkdata.data(), filesize);
+      if (filesize > CPIO_MAX_NAME_SIZE) {
+        LOGE("Invalid symlink %s", filename.c_str());
+        return false;
+      }
+      std::string target(filesize, '\0');
+      in.read(target.data(), static_cast<std::streamsize>(filesize));
       config << "path=\"" << filename << "\" type=symlink mode=" << mode_str
              << " uid=" << uid << " gid=" << gid << " target=\"" << target
-             << "\"\n";
+             << "\"" << tag << "\n";
     } else {
       LOGE("Unsupported file type");
       in.ignore(static_cast<std::streamsize>(filesize));
     }
 
-    int pad2 = static_cast<std::streamsize>((4 - (filesize % 4)) % 4);
-    in.ignore(pad2);
+    in.ignore(static_cast<std::streamsize>(CpioPad4(filesize)));
   }
-  return true;
+  return wait_writers();
 }
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+constexpr size_t CPIO_NEWC_HEADER_SIZE = 110;
+constexpr const char *CPIO_TRAILER_NAME = "TRAILER!!!";
+// Names and symlink targets beyond PATH_MAX only come from corrupt archives.
+constexpr uint32_t CPIO_MAX_NAME_SIZE = 4096;
+
+struct CpioNewcHeader {
+  uint32_t ino = 0;
+  uint32_t mode = 0;
+  uint32_t uid = 0;
+  uint32_t gid = 0;
+  uint32_t nlink = 0;
+  uint32_t mtime = 0;
+  uint32_t filesize = 0;
+  uint32_t devmajor = 0;
+  uint32_t devminor = 0;
+  uint32_t rdevmajor = 0;
+  uint32_t rdevminor = 0;
+  uint32_t namesize = 0;
+  uint32_t check = 0;
+};
+
+// newc pads both the header+name and the file data to 4 bytes.
+inline size_t CpioPad4(size_t size) { return (4 - (size % 4)) % 4; }
+
+// Parses a 110 byte "070701"/"070702" header. Like the kernel, a field ends
+// at the first non-hex character, so headers with NUL-filled fields still
+// parse. Returns false on a bad magic.
+inline bool ParseCpioNewcHeader(const char *header, CpioNewcHeader &out) {
+  if (header[0] != '0' || header[1] != '7' || header[2] != '0' ||
+      header[3] != '7' || header[4] != '0' ||
+      (header[5] != '1' && header[5] != '2')) {
+    return false;
+  }
+
+  auto read_field = [&](int offset) -> uint32_t {
+    uint32_t value = 0;
+    for (int i = 0; i < 8; ++i) {
+      const char c = header[offset + i];
+      uint32_t digit;
+      if (c >= '0' && c <= '9') {
+        digit = c - '0';
+      } else if (c >= 'A' && c <= 'F') {
+        digit = c - 'A' + 10;
+      } else if (c >= 'a' && c <= 'f') {
+        digit = c - 'a' + 10;
+      } else {
+        break;
+      }
+      value = (value << 4) | digit;
+    }
+    return value;
+  };
+
+  out.ino = read_field(6);
+  out.mode = read_field(14);
+  out.uid = read_field(22);
+  out.gid = read_field(30);
+  out.nlink = read_field(38);
+  out.mtime = read_field(46);
+  out.filesize = read_field(54);
+  out.devmajor = read_field(62);
+  out.devminor = read_field(70);
+  out.rdevmajor = read_field(78);
+  out.rdevminor = read_field(86);
+  out.namesize = read_field(94);
+  out.check = read_field(102);
+  return out.namesize > 0;
+}
+
+// Serialises a "070701" header into the 110 bytes at out. The name itself
+// follows the header and is not written here.
+inline void FormatCpioNewcHeader(const CpioNewcHeader &header, char *out) {
+  std::memcpy(out, "070701", 6);
+
+  auto write_field = [&](int offset, uint32_t value) {
+    char temp[9];
+    std::snprintf(temp, sizeof(temp), "%08X", value);
+    std::memcpy(out + offset, temp, 8);
+  };
+
+  write_field(6, header.ino);
+  write_field(14, header.mode);
+  write_field(22, header.uid);
+  write_field(30, header.gid);
+  write_field(38, header.nlink);
+  write_field(46, header.mtime);
+  write_field(54, header.filesize);
+  write_field(62, header.devmajor);
+  write_field(70, header.devminor);
+  write_field(78, header.rdevmajor);
+  write_field(86, header.rdevminor);
+  write_field(94, header.namesize);
+  write_field(102, header.check);
+}
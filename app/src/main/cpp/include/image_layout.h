@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Boot and vendor_boot images are a header followed by sections that each
+// start on a page boundary and are zero-padded up to the next one. The
+// planners below place every section from the sizes alone, so builders can
+// write sections in any order and unpackers find them without walking the
+// image.
+
+struct ImageSection {
+  uint64_t offset = 0;
+  uint64_t size = 0;
+};
+
+// Places sections one after another from start, each on a page boundary.
+// Empty sections take no space.
+class ImageLayout {
+ public:
+  explicit ImageLayout(uint64_t page_size, uint64_t start = 0)
+      : page_size_(page_size), size_(start) {}
+
+  ImageSection Add(uint64_t size);
+  // End of the last section's padding.
+  uint64_t size() const { return size_; }
+
+ private:
+  uint64_t page_size_;
+  uint64_t size_;
+};
+
+struct BootImageLayout {
+  ImageSection header;  // the whole header page
+  ImageSection kernel;
+  ImageSection ramdisk;
+  ImageSection second;  // v4 puts the boot signature here
+  ImageSection recovery_dtbo;
+  ImageSection dtb;
+  uint64_t size = 0;
+};
+
+// Sizes of sections header_version has no room for are ignored. From v3 the
+// header takes a 4096-byte page whatever page_size is.
+BootImageLayout PlanBootImage(uint32_t header_version, uint32_t page_size,
+                              uint64_t kernel_size, uint64_t ramdisk_size,
+                              uint64_t second_size, uint64_t recovery_dtbo_size,
+                              uint64_t dtb_size);
+
+struct VendorBootImageLayout {
+  ImageSection header;
+  ImageSection ramdisk;  // every ramdisk, back to back
+  ImageSection dtb;
+  ImageSection ramdisk_table;
+  ImageSection bootconfig;
+  uint64_t size = 0;
+};
+
+// The ramdisk table and bootconfig exist from v4.
+VendorBootImageLayout PlanVendorBootImage(uint32_t header_version,
+                                          uint32_t page_size,
+                                          uint32_t header_size,
+                                          uint64_t ramdisk_size,
+                                          uint64_t dtb_size,
+                                          uint64_t ramdisk_table_size,
+                                          uint64_t bootconfig_size);
+
+// Content of part of an image: data as is, or else the first size bytes of
+// the file at path.
+struct ImagePiece {
+  uint64_t offset = 0;
+  std::string data;
+  std::filesystem::path path;
+  uint64_t size = 0;
+};
+
+// The pieces of a planned image and its size.
+struct ImagePlan {
+  uint64_t size = 0;
+  std::vector<ImagePiece> pieces;
+};
+
+// Creates output at its final size, allocating the space up front, and
+// writes the pieces at their offsets concurrently on the scheduler. Gaps
+// between them read as zeroes. Files are copied in the kernel where the
+// filesystem allows, reporting progress to the current job. observe, if
+// set, sees every byte of the image in order, taken from the pieces
+// alongside the writes rather than read back. output is removed on failure.
+bool AssembleImage(
+    const std::filesystem::path &output, uint64_t size,
+    const std::vector<ImagePiece> &pieces,
+    const std::function<void(const uint8_t *, size_t)> &observe = {});
+// The same into out, a regular file the caller opened for writing. The image
+// starts at offset 0 and out is left for the caller to close.
+bool AssembleImage(
+    int out, uint64_t size, const std::vector<ImagePiece> &pieces,
+    const std::function<void(const uint8_t *, size_t)> &observe = {});
+
+// Writes one piece at its offset into out, a regular file open for writing,
+// as AssembleImage does for each. Builders use it to place sections as soon
+// as their offsets are known.
+bool WriteImagePiece(int out, const ImagePiece &piece);
+// Passes the image to observe in order, as AssembleImage's observe sees it,
+// reading only the pieces' sources.
+bool ObserveImage(
+    uint64_t size, const std::vector<ImagePiece> &pieces,
+    const std::function<void(const uint8_t *, size_t)> &observe);
+
+// Writes the image to out in one forward pass, for sinks that cannot seek
+// such as pipes: pieces go in offset order and the gaps as zeroes. observe,
+// if set, sees every byte of the image in order.
+bool StreamImage(
+    int out, uint64_t size, const std::vector<ImagePiece> &pieces,
+    const std::function<void(const uint8_t *, size_t)> &observe = {});
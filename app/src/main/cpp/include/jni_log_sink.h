@@ -0,0 +1,25 @@
+#pragma once
+
+#include <jni.h>
+
+#include "session.h"
+
+// Forwards console lines to DataHelper.updateConsoleText. Holds a global
+// reference to the class, so worker threads can log too; threads unknown to
+// the VM are attached on first use and detached when they exit. Jobs log
+// through an AsyncLogSink in front of it, so only its drain thread calls in.
+class JniLogSink : public LogSink {
+ public:
+  explicit JniLogSink(JNIEnv *env);
+  ~JniLogSink() override;
+
+  JniLogSink(const JniLogSink &) = delete;
+  JniLogSink &operator=(const JniLogSink &) = delete;
+
+  void Write(const char *line) override;
+
+ private:
+  JavaVM *vm_ = nullptr;
+  jclass data_helper_ = nullptr;
+  jmethodID update_console_text_ = nullptr;
+};
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "session.h"
+
+// Progress and cancellation of one running job. The job's thread reports
+// through the Job* helpers below; any thread may read progress or cancel.
+class Job {
+ public:
+  enum class State { Running, Succeeded, Failed, Cancelled };
+
+  struct Progress {
+    State state = State::Running;
+    std::string stage;
+    std::string detail;
+    uint64_t done = 0;   // bytes of the current stage
+    uint64_t total = 0;  // 0 when unknown
+    unsigned stages = 0;  // stages started so far
+  };
+
+  void Cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+  bool cancelled() const { return cancelled_.load(std::memory_order_relaxed); }
+
+  void BeginStage(const char *stage, std::string_view detail, uint64_t total);
+  void Advance(uint64_t bytes) {
+    done_.fetch_add(bytes, std::memory_order_relaxed);
+  }
+  void Finish(bool ok);
+
+  Progress progress() const;
+  std::string ProgressJson() const;
+
+ private:
+  std::atomic<bool> cancelled_{false};
+  std::atomic<uint64_t> done_{0};
+  std::atomic<uint64_t> total_{0};
+  mutable std::mutex mutex_;
+  State state_ = State::Running;
+  std::string stage_;
+  std::string detail_;
+  unsigned stages_ = 0;
+};
+
+// Stage-side helpers. They act on the job of the session bound to the
+// calling thread and are no-ops without one.
+Job *CurrentJob();
+bool JobCancelled();
+void JobStage(const char *stage, std::string_view detail, uint64_t total);
+void JobProgress(uint64_t bytes);
+
+// Background jobs, addressed by id. A job runs fn on its own thread under a
+// Session writing to sink at level, and is kept until ReleaseJob.
+using JobId = int64_t;
+
+JobId StartJob(std::unique_ptr<LogSink> sink, std::string_view level,
+               bool tracing, std::function<bool()> fn);
+// Progress of the job as JSON, or nullopt for an unknown id.
+std::optional<std::string> PollJob(JobId id);
+bool CancelJob(JobId id);
+// Forgets a finished job. Fails while it is still running.
+bool ReleaseJob(JobId id);
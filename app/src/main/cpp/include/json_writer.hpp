@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Minimal streaming JSON emitter for the structured results handed back to
+// Kotlin. Commas are tracked per nesting level.
+class JsonWriter {
+ public:
+  JsonWriter &BeginObject() { return Open('{'); }
+  JsonWriter &EndObject() { return Close('}'); }
+  JsonWriter &BeginArray() { return Open('['); }
+  JsonWriter &EndArray() { return Close(']'); }
+
+  JsonWriter &Key(std::string_view key) {
+    Separate();
+    AppendString(key);
+    out_ += ':';
+    after_key_ = true;
+    return *this;
+  }
+
+  JsonWriter &Value(std::string_view value) {
+    Separate();
+    AppendString(value);
+    return *this;
+  }
+  JsonWriter &Value(const char *value) { return Value(std::string_view(value)); }
+  JsonWriter &Value(const std::string &value) {
+    return Value(std::string_view(value));
+  }
+
+  JsonWriter &Value(uint64_t value) {
+    Separate();
+    out_ += std::to_string(value);
+    return *this;
+  }
+  JsonWriter &Value(uint32_t value) { return Value(static_cast<uint64_t>(value)); }
+  JsonWriter &Value(uint8_t value) { return Value(static_cast<uint64_t>(value)); }
+
+  JsonWriter &Value(double value) {
+    Separate();
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%.6g", value);
+    out_ += buffer;
+    return *this;
+  }
+
+  JsonWriter &Value(bool value) {
+    Separate();
+    out_ += value ? "true" : "false";
+    return *this;
+  }
+
+  template <typename T>
+  JsonWriter &Field(std::string_view key, const T &value) {
+    return Key(key).Value(value);
+  }
+
+  const std::string &str() const { return out_; }
+
+ private:
+  JsonWriter &Open(char c) {
+    Separate();
+    out_ += c;
+    first_.push_back(true);
+    return *this;
+  }
+
+  JsonWriter &Close(char c) {
+    out_ += c;
+    first_.pop_back();
+    return *this;
+  }
+
+  void Separate() {
+    if (after_key_) {
+      after_key_ = false;
+      return;
+    }
+    if (first_.empty()) return;
+    if (!first_.back()) out_ += ',';
+    first_.back() = false;
+  }
+
+  void AppendString(std::string_view s) {
+    out_ += '"';
+    for (unsigned char c : s) {
+      switch (c) {
+        case '"':
+          out_ += "\\\"";
+          break;
+        case '\\':
+          out_ += "\\\\";
+          break;
+        case '\n':
+          out_ += "\\n";
+          break;
+        case '\r':
+          out_ += "\\r";
+          break;
+        case '\t':
+          out_ += "\\t";
+          break;
+        default:
+          // Non-ASCII bytes are escaped too so the result is always valid
+          // modified UTF-8 for NewStringUTF.
+          if (c < 0x20 || c >= 0x80) {
+            char esc[7];
+            std::snprintf(esc, sizeof(esc), "\\u%04x", c);
+            out_ += esc;
+          } else {
+            out_ += static_cast<char>(c);
+          }
+      }
+    }
+    out_ += '"';
+  }
+
+  std::string out_;
+  std::vector<bool> first_;
+  bool after_key_ = false;
+};
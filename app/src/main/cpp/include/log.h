@@ -1,25 +1,30 @@
 #ifndef LOG_H
 #define LOG_H
 
-#include <jni.h>
-
 #include <cstdarg>
+#include <cstddef>
 #include <cstdio>
 #include <string>
+#include <string_view>
+
+// Longest console line including the terminator; longer lines are cut.
+constexpr size_t LOG_LINE_SIZE = 512;
 
-#define ADLOG(...) __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
+// Length of the longest prefix of text, at most max bytes, that does not end
+// inside a UTF-8 sequence. Lines are cut there, as the console decodes them
+// as UTF-8.
+size_t Utf8Prefix(std::string_view text, size_t max);
 
+// Formats a line for the console of the calling thread's Session. A null
+// level uses the session's own level.
 void logMessage(const char *level, const char *format, ...);
-void initializeJNIReferences(JNIEnv *env, const std::string_view &level);
-void releaseJNIReferences();
 
 constexpr std::string_view LEVEL_ERROR = "ERROR";
 constexpr std::string_view LEVEL_BUILD = "MAKE";
 constexpr std::string_view LEVEL_EXTRACT = "UNPACK";
 constexpr std::string_view LEVEL_INFO = "INFO";
-extern std::string CURRENT_LEVEL;
 
-#define LOGE(format, ...) logMessage(std::string(LEVEL_ERROR).c_str(), format, ##__VA_ARGS__)
-#define LOG(format, ...) logMessage(CURRENT_LEVEL.c_str(), format, ##__VA_ARGS__)
+#define LOGE(format, ...) logMessage(LEVEL_ERROR.data(), format, ##__VA_ARGS__)
+#define LOG(format, ...) logMessage(nullptr, format, ##__VA_ARGS__)
 
 #endif  // LOG_H
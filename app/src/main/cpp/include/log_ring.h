@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "log.h"
+#include "session.h"
+
+// Bounded multi-producer, single-consumer queue of fixed-size log records.
+// Producers claim a slot with one CAS and never block; when the ring is full
+// the record is refused. Slot sequence numbers hand each record from its
+// producer to the consumer (Vyukov's bounded queue).
+class LogRing {
+ public:
+  // capacity is rounded up to a power of two.
+  explicit LogRing(size_t capacity);
+
+  LogRing(const LogRing &) = delete;
+  LogRing &operator=(const LogRing &) = delete;
+
+  // Copies line, cut to at most LOG_LINE_SIZE - 1 bytes on a UTF-8 character
+  // boundary. False when full.
+  bool TryPush(std::string_view line);
+
+  // Hands every published record to f in order. Single consumer only.
+  template <typename F>
+  size_t Drain(F &&f) {
+    size_t drained = 0;
+    while (true) {
+      Slot &slot = slots_[tail_ & mask_];
+      if (slot.sequence.load(std::memory_order_acquire) != tail_ + 1) break;
+      f(std::string_view(slot.text, slot.length));
+      slot.sequence.store(tail_ + mask_ + 1, std::memory_order_release);
+      ++tail_;
+      ++drained;
+    }
+    return drained;
+  }
+
+ private:
+  struct Slot {
+    std::atomic<size_t> sequence;
+    uint32_t length;
+    char text[LOG_LINE_SIZE];
+  };
+
+  std::unique_ptr<Slot[]> slots_;
+  size_t mask_;
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) size_t tail_ = 0;
+};
+
+// Decouples logging threads from a slow sink. Write only enqueues into a
+// LogRing; a drain thread wakes every interval and hands the queued lines to
+// the downstream sink as one newline-joined batch. Lines that the filter,
+// the rate limit or a full ring drop are counted and reported in a summary
+// line; errors are never dropped.
+class AsyncLogSink : public LogSink {
+ public:
+  struct Options {
+    size_t capacity = 1024;
+    std::chrono::milliseconds interval{16};
+    // Forward [ERROR] lines only.
+    bool errors_only = false;
+    // Non-error lines delivered per second, 0 for unlimited.
+    unsigned max_lines_per_second = 500;
+  };
+
+  // downstream must outlive the sink. Pending lines are flushed on
+  // destruction.
+  AsyncLogSink(LogSink &downstream, Options options);
+  explicit AsyncLogSink(LogSink &downstream)
+      : AsyncLogSink(downstream, Options()) {}
+  ~AsyncLogSink() override;
+
+  AsyncLogSink(const AsyncLogSink &) = delete;
+  AsyncLogSink &operator=(const AsyncLogSink &) = delete;
+
+  void Write(const char *line) override;
+
+ private:
+  void Run();
+  // last also reports lines suppressed in the current window.
+  void DrainOnce(std::chrono::steady_clock::time_point now, bool last);
+
+  LogSink &downstream_;
+  Options options_;
+  LogRing ring_;
+  std::atomic<uint64_t> overflowed_{0};
+
+  // Drain thread state.
+  std::string batch_;
+  std::chrono::steady_clock::time_point window_start_;
+  unsigned window_lines_ = 0;
+  uint64_t suppressed_ = 0;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_ = false;
+  std::thread thread_;
+};
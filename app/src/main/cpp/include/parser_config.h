@@ -0,0 +1,33 @@
+#pragma once
+
+#include <filesystem>
+#include <optional>
+#include <variant>
+
+#include "../unpackbootimg/bootimg.h"
+#include "../unpackbootimg/vendorbootimg.h"
+
+// The image .parserconfig unpack leaves for build.
+//
+// Version 2 is laid out to be read in place from a mapping, little endian:
+//   header   "ABIKCFG\0", version, kind, field count, reserved, and the
+//            XXH64 of everything after the header
+//   fields   16 bytes each: record, id, type, reserved, size, and the
+//            offset of the value from the start of the data area
+//   data     the values, each 8 byte aligned
+// Record 0 is the image header; record n > 0 is vendor ramdisk table entry
+// n - 1. Readers skip ids they do not know and leave missing ones at their
+// defaults, so a new field is one line in the schema in ParserConfig.cc.
+//
+// Version 1 files, a field-by-field stream with the SHA1 of the content
+// appended, are still read.
+
+using ImageConfig = std::variant<BootImageInfo, VendorBootImageInfo>;
+
+bool WriteParserConfig(const BootImageInfo &info,
+                       const std::filesystem::path &path);
+bool WriteParserConfig(const VendorBootImageInfo &info,
+                       const std::filesystem::path &path);
+
+// Maps the file once, checks it and decodes whichever image it describes.
+std::optional<ImageConfig> ReadParserConfig(const std::filesystem::path &path);
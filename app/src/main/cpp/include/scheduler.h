@@ -0,0 +1,127 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class Session;
+
+// Order in which workers take queued tasks. Every task runs at the priority
+// of the session that submitted it.
+enum class TaskPriority : uint8_t { High, Normal, Low };
+constexpr size_t TASK_PRIORITIES = 3;
+
+// Process-wide pool of one worker per core that every job hands its parallel
+// work to, so concurrent jobs share the cores instead of each starting its
+// own threads. Each worker keeps a deque per priority, runs its own newest
+// task first and steals the oldest from the others when it runs dry.
+// Threads outside the pool submit through a shared queue.
+class Scheduler {
+ public:
+  struct Task;
+
+  static Scheduler &Shared();
+
+  explicit Scheduler(unsigned workers);
+  ~Scheduler();
+
+  Scheduler(const Scheduler &) = delete;
+  Scheduler &operator=(const Scheduler &) = delete;
+
+  unsigned workers() const { return static_cast<unsigned>(workers_.size()); }
+
+ private:
+  friend class TaskGroup;
+
+  struct Queue {
+    std::mutex mutex;
+    std::deque<std::shared_ptr<Task>> tasks[TASK_PRIORITIES];
+  };
+
+  static void Run(Task &task);
+  void Submit(std::shared_ptr<Task> task);
+  std::shared_ptr<Task> Take(size_t self);
+  void Work(size_t self);
+
+  std::vector<std::unique_ptr<Queue>> queues_;  // one per worker
+  Queue shared_;
+  std::atomic<size_t> queued_{0};
+  std::mutex sleep_mutex_;
+  std::condition_variable sleep_cv_;
+  bool stop_ = false;
+  std::vector<std::thread> workers_;
+};
+
+// Tasks waited on together. Each task runs with the submitting thread's
+// session bound. Wait runs the group's tasks no worker has started on the
+// calling thread, so a task may wait on a group of its own without tying up
+// the pool. Like a pooled buffer, a lock must not be held across Wait. A task
+// that throws is logged and counts as failed; it never escapes a worker.
+class TaskGroup {
+ public:
+  explicit TaskGroup(Scheduler &scheduler = Scheduler::Shared());
+  // Waits for the tasks still running.
+  ~TaskGroup();
+
+  TaskGroup(const TaskGroup &) = delete;
+  TaskGroup &operator=(const TaskGroup &) = delete;
+
+  // Any thread may add tasks, the group's own included; only the thread
+  // that owns the group waits on it.
+  void Run(std::function<void()> fn);
+  // Runs fn on the calling thread as one of the group's tasks, so that an
+  // exception from it fails the group instead of leaving before Wait.
+  void RunHere(const std::function<void()> &fn);
+  // Returns false if a task threw since the last Wait.
+  bool Wait();
+
+ private:
+  friend class Scheduler;
+
+  void Finished(bool ok);
+
+  Scheduler &scheduler_;
+  std::vector<std::shared_ptr<Scheduler::Task>> tasks_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  size_t pending_ = 0;
+  size_t next_ = 0;  // first of tasks_ Wait has not looked at
+  bool failed_ = false;
+};
+
+// Runs task(0) .. task(count - 1) on up to threads threads, the caller's
+// included, and returns whether all of them did. Once one fails or throws,
+// the ones not yet started are skipped.
+template <typename F>
+bool ParallelFor(size_t count, unsigned threads, F &&task) {
+  std::atomic<size_t> next{0};
+  std::atomic<bool> ok{true};
+  auto work = [&] {
+    try {
+      for (size_t i; ok.load(std::memory_order_relaxed) &&
+                     (i = next.fetch_add(1)) < count;) {
+        if (!task(i)) ok = false;
+      }
+    } catch (...) {
+      ok = false;
+      throw;
+    }
+  };
+  TaskGroup group;
+  for (size_t t = 1; t < std::min<size_t>(threads, count); ++t) {
+    group.Run(work);
+  }
+  group.RunHere(work);
+  return group.Wait() && ok;
+}
+
+// Threads the job on the calling thread may spread its work over.
+unsigned TaskThreads();
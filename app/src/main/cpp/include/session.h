@@ -0,0 +1,86 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+#include "scheduler.h"
+
+class Job;
+class Trace;
+
+// Destination for finished console lines: DataHelper on device, stderr for
+// the host CLI. Write may be called from any thread.
+class LogSink {
+ public:
+  virtual ~LogSink() = default;
+  virtual void Write(const char *line) = 0;
+};
+
+// Per-job state: where log lines go, the level they are tagged with and how
+// many scheduler workers the job may use at once. Jobs bind their session to the thread
+// running them, so concurrent jobs never share mutable state.
+class Session {
+ public:
+  // Top-level job. sink must outlive the session; null writes to stderr.
+  Session(LogSink *sink, std::string_view level);
+  // Job spawned by parent, e.g. one image of a batch. It shares the parent's
+  // sink and prefixes its lines with tag; parent must outlive it.
+  Session(const Session &parent, std::string tag, unsigned threads);
+
+  Session(const Session &) = delete;
+  Session &operator=(const Session &) = delete;
+
+  const std::string &level() const { return level_; }
+  const std::string &tag() const { return tag_; }
+  unsigned threads() const { return threads_; }
+
+  // Whether jobs record a trace of their stages; inherited by child
+  // sessions.
+  bool tracing() const { return tracing_; }
+  void set_tracing(bool tracing) { tracing_ = tracing; }
+  // Whether unpack also writes a seek index of the image's ramdisks;
+  // inherited by child sessions.
+  bool seek_index() const { return seek_index_; }
+  void set_seek_index(bool seek_index) { seek_index_ = seek_index; }
+  // Priority of the job's tasks on the shared scheduler; inherited by
+  // child sessions.
+  TaskPriority priority() const { return priority_; }
+  void set_priority(TaskPriority priority) { priority_ = priority; }
+  // Trace of the job running under this session, or nullptr. Not
+  // inherited: every job owns its trace.
+  Trace *trace() const { return trace_; }
+  void set_trace(Trace *trace) { trace_ = trace; }
+  // Progress and cancellation of the job, or nullptr. Inherited, so
+  // cancelling a batch cancels every image in it.
+  Job *job() const { return job_; }
+  void set_job(Job *job) { job_ = job; }
+
+  void Console(const char *message) const;
+
+  // Session bound to the calling thread, or nullptr.
+  static Session *Current();
+
+  // Binds a session to the calling thread for the lifetime of the scope.
+  class Scope {
+   public:
+    explicit Scope(Session &session);
+    ~Scope();
+
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+   private:
+    Session *previous_;
+  };
+
+ private:
+  LogSink *sink_;
+  std::string level_;
+  std::string tag_;
+  unsigned threads_ = 1;
+  bool tracing_ = false;
+  bool seek_index_ = false;
+  TaskPriority priority_ = TaskPriority::Normal;
+  Trace *trace_ = nullptr;
+  Job *job_ = nullptr;
+};
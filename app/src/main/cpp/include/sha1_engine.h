@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Block compression behind sha1::SHA1. The engine is picked once from what
+// the CPU reports: the ARMv8 Crypto Extensions on device, SHA-NI on x86
+// hosts, and a portable implementation everywhere else.
+namespace sha1 {
+
+enum class Engine { Portable, ShaNi, ArmCrypto };
+
+// Compresses blocks consecutive 64-byte blocks of data into state.
+void ProcessBlocks(uint32_t state[5], const uint8_t *data, size_t blocks);
+
+Engine ActiveEngine();
+const char *EngineName(Engine engine);
+
+// Forces an engine, e.g. to benchmark the portable one. Returns false and
+// changes nothing when the CPU does not support it.
+bool UseEngine(Engine engine);
+
+}  // namespace sha1
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Steps of a job with dependencies between them, run on the shared
+// scheduler. Each step starts once the ones it depends on have succeeded,
+// on up to TaskThreads() threads; among the ready steps, the one heading the
+// longest remaining chain of estimated cost goes first, so the chain that
+// bounds the wall time never waits behind short side work. Steps run
+// concurrently and so must not start job stages of their own, except one no
+// other step can overlap.
+class TaskGraph {
+ public:
+  using Node = size_t;
+
+  // Adds a step that runs fn after every one of deps, which must already be
+  // in the graph. cost is the work it is expected to take, in any unit as
+  // long as the graph uses one.
+  Node Add(std::string name, uint64_t cost, std::function<bool()> fn,
+           std::vector<Node> deps = {});
+
+  // Runs every step and returns whether all of them succeeded. Once one
+  // fails or the job is cancelled, steps not yet started are skipped.
+  bool Run();
+
+  // The chain of steps that ended last in the previous run, each started by
+  // the one before finishing, whether it was the last dependency or held
+  // the thread it waited for, with how long each took, e.g.
+  // "cpio ramdisk 0.41s > compress ramdisk 2.10s (2.51s of 2.53s)".
+  std::string CriticalPath() const;
+
+ private:
+  static constexpr Node NONE = static_cast<Node>(-1);
+
+  struct Step {
+    std::string name;
+    uint64_t cost;
+    std::function<bool()> fn;
+    std::vector<Node> deps;
+    std::vector<Node> next;
+    uint64_t rank = 0;  // cost of the longest chain this step starts
+    Node gate = NONE;   // the step whose end started this one
+    bool done = false;
+    double start = 0;  // seconds since Run began
+    double end = 0;
+  };
+
+  std::vector<Step> steps_;
+  double elapsed_ = 0;
+};
@@ -1,6 +1,10 @@
 #pragma once
 
+#include <sys/types.h>
+
+#include <cstdint>
 #include <filesystem>
+#include <map>
 #include <string>
 
 #include "log.h"
@@ -17,9 +21,47 @@ namespace fs = std::filesystem;
 inline uint32_t GetNumberOfPages(uint32_t image_size, uint32_t page_size) {
   return (image_size + page_size - 1) / page_size;
 }
+inline uint32_t LoadU32(const uint8_t* src) {
+  return static_cast<uint32_t>(src[0]) | (static_cast<uint32_t>(src[1]) << 8) |
+         (static_cast<uint32_t>(src[2]) << 16) |
+         (static_cast<uint32_t>(src[3]) << 24);
+}
+
+inline uint64_t LoadU64(const uint8_t* src) {
+  return static_cast<uint64_t>(LoadU32(src)) |
+         (static_cast<uint64_t>(LoadU32(src + 4)) << 32);
+}
+
+inline void StoreU32(uint8_t* dst, uint32_t value) {
+  dst[0] = static_cast<uint8_t>(value & 0xFF);
+  dst[1] = static_cast<uint8_t>((value >> 8) & 0xFF);
+  dst[2] = static_cast<uint8_t>((value >> 16) & 0xFF);
+  dst[3] = static_cast<uint8_t>((value >> 24) & 0xFF);
+}
+
+inline void StoreU64(uint8_t* dst, uint64_t value) {
+  StoreU32(dst, static_cast<uint32_t>(value));
+  StoreU32(dst + 4, static_cast<uint32_t>(value >> 32));
+}
+
 fs::path get_unique_path(const fs::path& output_dir);
+bool ReadFullyAt(int fd, void* buf, size_t size, off_t offset);
+bool WriteFullyAt(int fd, const void* buf, size_t size, off_t offset);
+// Sequential counterparts for pipes and other descriptors without offsets.
+bool WriteFully(int fd, const void* buf, size_t size);
+bool WriteZeros(int fd, uint64_t size);
+// Whether fd can be read or written at arbitrary offsets; pipes, sockets and
+// ttys cannot.
+bool IsSeekable(int fd);
+// Copies all of in into the empty file out, sharing extents where the
+// filesystem can.
+bool CloneFile(int in, int out);
 bool isCpioNewcHeader(const uint8_t* data, size_t size);
 bool isGzipHeader(const uint8_t* data, size_t size);
 bool isLz4LegacyHeader(const uint8_t* data, size_t size);
 bool isLzmaHeader(const uint8_t* data, size_t size);
 uint8_t getHeaderFormat(const uint8_t* data, size_t size);
+std::string_view getFormatName(uint8_t format);
+// Splits a .parserconfig line into its key="value" / key=value pairs.
+bool ParseConfigLine(const std::string& line,
+                     std::map<std::string, std::string>& entry);
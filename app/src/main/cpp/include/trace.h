@@ -0,0 +1,60 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Spans recorded while one job runs, exported as Chrome/Perfetto trace JSON.
+// Record may be called from any thread.
+class Trace {
+ public:
+  struct Event {
+    const char *name;
+    std::string detail;
+    uint64_t start_us;
+    uint64_t duration_us;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint32_t tid;
+  };
+
+  Trace();
+
+  std::chrono::steady_clock::time_point epoch() const { return epoch_; }
+  void Record(Event event);
+  bool WriteChromeJson(const std::filesystem::path &path) const;
+
+ private:
+  std::chrono::steady_clock::time_point epoch_;
+  mutable std::mutex mutex_;
+  std::vector<Event> events_;
+};
+
+// Times the enclosing scope into the trace of the session bound to the
+// calling thread. Without one the span is inert: no clock reads, no copies
+// and no file stats.
+class TraceSpan {
+ public:
+  explicit TraceSpan(const char *name, std::string_view detail = {});
+  ~TraceSpan();
+
+  TraceSpan(const TraceSpan &) = delete;
+  TraceSpan &operator=(const TraceSpan &) = delete;
+
+  void SetBytes(uint64_t in, uint64_t out);
+  // Takes the byte counts from file sizes, only when the span is live.
+  void SetInput(const std::filesystem::path &path);
+  void SetOutput(const std::filesystem::path &path);
+
+ private:
+  Trace *trace_;
+  const char *name_;
+  std::string detail_;
+  std::chrono::steady_clock::time_point start_;
+  uint64_t bytes_in_ = 0;
+  uint64_t bytes_out_ = 0;
+};
@@ -3,63 +3,9 @@
 #include "log.h"
 #include "config.h"
 
+// Reader for version 1 .parserconfig files; see parser_config.h.
 class VendorBootConfig {
  public:
-  static bool Write(const VendorBootImageInfo& info,
-                    const std::string& filename) {
-    std::ofstream file(filename, std::ios::binary);
-    if (!file.is_open()) {
-      LOGE("Failed to open config for writing");
-      return false;
-    }
-
-    WriteString(file, info.boot_magic);
-    WriteU32(file, info.header_version);
-    WriteU32(file, info.page_size);
-    WriteU32(file, info.kernel_load_address);
-    WriteU32(file, info.ramdisk_load_address);
-    WriteU32(file, info.vendor_ramdisk_size);
-    WriteString(file, info.cmdline);
-    WriteU32(file, info.tags_load_address);
-    WriteString(file, info.product_name);
-    WriteU32(file, info.header_size);
-    WriteU32(file, info.dtb_size);
-    WriteU64(file, info.dtb_load_address);
-    WriteU8(file, info.ramdisk_compression);
-
-    // Version >3 fields
-    WriteU32(file, info.vendor_ramdisk_table_size);
-    WriteU32(file, info.vendor_ramdisk_table_entry_num);
-    WriteU32(file, info.vendor_ramdisk_table_entry_size);
-    WriteU32(file, info.vendor_bootconfig_size);
-
-    // Validate entry count matches vector size
-    if (info.vendor_ramdisk_table.size() !=
-        info.vendor_ramdisk_table_entry_num) {
-      LOGE("Mismatch between vendor_ramdisk_table size and entry_num");
-      return false;
-    }
-
-    // Write each ramdisk table entry
-    for (const auto& entry : info.vendor_ramdisk_table) {
-      WriteString(file, entry.output_name);
-      WriteU32(file, entry.size);
-      WriteU32(file, entry.offset);
-      WriteU32(file, entry.type);
-      WriteString(file, entry.name);
-      for (uint32_t id : entry.board_id) {
-        WriteU32(file, id);
-      }
-      WriteU8(file, entry.ramdisk_compression);
-    }
-
-    if (!file.good()) {
-      LOGE("Error occurred while writing configuration");
-      return false;
-    }
-    return true;
-  }
-
   static bool Read(VendorBootImageInfo& info, const std::string& filename) {
     std::ifstream file(filename, std::ios::binary);
     if (!file.is_open()) {
@@ -112,33 +58,6 @@ class VendorBootConfig {
   }
 
  private:
-  static void WriteU8(std::ostream& os, uint8_t value) {
-    os.write(reinterpret_cast<const char*>(&value), sizeof(value));
-  }
-
-  static void WriteU16(std::ostream& os, uint16_t value) {
-      os.write(reinterpret_cast<const char*>(&value), sizeof(value));
-  }
-
-  static void WriteU32(std::ostream& os, uint32_t value) {
-    os.write(reinterpret_cast<const char*>(&value), sizeof(value));
-  }
-
-  static void WriteU64(std::ostream& os, uint64_t value) {
-    os.write(reinterpret_cast<const char*>(&value), sizeof(value));
-  }
-
-  template <typename T, typename = std::enable_if_t<std::is_trivially_copyable_v<T>>>
-  static void WriteUnsignedAny(std::ostream& os, T& value) {
-    os.write(reinterpret_cast<const char*>(&value), sizeof(T));
-  }
-
-  static void WriteString(std::ostream& os, const std::string& s) {
-    auto size = static_cast<string_size>(s.size());
-    WriteUnsignedAny(os, size);
-    os.write(s.data(), static_cast<std::streamsize>(size));
-  }
-
   static void ReadU8(std::istream& is, uint8_t& value) {
     is.read(reinterpret_cast<char*>(&value), sizeof(value));
   }
@@ -1,11 +1,12 @@
 #include "bootimg.h"
 
+#include <algorithm>
 #include <array>
-#include <format>
-#include <fstream>
-#include <regex>
+#include <sstream>
 
 #include "TinySHA1.hpp"
+#include "buffer_pool.h"
+#include "image_layout.h"
 #include "utils.h"
 
 namespace {
@@ -19,6 +20,33 @@ constexpr uint32_t BOOT_NAME_SIZE = 16;
 constexpr uint32_t BOOT_ARGS_SIZE = 512;
 constexpr uint32_t BOOT_EXTRA_ARGS_SIZE = 1024;
 constexpr uint32_t BOOT_IMAGE_HEADER_V3_PAGESIZE = 4096;
+constexpr uint32_t BOOT_ID_SIZE = 32;
+
+// Header field offsets, v0-v2.
+constexpr uint32_t BOOT_KERNEL_SIZE_OFFSET = BOOT_MAGIC_SIZE;
+constexpr uint32_t BOOT_RAMDISK_SIZE_OFFSET = BOOT_MAGIC_SIZE + 8;
+constexpr uint32_t BOOT_SECOND_SIZE_OFFSET = BOOT_MAGIC_SIZE + 16;
+constexpr uint32_t BOOT_PAGE_SIZE_OFFSET = BOOT_MAGIC_SIZE + 28;
+constexpr uint32_t BOOT_HEADER_VERSION_OFFSET = BOOT_MAGIC_SIZE + 32;
+constexpr uint32_t BOOT_OS_VERSION_OFFSET = BOOT_MAGIC_SIZE + 36;
+constexpr uint32_t BOOT_NAME_OFFSET = BOOT_OS_VERSION_OFFSET + 4;
+constexpr uint32_t BOOT_ARGS_OFFSET = BOOT_NAME_OFFSET + BOOT_NAME_SIZE;
+constexpr uint32_t BOOT_ID_OFFSET = BOOT_ARGS_OFFSET + BOOT_ARGS_SIZE;
+constexpr uint32_t BOOT_EXTRA_ARGS_OFFSET = BOOT_ID_OFFSET + BOOT_ID_SIZE;
+constexpr uint32_t BOOT_RECOVERY_DTBO_SIZE_OFFSET =
+    BOOT_EXTRA_ARGS_OFFSET + BOOT_EXTRA_ARGS_SIZE;
+constexpr uint32_t BOOT_RECOVERY_DTBO_OFFSET_OFFSET =
+    BOOT_RECOVERY_DTBO_SIZE_OFFSET + 4;
+constexpr uint32_t BOOT_DTB_SIZE_OFFSET = BOOT_IMAGE_HEADER_V1_SIZE;
+static_assert(BOOT_RECOVERY_DTBO_OFFSET_OFFSET + 12 ==
+              BOOT_IMAGE_HEADER_V1_SIZE);
+static_assert(BOOT_DTB_SIZE_OFFSET + 12 == BOOT_IMAGE_HEADER_V2_SIZE);
+
+// Header field offsets, v3+.
+constexpr uint32_t BOOT_V3_OS_VERSION_OFFSET = BOOT_MAGIC_SIZE + 8;
+constexpr uint32_t BOOT_V3_ARGS_OFFSET = BOOT_MAGIC_SIZE + 36;
+static_assert(BOOT_V3_ARGS_OFFSET + BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE ==
+              BOOT_IMAGE_HEADER_V3_SIZE);
 
 bool WriteHeaderV3Plus(std::ostream &out, const BootImageArgs &args) {
   const uint32_t header_size = args.header_version > 3
@@ -104,10 +132,20 @@ bool WriteLegacyHeader(std::ostream &out, const BootImageArgs &args) {
   auto update_sha = [&](const std::filesystem::path &path) {
     if (!path.empty()) {
       if (auto file = utils::OpenFile(path)) {
-        auto data = utils::ReadFileContents(*file);
-        sha.processBytes(data.data(), data.size());
-
-        uint32_t size = static_cast<uint32_t>(data.size());
+        auto buffer = BufferPool::Shared().Acquire();
+        size_t hashed = 0;
+        while (hashed < file->size) {
+          const size_t length = std::min(file->size - hashed, buffer.size());
+          if (!file->stream->read(buffer.data(),
+                                  static_cast<std::streamsize>(length))) {
+            LOGE("Failed to read stream");
+            break;
+          }
+          sha.processBytes(buffer.data(), length);
+          hashed += length;
+        }
+
+        uint32_t size = static_cast<uint32_t>(hashed);
         std::array<uint8_t, 4> size_bytes{
             static_cast<uint8_t>(size & 0xFF),
             static_cast<uint8_t>((size >> 8) & 0xFF),
@@ -146,17 +184,11 @@ bool WriteLegacyHeader(std::ostream &out, const BootImageArgs &args) {
   if (args.header_version > 0) {
     utils::WriteU32(out, utils::GetFileSize(recovery_dtbo));
     if (recovery_dtbo) {
-      uint32_t num_header_pages = 1;
-      uint32_t num_kernel_pages =
-          GetNumberOfPages(utils::GetFileSize(kernel), args.page_size);
-      uint32_t num_ramdisk_pages =
-          GetNumberOfPages(utils::GetFileSize(ramdisk), args.page_size);
-      uint32_t num_second_pages =
-          GetNumberOfPages(utils::GetFileSize(second), args.page_size);
-      uint64_t dtbo_offset =
-          args.page_size * (num_header_pages + num_kernel_pages +
-                            num_ramdisk_pages + num_second_pages);
-      utils::WriteU64(out, dtbo_offset);
+      const auto layout = PlanBootImage(
+          args.header_version, args.page_size, utils::GetFileSize(kernel),
+          utils::GetFileSize(ramdisk), utils::GetFileSize(second),
+          utils::GetFileSize(recovery_dtbo), utils::GetFileSize(dtb));
+      utils::WriteU64(out, layout.recovery_dtbo.offset);
     } else {
       utils::WriteU64(out, 0);
     }
@@ -179,47 +211,216 @@ bool WriteLegacyHeader(std::ostream &out, const BootImageArgs &args) {
   utils::PadFile(out, args.page_size);
   return true;
 }
+
 }  // namespace
 
-bool WriteBootImage(const BootImageArgs &args) {
-  std::ofstream out(args.output, std::ios::binary);
-  if (!out) {
-    LOGE("Failed to open %s for writing",
-         fs::path(args.output).filename().c_str());
-    return false;
+std::optional<ImagePlan> BootImageSections(const BootImageArgs &args) {
+  if (args.page_size == 0) {
+    LOGE("Invalid page size");
+    return std::nullopt;
   }
+  const auto layout = PlanBootImage(
+      args.header_version, args.page_size, utils::GetFileSize(args.kernel),
+      utils::GetFileSize(args.ramdisk), utils::GetFileSize(args.second),
+      utils::GetFileSize(args.recovery_dtbo), utils::GetFileSize(args.dtb));
+  ImagePlan plan;
+  plan.size = layout.size;
+  auto add_section = [&](const fs::path &path, const ImageSection &section) {
+    if (!path.empty()) {
+      plan.pieces.push_back({section.offset, {}, path, section.size});
+    }
+  };
+  add_section(args.kernel, layout.kernel);
+  add_section(args.ramdisk, layout.ramdisk);
+  if (args.header_version < 3) {
+    add_section(args.second, layout.second);
+  }
+  if (args.header_version > 0 && args.header_version < 3) {
+    add_section(args.recovery_dtbo, layout.recovery_dtbo);
+  }
+  if (args.header_version == 2) {
+    add_section(args.dtb, layout.dtb);
+  }
+  return plan;
+}
 
-  LOG("Building to: %s", fs::path(args.output).filename().c_str());
-
+std::optional<ImagePiece> BootImageHeader(const BootImageArgs &args) {
+  std::ostringstream header;
   if (args.header_version >= 3) {
-    if (!WriteHeaderV3Plus(out, args)) return false;
+    if (!WriteHeaderV3Plus(header, args)) return std::nullopt;
   } else {
-    if (!WriteLegacyHeader(out, args)) return false;
+    if (!WriteLegacyHeader(header, args)) return std::nullopt;
   }
+  return ImagePiece{0, header.str(), {}, 0};
+}
 
-  // Write kernel/ramdisk/second data
-  auto write_section = [&](const auto &path) {
-    if (!path.empty()) {
-      auto file = utils::OpenFile(path);
-      if (!file) return false;
-      auto data = utils::ReadFileContents(*file);
-      out.write(reinterpret_cast<const char *>(data.data()), data.size());
-      utils::PadFile(out, args.page_size);
-    }
-    return true;
-  };
+bool WriteBootImage(const BootImageArgs &args) {
+  LOG("Building to: %s",
+      utils::OutputName(args.output, args.output_fd, args.output_name)
+          .c_str());
+  auto plan = BootImageSections(args);
+  if (!plan) return false;
+  auto header = BootImageHeader(args);
+  if (!header) return false;
+  plan->pieces.push_back(std::move(*header));
+  return utils::WriteImage(args.output, args.output_fd, plan->size,
+                           plan->pieces, args.avb);
+}
 
-  if (!write_section(args.kernel)) return false;
-  if (!write_section(args.ramdisk)) return false;
-  if (!write_section(args.second)) return false;
+namespace {
+uint32_t PatchOsVersion(uint32_t current, const BootImagePatch &patch) {
+  utils::OSVersion os_version;
+  os_version.version_str = patch.os_version.value_or("");
+  os_version.patch_level_str = patch.os_patch_level.value_or("");
+  utils::OSVersion::Parse(os_version);
 
-  if (args.header_version > 0 && args.header_version < 3) {
-    if (!write_section(args.recovery_dtbo)) return false;
+  const uint32_t version = patch.os_version ? os_version.version : current >> 11;
+  const uint32_t patch_level =
+      patch.os_patch_level ? os_version.patch_level : current & 0x7FF;
+  return (version << 11) | patch_level;
+}
+
+// Same digest as WriteLegacyHeader, but fed from the sections already laid
+// out in the image instead of the input files.
+bool ComputeLegacyId(int fd, const uint8_t *header, uint8_t *id) {
+  const uint32_t page_size = LoadU32(header + BOOT_PAGE_SIZE_OFFSET);
+  const uint32_t header_version = LoadU32(header + BOOT_HEADER_VERSION_OFFSET);
+  const uint32_t kernel_size = LoadU32(header + BOOT_KERNEL_SIZE_OFFSET);
+  const uint32_t ramdisk_size = LoadU32(header + BOOT_RAMDISK_SIZE_OFFSET);
+  const uint32_t second_size = LoadU32(header + BOOT_SECOND_SIZE_OFFSET);
+  if (page_size == 0) return false;
+
+  const uint32_t dtbo_size =
+      header_version > 0 ? LoadU32(header + BOOT_RECOVERY_DTBO_SIZE_OFFSET) : 0;
+  const uint32_t dtb_size =
+      header_version > 1 ? LoadU32(header + BOOT_DTB_SIZE_OFFSET) : 0;
+  const auto layout = PlanBootImage(header_version, page_size, kernel_size,
+                                    ramdisk_size, second_size, dtbo_size,
+                                    dtb_size);
+  std::vector<ImageSection> sections{layout.kernel, layout.ramdisk,
+                                     layout.second};
+  if (header_version > 0) {
+    sections.push_back(
+        {LoadU64(header + BOOT_RECOVERY_DTBO_OFFSET_OFFSET), dtbo_size});
   }
+  if (header_version > 1) sections.push_back(layout.dtb);
 
-  if (args.header_version == 2) {
-    if (!write_section(args.dtb)) return false;
+  sha1::SHA1 sha;
+  std::vector<uint8_t> buffer(1 << 20);
+  for (const auto &section : sections) {
+    uint64_t done = 0;
+    while (done < section.size) {
+      const size_t chunk =
+          std::min<uint64_t>(buffer.size(), section.size - done);
+      if (!ReadFullyAt(fd, buffer.data(), chunk,
+                       static_cast<off_t>(section.offset + done))) {
+        return false;
+      }
+      sha.processBytes(buffer.data(), chunk);
+      done += chunk;
+    }
+    uint8_t size_bytes[4];
+    StoreU32(size_bytes, static_cast<uint32_t>(section.size));
+    sha.processBytes(size_bytes, sizeof(size_bytes));
   }
 
+  uint32_t digest[5];
+  sha.getDigest(digest);
+  std::fill_n(id, BOOT_ID_SIZE, 0);
+  for (size_t i = 0; i < 5; ++i) {
+    const std::string word = utils::UToS(digest[i]);
+    std::copy(word.begin(), word.end(), id + i * 4);
+  }
   return true;
 }
+
+bool PatchHeader(int fd, const BootImagePatch &patch) {
+  std::array<uint8_t, BOOT_IMAGE_HEADER_V2_SIZE> header{};
+  if (!ReadFullyAt(fd, header.data(), BOOT_IMAGE_HEADER_V3_SIZE, 0) ||
+      std::string_view(reinterpret_cast<const char *>(header.data()),
+                       BOOT_MAGIC_SIZE) != BOOT_MAGIC) {
+    LOGE("Not a boot image");
+    return false;
+  }
+
+  const uint32_t header_version = LoadU32(header.data() + BOOT_HEADER_VERSION_OFFSET);
+  if (header_version > 1024) {
+    LOGE("Legacy boot images are not supported!!!");
+    return false;
+  }
+
+  if (header_version >= 3) {
+    const uint32_t header_size = header_version > 3
+                                     ? BOOT_IMAGE_HEADER_V4_SIZE
+                                     : BOOT_IMAGE_HEADER_V3_SIZE;
+    if (patch.board) {
+      LOGE("Header version %d has no board field", header_version);
+      return false;
+    }
+    if (patch.cmdline) {
+      if (patch.cmdline->size() >= BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE) {
+        LOGE("Cmdline is too long");
+        return false;
+      }
+      utils::PatchString(header.data() + BOOT_V3_ARGS_OFFSET,
+                         BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE, *patch.cmdline);
+    }
+    if (patch.os_version || patch.os_patch_level) {
+      uint8_t *field = header.data() + BOOT_V3_OS_VERSION_OFFSET;
+      StoreU32(field, PatchOsVersion(LoadU32(field), patch));
+    }
+    return WriteFullyAt(fd, header.data(), header_size, 0);
+  }
+
+  const uint32_t header_size = header_version == 2   ? BOOT_IMAGE_HEADER_V2_SIZE
+                               : header_version == 1 ? BOOT_IMAGE_HEADER_V1_SIZE
+                                                     : BOOT_RECOVERY_DTBO_SIZE_OFFSET;
+  if (header_size > BOOT_IMAGE_HEADER_V3_SIZE &&
+      !ReadFullyAt(fd, header.data() + BOOT_IMAGE_HEADER_V3_SIZE,
+                   header_size - BOOT_IMAGE_HEADER_V3_SIZE,
+                   BOOT_IMAGE_HEADER_V3_SIZE)) {
+    LOGE("Truncated boot image header");
+    return false;
+  }
+
+  if (patch.board) {
+    if (patch.board->size() >= BOOT_NAME_SIZE) {
+      LOGE("Board name is too long");
+      return false;
+    }
+    utils::PatchString(header.data() + BOOT_NAME_OFFSET, BOOT_NAME_SIZE,
+                       *patch.board);
+  }
+  if (patch.cmdline) {
+    // Split like mkbootimg: the first BOOT_ARGS_SIZE - 1 bytes go to cmdline,
+    // the remainder to extra_cmdline.
+    const std::string &cmdline = *patch.cmdline;
+    if (cmdline.size() >= BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE - 1) {
+      LOGE("Cmdline is too long");
+      return false;
+    }
+    const size_t split = std::min<size_t>(cmdline.size(), BOOT_ARGS_SIZE - 1);
+    utils::PatchString(header.data() + BOOT_ARGS_OFFSET, BOOT_ARGS_SIZE,
+                       cmdline.substr(0, split));
+    utils::PatchString(header.data() + BOOT_EXTRA_ARGS_OFFSET,
+                       BOOT_EXTRA_ARGS_SIZE, cmdline.substr(split));
+  }
+  if (patch.os_version || patch.os_patch_level) {
+    uint8_t *field = header.data() + BOOT_OS_VERSION_OFFSET;
+    StoreU32(field, PatchOsVersion(LoadU32(field), patch));
+  }
+
+  if (!ComputeLegacyId(fd, header.data(), header.data() + BOOT_ID_OFFSET)) {
+    LOGE("Failed to compute boot image id");
+    return false;
+  }
+  return WriteFullyAt(fd, header.data(), header_size, 0);
+}
+}  // namespace
+
+bool PatchBootImage(int fd, const BootImagePatch &patch) {
+  // Header patches leave the image size alone.
+  auto footer = utils::ReadPatchFooter(fd, patch.avb_key);
+  return footer && PatchHeader(fd, patch) &&
+         utils::RebuildPatchFooter(fd, *footer, footer->image_size);
+}
@@ -7,6 +7,7 @@
 #include <string>
 #include <vector>
 
+#include "avb/footer.h"
 #include "utils.h"
 
 struct BootImageArgs {
@@ -27,8 +28,29 @@ struct BootImageArgs {
   uint32_t page_size = 2048;
   uint32_t header_version = 4;
   std::filesystem::path output;
+  int output_fd = -1;  // written instead of output when set
+  std::string output_name;  // what the log calls output_fd, if known
+  std::optional<avb::HashFooterArgs> avb;
   // bool print_id = false;
 };
 
+// Header fields to rewrite in place; unset fields keep their current value.
+struct BootImagePatch {
+  std::optional<std::string> cmdline;
+  std::optional<std::string> os_version;
+  std::optional<std::string> os_patch_level;
+  std::optional<std::string> board;
+  std::filesystem::path avb_key;  // re-signs a signed AVB footer
+};
+
 // std::optional<BootImageArgs> ParseArguments(int argc, char* argv[]);
 bool WriteBootImage(const BootImageArgs &args);
+// The file sections of the image args describes, placed from the sizes its
+// inputs have now. A section's offset only depends on the inputs ahead of
+// it, so it is final once those are, whatever the later ones become.
+std::optional<ImagePlan> BootImageSections(const BootImageArgs &args);
+// The header page, from the inputs as they are now; they must be final.
+std::optional<ImagePiece> BootImageHeader(const BootImageArgs &args);
+// Patches the header of the image in fd, which must be a regular file open
+// for reading and writing, in place.
+bool PatchBootImage(int fd, const BootImagePatch &patch);
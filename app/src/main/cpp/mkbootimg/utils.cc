@@ -1,10 +1,19 @@
 #include "utils.h"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
 #include <fstream>
+#include <functional>
 #include <iomanip>
-#include <regex>
+#include <string_view>
 #include <system_error>
 
+#include "log.h"
+
 namespace utils {
 
 void WriteS32(std::ostream &stream, const std::string &value) {
@@ -49,15 +58,6 @@ std::optional<FileWrapper> OpenFile(const std::filesystem::path &path) {
   return FileWrapper{std::move(file), size};
 }
 
-std::vector<uint8_t> ReadFileContents(FileWrapper &file) {
-  std::vector<uint8_t> buffer(file.size);
-  if (!file.stream->read(reinterpret_cast<char *>(buffer.data()), file.size)) {
-    LOGE("Failed to read stream");
-    return {};
-  }
-  return buffer;
-}
-
 size_t GetFileSize(FileWrapper &file) { return file.size; }
 size_t GetFileSize(std::optional<FileWrapper> &file) {
   if (file) return GetFileSize(*file);
@@ -86,47 +86,190 @@ std::optional<std::vector<char>> AsciizString::operator()(
   return result;
 }
 
-uint32_t ParseOSPatchLevel(const std::string &s) {
-  std::regex patch_re(R"(^(\d{4})-(\d{2})(?:-(\d{2}))?)");
-  std::smatch match;
-  if (std::regex_search(s, match, patch_re)) {
-    try {
-      int year = std::stoi(match[1]);
-      int month = std::stoi(match[2]);
+void PatchString(uint8_t *field, size_t field_size, const std::string &value) {
+  std::fill_n(field, field_size, 0);
+  std::copy_n(value.begin(), std::min(value.size(), field_size - 1), field);
+}
 
-      int y = year - 2000;
-      if (y < 0 || y >= 128) {
-        return 0;
-      }
+// pwrite ignores offsets on O_APPEND descriptors.
+bool AcceptsPositionedWrites(int fd) {
+  struct stat st {};
+  const int flags = fcntl(fd, F_GETFL);
+  return fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && flags >= 0 &&
+         (flags & O_APPEND) == 0;
+}
 
-      int m = month;
-      if (m < 1 || m > 12) {
-        return 0;
-      }
+std::string OutputName(const std::filesystem::path &output, int output_fd,
+                       const std::string &output_name) {
+  if (output_fd < 0) return output.filename().string();
+  if (!output_name.empty()) return output_name;
+  if (output_fd == STDOUT_FILENO) return "stdout";
+  struct stat st {};
+  if (fstat(output_fd, &st) != 0 || !S_ISREG(st.st_mode)) return "pipe";
+  std::error_code ec;
+  const auto target = std::filesystem::read_symlink(
+      "/proc/self/fd/" + std::to_string(output_fd), ec);
+  return ec ? "file" : target.filename().string();
+}
 
-      return (static_cast<uint32_t>(y) << 4) | static_cast<uint32_t>(m);
-    } catch (...) {
+bool WriteImage(const std::filesystem::path &output, int output_fd,
+                uint64_t size, const std::vector<ImagePiece> &pieces,
+                const std::optional<avb::HashFooterArgs> &avb) {
+  // The footer digest is taken from the pieces as they are placed, so the
+  // image is never read back.
+  std::optional<avb::HashFooterStream> footer;
+  if (avb) footer.emplace(*avb);
+  std::function<void(const uint8_t *, size_t)> observe;
+  if (footer) {
+    observe = [&](const uint8_t *data, size_t length) {
+      footer->Update(data, length);
+    };
+  }
+  if (output_fd < 0) {
+    if (!AssembleImage(output, size, pieces, observe)) return false;
+    if (!footer) return true;
+    int fd = open(output.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+      LOGE("Error opening %s", output.filename().c_str());
+      return false;
     }
+    bool ok = footer->FinishAt(fd, size);
+    if (close(fd) != 0) ok = false;
+    return ok;
   }
-  return 0;
+  if (AcceptsPositionedWrites(output_fd)) {
+    return AssembleImage(output_fd, size, pieces, observe) &&
+           (!footer || footer->FinishAt(output_fd, size));
+  }
+
+  LOG("Output is not seekable; writing the image in one pass");
+  if (!StreamImage(output_fd, size, pieces, observe)) {
+    LOGE("Error writing the image");
+    return false;
+  }
+  return !footer || footer->Finish(output_fd, size);
 }
 
-void OSVersion::Parse(OSVersion &version) {
-  std::regex version_re(R"((\d{1,3})(?:\.(\d{1,3})(?:\.(\d{1,3}))?)?)");
-  std::smatch match;
-  version.version = 0;
-  version.patch_level = ParseOSPatchLevel(version.patch_level_str);
-  if (std::regex_search(version.version_str, match, version_re)) {
-    try {
-      uint32_t a = std::stoi(match[1]);
-      uint32_t b = match[2].matched ? std::stoi(match[2]) : 0;
-      uint32_t c = match[3].matched ? std::stoi(match[3]) : 0;
-
-      if (a < 128 && b < 128 && c < 128)
-        version.version = (a << 14) | (b << 7) | c;
-    } catch (...) {
+bool FinishImage(int fd, uint64_t size, const std::vector<ImagePiece> &pieces,
+                 const std::optional<avb::HashFooterArgs> &avb) {
+  if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+    LOGE("Failed to allocate the image");
+    return false;
+  }
+  for (const auto &piece : pieces) {
+    if (piece.path.empty() &&
+        !WriteFullyAt(fd, piece.data.data(), piece.data.size(),
+                      static_cast<off_t>(piece.offset))) {
+      LOGE("Error writing the image");
+      return false;
+    }
+  }
+  if (!avb) return true;
+  avb::HashFooterStream footer(*avb);
+  return ObserveImage(size, pieces,
+                      [&](const uint8_t *data, size_t length) {
+                        footer.Update(data, length);
+                      }) &&
+         footer.FinishAt(fd, size);
+}
+
+std::optional<PatchFooter> ReadPatchFooter(int fd,
+                                           const std::filesystem::path &key) {
+  PatchFooter footer;
+  auto info = avb::ReadHashFooter(fd);
+  if (!info) {
+    if (avb::HasFooterMagic(fd)) {
+      LOGE("Image has an AVB footer that cannot be rebuilt");
+      return std::nullopt;
     }
+    return footer;
   }
+  if (info->algorithm != "NONE" && key.empty()) {
+    LOGE("AVB footer is signed with %s; a key is needed to re-sign it",
+         info->algorithm.c_str());
+    return std::nullopt;
+  }
+  footer.args = std::move(info->args);
+  footer.args->key = key;
+  footer.image_size = info->image_size;
+  return footer;
+}
+
+bool RebuildPatchFooter(int fd, const PatchFooter &footer,
+                        uint64_t image_size) {
+  if (!footer.args) return true;
+  // Drop the old vbmeta so nothing of it is left between the new one and the
+  // footer.
+  if (ftruncate(fd, static_cast<off_t>(image_size)) != 0) {
+    LOGE("Error writing AVB footer");
+    return false;
+  }
+  return avb::AddHashFooter(fd, image_size, *footer.args);
+}
+
+namespace {
+constexpr bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+
+// Reads min_digits to max_digits decimal digits at s[pos] and moves pos past
+// them. Returns -1, leaving pos alone, when there are fewer.
+constexpr int ParseDigits(std::string_view s, size_t &pos, size_t min_digits,
+                          size_t max_digits) {
+  int value = 0;
+  size_t n = 0;
+  for (; n < max_digits && pos + n < s.size() && IsDigit(s[pos + n]); ++n) {
+    value = value * 10 + (s[pos + n] - '0');
+  }
+  if (n < min_digits) return -1;
+  pos += n;
+  return value;
+}
+
+// "YYYY-MM", optionally followed by anything (usually "-DD"), at the start of
+// s. 0 when absent or out of range.
+constexpr uint32_t ParseOSPatchLevel(std::string_view s) {
+  size_t pos = 0;
+  const int year = ParseDigits(s, pos, 4, 4);
+  if (year < 0 || pos >= s.size() || s[pos++] != '-') return 0;
+  const int month = ParseDigits(s, pos, 2, 2);
+  if (month < 0) return 0;
+
+  const int y = year - 2000;
+  if (y < 0 || y >= 128 || month < 1 || month > 12) return 0;
+  return (static_cast<uint32_t>(y) << 4) | static_cast<uint32_t>(month);
+}
+
+// "A[.B[.C]]" with components of up to three digits, starting at the first
+// digit of s. 0 when absent or a component is out of range.
+constexpr uint32_t ParseOSVersion(std::string_view s) {
+  size_t pos = 0;
+  while (pos < s.size() && !IsDigit(s[pos])) ++pos;
+  int parts[3] = {ParseDigits(s, pos, 1, 3), 0, 0};
+  if (parts[0] < 0) return 0;
+  for (size_t i = 1; i < 3; ++i) {
+    if (pos + 1 >= s.size() || s[pos] != '.' || !IsDigit(s[pos + 1])) break;
+    ++pos;
+    parts[i] = ParseDigits(s, pos, 1, 3);
+  }
+  if (parts[0] >= 128 || parts[1] >= 128 || parts[2] >= 128) return 0;
+  return (static_cast<uint32_t>(parts[0]) << 14) |
+         (static_cast<uint32_t>(parts[1]) << 7) |
+         static_cast<uint32_t>(parts[2]);
+}
+
+static_assert(ParseOSPatchLevel("2024-03") == ((24u << 4) | 3));
+static_assert(ParseOSPatchLevel("2024-03-05") == ((24u << 4) | 3));
+static_assert(ParseOSPatchLevel("2024-13") == 0);
+static_assert(ParseOSPatchLevel("24-03") == 0);
+static_assert(ParseOSVersion("14.0.0") == (14u << 14));
+static_assert(ParseOSVersion("v11.2") == ((11u << 14) | (2u << 7)));
+static_assert(ParseOSVersion("1234") == (123u << 14));
+static_assert(ParseOSVersion("12.") == (12u << 14));
+static_assert(ParseOSVersion("200") == 0);
+}  // namespace
+
+void OSVersion::Parse(OSVersion &version) {
+  version.version = ParseOSVersion(version.version_str);
+  version.patch_level = ParseOSPatchLevel(version.patch_level_str);
 }
 
 }  // namespace utils
@@ -8,6 +8,8 @@
 #include <vector>
 
 #include "TinySHA1.hpp"
+#include "avb/footer.h"
+#include "image_layout.h"
 #include "tools.h"
 
 namespace utils {
@@ -32,7 +34,6 @@ struct FileWrapper {
 };
 
 std::optional<FileWrapper> OpenFile(const std::filesystem::path &path);
-std::vector<uint8_t> ReadFileContents(FileWrapper &file);
 size_t GetFileSize(FileWrapper &file);
 size_t GetFileSize(std::optional<FileWrapper> &file);
 size_t GetFileSize(const std::filesystem::path &path);
@@ -46,6 +47,49 @@ class AsciizString {
   std::optional<std::vector<char>> operator()(const std::string &s) const;
 };
 
+// Overwrites a NUL-padded header field in place, truncating value so the
+// field stays terminated.
+void PatchString(uint8_t *field, size_t field_size, const std::string &value);
+
+// What the build log calls the image: output's file name or, when output_fd
+// is set, output_name if the caller knows one, else "stdout", "pipe" or the
+// name of the file the descriptor is open on.
+std::string OutputName(const std::filesystem::path &output, int output_fd,
+                       const std::string &output_name);
+
+// Writes a planned image, with its AVB footer when avb is set, to output or,
+// when output_fd is set, into that descriptor. Regular files get the
+// sections concurrently at their offsets and the footer patched in at the
+// end; any other sink gets one forward pass. Either way the footer digest is
+// taken from the sections, never from the written image.
+bool WriteImage(const std::filesystem::path &output, int output_fd,
+                uint64_t size, const std::vector<ImagePiece> &pieces,
+                const std::optional<avb::HashFooterArgs> &avb);
+
+// Whether fd is a regular file that places pwrite data at its offset, so an
+// image's sections can be written into it concurrently.
+bool AcceptsPositionedWrites(int fd);
+
+// Completes an image in fd, a file that took positioned writes, whose file
+// sections separate build steps already placed with WriteImagePiece: sizes
+// fd to the image, writes the in-memory pieces and, with avb, appends the
+// footer, hashing every piece from its source.
+bool FinishImage(int fd, uint64_t size, const std::vector<ImagePiece> &pieces,
+                 const std::optional<avb::HashFooterArgs> &avb);
+
+// Patching an image in place leaves its AVB footer with a stale digest.
+// ReadPatchFooter takes the footer before the patch and RebuildPatchFooter
+// rehashes the first image_size bytes into a fresh one afterwards. A signed
+// footer is re-signed with key; without one, like with a footer that does
+// not parse, the image is refused and nullopt returned.
+struct PatchFooter {
+  std::optional<avb::HashFooterArgs> args;  // unset: the image has none
+  uint64_t image_size = 0;
+};
+std::optional<PatchFooter> ReadPatchFooter(int fd,
+                                           const std::filesystem::path &key);
+bool RebuildPatchFooter(int fd, const PatchFooter &footer, uint64_t image_size);
+
 struct OSVersion {
   uint32_t version = 0;
   uint32_t patch_level = 0;
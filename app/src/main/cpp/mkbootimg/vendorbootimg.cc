@@ -1,6 +1,14 @@
 #include "vendorbootimg.h"
 
-#include <fstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <sstream>
+
+#include "buffer_pool.h"
+#include "image_layout.h"
 
 namespace {
 constexpr std::string_view VENDOR_BOOT_MAGIC = "VNDRBOOT";
@@ -11,55 +19,122 @@ constexpr uint32_t VENDOR_BOOT_IMAGE_HEADER_V3_SIZE = 2112;
 constexpr uint32_t VENDOR_BOOT_IMAGE_HEADER_V4_SIZE = 2128;
 constexpr uint32_t VENDOR_BOOT_ARGS_SIZE = 2048;
 constexpr uint32_t VENDOR_BOOT_NAME_SIZE = 16;
-}  // namespace
 
-bool VendorBootBuilder::Build() {
-  std::ofstream out(args.output, std::ios::binary);
-  if (!out) {
-    LOGE("Failed to open %s for writing",
-         fs::path(args.output).filename().c_str());
-    return false;
-  }
-
-  LOG("Building to: %s", fs::path(args.output).filename().c_str());
+// Header field offsets.
+constexpr uint32_t VENDOR_BOOT_HEADER_VERSION_OFFSET = VENDOR_BOOT_MAGIC_SIZE;
+constexpr uint32_t VENDOR_BOOT_PAGE_SIZE_OFFSET = VENDOR_BOOT_MAGIC_SIZE + 4;
+constexpr uint32_t VENDOR_RAMDISK_SIZE_OFFSET = VENDOR_BOOT_MAGIC_SIZE + 16;
+constexpr uint32_t VENDOR_BOOT_ARGS_OFFSET = VENDOR_BOOT_MAGIC_SIZE + 20;
+constexpr uint32_t VENDOR_BOOT_NAME_OFFSET =
+    VENDOR_BOOT_ARGS_OFFSET + VENDOR_BOOT_ARGS_SIZE + 4;
+constexpr uint32_t VENDOR_BOOT_HEADER_SIZE_OFFSET =
+    VENDOR_BOOT_NAME_OFFSET + VENDOR_BOOT_NAME_SIZE;
+constexpr uint32_t VENDOR_DTB_SIZE_OFFSET = VENDOR_BOOT_HEADER_SIZE_OFFSET + 4;
+constexpr uint32_t VENDOR_RAMDISK_TABLE_SIZE_OFFSET =
+    VENDOR_BOOT_IMAGE_HEADER_V3_SIZE;
+constexpr uint32_t VENDOR_BOOTCONFIG_SIZE_OFFSET =
+    VENDOR_RAMDISK_TABLE_SIZE_OFFSET + 12;
+static_assert(VENDOR_DTB_SIZE_OFFSET + 12 == VENDOR_BOOT_IMAGE_HEADER_V3_SIZE);
+static_assert(VENDOR_BOOTCONFIG_SIZE_OFFSET + 4 ==
+              VENDOR_BOOT_IMAGE_HEADER_V4_SIZE);
+}  // namespace
 
-  if (args.header_version > 3 && !args.vendor_ramdisk.empty()) {
+VendorBootBuilder::VendorBootBuilder(VendorBootArgs &&args)
+    : args(std::move(args)) {
+  if (this->args.header_version > 3 && !this->args.vendor_ramdisk.empty()) {
     VendorRamdiskEntry MainEntry;
     MainEntry.name = "";
     MainEntry.type = VENDOR_RAMDISK_TYPE_PLATFORM;
-    MainEntry.path = args.vendor_ramdisk;
-    args.vendor_ramdisk.clear();
-    args.ramdisks.insert(args.ramdisks.begin(), MainEntry);
+    MainEntry.path = this->args.vendor_ramdisk;
+    this->args.vendor_ramdisk.clear();
+    this->args.ramdisks.insert(this->args.ramdisks.begin(), MainEntry);
   }
+}
 
+bool VendorBootBuilder::Build() {
+  LOG("Building to: %s",
+      utils::OutputName(args.output, args.output_fd, args.output_name)
+          .c_str());
+  auto plan = Sections();
+  if (!plan) return false;
+  auto headers = Headers();
+  if (!headers) return false;
+  for (auto &piece : *headers) plan->pieces.push_back(std::move(piece));
+  return utils::WriteImage(args.output, args.output_fd, plan->size,
+                           plan->pieces, args.avb);
+}
+
+std::vector<std::pair<fs::path, uint64_t>> VendorBootBuilder::Ramdisks()
+    const {
+  // v3 has a single ramdisk; v4 lists its ramdisks in a table.
+  std::vector<std::pair<fs::path, uint64_t>> ramdisks;
   if (args.header_version > 3) {
     for (const auto &entry : args.ramdisks) {
-      ramdisk_total_size += utils::GetFileSize(entry.path);
+      ramdisks.emplace_back(entry.path, utils::GetFileSize(entry.path));
     }
   } else {
-    ramdisk_total_size = utils::GetFileSize(args.vendor_ramdisk);
+    ramdisks.emplace_back(args.vendor_ramdisk,
+                          utils::GetFileSize(args.vendor_ramdisk));
   }
+  return ramdisks;
+}
 
-  if (!WriteHeader(out)) return false;
-  if (!WriteRamdisks(out)) return false;
+VendorBootImageLayout VendorBootBuilder::Layout(uint64_t ramdisk_size) const {
+  return PlanVendorBootImage(
+      args.header_version, args.page_size,
+      args.header_version > 3 ? VENDOR_BOOT_IMAGE_HEADER_V4_SIZE
+                              : VENDOR_BOOT_IMAGE_HEADER_V3_SIZE,
+      ramdisk_size, utils::GetFileSize(args.dtb),
+      args.ramdisks.size() * VENDOR_RAMDISK_TABLE_ENTRY_V4_SIZE,
+      utils::GetFileSize(args.bootconfig));
+}
 
-  if (auto dtb = utils::OpenFile(args.dtb)) {
-    auto data = utils::ReadFileContents(*dtb);
-    out.write(reinterpret_cast<const char *>(data.data()), data.size());
-    utils::PadFile(out, args.page_size);
+std::optional<ImagePlan> VendorBootBuilder::Sections() const {
+  if (args.page_size == 0) {
+    LOGE("Invalid page size");
+    return std::nullopt;
   }
+  const auto ramdisks = Ramdisks();
+  uint64_t total = 0;
+  for (const auto &[path, size] : ramdisks) total += size;
+  const auto layout = Layout(total);
 
+  ImagePlan plan;
+  plan.size = layout.size;
+  // Inputs that are missing or empty leave their section empty.
+  auto add_file = [&](const fs::path &path, uint64_t offset, uint64_t size) {
+    if (size > 0) plan.pieces.push_back({offset, {}, path, size});
+  };
+  uint64_t ramdisk_offset = layout.ramdisk.offset;
+  for (const auto &[path, size] : ramdisks) {
+    add_file(path, ramdisk_offset, size);
+    ramdisk_offset += size;
+  }
+  add_file(args.dtb, layout.dtb.offset, layout.dtb.size);
   if (args.header_version > 3) {
-    if (!WriteTableEntries(out)) return false;
+    add_file(args.bootconfig, layout.bootconfig.offset, layout.bootconfig.size);
+  }
+  return plan;
+}
 
-    if (auto bc = utils::OpenFile(args.bootconfig)) {
-      auto data = utils::ReadFileContents(*bc);
-      out.write(reinterpret_cast<const char *>(data.data()), data.size());
-      utils::PadFile(out, args.page_size);
-    }
+std::optional<std::vector<ImagePiece>> VendorBootBuilder::Headers() {
+  ramdisk_total_size = 0;
+  for (const auto &[path, size] : Ramdisks()) ramdisk_total_size += size;
+
+  std::ostringstream header;
+  std::ostringstream table;
+  if (!WriteHeader(header)) return std::nullopt;
+  if (args.header_version > 3 && !WriteTableEntries(table)) {
+    return std::nullopt;
   }
 
-  return true;
+  const auto layout = Layout(ramdisk_total_size);
+  std::vector<ImagePiece> pieces;
+  pieces.push_back({layout.header.offset, header.str(), {}, 0});
+  if (args.header_version > 3) {
+    pieces.push_back({layout.ramdisk_table.offset, table.str(), {}, 0});
+  }
+  return pieces;
 }
 
 bool VendorBootBuilder::WriteHeader(std::ostream &out) {
@@ -101,24 +176,6 @@ bool VendorBootBuilder::WriteHeader(std::ostream &out) {
   return true;
 }
 
-bool VendorBootBuilder::WriteRamdisks(std::ostream &out) {
-  if (args.header_version > 3) {
-    for (const auto &entry : args.ramdisks) {
-      if (auto file = utils::OpenFile(entry.path)) {
-        auto data = utils::ReadFileContents(*file);
-        out.write(reinterpret_cast<const char *>(data.data()), data.size());
-      }
-    }
-  } else {
-    if (auto file = utils::OpenFile(args.vendor_ramdisk)) {
-      auto data = utils::ReadFileContents(*file);
-      out.write(reinterpret_cast<const char *>(data.data()), data.size());
-    }
-  }
-  utils::PadFile(out, args.page_size);
-  return true;
-}
-
 bool VendorBootBuilder::WriteTableEntries(std::ostream &out) {
   uint32_t offset = 0;
   for (const auto &entry : args.ramdisks) {
@@ -143,3 +200,128 @@ bool VendorBootBuilder::WriteTableEntries(std::ostream &out) {
   utils::PadFile(out, args.page_size);
   return true;
 }
+
+namespace {
+// The bootconfig is the last section of a v4 image, so it can be replaced by
+// rewriting the tail of the file without moving anything else. Anything
+// after it but an AVB footer, which is rebuilt, would be cut off, so such
+// images are refused. image_size is set to the new end of the image.
+bool PatchBootconfig(int fd, uint8_t *header,
+                     const std::filesystem::path &bootconfig,
+                     const utils::PatchFooter &footer, uint64_t &image_size) {
+  const uint32_t page_size = LoadU32(header + VENDOR_BOOT_PAGE_SIZE_OFFSET);
+  if (page_size == 0) return false;
+
+  auto file = utils::OpenFile(bootconfig);
+  if (!file) {
+    LOGE("Failed to open %s", bootconfig.filename().c_str());
+    return false;
+  }
+  const size_t size = file->size;
+
+  auto plan = [&](uint64_t bootconfig_size) {
+    return PlanVendorBootImage(
+        LoadU32(header + VENDOR_BOOT_HEADER_VERSION_OFFSET), page_size,
+        LoadU32(header + VENDOR_BOOT_HEADER_SIZE_OFFSET),
+        LoadU32(header + VENDOR_RAMDISK_SIZE_OFFSET),
+        LoadU32(header + VENDOR_DTB_SIZE_OFFSET),
+        LoadU32(header + VENDOR_RAMDISK_TABLE_SIZE_OFFSET), bootconfig_size);
+  };
+  struct stat st {};
+  if (!footer.args && fstat(fd, &st) != 0) return false;
+  const uint64_t old_end =
+      footer.args ? footer.image_size : static_cast<uint64_t>(st.st_size);
+  if (old_end > plan(LoadU32(header + VENDOR_BOOTCONFIG_SIZE_OFFSET)).size) {
+    LOGE("Image has data after its bootconfig");
+    return false;
+  }
+
+  const auto layout = plan(size);
+  const uint64_t offset = layout.bootconfig.offset;
+  const uint64_t padded_size = layout.size - offset;
+
+  auto buffer = BufferPool::Shared().Acquire();
+  for (size_t written = 0; written < size;) {
+    const size_t length = std::min(size - written, buffer.size());
+    if (!file->stream->read(buffer.data(),
+                            static_cast<std::streamsize>(length)) ||
+        !WriteFullyAt(fd, buffer.data(), length,
+                      static_cast<off_t>(offset + written))) {
+      LOGE("Failed to write bootconfig");
+      return false;
+    }
+    written += length;
+  }
+  // Cut the old tail first so growing the file back to the page boundary
+  // zero-fills the padding.
+  if (ftruncate(fd, static_cast<off_t>(offset + size)) != 0 ||
+      ftruncate(fd, static_cast<off_t>(offset + padded_size)) != 0) {
+    LOGE("Failed to write bootconfig");
+    return false;
+  }
+  StoreU32(header + VENDOR_BOOTCONFIG_SIZE_OFFSET,
+           static_cast<uint32_t>(size));
+  image_size = layout.size;
+  return true;
+}
+
+bool PatchHeader(int fd, const VendorBootImagePatch &patch,
+                 const utils::PatchFooter &footer, uint64_t &image_size) {
+  std::array<uint8_t, VENDOR_BOOT_IMAGE_HEADER_V4_SIZE> header{};
+  if (!ReadFullyAt(fd, header.data(), VENDOR_BOOT_IMAGE_HEADER_V3_SIZE, 0) ||
+      std::string_view(reinterpret_cast<const char *>(header.data()),
+                       VENDOR_BOOT_MAGIC_SIZE) != VENDOR_BOOT_MAGIC) {
+    LOGE("Not a vendor_boot image");
+    return false;
+  }
+
+  const uint32_t header_version =
+      LoadU32(header.data() + VENDOR_BOOT_HEADER_VERSION_OFFSET);
+  const uint32_t header_size = header_version > 3
+                                   ? VENDOR_BOOT_IMAGE_HEADER_V4_SIZE
+                                   : VENDOR_BOOT_IMAGE_HEADER_V3_SIZE;
+  if (header_version > 3 &&
+      !ReadFullyAt(fd, header.data() + VENDOR_BOOT_IMAGE_HEADER_V3_SIZE,
+                   header_size - VENDOR_BOOT_IMAGE_HEADER_V3_SIZE,
+                   VENDOR_BOOT_IMAGE_HEADER_V3_SIZE)) {
+    LOGE("Truncated vendor_boot header");
+    return false;
+  }
+
+  if (patch.vendor_cmdline) {
+    if (patch.vendor_cmdline->size() >= VENDOR_BOOT_ARGS_SIZE) {
+      LOGE("Vendor cmdline is too long");
+      return false;
+    }
+    utils::PatchString(header.data() + VENDOR_BOOT_ARGS_OFFSET,
+                       VENDOR_BOOT_ARGS_SIZE, *patch.vendor_cmdline);
+  }
+  if (patch.board) {
+    if (patch.board->size() >= VENDOR_BOOT_NAME_SIZE) {
+      LOGE("Board name is too long");
+      return false;
+    }
+    utils::PatchString(header.data() + VENDOR_BOOT_NAME_OFFSET,
+                       VENDOR_BOOT_NAME_SIZE, *patch.board);
+  }
+  if (patch.bootconfig) {
+    if (header_version < 4) {
+      LOGE("Header version %d has no bootconfig section", header_version);
+      return false;
+    }
+    if (!PatchBootconfig(fd, header.data(), *patch.bootconfig, footer,
+                         image_size)) {
+      return false;
+    }
+  }
+
+  return WriteFullyAt(fd, header.data(), header_size, 0);
+}
+}  // namespace
+
+bool PatchVendorBootImage(int fd, const VendorBootImagePatch &patch) {
+  auto footer = utils::ReadPatchFooter(fd, patch.avb_key);
+  uint64_t image_size = footer ? footer->image_size : 0;
+  return footer && PatchHeader(fd, patch, *footer, image_size) &&
+         utils::RebuildPatchFooter(fd, *footer, image_size);
+}
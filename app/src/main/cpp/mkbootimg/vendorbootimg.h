@@ -1,10 +1,14 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
 #include <filesystem>
+#include <optional>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
+#include "avb/footer.h"
 #include "utils.h"
 
 constexpr uint32_t VENDOR_RAMDISK_TYPE_NONE = 0;
@@ -21,6 +25,8 @@ struct VendorRamdiskEntry {
 
 struct VendorBootArgs {
   std::filesystem::path output;
+  int output_fd = -1;  // written instead of output when set
+  std::string output_name;  // what the log calls output_fd, if known
   std::filesystem::path dtb;
   std::filesystem::path bootconfig;
   std::filesystem::path vendor_ramdisk;
@@ -34,6 +40,16 @@ struct VendorBootArgs {
   uint32_t tags_offset = 0x00000100;
   uint32_t page_size = 2048;
   uint32_t header_version = 3;
+  std::optional<avb::HashFooterArgs> avb;
+};
+
+// Header fields to rewrite in place; unset fields keep their current value.
+// bootconfig replaces the trailing bootconfig section of a v4 image.
+struct VendorBootImagePatch {
+  std::optional<std::string> vendor_cmdline;
+  std::optional<std::string> board;
+  std::optional<std::filesystem::path> bootconfig;
+  std::filesystem::path avb_key;  // re-signs a signed AVB footer
 };
 
 class VendorBootBuilder {
@@ -41,11 +57,23 @@ class VendorBootBuilder {
   uint64_t ramdisk_total_size = 0;
 
  public:
-  explicit VendorBootBuilder(VendorBootArgs &&args) : args(std::move(args)) {}
+  explicit VendorBootBuilder(VendorBootArgs &&args);
   bool Build();
+  // The file sections, placed from the sizes the inputs have now. A
+  // section's offset only depends on the inputs ahead of it, so it is final
+  // once those are, whatever the later ones become.
+  std::optional<ImagePlan> Sections() const;
+  // The header and, from v4, the ramdisk table, from the inputs as they are
+  // now; they must be final.
+  std::optional<std::vector<ImagePiece>> Headers();
 
  private:
+  std::vector<std::pair<std::filesystem::path, uint64_t>> Ramdisks() const;
+  VendorBootImageLayout Layout(uint64_t ramdisk_size) const;
   bool WriteHeader(std::ostream &out);
-  bool WriteRamdisks(std::ostream &out);
   bool WriteTableEntries(std::ostream &out);
 };
+
+// Patches the image in fd, which must be a regular file open for reading and
+// writing, in place.
+bool PatchVendorBootImage(int fd, const VendorBootImagePatch &patch);
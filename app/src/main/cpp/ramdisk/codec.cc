@@ -0,0 +1,259 @@
+#include "codec.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "decoder.h"
+#include "encoder.h"
+#include "inflate.h"
+#include "job.h"
+#include "log.h"
+#include "lz4hc.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+constexpr size_t COPY_BUFSIZE = 256 * 1024;
+constexpr uint64_t SLOW_ENCODE_SIZE = 10 * 1024 * 1024;
+
+class MappedSource : public MemorySource {
+ public:
+  MappedSource(void *base, size_t length, size_t skew, size_t size)
+      : MemorySource(static_cast<const uint8_t *>(base) + skew, size),
+        base_(base),
+        length_(length) {}
+  ~MappedSource() override { munmap(base_, length_); }
+
+ private:
+  void *base_;
+  size_t length_;
+};
+
+// The cpio needs no coding, only moving into place.
+bool MoveFile(const fs::path &input, const fs::path &output) {
+  std::error_code ec;
+  fs::rename(input, output, ec);
+  if (ec) LOGE("Error moving %s: %s", input.c_str(), ec.message().c_str());
+  return !ec;
+}
+
+bool MoveFileAtLevel(const fs::path &input, const fs::path &output, int) {
+  return MoveFile(input, output);
+}
+
+bool InflateFile(const fs::path &input, const fs::path &output) {
+  return InflateGzipFile(input, output);
+}
+
+constexpr Codec CODECS[] = {
+    {FORMAT_NONE, "none", 0, 0, 0, 0, isCpioNewcHeader, NewRawDecoder,
+     NewRawEncoder, MoveFile, MoveFileAtLevel},
+    {FORMAT_LZ4, "lz4", CODEC_PARALLEL_ENCODE | CODEC_SEEKABLE, 1,
+     LZ4HC_CLEVEL_MAX, LZ4HC_CLEVEL_MAX, isLz4LegacyHeader,
+     NewLz4LegacyDecoder, NewLz4LegacyEncoder, nullptr, nullptr},
+    {FORMAT_GZIP, "gzip", CODEC_PARALLEL_DECODE | CODEC_SEEKABLE, 1, 9, 9,
+     isGzipHeader, NewGzipDecoder, NewGzipEncoder, InflateFile, nullptr},
+    {FORMAT_LZMA, "lzma", 0, 0, 9, 0, isLzmaHeader, NewLzmaDecoder,
+     NewLzmaEncoder, nullptr, nullptr},
+};
+
+bool StreamDecode(const Codec &codec, const fs::path &input,
+                  const fs::path &output) {
+  int in_fd = open(input.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in_fd < 0) {
+    LOGE("%s: Error opening input file: %s", codec.name.data(), input.c_str());
+    return false;
+  }
+  struct stat st {};
+  if (fstat(in_fd, &st) != 0) {
+    close(in_fd);
+    return false;
+  }
+  auto decoder = codec.decoder(
+      ByteSource::Map(in_fd, 0, static_cast<uint64_t>(st.st_size)));
+  int out_fd =
+      open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (out_fd < 0) {
+    LOGE("%s: Error opening output file: %s", codec.name.data(),
+         output.c_str());
+    close(in_fd);
+    return false;
+  }
+
+  FdSink sink(out_fd);
+  std::vector<uint8_t> buffer(COPY_BUFSIZE);
+  uint64_t reported = 0;
+  bool ok = true;
+  while (ok) {
+    const ssize_t n = decoder->Read(buffer.data(), buffer.size());
+    if (n <= 0) {
+      ok = n == 0;
+      break;
+    }
+    if (!sink.Write(buffer.data(), static_cast<size_t>(n))) {
+      LOGE("%s: Error writing to output file: %s", codec.name.data(),
+           output.c_str());
+      ok = false;
+    }
+    JobProgress(decoder->consumed() - reported);
+    reported = decoder->consumed();
+    if (JobCancelled()) ok = false;
+  }
+  decoder.reset();
+  close(in_fd);
+  return close(out_fd) == 0 && ok;
+}
+
+bool StreamEncode(const Codec &codec, const fs::path &input,
+                  const fs::path &output) {
+  int in_fd = open(input.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in_fd < 0) {
+    LOGE("%s: Error opening input file: %s", codec.name.data(), input.c_str());
+    return false;
+  }
+  int out_fd =
+      open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (out_fd < 0) {
+    LOGE("%s: Error opening output file: %s", codec.name.data(),
+         output.c_str());
+    close(in_fd);
+    return false;
+  }
+
+  auto encoder = codec.encoder(std::make_unique<FdSink>(out_fd), codec.level);
+  std::vector<uint8_t> buffer(COPY_BUFSIZE);
+  bool ok = true;
+  while (ok) {
+    const ssize_t n = read(in_fd, buffer.data(), buffer.size());
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      if (n < 0) {
+        LOGE("%s: Error reading from input file: %s", codec.name.data(),
+             input.c_str());
+      }
+      ok = n == 0 && encoder->Finish();
+      break;
+    }
+    ok = encoder->Write(buffer.data(), static_cast<size_t>(n));
+    JobProgress(static_cast<uint64_t>(n));
+    if (JobCancelled()) ok = false;
+  }
+  encoder.reset();
+  close(in_fd);
+  return close(out_fd) == 0 && ok;
+}
+
+// On success the input is consumed, as the cpio stages expect.
+bool Finish(bool ok, const fs::path &input, const fs::path &output) {
+  std::error_code ec;
+  if (!ok) {
+    fs::remove(output, ec);
+    return false;
+  }
+  fs::remove(input, ec);
+  return true;
+}
+}  // namespace
+
+bool FdSource::ReadAt(void *buf, size_t size, uint64_t offset) const {
+  if (offset > size_ || size > size_ - offset) return false;
+  return ReadFullyAt(fd_, buf, size, static_cast<off_t>(offset_ + offset));
+}
+
+bool MemorySource::ReadAt(void *buf, size_t size, uint64_t offset) const {
+  if (offset > size_ || size > size_ - offset) return false;
+  std::memcpy(buf, data_ + offset, size);
+  return true;
+}
+
+std::unique_ptr<ByteSource> ByteSource::Map(int fd, uint64_t offset,
+                                            uint64_t size) {
+  const auto page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+  const uint64_t skew = offset % page;
+  if (size > 0 && size + skew <= SIZE_MAX) {
+    const auto length = static_cast<size_t>(size + skew);
+    void *base = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd,
+                      static_cast<off_t>(offset - skew));
+    if (base != MAP_FAILED) {
+      madvise(base, length, MADV_SEQUENTIAL);
+      return std::make_unique<MappedSource>(base, length,
+                                            static_cast<size_t>(skew),
+                                            static_cast<size_t>(size));
+    }
+  }
+  return std::make_unique<FdSource>(fd, offset, size);
+}
+
+bool FdSink::Write(const void *buf, size_t size) {
+  auto *p = static_cast<const uint8_t *>(buf);
+  while (size > 0) {
+    ssize_t n = write(fd_, p, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    size -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+bool MemorySink::Write(const void *buf, size_t size) {
+  const auto *bytes = static_cast<const uint8_t *>(buf);
+  out_.insert(out_.end(), bytes, bytes + size);
+  return true;
+}
+
+std::span<const Codec> Codecs() { return CODECS; }
+
+const Codec *FindCodec(uint8_t format) {
+  for (const auto &codec : CODECS) {
+    if (codec.format == format) return &codec;
+  }
+  return nullptr;
+}
+
+const Codec *FindCodec(std::string_view name) {
+  for (const auto &codec : CODECS) {
+    if (codec.name == name) return &codec;
+  }
+  return nullptr;
+}
+
+const Codec *DetectCodec(const uint8_t *data, size_t size) {
+  for (const auto &codec : CODECS) {
+    if (codec.sniff(data, size)) return &codec;
+  }
+  return nullptr;
+}
+
+bool DecodeFile(const Codec &codec, const fs::path &input,
+                const fs::path &output) {
+  std::error_code ec;
+  if (codec.decode_file != nullptr) {
+    const uint64_t size = fs::file_size(input, ec);
+    if (codec.decode_file(input, output)) {
+      JobProgress(size);
+      return Finish(!JobCancelled(), input, output);
+    }
+    if (JobCancelled()) return Finish(false, input, output);
+  }
+  return Finish(StreamDecode(codec, input, output), input, output);
+}
+
+bool EncodeFile(const Codec &codec, const fs::path &input,
+                const fs::path &output) {
+  std::error_code ec;
+  if (codec.format != FORMAT_NONE &&
+      fs::file_size(input, ec) > SLOW_ENCODE_SIZE) {
+    LOG("This might take a while!");
+  }
+  const bool ok = codec.encode_file != nullptr
+                      ? codec.encode_file(input, output, codec.level)
+                      : StreamEncode(codec, input, output);
+  return Finish(ok, input, output);
+}
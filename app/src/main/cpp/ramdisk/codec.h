@@ -0,0 +1,133 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include "tools.h"
+
+class RamdiskDecoder;
+class RamdiskEncoder;
+
+// Compressed input for a decoder: a region of an fd, memory or a mapping.
+// Decoders peek ahead at member and block headers, so reads are positioned.
+class ByteSource {
+ public:
+  virtual ~ByteSource() = default;
+
+  virtual uint64_t size() const = 0;
+  // Reads exactly size bytes at offset.
+  virtual bool ReadAt(void *buf, size_t size, uint64_t offset) const = 0;
+  // The bytes in place when they are in memory, else nullptr.
+  virtual const uint8_t *data() const { return nullptr; }
+
+  // [offset, offset + size) of fd, mapped when the kernel allows it.
+  static std::unique_ptr<ByteSource> Map(int fd, uint64_t offset,
+                                         uint64_t size);
+};
+
+class FdSource : public ByteSource {
+ public:
+  FdSource(int fd, uint64_t offset, uint64_t size)
+      : fd_(fd), offset_(offset), size_(size) {}
+
+  uint64_t size() const override { return size_; }
+  bool ReadAt(void *buf, size_t size, uint64_t offset) const override;
+
+ private:
+  int fd_;
+  uint64_t offset_;
+  uint64_t size_;
+};
+
+// Borrows memory that must outlive it.
+class MemorySource : public ByteSource {
+ public:
+  MemorySource(const uint8_t *data, size_t size) : data_(data), size_(size) {}
+
+  uint64_t size() const override { return size_; }
+  bool ReadAt(void *buf, size_t size, uint64_t offset) const override;
+  const uint8_t *data() const override { return data_; }
+
+ protected:
+  const uint8_t *data_;
+  size_t size_;
+};
+
+// Compressed output of an encoder. Writes are sequential, so an fd sink
+// works on pipes and sockets as well as files.
+class ByteSink {
+ public:
+  virtual ~ByteSink() = default;
+  virtual bool Write(const void *buf, size_t size) = 0;
+};
+
+class FdSink : public ByteSink {
+ public:
+  explicit FdSink(int fd) : fd_(fd) {}
+  bool Write(const void *buf, size_t size) override;
+
+ private:
+  int fd_;
+};
+
+// Appends to a vector that must outlive it.
+class MemorySink : public ByteSink {
+ public:
+  explicit MemorySink(std::vector<uint8_t> &out) : out_(out) {}
+  bool Write(const void *buf, size_t size) override;
+
+ private:
+  std::vector<uint8_t> &out_;
+};
+
+enum CodecCaps : uint32_t {
+  CODEC_PARALLEL_DECODE = 1 << 0,  // decoding spreads over the scheduler
+  CODEC_PARALLEL_ENCODE = 1 << 1,  // encoding spreads over the scheduler
+  CODEC_SEEKABLE = 1 << 2,         // the decoder resumes at SeekCheckpoints
+};
+
+// One ramdisk format. Adding a format means adding its decoder and encoder
+// and a row to the table in codec.cc.
+struct Codec {
+  uint8_t format;
+  std::string_view name;
+  uint32_t caps;
+  int min_level;
+  int max_level;
+  // What build compresses with, so rebuilt images match the originals.
+  int level;
+  bool (*sniff)(const uint8_t *data, size_t size);
+  std::unique_ptr<RamdiskDecoder> (*decoder)(std::unique_ptr<ByteSource> in);
+  std::unique_ptr<RamdiskEncoder> (*encoder)(std::unique_ptr<ByteSink> out,
+                                             int level);
+  // Whole-file fast paths, or nullptr to stream through the above. A
+  // decode_file failure that is not a cancellation falls back to streaming.
+  bool (*decode_file)(const std::filesystem::path &input,
+                      const std::filesystem::path &output);
+  bool (*encode_file)(const std::filesystem::path &input,
+                      const std::filesystem::path &output, int level);
+
+  bool has(CodecCaps cap) const { return (caps & cap) != 0; }
+};
+
+// Every codec, in the order their magics are tried.
+std::span<const Codec> Codecs();
+const Codec *FindCodec(uint8_t format);
+const Codec *FindCodec(std::string_view name);
+// The codec whose magic starts data, or nullptr.
+const Codec *DetectCodec(const uint8_t *data, size_t size);
+
+// Decompresses input into output, reporting progress in input bytes to the
+// current job. input is removed on success and output on failure.
+bool DecodeFile(const Codec &codec, const std::filesystem::path &input,
+                const std::filesystem::path &output);
+// Compresses input into output at codec.level, likewise.
+bool EncodeFile(const Codec &codec, const std::filesystem::path &input,
+                const std::filesystem::path &output);
@@ -0,0 +1,153 @@
+#include "cpio_reader.h"
+
+#include <algorithm>
+#include <iterator>
+#include <vector>
+
+#include "log.h"
+
+bool CpioReader::Read(void *buf, size_t size) {
+  if (!decoder_.ReadExact(buf, size)) return false;
+  position_ += size;
+  return true;
+}
+
+bool CpioReader::Skip(uint64_t size) {
+  if (size == 0) return true;
+  if (!decoder_.Skip(size)) return false;
+  position_ += size;
+  return true;
+}
+
+bool CpioReader::SkipPending() {
+  if (!Skip(data_left_ + data_pad_)) return false;
+  data_left_ = data_pad_ = 0;
+  return true;
+}
+
+bool CpioReader::Next(CpioEntry &entry) {
+  if (failed_ || done_) return false;
+  if (!SkipPending()) {
+    LOGE("cpio: Truncated archive");
+    failed_ = true;
+    return false;
+  }
+
+  char header[CPIO_NEWC_HEADER_SIZE];
+  const uint64_t header_offset = position_;
+  ssize_t first = decoder_.Read(header, sizeof(header));
+  if (first == 0) {
+    // Archive without a trailer.
+    done_ = true;
+    return false;
+  }
+  if (first < 0 || !Read(header + first, sizeof(header) - first)) {
+    LOGE("cpio: Truncated header");
+    failed_ = true;
+    return false;
+  }
+  position_ += static_cast<uint64_t>(first);
+
+  CpioNewcHeader hdr;
+  if (!ParseCpioNewcHeader(header, hdr) || hdr.namesize > CPIO_MAX_NAME_SIZE) {
+    LOGE("Unsupported format");
+    failed_ = true;
+    return false;
+  }
+
+  std::vector<char> name(hdr.namesize);
+  if (!Read(name.data(), name.size()) ||
+      !Skip(CpioPad4(CPIO_NEWC_HEADER_SIZE + hdr.namesize))) {
+    LOGE("cpio: Truncated name");
+    failed_ = true;
+    return false;
+  }
+
+  entry = CpioEntry{};
+  entry.path.assign(name.data(), hdr.namesize - 1);
+  if (entry.path == CPIO_TRAILER_NAME) {
+    done_ = true;
+    return false;
+  }
+
+  entry.mode = hdr.mode;
+  entry.uid = hdr.uid;
+  entry.gid = hdr.gid;
+  entry.nlink = hdr.nlink;
+  entry.mtime = hdr.mtime;
+  entry.size = hdr.filesize;
+  entry.header_offset = header_offset;
+  entry.data_offset = position_;
+
+  data_left_ = hdr.filesize;
+  data_pad_ = CpioPad4(hdr.filesize);
+
+  if (entry.is_symlink()) {
+    if (hdr.filesize > CPIO_MAX_NAME_SIZE) {
+      LOGE("cpio: Invalid symlink %s", entry.path.c_str());
+      failed_ = true;
+      return false;
+    }
+    entry.target.resize(hdr.filesize);
+    if (!ReadData(entry.target.data(), entry.target.size())) return false;
+  }
+  return true;
+}
+
+bool CpioReader::ReadData(void *buf, size_t size) {
+  if (size > data_left_ || !Read(buf, size)) {
+    LOGE("cpio: Truncated file data");
+    failed_ = true;
+    return false;
+  }
+  data_left_ -= size;
+  return true;
+}
+
+bool CpioReader::SeekTo(uint64_t header_offset,
+                        const std::vector<SeekCheckpoint> &checkpoints) {
+  if (failed_) return false;
+  const uint64_t next = position_ + data_left_ + data_pad_;
+  auto checkpoint = std::upper_bound(
+      checkpoints.begin(), checkpoints.end(), header_offset,
+      [](uint64_t offset, const SeekCheckpoint &c) { return offset < c.out; });
+  if (checkpoint != checkpoints.begin() &&
+      (std::prev(checkpoint)->out > next || header_offset < next) &&
+      decoder_.Resume(*std::prev(checkpoint))) {
+    position_ = std::prev(checkpoint)->out;
+    data_left_ = data_pad_ = 0;
+  } else if (header_offset < next || !SkipPending()) {
+    LOGE("cpio: Cannot seek to offset %llu",
+         static_cast<unsigned long long>(header_offset));
+    failed_ = true;
+    return false;
+  }
+  if (!Skip(header_offset - position_)) {
+    LOGE("cpio: Truncated archive");
+    failed_ = true;
+    return false;
+  }
+  done_ = false;
+  return true;
+}
+
+const char *CpioTypeName(uint32_t mode) {
+  switch (mode & S_IFMT) {
+    case S_IFDIR:
+      return "dir";
+    case S_IFREG:
+      return "file";
+    case S_IFLNK:
+      return "symlink";
+    case S_IFCHR:
+      return "char";
+    case S_IFBLK:
+      return "block";
+    case S_IFIFO:
+      return "fifo";
+    case S_IFSOCK:
+      return "socket";
+    default:
+      return "unknown";
+  }
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <sys/stat.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "cpio_newc.h"
+#include "decoder.h"
+
+struct CpioEntry {
+  std::string path;
+  uint32_t mode = 0;
+  uint32_t uid = 0;
+  uint32_t gid = 0;
+  uint32_t nlink = 0;
+  uint32_t mtime = 0;
+  uint64_t size = 0;
+  std::string target;  // symlinks only
+  // Offsets into the uncompressed archive.
+  uint64_t header_offset = 0;
+  uint64_t data_offset = 0;
+
+  bool is_dir() const { return (mode & S_IFMT) == S_IFDIR; }
+  bool is_file() const { return (mode & S_IFMT) == S_IFREG; }
+  bool is_symlink() const { return (mode & S_IFMT) == S_IFLNK; }
+};
+
+// Walks newc headers on a decoded ramdisk stream. File payloads that the
+// caller does not read are skipped through RamdiskDecoder::Skip.
+class CpioReader {
+ public:
+  explicit CpioReader(RamdiskDecoder &decoder) : decoder_(decoder) {}
+
+  // Advances to the next entry. Returns false at the trailer, at the end of
+  // the stream, or on error (see failed()).
+  bool Next(CpioEntry &entry);
+
+  // Reads from the payload of the current entry.
+  bool ReadData(void *buf, size_t size);
+
+  // Moves to the entry whose header is at header_offset, as found by an
+  // earlier pass over the same stream, so Next() returns it. The decoder
+  // resumes at the last checkpoint before it unless decoding on from here
+  // is shorter.
+  bool SeekTo(uint64_t header_offset,
+              const std::vector<SeekCheckpoint> &checkpoints);
+
+  bool failed() const { return failed_; }
+
+ private:
+  bool SkipPending();
+  bool Read(void *buf, size_t size);
+  bool Skip(uint64_t size);
+
+  RamdiskDecoder &decoder_;
+  uint64_t position_ = 0;
+  uint64_t data_left_ = 0;
+  uint64_t data_pad_ = 0;
+  bool failed_ = false;
+  bool done_ = false;
+};
+
+const char *CpioTypeName(uint32_t mode);
@@ -0,0 +1,66 @@
+#include "cpio_writer.h"
+
+#include "log.h"
+
+bool CpioWriter::Write(const void *buf, size_t size) {
+  if (!encoder_.Write(buf, size)) return false;
+  position_ += size;
+  return true;
+}
+
+bool CpioWriter::Pad() {
+  static constexpr char zeros[4] = {};
+  return Write(zeros, CpioPad4(position_));
+}
+
+bool CpioWriter::WriteHeader(const CpioEntry &entry) {
+  if (data_left_ != 0) {
+    LOGE("cpio: Short data for previous entry");
+    return false;
+  }
+  const uint64_t size = entry.is_symlink() ? entry.target.size() : entry.size;
+  if (size > UINT32_MAX) {
+    LOGE("cpio: Entry too large: %s", entry.path.c_str());
+    return false;
+  }
+
+  // Inodes are not preserved, so never claim hard links for files.
+  CpioNewcHeader fields;
+  fields.mode = entry.mode;
+  fields.uid = entry.uid;
+  fields.gid = entry.gid;
+  fields.nlink = entry.is_dir() ? 2 : 1;
+  fields.mtime = entry.mtime;
+  fields.filesize = static_cast<uint32_t>(size);
+  fields.namesize = static_cast<uint32_t>(entry.path.size() + 1);
+
+  char header[CPIO_NEWC_HEADER_SIZE];
+  FormatCpioNewcHeader(fields, header);
+  return Write(header, sizeof(header)) &&
+         Write(entry.path.c_str(), entry.path.size() + 1) && Pad();
+}
+
+bool CpioWriter::WriteEntry(const CpioEntry &entry) {
+  if (!WriteHeader(entry)) return false;
+  if (entry.is_symlink()) {
+    return Write(entry.target.data(), entry.target.size()) && Pad();
+  }
+  data_left_ = entry.size;
+  return data_left_ != 0 || Pad();
+}
+
+bool CpioWriter::WriteData(const void *buf, size_t size) {
+  if (size > data_left_) {
+    LOGE("cpio: Data exceeds entry size");
+    return false;
+  }
+  if (!Write(buf, size)) return false;
+  data_left_ -= size;
+  return data_left_ != 0 || Pad();
+}
+
+bool CpioWriter::Finish() {
+  CpioEntry trailer;
+  trailer.path = CPIO_TRAILER_NAME;
+  return WriteHeader(trailer) && encoder_.Finish();
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+
+#include "cpio_reader.h"
+#include "encoder.h"
+
+// Emits newc entries into a RamdiskEncoder, the write side of CpioReader.
+class CpioWriter {
+ public:
+  explicit CpioWriter(RamdiskEncoder &encoder) : encoder_(encoder) {}
+
+  // Writes the header and name of entry. Symlink targets are written here
+  // too; regular files must be followed by exactly entry.size bytes of
+  // WriteData.
+  bool WriteEntry(const CpioEntry &entry);
+  bool WriteData(const void *buf, size_t size);
+
+  // Writes the trailer and finishes the encoder.
+  bool Finish();
+
+ private:
+  bool WriteHeader(const CpioEntry &entry);
+  bool Write(const void *buf, size_t size);
+  bool Pad();
+
+  RamdiskEncoder &encoder_;
+  uint64_t position_ = 0;
+  uint64_t data_left_ = 0;
+};
@@ -0,0 +1,413 @@
+#include "decoder.h"
+
+#include <algorithm>
+
+#include "log.h"
+#include "lz4.h"
+#include "lzma/lzma.h"
+#include "tools.h"
+#include "zlib.h"
+
+namespace {
+constexpr size_t IN_BUFSIZE = 65536;
+constexpr uint32_t LZ4_LEGACY_MAGIC = 0x184C2102;
+constexpr uint32_t LZ4_LEGACY_BLOCKSIZE = 8 * 1024 * 1024;
+constexpr uint64_t LZMA_MEMLIMIT = 20 * 1024 * 1024;
+constexpr size_t GZIP_TRAILER_SIZE = 8;
+constexpr size_t DEFLATE_WINDOW_SIZE = 32768;
+
+class RawDecoder : public RamdiskDecoder {
+ public:
+  explicit RawDecoder(std::unique_ptr<ByteSource> source)
+      : source_(std::move(source)), end_(source_->size()) {}
+
+  ssize_t Read(void *buf, size_t size) override {
+    size = static_cast<size_t>(std::min<uint64_t>(size, end_ - pos_));
+    if (size == 0) return 0;
+    if (!source_->ReadAt(buf, size, pos_)) return -1;
+    pos_ += size;
+    return static_cast<ssize_t>(size);
+  }
+
+  bool Skip(uint64_t size) override {
+    if (size > end_ - pos_) return false;
+    pos_ += size;
+    return true;
+  }
+
+  uint64_t consumed() const override { return pos_; }
+
+ private:
+  std::unique_ptr<ByteSource> source_;
+  uint64_t pos_ = 0;
+  uint64_t end_;
+};
+
+class GzipDecoder : public RamdiskDecoder {
+ public:
+  explicit GzipDecoder(std::unique_ptr<ByteSource> source)
+      : source_(std::move(source)), in_(*source_) {
+    // 32: accept both gzip and zlib wrappers.
+    ok_ = inflateInit2(&strm_, 15 + 32) == Z_OK;
+  }
+  ~GzipDecoder() override {
+    if (ok_) inflateEnd(&strm_);
+  }
+
+  ssize_t Read(void *buf, size_t size) override {
+    if (!ok_) return -1;
+    strm_.next_out = static_cast<Bytef *>(buf);
+    strm_.avail_out = static_cast<uInt>(size);
+
+    while (strm_.avail_out > 0 && !done_) {
+      if (in_.available() == 0 && !in_.Fill()) return -1;
+
+      strm_.next_in = const_cast<Bytef *>(in_.data());
+      strm_.avail_in = static_cast<uInt>(in_.available());
+      const uInt avail_out = strm_.avail_out;
+      // Z_BLOCK stops at every block boundary, where a checkpoint can go.
+      int ret = inflate(&strm_, recording() ? Z_BLOCK : Z_NO_FLUSH);
+      in_.Consume(in_.available() - strm_.avail_in);
+      out_ += avail_out - strm_.avail_out;
+
+      if (ret == Z_OK && (strm_.data_type & 128) &&
+          !(strm_.data_type & 64) && WantCheckpoint(out_)) {
+        Checkpoint();
+      }
+      if (ret == Z_STREAM_END) {
+        // A stream resumed without its wrapper leaves the trailer unread.
+        if (raw_) {
+          in_.SeekTo(in_.position() + GZIP_TRAILER_SIZE);
+          inflateReset2(&strm_, 15 + 32);
+          raw_ = false;
+        }
+        // Like gzread, continue into a following gzip member if there is one.
+        uint8_t magic[2];
+        uint64_t next = in_.position();
+        if (next + 2 <= in_.end() && in_.PeekAt(next, magic, 2) &&
+            isGzipHeader(magic, 2)) {
+          inflateReset(&strm_);
+        } else {
+          done_ = true;
+        }
+      } else if (ret == Z_BUF_ERROR && in_.eof()) {
+        LOGE("gzip: Unexpected end of stream");
+        ok_ = false;
+        break;
+      } else if (ret != Z_OK) {
+        LOGE("gzip: Error during decompression: %s",
+             strm_.msg ? strm_.msg : "unknown");
+        ok_ = false;
+        break;
+      }
+    }
+
+    const size_t produced = size - strm_.avail_out;
+    if (produced == 0 && !ok_) return -1;
+    return static_cast<ssize_t>(produced);
+  }
+
+  // As zran does: the bit position in the input plus the last 32 KB of
+  // output are all raw inflate needs to pick up at a block boundary.
+  bool Resume(const SeekCheckpoint &checkpoint) override {
+    // A failed resume leaves the stream unusable.
+    ok_ = false;
+    if (inflateReset2(&strm_, -15) != Z_OK) return false;
+    const uint64_t in = checkpoint.in;
+    if (checkpoint.bits > 0) {
+      uint8_t byte;
+      if (checkpoint.bits > 7 || !in_.PeekAt(in - 1, &byte, 1) ||
+          inflatePrime(&strm_, checkpoint.bits,
+                       byte >> (8 - checkpoint.bits)) != Z_OK) {
+        return false;
+      }
+    }
+    if (inflateSetDictionary(&strm_, checkpoint.window.data(),
+                             static_cast<uInt>(checkpoint.window.size())) !=
+        Z_OK) {
+      return false;
+    }
+    in_.SeekTo(in);
+    out_ = checkpoint.out;
+    ok_ = raw_ = true;
+    done_ = false;
+    return true;
+  }
+
+  uint64_t consumed() const override { return in_.position(); }
+
+ private:
+  void Checkpoint() {
+    SeekCheckpoint checkpoint;
+    checkpoint.out = out_;
+    checkpoint.in = in_.position();
+    checkpoint.bits = static_cast<uint8_t>(strm_.data_type & 7);
+    checkpoint.window.resize(DEFLATE_WINDOW_SIZE);
+    uInt window_size = 0;
+    inflateGetDictionary(&strm_, checkpoint.window.data(), &window_size);
+    checkpoint.window.resize(window_size);
+    AddCheckpoint(std::move(checkpoint));
+  }
+
+  std::unique_ptr<ByteSource> source_;
+  SourceReader in_;
+  z_stream strm_{};
+  uint64_t out_ = 0;
+  bool ok_ = false;
+  bool done_ = false;
+  bool raw_ = false;
+};
+
+class LzmaDecoder : public RamdiskDecoder {
+ public:
+  explicit LzmaDecoder(std::unique_ptr<ByteSource> source)
+      : source_(std::move(source)), in_(*source_) {
+    ok_ = lzma_alone_decoder(&strm_, LZMA_MEMLIMIT) == LZMA_OK;
+  }
+  ~LzmaDecoder() override { lzma_end(&strm_); }
+
+  ssize_t Read(void *buf, size_t size) override {
+    if (!ok_) return -1;
+    strm_.next_out = static_cast<uint8_t *>(buf);
+    strm_.avail_out = size;
+
+    while (strm_.avail_out > 0 && !done_) {
+      if (in_.available() == 0 && !in_.Fill()) return -1;
+
+      strm_.next_in = in_.data();
+      strm_.avail_in = in_.available();
+      lzma_ret ret = lzma_code(&strm_, in_.eof() ? LZMA_FINISH : LZMA_RUN);
+      in_.Consume(in_.available() - strm_.avail_in);
+
+      if (ret == LZMA_STREAM_END) {
+        done_ = true;
+      } else if (ret != LZMA_OK) {
+        LOGE("LZMA: Decompression error: %d", ret);
+        ok_ = false;
+        break;
+      }
+    }
+
+    const size_t produced = size - strm_.avail_out;
+    if (produced == 0 && !ok_) return -1;
+    return static_cast<ssize_t>(produced);
+  }
+
+  uint64_t consumed() const override { return in_.position(); }
+
+ private:
+  std::unique_ptr<ByteSource> source_;
+  SourceReader in_;
+  lzma_stream strm_ = LZMA_STREAM_INIT;
+  bool ok_ = false;
+  bool done_ = false;
+};
+
+// Legacy LZ4 frames are a magic followed by [le32 size][block] pairs. Every
+// block but the last decodes to exactly LZ4_LEGACY_BLOCKSIZE bytes, which lets
+// Skip() step over whole blocks without decompressing them.
+class Lz4LegacyDecoder : public RamdiskDecoder {
+ public:
+  explicit Lz4LegacyDecoder(std::unique_ptr<ByteSource> source)
+      : source_(std::move(source)), in_(*source_) {}
+
+  ssize_t Read(void *buf, size_t size) override {
+    auto *out = static_cast<uint8_t *>(buf);
+    size_t produced = 0;
+    while (produced < size) {
+      if (out_pos_ == out_len_) {
+        int ret = DecodeNextBlock();
+        if (ret < 0) return produced > 0 ? static_cast<ssize_t>(produced) : -1;
+        if (ret == 0) break;
+      }
+      const size_t chunk = std::min(size - produced, out_len_ - out_pos_);
+      std::copy_n(out_buf_.data() + out_pos_, chunk, out + produced);
+      out_pos_ += chunk;
+      produced += chunk;
+    }
+    return static_cast<ssize_t>(produced);
+  }
+
+  bool Skip(uint64_t size) override {
+    const size_t buffered = std::min<uint64_t>(size, out_len_ - out_pos_);
+    out_pos_ += buffered;
+    size -= buffered;
+
+    while (size >= LZ4_LEGACY_BLOCKSIZE) {
+      uint32_t block_size;
+      if (!BlockAt(next_block_, block_size)) break;
+      uint64_t following = next_block_ + 4 + block_size;
+      uint32_t following_size;
+      uint8_t raw[4];
+      // Only a block followed by another block of the same stream is known to
+      // be full size.
+      if (!in_.PeekAt(following, raw, sizeof(raw)) ||
+          LoadU32(raw) == LZ4_LEGACY_MAGIC ||
+          !BlockAt(following, following_size)) {
+        break;
+      }
+      Checkpoint();
+      next_block_ = following;
+      block_out_ += LZ4_LEGACY_BLOCKSIZE;
+      size -= LZ4_LEGACY_BLOCKSIZE;
+    }
+    return RamdiskDecoder::Skip(size);
+  }
+
+  bool Resume(const SeekCheckpoint &checkpoint) override {
+    next_block_ = checkpoint.in;
+    block_out_ = checkpoint.out;
+    out_pos_ = out_len_ = 0;
+    checked_magic_ = true;
+    return true;
+  }
+
+  uint64_t consumed() const override { return next_block_; }
+
+ private:
+  // Locates the block header at offset, stepping over the magic of a
+  // concatenated stream. Returns false at the end of the data.
+  bool BlockAt(uint64_t &offset, uint32_t &block_size) const {
+    while (offset + 4 <= in_.end()) {
+      uint8_t raw[4];
+      if (!in_.PeekAt(offset, raw, sizeof(raw))) return false;
+      block_size = LoadU32(raw);
+      if (block_size == LZ4_LEGACY_MAGIC) {
+        offset += 4;
+        continue;
+      }
+      return block_size != 0 &&
+             block_size <= LZ4_COMPRESSBOUND(LZ4_LEGACY_BLOCKSIZE) &&
+             offset + 4 + block_size <= in_.end();
+    }
+    return false;
+  }
+
+  // Returns 1 when a block was decoded, 0 at the end and -1 on error.
+  int DecodeNextBlock() {
+    if (!checked_magic_) {
+      uint8_t raw[4];
+      if (!in_.PeekAt(in_.position(), raw, sizeof(raw)) ||
+          LoadU32(raw) != LZ4_LEGACY_MAGIC) {
+        LOGE("LZ4: Invalid legacy frame");
+        return -1;
+      }
+      checked_magic_ = true;
+    }
+
+    uint32_t block_size;
+    if (!BlockAt(next_block_, block_size)) return 0;
+    Checkpoint();
+
+    in_buf_.resize(block_size);
+    if (!in_.PeekAt(next_block_ + 4, in_buf_.data(), block_size)) return -1;
+    out_buf_.resize(LZ4_LEGACY_BLOCKSIZE);
+    int decoded = LZ4_decompress_safe(
+        reinterpret_cast<const char *>(in_buf_.data()),
+        reinterpret_cast<char *>(out_buf_.data()), static_cast<int>(block_size),
+        static_cast<int>(out_buf_.size()));
+    if (decoded < 0) {
+      LOGE("LZ4: Error decompressing");
+      return -1;
+    }
+    next_block_ += 4 + block_size;
+    block_out_ += static_cast<uint64_t>(decoded);
+    out_pos_ = 0;
+    out_len_ = static_cast<size_t>(decoded);
+    return 1;
+  }
+
+  // Every block starts afresh, so its header offset is a checkpoint.
+  void Checkpoint() {
+    if (WantCheckpoint(block_out_)) {
+      AddCheckpoint(SeekCheckpoint{block_out_, next_block_, 0, {}});
+    }
+  }
+
+  std::unique_ptr<ByteSource> source_;
+  SourceReader in_;
+  uint64_t next_block_ = 4;
+  uint64_t block_out_ = 0;  // decoded offset of the block at next_block_
+  bool checked_magic_ = false;
+  std::vector<uint8_t> in_buf_;
+  std::vector<uint8_t> out_buf_;
+  size_t out_pos_ = 0;
+  size_t out_len_ = 0;
+};
+}  // namespace
+
+bool RamdiskDecoder::Skip(uint64_t size) {
+  uint8_t scratch[IN_BUFSIZE];
+  while (size > 0) {
+    ssize_t n = Read(scratch, std::min<uint64_t>(size, sizeof(scratch)));
+    if (n <= 0) return false;
+    size -= static_cast<uint64_t>(n);
+  }
+  return true;
+}
+
+bool RamdiskDecoder::Resume(const SeekCheckpoint &) { return false; }
+
+bool RamdiskDecoder::ReadExact(void *buf, size_t size) {
+  auto *out = static_cast<uint8_t *>(buf);
+  while (size > 0) {
+    ssize_t n = Read(out, size);
+    if (n <= 0) return false;
+    out += n;
+    size -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+std::unique_ptr<RamdiskDecoder> RamdiskDecoder::Open(int fd, uint64_t offset,
+                                                     uint64_t size,
+                                                     uint8_t format) {
+  const Codec *codec = FindCodec(format);
+  if (codec == nullptr) {
+    LOGE("Compression method is unknown!");
+    return nullptr;
+  }
+  return codec->decoder(std::make_unique<FdSource>(fd, offset, size));
+}
+
+std::unique_ptr<RamdiskDecoder> NewRawDecoder(std::unique_ptr<ByteSource> in) {
+  return std::make_unique<RawDecoder>(std::move(in));
+}
+
+std::unique_ptr<RamdiskDecoder> NewGzipDecoder(std::unique_ptr<ByteSource> in) {
+  return std::make_unique<GzipDecoder>(std::move(in));
+}
+
+std::unique_ptr<RamdiskDecoder> NewLz4LegacyDecoder(
+    std::unique_ptr<ByteSource> in) {
+  return std::make_unique<Lz4LegacyDecoder>(std::move(in));
+}
+
+std::unique_ptr<RamdiskDecoder> NewLzmaDecoder(std::unique_ptr<ByteSource> in) {
+  return std::make_unique<LzmaDecoder>(std::move(in));
+}
+
+bool SourceReader::Fill() {
+  if (available() > 0 || pos_ >= end_) return true;
+  buffer_.resize(IN_BUFSIZE);
+  const size_t want =
+      static_cast<size_t>(std::min<uint64_t>(buffer_.size(), end_ - pos_));
+  if (!source_.ReadAt(buffer_.data(), want, pos_)) {
+    LOGE("Error reading at offset %llu", static_cast<unsigned long long>(pos_));
+    return false;
+  }
+  head_ = 0;
+  tail_ = want;
+  pos_ += want;
+  return true;
+}
+
+bool SourceReader::PeekAt(uint64_t offset, void *buf, size_t size) const {
+  if (offset > end_ || size > end_ - offset) return false;
+  return source_.ReadAt(buf, size, offset);
+}
+
+void SourceReader::SeekTo(uint64_t offset) {
+  pos_ = std::min(offset, end_);
+  head_ = tail_ = 0;
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "codec.h"
+
+// A place partway into a compressed stream where decoding can restart.
+struct SeekCheckpoint {
+  uint64_t out = 0;  // offset in the decoded stream
+  uint64_t in = 0;   // offset of the next input byte, from the section start
+  uint8_t bits = 0;  // gzip: bits of the byte before in still to be read
+  std::vector<uint8_t> window;  // gzip: up to 32 KB of output before out
+};
+
+// Pull-based decoder over a ByteSource, so ramdisks can be read straight out
+// of the image without extracting them first. Codec::decoder creates one.
+class RamdiskDecoder {
+ public:
+  virtual ~RamdiskDecoder() = default;
+
+  // Returns the number of bytes decoded into buf, 0 at the end of the stream
+  // and -1 on error.
+  virtual ssize_t Read(void *buf, size_t size) = 0;
+
+  // Discards size bytes of decoded output. Codecs that can locate output
+  // without decoding it override this.
+  virtual bool Skip(uint64_t size);
+
+  bool ReadExact(void *buf, size_t size);
+
+  // Input bytes used up so far, for progress.
+  virtual uint64_t consumed() const = 0;
+
+  // While decoding from the start, appends a checkpoint to *checkpoints
+  // roughly every span bytes of output. Codecs with no place to restart
+  // (LZMA, uncompressed data) record none.
+  void RecordCheckpoints(std::vector<SeekCheckpoint> *checkpoints,
+                         uint64_t span) {
+    checkpoints_ = checkpoints;
+    span_ = span;
+  }
+
+  // Continues decoding at checkpoint, recorded on the same stream. Returns
+  // false if the codec cannot.
+  virtual bool Resume(const SeekCheckpoint &checkpoint);
+
+  // Decoder for the format over [offset, offset + size) of fd.
+  static std::unique_ptr<RamdiskDecoder> Open(int fd, uint64_t offset,
+                                              uint64_t size, uint8_t format);
+
+ protected:
+  bool recording() const { return checkpoints_ != nullptr; }
+  // Whether a checkpoint at output offset out is due.
+  bool WantCheckpoint(uint64_t out) const {
+    return checkpoints_ != nullptr &&
+           out >= (checkpoints_->empty() ? 0 : checkpoints_->back().out) + span_;
+  }
+  void AddCheckpoint(SeekCheckpoint checkpoint) {
+    checkpoints_->push_back(std::move(checkpoint));
+  }
+
+ private:
+  std::vector<SeekCheckpoint> *checkpoints_ = nullptr;
+  uint64_t span_ = 0;
+};
+
+std::unique_ptr<RamdiskDecoder> NewRawDecoder(std::unique_ptr<ByteSource> in);
+std::unique_ptr<RamdiskDecoder> NewGzipDecoder(std::unique_ptr<ByteSource> in);
+std::unique_ptr<RamdiskDecoder> NewLz4LegacyDecoder(
+    std::unique_ptr<ByteSource> in);
+std::unique_ptr<RamdiskDecoder> NewLzmaDecoder(std::unique_ptr<ByteSource> in);
+
+// Buffered sequential reader over a ByteSource.
+class SourceReader {
+ public:
+  explicit SourceReader(const ByteSource &source)
+      : source_(source), end_(source.size()) {}
+
+  // Refills the buffer once it has been consumed. Returns false on a read
+  // error; at the end of the region the buffer simply stays empty.
+  bool Fill();
+  const uint8_t *data() const { return buffer_.data() + head_; }
+  size_t available() const { return tail_ - head_; }
+  void Consume(size_t size) { head_ += size; }
+  bool eof() const { return available() == 0 && pos_ >= end_; }
+
+  // Reads at an offset without disturbing the buffered stream.
+  bool PeekAt(uint64_t offset, void *buf, size_t size) const;
+  // Offset of the next unconsumed byte.
+  uint64_t position() const { return pos_ - available(); }
+  // Drops the buffer and continues at offset.
+  void SeekTo(uint64_t offset);
+  uint64_t end() const { return end_; }
+
+ private:
+  const ByteSource &source_;
+  uint64_t pos_ = 0;
+  uint64_t end_;
+  std::vector<uint8_t> buffer_;
+  size_t head_ = 0;
+  size_t tail_ = 0;
+};
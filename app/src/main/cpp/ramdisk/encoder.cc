@@ -0,0 +1,246 @@
+#include "encoder.h"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "log.h"
+#include "lz4hc.h"
+#include "lzma/lzma.h"
+#include "scheduler.h"
+#include "tools.h"
+#include "zlib.h"
+
+namespace {
+constexpr size_t OUT_BUFSIZE = 65536;
+constexpr uint32_t LZ4_LEGACY_MAGIC = 0x184C2102;
+constexpr size_t LZ4_LEGACY_BLOCKSIZE = 8 * 1024 * 1024;
+
+class RawEncoder : public RamdiskEncoder {
+ public:
+  explicit RawEncoder(std::unique_ptr<ByteSink> sink) : sink_(std::move(sink)) {}
+
+  bool Write(const void *buf, size_t size) override {
+    return sink_->Write(buf, size);
+  }
+  bool Finish() override { return true; }
+
+ private:
+  std::unique_ptr<ByteSink> sink_;
+};
+
+class GzipEncoder : public RamdiskEncoder {
+ public:
+  GzipEncoder(std::unique_ptr<ByteSink> sink, int level)
+      : sink_(std::move(sink)), out_(OUT_BUFSIZE) {
+    // 16: gzip wrapper, as gzopen() writes.
+    ok_ = deflateInit2(&strm_, level, Z_DEFLATED, 15 + 16, 8,
+                       Z_DEFAULT_STRATEGY) == Z_OK;
+  }
+  ~GzipEncoder() override {
+    if (ok_) deflateEnd(&strm_);
+  }
+
+  bool Write(const void *buf, size_t size) override {
+    strm_.next_in = static_cast<Bytef *>(const_cast<void *>(buf));
+    strm_.avail_in = static_cast<uInt>(size);
+    return Pump(Z_NO_FLUSH);
+  }
+
+  bool Finish() override {
+    strm_.next_in = nullptr;
+    strm_.avail_in = 0;
+    return Pump(Z_FINISH);
+  }
+
+ private:
+  bool Pump(int flush) {
+    if (!ok_) return false;
+    int ret;
+    do {
+      strm_.next_out = out_.data();
+      strm_.avail_out = static_cast<uInt>(out_.size());
+      ret = deflate(&strm_, flush);
+      if (ret == Z_STREAM_ERROR) {
+        LOGE("gzip: Error compressing");
+        return false;
+      }
+      if (!sink_->Write(out_.data(), out_.size() - strm_.avail_out)) {
+        LOGE("gzip: Error writing output");
+        return false;
+      }
+    } while (strm_.avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+    return true;
+  }
+
+  std::unique_ptr<ByteSink> sink_;
+  z_stream strm_{};
+  std::vector<Bytef> out_;
+  bool ok_ = false;
+};
+
+class LzmaEncoder : public RamdiskEncoder {
+ public:
+  LzmaEncoder(std::unique_ptr<ByteSink> sink, int level)
+      : sink_(std::move(sink)), out_(OUT_BUFSIZE) {
+    lzma_options_lzma options;
+    lzma_lzma_preset(&options,
+                     static_cast<uint32_t>(level) | LZMA_PRESET_EXTREME);
+    options.dict_size = 16 * 1024 * 1024;
+    ok_ = lzma_alone_encoder(&strm_, &options) == LZMA_OK;
+  }
+  ~LzmaEncoder() override { lzma_end(&strm_); }
+
+  bool Write(const void *buf, size_t size) override {
+    strm_.next_in = static_cast<const uint8_t *>(buf);
+    strm_.avail_in = size;
+    return Pump(LZMA_RUN);
+  }
+
+  bool Finish() override {
+    strm_.next_in = nullptr;
+    strm_.avail_in = 0;
+    return Pump(LZMA_FINISH);
+  }
+
+ private:
+  bool Pump(lzma_action action) {
+    if (!ok_) return false;
+    while (true) {
+      strm_.next_out = out_.data();
+      strm_.avail_out = out_.size();
+      lzma_ret ret = lzma_code(&strm_, action);
+      if (ret != LZMA_OK && ret != LZMA_STREAM_END) {
+        LOGE("LZMA: Error compressing");
+        return false;
+      }
+      if (!sink_->Write(out_.data(), out_.size() - strm_.avail_out)) {
+        LOGE("LZMA: Error writing output");
+        return false;
+      }
+      if (ret == LZMA_STREAM_END) return true;
+      if (action == LZMA_RUN && strm_.avail_in == 0 && strm_.avail_out != 0) {
+        return true;
+      }
+    }
+  }
+
+  std::unique_ptr<ByteSink> sink_;
+  lzma_stream strm_ = LZMA_STREAM_INIT;
+  std::vector<uint8_t> out_;
+  bool ok_ = false;
+};
+
+// Legacy frame: magic, then [le32 size][block] for every 8 MB of input.
+// Blocks are independent, so one per scheduler thread is compressed at a
+// time and they are written out in order.
+class Lz4LegacyEncoder : public RamdiskEncoder {
+ public:
+  Lz4LegacyEncoder(std::unique_ptr<ByteSink> sink, int level)
+      : sink_(std::move(sink)), level_(level), blocks_(TaskThreads()) {
+    uint8_t magic[4];
+    StoreU32(magic, LZ4_LEGACY_MAGIC);
+    ok_ = sink_->Write(magic, sizeof(magic));
+  }
+
+  bool Write(const void *buf, size_t size) override {
+    auto *p = static_cast<const uint8_t *>(buf);
+    while (ok_ && size > 0) {
+      auto &in = blocks_[filled_].in;
+      if (in.empty()) in.reserve(LZ4_LEGACY_BLOCKSIZE);
+      const size_t chunk = std::min(size, LZ4_LEGACY_BLOCKSIZE - in.size());
+      in.insert(in.end(), p, p + chunk);
+      p += chunk;
+      size -= chunk;
+      if (in.size() == LZ4_LEGACY_BLOCKSIZE && ++filled_ == blocks_.size()) {
+        ok_ = Flush();
+      }
+    }
+    return ok_;
+  }
+
+  bool Finish() override {
+    if (ok_ && !blocks_[filled_].in.empty()) ++filled_;
+    if (ok_ && filled_ > 0) ok_ = Flush();
+    return ok_;
+  }
+
+ private:
+  struct Block {
+    std::vector<uint8_t> in;
+    std::vector<uint8_t> out;
+    int size = 0;
+  };
+
+  // Levels below 3 take LZ4's fast path, as in the lz4 tool.
+  bool Compress(Block &block) const {
+    block.out.resize(LZ4_compressBound(LZ4_LEGACY_BLOCKSIZE));
+    const auto *src = reinterpret_cast<const char *>(block.in.data());
+    auto *dst = reinterpret_cast<char *>(block.out.data());
+    const auto src_size = static_cast<int>(block.in.size());
+    const auto dst_size = static_cast<int>(block.out.size());
+    block.size = level_ < 3
+                     ? LZ4_compress_default(src, dst, src_size, dst_size)
+                     : LZ4_compress_HC(src, dst, src_size, dst_size, level_);
+    if (block.size <= 0) {
+      LOGE("LZ4: Error compressing");
+      return false;
+    }
+    return true;
+  }
+
+  bool Flush() {
+    const size_t count = std::exchange(filled_, 0);
+    bool ok = ParallelFor(count, static_cast<unsigned>(blocks_.size()),
+                          [&](size_t i) { return Compress(blocks_[i]); });
+    for (size_t i = 0; i < count; ++i) {
+      Block &block = blocks_[i];
+      uint8_t header[4];
+      StoreU32(header, static_cast<uint32_t>(block.size));
+      if (ok && (!sink_->Write(header, sizeof(header)) ||
+                 !sink_->Write(block.out.data(),
+                               static_cast<size_t>(block.size)))) {
+        LOGE("LZ4: Error writing output");
+        ok = false;
+      }
+      block.in.clear();
+    }
+    return ok;
+  }
+
+  std::unique_ptr<ByteSink> sink_;
+  int level_;
+  std::vector<Block> blocks_;
+  size_t filled_ = 0;
+  bool ok_;
+};
+}  // namespace
+
+std::unique_ptr<RamdiskEncoder> RamdiskEncoder::Open(int fd, uint8_t format) {
+  const Codec *codec = FindCodec(format);
+  if (codec == nullptr) {
+    LOGE("Unsupported ramdisk compression");
+    return nullptr;
+  }
+  return codec->encoder(std::make_unique<FdSink>(fd), codec->level);
+}
+
+std::unique_ptr<RamdiskEncoder> NewRawEncoder(std::unique_ptr<ByteSink> out,
+                                              int) {
+  return std::make_unique<RawEncoder>(std::move(out));
+}
+
+std::unique_ptr<RamdiskEncoder> NewGzipEncoder(std::unique_ptr<ByteSink> out,
+                                               int level) {
+  return std::make_unique<GzipEncoder>(std::move(out), level);
+}
+
+std::unique_ptr<RamdiskEncoder> NewLz4LegacyEncoder(
+    std::unique_ptr<ByteSink> out, int level) {
+  return std::make_unique<Lz4LegacyEncoder>(std::move(out), level);
+}
+
+std::unique_ptr<RamdiskEncoder> NewLzmaEncoder(std::unique_ptr<ByteSink> out,
+                                               int level) {
+  return std::make_unique<LzmaEncoder>(std::move(out), level);
+}
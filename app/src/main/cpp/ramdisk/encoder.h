@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "codec.h"
+
+// Push-based counterpart of RamdiskDecoder: compresses whatever is written
+// into it straight to a ByteSink, so archives never need to exist
+// uncompressed. Codec::encoder creates one.
+class RamdiskEncoder {
+ public:
+  virtual ~RamdiskEncoder() = default;
+
+  virtual bool Write(const void *buf, size_t size) = 0;
+  // Flushes the remaining input and ends the stream.
+  virtual bool Finish() = 0;
+
+  // Encoder for the format at its build level, writing to fd.
+  static std::unique_ptr<RamdiskEncoder> Open(int fd, uint8_t format);
+};
+
+std::unique_ptr<RamdiskEncoder> NewRawEncoder(std::unique_ptr<ByteSink> out,
+                                              int level);
+std::unique_ptr<RamdiskEncoder> NewGzipEncoder(std::unique_ptr<ByteSink> out,
+                                               int level);
+std::unique_ptr<RamdiskEncoder> NewLz4LegacyEncoder(
+    std::unique_ptr<ByteSink> out, int level);
+// Levels are LZMA presets, always used with LZMA_PRESET_EXTREME.
+std::unique_ptr<RamdiskEncoder> NewLzmaEncoder(std::unique_ptr<ByteSink> out,
+                                               int level);
@@ -0,0 +1,205 @@
+#include <fnmatch.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <system_error>
+#include <unordered_set>
+
+#include "log.h"
+#include "ramdisk.h"
+#include "seek_index.h"
+#include "tools.h"
+
+namespace {
+constexpr size_t COPY_BUFSIZE = 65536;
+
+std::string NormalizePath(std::string_view path) {
+  while (path.starts_with("./")) path.remove_prefix(2);
+  while (path.starts_with("/")) path.remove_prefix(1);
+  return std::string(path);
+}
+
+bool IsGlob(const std::string &pattern) {
+  return pattern.find_first_of("*?[") != std::string::npos;
+}
+
+// Archive paths come from the image; never let one escape output_dir.
+bool IsSafePath(const std::string &path) {
+  if (path.empty()) return false;
+  for (const auto &part : std::filesystem::path(path)) {
+    if (part == "..") return false;
+  }
+  return true;
+}
+
+class PathSelector {
+ public:
+  explicit PathSelector(const std::vector<std::string> &patterns) {
+    for (const auto &p : patterns) {
+      auto pattern = NormalizePath(p);
+      if (IsGlob(pattern)) {
+        globs_.push_back(std::move(pattern));
+      } else {
+        literals_.insert(std::move(pattern));
+      }
+    }
+  }
+
+  bool Matches(const std::string &path) {
+    if (literals_.contains(path)) {
+      seen_.insert(path);
+      return true;
+    }
+    for (const auto &glob : globs_) {
+      if (fnmatch(glob.c_str(), path.c_str(), 0) == 0) return true;
+    }
+    return false;
+  }
+
+  // Globs can match anywhere in the archive; literals only once.
+  bool Done() const { return globs_.empty() && seen_.size() == literals_.size(); }
+
+  std::vector<std::string> Missing() const {
+    std::vector<std::string> missing;
+    for (const auto &literal : literals_) {
+      if (!seen_.contains(literal)) missing.push_back(literal);
+    }
+    return missing;
+  }
+
+ private:
+  std::unordered_set<std::string> literals_;
+  std::unordered_set<std::string> seen_;
+  std::vector<std::string> globs_;
+};
+
+bool Materialise(CpioReader &reader, const CpioEntry &entry,
+                 const std::filesystem::path &output, std::ofstream &config) {
+  const auto outpath = output / entry.path;
+  std::error_code ec;
+  std::filesystem::create_directories(outpath.parent_path(), ec);
+
+  char mode_str[6];
+  std::snprintf(mode_str, sizeof(mode_str), "0%03o",
+                static_cast<unsigned int>(entry.mode & 07777));
+
+  if (entry.is_dir()) {
+    std::filesystem::create_directory(outpath, ec);
+    config << "path=\"" << entry.path << "\" type=dir mode=" << mode_str
+           << " uid=" << entry.uid << " gid=" << entry.gid << "\n";
+  } else if (entry.is_file()) {
+    std::ofstream outfile(outpath, std::ios::binary);
+    if (!outfile) {
+      LOGE("Error creating file: %s", outpath.string().c_str());
+      return false;
+    }
+    std::vector<char> buffer(std::min<uint64_t>(entry.size, COPY_BUFSIZE));
+    uint64_t left = entry.size;
+    while (left > 0) {
+      const size_t chunk = std::min<uint64_t>(left, buffer.size());
+      if (!reader.ReadData(buffer.data(), chunk)) return false;
+      outfile.write(buffer.data(), static_cast<std::streamsize>(chunk));
+      left -= chunk;
+    }
+    if (!outfile) {
+      LOGE("Error writing file: %s", outpath.string().c_str());
+      return false;
+    }
+    config << "path=\"" << entry.path << "\" type=file mode=" << mode_str
+           << " uid=" << entry.uid << " gid=" << entry.gid << "\n";
+  } else if (entry.is_symlink()) {
+    config << "path=\"" << entry.path << "\" type=symlink mode=" << mode_str
+           << " uid=" << entry.uid << " gid=" << entry.gid << " target=\""
+           << entry.target << "\"\n";
+  } else {
+    LOGE("Unsupported file type: %s", entry.path.c_str());
+  }
+  return true;
+}
+}  // namespace
+
+bool ExtractRamdiskEntries(int fd, const std::vector<std::string> &patterns,
+                           const std::filesystem::path &output_dir,
+                           const std::filesystem::path &index) {
+  auto sections = LocateRamdisks(fd);
+  if (!sections) return false;
+  std::vector<RamdiskIndex> indexes;
+  if (!index.empty()) indexes = ReadSeekIndex(index).value_or(indexes);
+
+  PathSelector selector(patterns);
+  size_t extracted = 0;
+
+  for (const auto &section : *sections) {
+    if (selector.Done()) break;
+
+    // The segments of a ramdisk all extract into the same tree.
+    const auto output = output_dir / section.name;
+    std::ofstream config;
+    for (const auto &segment : SplitRamdisk(fd, section)) {
+      if (selector.Done()) break;
+
+      auto decoder = RamdiskDecoder::Open(fd, segment.offset, segment.size,
+                                          segment.format);
+      if (!decoder) {
+        LOGE("Skipping %s", section.name.c_str());
+        break;
+      }
+
+      CpioReader reader(*decoder);
+      auto wanted = [&](CpioEntry &entry) {
+        entry.path = NormalizePath(entry.path);
+        if (!selector.Matches(entry.path)) return false;
+        if (!IsSafePath(entry.path)) {
+          LOGE("Refusing unsafe path: %s", entry.path.c_str());
+          return false;
+        }
+        return true;
+      };
+      auto take = [&](const CpioEntry &entry) {
+        if (!config.is_open()) {
+          std::error_code ec;
+          std::filesystem::create_directories(output, ec);
+          config.open(output / CONFIG_FILE);
+          if (!config) {
+            LOGE("Error creating config file");
+            return false;
+          }
+        }
+        LOG("Extracting %s", entry.path.c_str());
+        if (!Materialise(reader, entry, output, config)) return false;
+        ++extracted;
+        return true;
+      };
+
+      if (const auto *indexed = FindRamdiskIndex(fd, indexes, segment)) {
+        LOG("Seeking in %s", section.name.c_str());
+        for (auto listed : indexed->entries) {
+          if (selector.Done()) break;
+          if (!wanted(listed)) continue;
+          CpioEntry entry;
+          if (!reader.SeekTo(listed.header_offset, indexed->checkpoints) ||
+              !reader.Next(entry)) {
+            return false;
+          }
+          entry.path = listed.path;
+          if (!take(entry)) return false;
+        }
+        continue;
+      }
+
+      LOG("Scanning %s", section.name.c_str());
+      CpioEntry entry;
+      while (!selector.Done() && reader.Next(entry)) {
+        if (wanted(entry) && !take(entry)) return false;
+      }
+      if (reader.failed()) return false;
+    }
+  }
+
+  for (const auto &missing : selector.Missing()) {
+    LOGE("Not found: %s", missing.c_str());
+  }
+  LOG("Extracted %zu entries", extracted);
+  return extracted > 0;
+}
@@ -0,0 +1,1081 @@
+#include "inflate.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "buffer_pool.h"
+#include "job.h"
+#include "scheduler.h"
+#include "session.h"
+#include "tools.h"
+#include "zlib.h"
+
+namespace {
+constexpr unsigned MAX_CODE_BITS = 15;
+constexpr unsigned LITLEN_TABLE_BITS = 11;
+constexpr unsigned DIST_TABLE_BITS = 8;
+constexpr unsigned PRECODE_TABLE_BITS = 7;
+constexpr unsigned NUM_LITLEN_SYMS = 288;
+constexpr unsigned NUM_DIST_SYMS = 32;
+constexpr unsigned NUM_PRECODE_SYMS = 19;
+// Main table plus, at worst, one subtable per symbol for codewords longer
+// than the main table.
+constexpr size_t LITLEN_TABLE_SIZE =
+    (1u << LITLEN_TABLE_BITS) +
+    NUM_LITLEN_SYMS * (1u << (MAX_CODE_BITS - LITLEN_TABLE_BITS));
+constexpr size_t DIST_TABLE_SIZE =
+    (1u << DIST_TABLE_BITS) +
+    NUM_DIST_SYMS * (1u << (MAX_CODE_BITS - DIST_TABLE_BITS));
+
+// Table entries: bits 0-3 hold the codeword bits to consume, 4-7 the flags,
+// 8-12 the extra bits that follow (or the index bits of a subtable), and
+// 16-31 the value: a literal, a length or distance base, or where the
+// subtable starts.
+constexpr uint32_t ENTRY_LITERAL = 0x10;
+constexpr uint32_t ENTRY_END = 0x20;
+constexpr uint32_t ENTRY_SUBTABLE = 0x40;
+constexpr uint32_t ENTRY_INVALID = 0x80;
+
+constexpr uint32_t Entry(uint32_t value, uint32_t extra, uint32_t flags) {
+  return value << 16 | extra << 8 | flags;
+}
+
+constexpr uint16_t LENGTH_BASE[29] = {3,  4,  5,  6,   7,   8,   9,   10,
+                                      11, 13, 15, 17,  19,  23,  27,  31,
+                                      35, 43, 51, 59,  67,  83,  99,  115,
+                                      131, 163, 195, 227, 258};
+constexpr uint8_t LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                      1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                      4, 4, 4, 4, 5, 5, 5, 5, 0};
+constexpr uint16_t DIST_BASE[30] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577};
+constexpr uint8_t DIST_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,
+                                    4, 4, 5, 5, 6, 6, 7,  7,  8,  8,
+                                    9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+constexpr uint8_t PRECODE_ORDER[NUM_PRECODE_SYMS] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+struct SymbolEntries {
+  uint32_t litlen[NUM_LITLEN_SYMS];
+  uint32_t dist[NUM_DIST_SYMS];
+  uint32_t precode[NUM_PRECODE_SYMS];
+
+  constexpr SymbolEntries() : litlen(), dist(), precode() {
+    for (uint32_t sym = 0; sym < 256; ++sym) {
+      litlen[sym] = Entry(sym, 0, ENTRY_LITERAL);
+    }
+    litlen[256] = ENTRY_END;
+    for (uint32_t sym = 257; sym < 286; ++sym) {
+      litlen[sym] = Entry(LENGTH_BASE[sym - 257], LENGTH_EXTRA[sym - 257], 0);
+    }
+    litlen[286] = litlen[287] = ENTRY_INVALID;
+    for (uint32_t sym = 0; sym < 30; ++sym) {
+      dist[sym] = Entry(DIST_BASE[sym], DIST_EXTRA[sym], 0);
+    }
+    dist[30] = dist[31] = ENTRY_INVALID;
+    for (uint32_t sym = 0; sym < NUM_PRECODE_SYMS; ++sym) {
+      precode[sym] = Entry(sym, 0, 0);
+    }
+  }
+};
+constexpr SymbolEntries SYMBOLS;
+
+struct Tables {
+  uint32_t litlen[LITLEN_TABLE_SIZE];
+  uint32_t dist[DIST_TABLE_SIZE];
+  uint32_t precode[1u << PRECODE_TABLE_BITS];
+};
+
+inline uint64_t Mask(unsigned bits) { return (uint64_t{1} << bits) - 1; }
+
+// Builds a decode table for the canonical code given by lens. Incomplete
+// codes are only accepted where zlib accepts them: a lone one-bit code, or
+// none at all, and never for the precode.
+bool BuildTable(uint32_t *table, unsigned table_bits, const uint8_t *lens,
+                unsigned num_syms, const uint32_t *entries,
+                bool allow_incomplete) {
+  unsigned count[MAX_CODE_BITS + 1] = {};
+  for (unsigned sym = 0; sym < num_syms; ++sym) ++count[lens[sym]];
+  count[0] = 0;
+
+  int left = 1;
+  unsigned max_len = 0;
+  for (unsigned len = 1; len <= MAX_CODE_BITS; ++len) {
+    left = (left << 1) - static_cast<int>(count[len]);
+    if (left < 0) return false;  // over-subscribed
+    if (count[len]) max_len = len;
+  }
+  const size_t main_size = size_t{1} << table_bits;
+  if (left > 0) {
+    if (!allow_incomplete || max_len > 1) return false;
+    std::fill(table, table + main_size, ENTRY_INVALID);
+  }
+
+  unsigned next_code[MAX_CODE_BITS + 1] = {};
+  for (unsigned len = 1, code = 0; len <= MAX_CODE_BITS; ++len) {
+    code = (code + count[len - 1]) << 1;
+    next_code[len] = code;
+  }
+  // Codewords are read least significant bit first, so index by them
+  // reversed.
+  uint16_t codes[NUM_LITLEN_SYMS];
+  for (unsigned sym = 0; sym < num_syms; ++sym) {
+    const unsigned len = lens[sym];
+    if (len == 0) continue;
+    unsigned code = next_code[len]++, reversed = 0;
+    for (unsigned i = 0; i < len; ++i, code >>= 1) {
+      reversed = (reversed << 1) | (code & 1);
+    }
+    codes[sym] = static_cast<uint16_t>(reversed);
+  }
+
+  if (max_len > table_bits) {
+    // Size each subtable for the longest codeword sharing its prefix.
+    uint8_t longest[1u << LITLEN_TABLE_BITS] = {};
+    for (unsigned sym = 0; sym < num_syms; ++sym) {
+      if (lens[sym] <= table_bits) continue;
+      uint8_t &slot = longest[codes[sym] & (main_size - 1)];
+      slot = std::max(slot, lens[sym]);
+    }
+    size_t next_subtable = main_size;
+    for (size_t prefix = 0; prefix < main_size; ++prefix) {
+      if (!longest[prefix]) continue;
+      const unsigned sub_bits = longest[prefix] - table_bits;
+      table[prefix] = Entry(static_cast<uint32_t>(next_subtable), sub_bits,
+                            ENTRY_SUBTABLE) |
+                      table_bits;
+      std::fill(table + next_subtable,
+                table + next_subtable + (size_t{1} << sub_bits),
+                ENTRY_INVALID);
+      next_subtable += size_t{1} << sub_bits;
+    }
+  }
+
+  for (unsigned sym = 0; sym < num_syms; ++sym) {
+    const unsigned len = lens[sym];
+    if (len == 0) continue;
+    if (len <= table_bits) {
+      for (size_t i = codes[sym]; i < main_size; i += size_t{1} << len) {
+        table[i] = entries[sym] | len;
+      }
+      continue;
+    }
+    const uint32_t pointer = table[codes[sym] & (main_size - 1)];
+    const size_t start = pointer >> 16;
+    const unsigned sub_bits = (pointer >> 8) & 0x1f;
+    const unsigned rest = len - table_bits;
+    for (size_t i = codes[sym] >> table_bits; i < (size_t{1} << sub_bits);
+         i += size_t{1} << rest) {
+      table[start + i] = entries[sym] | rest;
+    }
+  }
+  return true;
+}
+
+// The fixed code of BTYPE 01, built on first use.
+const Tables &FixedTables() {
+  static const auto tables = [] {
+    auto t = std::make_unique<Tables>();
+    uint8_t lens[NUM_LITLEN_SYMS];
+    std::fill(lens, lens + 144, 8);
+    std::fill(lens + 144, lens + 256, 9);
+    std::fill(lens + 256, lens + 280, 7);
+    std::fill(lens + 280, lens + NUM_LITLEN_SYMS, 8);
+    BuildTable(t->litlen, LITLEN_TABLE_BITS, lens, NUM_LITLEN_SYMS,
+               SYMBOLS.litlen, false);
+    std::fill(lens, lens + NUM_DIST_SYMS, 5);
+    BuildTable(t->dist, DIST_TABLE_BITS, lens, NUM_DIST_SYMS, SYMBOLS.dist,
+               false);
+    return t;
+  }();
+  return *tables;
+}
+
+// LSB-first bit reader. Refill tops the buffer up to at least 56 bits, which
+// covers a whole length/distance pair. Past the end of the input it feeds
+// zero bytes and counts them, so the decode loop needs no bounds checks;
+// consuming any of them is caught at block boundaries.
+struct BitReader {
+  const uint8_t *next;
+  const uint8_t *end;
+  uint64_t buf = 0;
+  unsigned left = 0;
+  size_t overrun = 0;
+
+  void Refill() {
+    if (end - next >= 8) {
+      uint64_t word;
+      std::memcpy(&word, next, sizeof(word));
+      buf |= word << left;  // little endian hosts only, as everywhere here
+      next += (63 - left) >> 3;
+      left += ((63 - left) >> 3) << 3;
+      return;
+    }
+    while (left < 56) {
+      uint64_t byte = 0;
+      if (next < end) {
+        byte = *next++;
+      } else {
+        ++overrun;
+      }
+      buf |= byte << left;
+      left += 8;
+    }
+  }
+  void Ensure(unsigned bits) {
+    if (left < bits) Refill();
+  }
+  uint32_t Peek(unsigned bits) const {
+    return static_cast<uint32_t>(buf & Mask(bits));
+  }
+  void Consume(unsigned bits) {
+    buf >>= bits;
+    left -= bits;
+  }
+  uint32_t Take(unsigned bits) {
+    const uint32_t value = Peek(bits);
+    Consume(bits);
+    return value;
+  }
+  // Whether the bytes consumed so far all came from the input.
+  bool InBounds() const { return overrun <= (left >> 3); }
+  size_t Consumed(const uint8_t *start) const {
+    return static_cast<size_t>(next - start) + overrun - (left >> 3);
+  }
+  uint64_t BitPosition(const uint8_t *start) const {
+    return (static_cast<uint64_t>(next - start) + overrun) * 8 - left;
+  }
+};
+
+InflateResult ReadDynamicTables(BitReader &bits, Tables &tables) {
+  bits.Ensure(14);
+  const unsigned num_litlen = bits.Take(5) + 257;
+  const unsigned num_dist = bits.Take(5) + 1;
+  const unsigned num_precode = bits.Take(4) + 4;
+  if (num_litlen > 286 || num_dist > 30) return InflateResult::BAD_DATA;
+
+  uint8_t precode_lens[NUM_PRECODE_SYMS] = {};
+  for (unsigned i = 0; i < num_precode; ++i) {
+    bits.Ensure(3);
+    precode_lens[PRECODE_ORDER[i]] = static_cast<uint8_t>(bits.Take(3));
+  }
+  if (!BuildTable(tables.precode, PRECODE_TABLE_BITS, precode_lens,
+                  NUM_PRECODE_SYMS, SYMBOLS.precode, false)) {
+    return InflateResult::BAD_DATA;
+  }
+
+  uint8_t lens[286 + 30] = {};
+  const unsigned total = num_litlen + num_dist;
+  for (unsigned i = 0; i < total;) {
+    bits.Ensure(14);  // a codeword and up to 7 repeat bits
+    const uint32_t entry = tables.precode[bits.Peek(PRECODE_TABLE_BITS)];
+    if (entry & ENTRY_INVALID) return InflateResult::BAD_DATA;
+    bits.Consume(entry & 0xF);
+    const unsigned sym = entry >> 16;
+    if (sym < 16) {
+      lens[i++] = static_cast<uint8_t>(sym);
+      continue;
+    }
+    uint8_t value = 0;
+    unsigned repeat;
+    if (sym == 16) {
+      if (i == 0) return InflateResult::BAD_DATA;
+      value = lens[i - 1];
+      repeat = 3 + bits.Take(2);
+    } else if (sym == 17) {
+      repeat = 3 + bits.Take(3);
+    } else {
+      repeat = 11 + bits.Take(7);
+    }
+    if (repeat > total - i) return InflateResult::BAD_DATA;
+    std::fill(lens + i, lens + i + repeat, value);
+    i += repeat;
+  }
+  if (lens[256] == 0) return InflateResult::BAD_DATA;  // no end of block
+
+  if (!BuildTable(tables.litlen, LITLEN_TABLE_BITS, lens, num_litlen,
+                  SYMBOLS.litlen, true) ||
+      !BuildTable(tables.dist, DIST_TABLE_BITS, lens + num_litlen, num_dist,
+                  SYMBOLS.dist, true)) {
+    return InflateResult::BAD_DATA;
+  }
+  return InflateResult::OK;
+}
+
+// Copies a match whose bounds have been checked. With slack set, whole words
+// may run up to 16 bytes past the match; that is overwritten later.
+template <typename T>
+inline void CopyMatch(T *dst, size_t length, size_t distance, bool slack) {
+  constexpr size_t WORD = 8 / sizeof(T);
+  const T *src = dst - distance;
+  T *const end = dst + length;
+  if (distance >= WORD && slack) {
+    // Most matches are short: two words cover them without looping.
+    std::memcpy(dst, src, 8);
+    std::memcpy(dst + WORD, src + WORD, 8);
+    dst += 2 * WORD;
+    src += 2 * WORD;
+    while (dst < end) {
+      std::memcpy(dst, src, 8);
+      dst += WORD;
+      src += WORD;
+    }
+  } else if (distance == 1) {
+    std::fill(dst, end, *src);
+  } else {
+    while (dst < end) *dst++ = *src++;
+  }
+}
+
+// Decodes one Huffman block. The main loop runs while a whole match plus
+// word slack fits in the output and a whole refill is left in the input, so
+// it needs no bounds checks beyond the match distance. The bit buffer lives
+// in locals there: stores through out_next may alias anything, which would
+// otherwise force it back to memory on every literal. T is uint8_t but for
+// the 16-bit output of speculative decoding below.
+template <typename T>
+InflateResult DecodeHuffmanBlock(BitReader &bits, const Tables &tables,
+                                 T *out_start, T *&out_next, T *out_end) {
+  constexpr size_t MAX_MATCH = 258;
+  constexpr size_t FAST_OUT_MARGIN = MAX_MATCH + 16;
+  const uint32_t *const litlen = tables.litlen;
+  const uint32_t *const dist = tables.dist;
+
+  {
+    uint64_t buf = bits.buf;
+    unsigned left = bits.left;
+    const uint8_t *next = bits.next;
+    T *out = out_next;
+    InflateResult result = InflateResult::SHORT_OUTPUT;  // not done yet
+
+    while (out_end - out >= static_cast<ptrdiff_t>(FAST_OUT_MARGIN) &&
+           bits.end - next >= 8) {
+      uint64_t word;
+      std::memcpy(&word, next, sizeof(word));
+      buf |= word << left;
+      next += (63 - left) >> 3;
+      left |= 56;
+
+      uint32_t entry = litlen[buf & Mask(LITLEN_TABLE_BITS)];
+      if (entry & ENTRY_LITERAL) {
+        // 56 bits cover three literal codewords.
+        buf >>= entry & 0xF;
+        left -= entry & 0xF;
+        *out++ = static_cast<T>(entry >> 16);
+        entry = litlen[buf & Mask(LITLEN_TABLE_BITS)];
+        if (!(entry & ENTRY_LITERAL)) continue;
+        buf >>= entry & 0xF;
+        left -= entry & 0xF;
+        *out++ = static_cast<T>(entry >> 16);
+        entry = litlen[buf & Mask(LITLEN_TABLE_BITS)];
+        if (!(entry & ENTRY_LITERAL)) continue;
+        buf >>= entry & 0xF;
+        left -= entry & 0xF;
+        *out++ = static_cast<T>(entry >> 16);
+        continue;
+      }
+      if (entry & ENTRY_SUBTABLE) {
+        buf >>= LITLEN_TABLE_BITS;
+        left -= LITLEN_TABLE_BITS;
+        entry = litlen[(entry >> 16) + (buf & Mask((entry >> 8) & 0x1f))];
+      }
+      buf >>= entry & 0xF;
+      left -= entry & 0xF;
+      if (entry & (ENTRY_LITERAL | ENTRY_END | ENTRY_INVALID)) {
+        if (entry & ENTRY_LITERAL) {
+          *out++ = static_cast<T>(entry >> 16);
+          continue;
+        }
+        result = entry & ENTRY_END ? InflateResult::OK
+                                   : InflateResult::BAD_DATA;
+        break;
+      }
+      unsigned extra = (entry >> 8) & 0x1f;
+      const size_t length = (entry >> 16) + (buf & Mask(extra));
+      buf >>= extra;
+      left -= extra;
+
+      entry = dist[buf & Mask(DIST_TABLE_BITS)];
+      if (entry & ENTRY_SUBTABLE) {
+        buf >>= DIST_TABLE_BITS;
+        left -= DIST_TABLE_BITS;
+        entry = dist[(entry >> 16) + (buf & Mask((entry >> 8) & 0x1f))];
+      }
+      buf >>= entry & 0xF;
+      left -= entry & 0xF;
+      extra = (entry >> 8) & 0x1f;
+      const size_t distance = (entry >> 16) + (buf & Mask(extra));
+      buf >>= extra;
+      left -= extra;
+      if ((entry & ENTRY_INVALID) ||
+          distance > static_cast<size_t>(out - out_start)) {
+        result = InflateResult::BAD_DATA;
+        break;
+      }
+      CopyMatch(out, length, distance, true);
+      out += length;
+    }
+
+    bits.buf = buf;
+    bits.left = left;
+    bits.next = next;
+    out_next = out;
+    if (result != InflateResult::SHORT_OUTPUT) return result;
+  }
+
+  // The last few hundred bytes of either end, checked symbol by symbol.
+  for (;;) {
+    bits.Refill();
+    uint32_t entry = litlen[bits.Peek(LITLEN_TABLE_BITS)];
+    if (entry & ENTRY_SUBTABLE) {
+      bits.Consume(LITLEN_TABLE_BITS);
+      entry = litlen[(entry >> 16) + bits.Peek((entry >> 8) & 0x1f)];
+    }
+    bits.Consume(entry & 0xF);
+    if (entry & ENTRY_LITERAL) {
+      if (out_next == out_end) return InflateResult::SHORT_OUTPUT;
+      *out_next++ = static_cast<T>(entry >> 16);
+      continue;
+    }
+    if (entry & ENTRY_END) return InflateResult::OK;
+    if (entry & ENTRY_INVALID) return InflateResult::BAD_DATA;
+
+    const size_t length = (entry >> 16) + bits.Take((entry >> 8) & 0x1f);
+
+    entry = dist[bits.Peek(DIST_TABLE_BITS)];
+    if (entry & ENTRY_SUBTABLE) {
+      bits.Consume(DIST_TABLE_BITS);
+      entry = dist[(entry >> 16) + bits.Peek((entry >> 8) & 0x1f)];
+    }
+    bits.Consume(entry & 0xF);
+    if (entry & ENTRY_INVALID) return InflateResult::BAD_DATA;
+    const size_t distance = (entry >> 16) + bits.Take((entry >> 8) & 0x1f);
+
+    if (distance > static_cast<size_t>(out_next - out_start)) {
+      return InflateResult::BAD_DATA;
+    }
+    if (length > static_cast<size_t>(out_end - out_next)) {
+      return InflateResult::SHORT_OUTPUT;
+    }
+    CopyMatch(out_next, length, distance,
+              static_cast<size_t>(out_end - out_next) >= length + 16);
+    out_next += length;
+  }
+}
+
+template <typename T>
+InflateResult CopyStoredBlock(BitReader &bits, T *&out_next, T *out_end) {
+  // Stored data starts on a byte boundary; go back to reading bytes.
+  bits.Consume(bits.left & 7);
+  if (!bits.InBounds()) return InflateResult::BAD_DATA;
+  const uint8_t *p = bits.next - ((bits.left >> 3) - bits.overrun);
+  if (bits.end - p < 4) return InflateResult::BAD_DATA;
+  const size_t length = p[0] | (p[1] << 8);
+  if (length != static_cast<size_t>(~(p[2] | (p[3] << 8)) & 0xFFFF)) {
+    return InflateResult::BAD_DATA;
+  }
+  p += 4;
+  if (static_cast<size_t>(bits.end - p) < length) {
+    return InflateResult::BAD_DATA;
+  }
+  if (static_cast<size_t>(out_end - out_next) < length) {
+    return InflateResult::SHORT_OUTPUT;
+  }
+  out_next = std::copy(p, p + length, out_next);
+  bits.next = p + length;
+  bits.buf = 0;
+  bits.left = 0;
+  bits.overrun = 0;
+  return InflateResult::OK;
+}
+
+// Decodes the block starting at bits; final is set from its header.
+template <typename T>
+InflateResult DecodeBlock(BitReader &bits, Tables &tables, T *out_start,
+                          T *&out_next, T *out_end, bool &final) {
+  bits.Ensure(3);
+  final = bits.Take(1);
+  InflateResult result;
+  switch (bits.Take(2)) {
+    case 0:
+      result = CopyStoredBlock(bits, out_next, out_end);
+      break;
+    case 1:
+      result = DecodeHuffmanBlock(bits, FixedTables(), out_start, out_next,
+                                  out_end);
+      break;
+    case 2:
+      result = ReadDynamicTables(bits, tables);
+      if (result == InflateResult::OK) {
+        result = DecodeHuffmanBlock(bits, tables, out_start, out_next, out_end);
+      }
+      break;
+    default:
+      result = InflateResult::BAD_DATA;
+  }
+  if (!bits.InBounds()) result = InflateResult::BAD_DATA;
+  return result;
+}
+
+// Speculative parallel decoding, after rapidgzip. The input is cut into
+// chunks, and every chunk after the first starts at the first bit offset in
+// it that parses as a dynamic block header. Chunks decode on their own
+// threads without the 32 KiB of output before them: their output starts
+// with a window of markers instead, so matches reaching back into it copy
+// markers naming the window byte. Joining the chunks in order places each
+// one and resolves its last 32 KiB, the window of the next; resolving the
+// rest and its CRC is again spread over the threads. A chunk has to end
+// exactly where the next one was started; a guess that does not line up,
+// like a bad CRC, sends the caller back to decoding in order.
+constexpr size_t WINDOW_SIZE = 32768;
+constexpr uint16_t WINDOW_MARKER = 256;  // + the index into the window
+constexpr size_t PARALLEL_CHUNK_SIZE = 1 << 20;  // of input
+// DEFLATE cannot expand a byte to more than 1032; a bigger ISIZE is a lie.
+constexpr uint64_t MAX_INFLATE_RATIO = 1032;
+constexpr uint64_t NO_OFFSET = UINT64_MAX;
+
+BitReader ReaderAt(const uint8_t *in, size_t in_size, uint64_t bit) {
+  BitReader bits{in + (bit >> 3), in + in_size};
+  bits.Refill();
+  bits.Consume(bit & 7);
+  return bits;
+}
+
+// Kraft sums of two 3-bit precode lengths, in 128ths.
+constexpr auto PRECODE_PAIR_KRAFT = [] {
+  std::array<uint8_t, 64> kraft{};
+  for (unsigned pair = 0; pair < 64; ++pair) {
+    for (unsigned len : {pair & 7, pair >> 3}) {
+      if (len) kraft[pair] += (1u << PRECODE_TABLE_BITS) >> len;
+    }
+  }
+  return kraft;
+}();
+
+// For each 16 bits of input, how far ahead the next offset is whose known
+// bits could begin a non-final dynamic block header: BFINAL 0, BTYPE 2,
+// then HLIT and HDIST not above 29 (neither field ending in four ones).
+const std::array<uint8_t, 1 << 16> &HeaderSkips() {
+  static const auto skips = [] {
+    auto table = std::make_unique<std::array<uint8_t, 1 << 16>>();
+    auto possible = [](uint32_t bits, unsigned known) {
+      auto ones = [&](unsigned from, unsigned count) {
+        return from + count <= known &&
+               ((bits >> from) & Mask(count)) == Mask(count);
+      };
+      const uint32_t type = 4 & static_cast<uint32_t>(Mask(std::min(known, 3u)));
+      return (bits & Mask(std::min(known, 3u))) == type && !ones(4, 4) &&
+             !ones(9, 4);
+    };
+    for (uint32_t bits = 0; bits < (1 << 16); ++bits) {
+      unsigned skip = 0;
+      while (skip < 16 && !possible(bits >> skip, 16 - skip)) ++skip;
+      (*table)[bits] = static_cast<uint8_t>(skip);
+    }
+    return table;
+  }();
+  return *skips;
+}
+
+// First bit offset in [from, to) where a non-final dynamic block could
+// start, or NO_OFFSET. The header has to describe a complete precode and
+// literal/length and distance codes with an end of block, which random bits
+// rarely do; the few false hits are caught when chunks are joined.
+uint64_t FindBlockStart(const uint8_t *in, size_t in_size, uint64_t from,
+                        uint64_t to, Tables &tables) {
+  const auto &skips = HeaderSkips();
+  for (uint64_t bit = from; bit < to; ++bit) {
+    const size_t byte = bit >> 3;
+    if (in_size - byte < 8) break;
+    uint64_t word;
+    std::memcpy(&word, in + byte, sizeof(word));
+    word >>= bit & 7;
+    if (const unsigned skip = skips[word & 0xFFFF]) {
+      bit += skip - 1;
+      continue;
+    }
+    // The precode lengths must fill their code exactly; checking the 18
+    // that fit in a word first spares building tables for most candidates.
+    if (in_size - byte < 10) break;
+    uint64_t lens;
+    std::memcpy(&lens, in + byte + 2, sizeof(lens));
+    lens >>= (bit & 7) + 1;
+    const unsigned num_precode = ((word >> 13) & 15) + 4;
+    lens &= Mask(3 * std::min(num_precode, 18u));
+    unsigned kraft = 0;
+    for (unsigned i = 0; i < 9; ++i, lens >>= 6) {
+      kraft += PRECODE_PAIR_KRAFT[lens & 63];
+    }
+    if (kraft > 1u << PRECODE_TABLE_BITS ||
+        (num_precode <= 18 && kraft != 1u << PRECODE_TABLE_BITS)) {
+      continue;
+    }
+
+    BitReader bits = ReaderAt(in, in_size, bit + 3);
+    if (ReadDynamicTables(bits, tables) == InflateResult::OK &&
+        bits.InBounds()) {
+      return bit;
+    }
+  }
+  return NO_OFFSET;
+}
+
+// Output of a chunk decoded without the window before it. Both buffers
+// start with a window: markers in wide, and in narrow the last bytes of
+// wide, moved there.
+struct ChunkOutput {
+  // Bytes, or WINDOW_MARKER + i for byte i of the window, up to the first
+  // block end after which the last WINDOW_SIZE values are all bytes.
+  std::vector<uint16_t> wide;
+  // The rest, decoded as usual.
+  std::vector<uint8_t> narrow;
+  size_t in_end = 0;  // input consumed through the chunk's last block
+  size_t offset = 0;  // in the output, once joined
+  BufferPool::Charge charge;  // both buffers, against the memory budget
+
+  size_t WideSize() const { return wide.size() - WINDOW_SIZE; }
+  size_t Size() const { return WideSize() + narrow.size(); }
+};
+
+enum class ChunkStep { BLOCK, DONE, FAILED, NARROW };
+
+// Decodes blocks into buf from used on, growing it up to max_size when a
+// block does not fit and charge has room, until after_block() ends the run.
+template <typename T, typename AfterBlock>
+ChunkStep DecodeBlocks(BitReader &bits, Tables &tables, std::vector<T> &buf,
+                       size_t &used, size_t max_size, bool &final,
+                       BufferPool::Charge &charge,
+                       const AfterBlock &after_block) {
+  for (;;) {
+    const BitReader block_start = bits;
+    T *next = buf.data() + used;
+    const InflateResult result = DecodeBlock(
+        bits, tables, buf.data(), next, buf.data() + buf.size(), final);
+    if (result == InflateResult::SHORT_OUTPUT && buf.size() < max_size) {
+      const size_t size = std::min(buf.size() * 2, max_size);
+      if (!charge.Set(charge.bytes() + (size - buf.size()) * sizeof(T))) {
+        return ChunkStep::FAILED;
+      }
+      bits = block_start;
+      buf.resize(size);
+      continue;
+    }
+    if (result != InflateResult::OK) return ChunkStep::FAILED;
+    used = static_cast<size_t>(next - buf.data());
+    const ChunkStep step = after_block(used);
+    if (step != ChunkStep::BLOCK) return step;
+  }
+}
+
+// Buffers a chunk starts with, charged before it is taken on.
+constexpr size_t CHUNK_START_BYTES =
+    (WINDOW_SIZE + 2 * PARALLEL_CHUNK_SIZE) * sizeof(uint16_t);
+
+// Decodes blocks from start_bit until one ends exactly at stop_bit or, for
+// the last chunk, through the final block. The output is bounded by limit
+// and by what the input span can expand to, and every buffer is charged to
+// chunk.charge, so a false start cannot run away with memory; either bound
+// fails the chunk.
+bool DecodeChunk(const uint8_t *in, size_t in_size, uint64_t start_bit,
+                 uint64_t stop_bit, size_t limit, ChunkOutput &chunk) {
+  const uint64_t end_bit = stop_bit == NO_OFFSET ? uint64_t{in_size} * 8
+                                                 : stop_bit;
+  limit = static_cast<size_t>(std::min<uint64_t>(
+      limit, ((end_bit - start_bit) / 8 + 1) * MAX_INFLATE_RATIO));
+  auto tables = std::make_unique<Tables>();
+  BitReader bits = ReaderAt(in, in_size, start_bit);
+  bool final = false;
+  auto at_boundary = [&] {
+    const uint64_t pos = bits.BitPosition(in);
+    if (pos == stop_bit || (final && stop_bit == NO_OFFSET)) {
+      chunk.in_end = bits.Consumed(in);
+      return ChunkStep::DONE;
+    }
+    return pos > stop_bit || final ? ChunkStep::FAILED : ChunkStep::BLOCK;
+  };
+
+  std::vector<uint16_t> &wide = chunk.wide;
+  const size_t wide_size =
+      WINDOW_SIZE + std::min(2 * PARALLEL_CHUNK_SIZE, limit);
+  if (!chunk.charge.Set(wide_size * sizeof(uint16_t))) return false;
+  wide.resize(wide_size);
+  for (size_t i = 0; i < WINDOW_SIZE; ++i) {
+    wide[i] = static_cast<uint16_t>(WINDOW_MARKER + i);
+  }
+  size_t used = WINDOW_SIZE;
+  ChunkStep step = DecodeBlocks(
+      bits, *tables, wide, used, WINDOW_SIZE + limit, final, chunk.charge,
+      [&](size_t end) {
+        const ChunkStep boundary = at_boundary();
+        if (boundary != ChunkStep::BLOCK) return boundary;
+        if (end < 2 * WINDOW_SIZE) return ChunkStep::BLOCK;
+        // Markers tend to sit near the end while there are any, so look
+        // from there.
+        const auto last = wide.begin() + static_cast<ptrdiff_t>(end);
+        const bool clean = std::none_of(
+            std::make_reverse_iterator(last),
+            std::make_reverse_iterator(last - WINDOW_SIZE),
+            [](uint16_t value) { return value >= WINDOW_MARKER; });
+        return clean ? ChunkStep::NARROW : ChunkStep::BLOCK;
+      });
+  if (step != ChunkStep::NARROW) {
+    wide.resize(used);
+    return step == ChunkStep::DONE;
+  }
+
+  // The window is known to be bytes now: hand over to the ordinary decoder.
+  std::vector<uint8_t> &narrow = chunk.narrow;
+  narrow.resize(WINDOW_SIZE);
+  std::transform(wide.begin() + static_cast<ptrdiff_t>(used - WINDOW_SIZE),
+                 wide.begin() + static_cast<ptrdiff_t>(used), narrow.begin(),
+                 [](uint16_t value) { return static_cast<uint8_t>(value); });
+  // Give back what wide was grown to but never filled.
+  wide.resize(used - WINDOW_SIZE);
+  wide.shrink_to_fit();
+  const size_t narrow_size =
+      std::min(4 * PARALLEL_CHUNK_SIZE, limit) + WINDOW_SIZE;
+  if (!chunk.charge.Set(wide.size() * sizeof(uint16_t) + narrow_size)) {
+    return false;
+  }
+  narrow.resize(narrow_size);
+  used = WINDOW_SIZE;
+  step = DecodeBlocks(bits, *tables, narrow, used, WINDOW_SIZE + limit, final,
+                      chunk.charge, [&](size_t) { return at_boundary(); });
+  narrow.resize(used);
+  return step == ChunkStep::DONE;
+}
+
+// Writes chunk output [from, to) in place, replacing markers with the
+// window bytes before the chunk.
+bool ResolveChunk(const ChunkOutput &chunk, uint8_t *out, size_t from,
+                  size_t to) {
+  uint8_t *const dst = out + chunk.offset;
+  const size_t wide_end = std::min(to, chunk.WideSize());
+  const uint16_t *const wide = chunk.wide.data() + WINDOW_SIZE;
+  // The first chunk has no window; a marker there is a bad guess.
+  const size_t missing =
+      chunk.offset < WINDOW_SIZE ? WINDOW_SIZE - chunk.offset : 0;
+  if (missing && std::any_of(wide + from, wide + std::max(from, wide_end),
+                             [&](uint16_t value) {
+                               return value >= WINDOW_MARKER &&
+                                      value < WINDOW_MARKER + missing;
+                             })) {
+    return false;
+  }
+  // One lookup per value, bytes and markers alike.
+  uint8_t resolve[WINDOW_MARKER + WINDOW_SIZE];
+  for (unsigned value = 0; value < WINDOW_MARKER; ++value) {
+    resolve[value] = static_cast<uint8_t>(value);
+  }
+  std::copy(out + chunk.offset + missing - WINDOW_SIZE, out + chunk.offset,
+            resolve + WINDOW_MARKER + missing);
+  for (size_t i = from; i < wide_end; ++i) dst[i] = resolve[wide[i]];
+  from = std::max(from, chunk.WideSize());
+  if (from < to) {
+    std::memcpy(dst + from, chunk.narrow.data() + (from - chunk.WideSize()),
+                to - from);
+  }
+  return true;
+}
+
+// Decodes a raw DEFLATE stream of exactly out_size bytes on up to threads
+// threads, setting crc to the CRC-32 of the output. Returns false if any
+// guess misses; out then holds garbage.
+bool InflateRawParallel(const uint8_t *in, size_t in_size, uint8_t *out,
+                        size_t out_size, unsigned threads, uint32_t &crc) {
+  std::vector<uint64_t> starts((in_size - 1) / PARALLEL_CHUNK_SIZE + 1);
+  starts[0] = 0;
+  if (!ParallelFor(starts.size() - 1, threads, [&](size_t i) {
+        auto tables = std::make_unique<Tables>();
+        const uint64_t from = uint64_t{i + 1} * PARALLEL_CHUNK_SIZE * 8;
+        starts[i + 1] = FindBlockStart(in, in_size, from,
+                                       from + PARALLEL_CHUNK_SIZE * 8, *tables);
+        return true;
+      })) {
+    return false;
+  }
+  // A chunk without a plausible start is left to the one before it.
+  std::erase(starts, NO_OFFSET);
+  const size_t num_chunks = starts.size();
+  if (num_chunks < 2) return false;
+
+  // Chunks move from decoded to joined (placed, window resolved) to
+  // finished (resolved, CRC taken, freed). Workers prefer finishing, and
+  // decode at most max_ahead chunks past the finished ones, which bounds
+  // the memory held. The joining thread works too whenever it would
+  // otherwise wait, so progress never depends on the helpers the scheduler
+  // has not got round to yet.
+  const size_t max_ahead = size_t{threads} + 2;
+  std::vector<std::unique_ptr<ChunkOutput>> chunks(num_chunks);
+  std::vector<uint32_t> crcs(num_chunks);
+  std::vector<size_t> sizes(num_chunks);
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t next_decode = 0, joined = 0, next_finish = 0, finished = 0;
+  bool failed = false;
+
+  auto finish = [&](size_t i) {
+    const ChunkOutput &chunk = *chunks[i];
+    const size_t size = chunk.Size();
+    if (!ResolveChunk(chunk, out, 0, size - std::min(size, WINDOW_SIZE))) {
+      return false;
+    }
+    sizes[i] = size;
+    crcs[i] = crc32(0, out + chunk.offset, static_cast<uInt>(size));
+    return true;
+  };
+  // Does one piece of work, if any is ready. Called with mutex held.
+  auto step = [&](std::unique_lock<std::mutex> &lock) {
+    if (next_finish < joined) {
+      const size_t i = next_finish++;
+      lock.unlock();
+      const bool ok = finish(i);
+      lock.lock();
+      chunks[i].reset();
+      failed |= !ok;
+      ++finished;
+    } else if (next_decode < num_chunks &&
+               next_decode < finished + max_ahead) {
+      auto charge = BufferPool::Shared().TryCharge(CHUNK_START_BYTES);
+      if (!charge) {
+        // Chunks of ours give the budget back as they finish. Without any,
+        // others hold it and waiting might never end.
+        if (next_decode > finished) return false;
+        failed = true;
+        cv.notify_all();
+        return true;
+      }
+      const size_t i = next_decode++;
+      lock.unlock();
+      const uint64_t stop = i + 1 < num_chunks ? starts[i + 1] : NO_OFFSET;
+      // Running out of memory on a guess fails the speculation, which the
+      // caller redoes serially; it must not leave the joiner waiting.
+      std::unique_ptr<ChunkOutput> chunk;
+      bool ok = false;
+      try {
+        chunk = std::make_unique<ChunkOutput>();
+        chunk->charge = std::move(*charge);
+        ok = DecodeChunk(in, in_size, starts[i], stop, out_size, *chunk);
+      } catch (const std::bad_alloc &) {
+      }
+      lock.lock();
+      if (ok) {
+        chunks[i] = std::move(chunk);
+      } else {
+        failed = true;
+      }
+    } else {
+      return false;
+    }
+    cv.notify_all();
+    return true;
+  };
+  auto helper = [&] {
+    std::unique_lock lock(mutex);
+    while (!failed && next_finish < num_chunks) {
+      if (!step(lock)) cv.wait(lock);
+    }
+  };
+  TaskGroup group;
+  for (unsigned t = 1; t < threads; ++t) group.Run(helper);
+
+  size_t done = 0;
+  for (size_t i = 0; i < num_chunks; ++i) {
+    ChunkOutput *chunk;
+    {
+      std::unique_lock lock(mutex);
+      while (!failed && !chunks[i]) {
+        if (!step(lock)) cv.wait(lock);
+      }
+      if (failed) break;
+      chunk = chunks[i].get();
+    }
+    const size_t size = chunk->Size();
+    bool ok = size <= out_size - done &&
+              (i + 1 < num_chunks || chunk->in_end == in_size);
+    if (ok) {
+      chunk->offset = done;
+      done += size;
+      ok = ResolveChunk(*chunk, out, size - std::min(size, WINDOW_SIZE),
+                        size) &&
+           !JobCancelled();
+    }
+    std::lock_guard lock(mutex);
+    failed |= !ok;
+    joined = i + 1;
+    cv.notify_all();
+    if (failed) break;
+  }
+  {
+    std::unique_lock lock(mutex);
+    while (!failed && finished != joined) {
+      if (!step(lock)) cv.wait(lock);
+    }
+  }
+  if (!group.Wait() || failed || done != out_size) return false;
+
+  crc = crcs[0];
+  for (size_t i = 1; i < num_chunks; ++i) {
+    crc = static_cast<uint32_t>(
+        crc32_combine(crc, crcs[i], static_cast<z_off_t>(sizes[i])));
+  }
+  return true;
+}
+
+// Read-only or writable shared mapping of a whole file.
+class Mapping {
+ public:
+  Mapping(int fd, size_t size, bool writable) : size_(size) {
+    void *map = mmap(nullptr, size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                     MAP_SHARED, fd, 0);
+    if (map != MAP_FAILED) data_ = static_cast<uint8_t *>(map);
+  }
+  ~Mapping() {
+    if (data_) munmap(data_, size_);
+  }
+  Mapping(const Mapping &) = delete;
+  Mapping &operator=(const Mapping &) = delete;
+
+  uint8_t *data() const { return data_; }
+
+ private:
+  uint8_t *data_ = nullptr;
+  size_t size_;
+};
+
+constexpr size_t GZIP_TRAILER_SIZE = 8;
+// Below this the thread start-up and boundary search outweigh the gain.
+constexpr size_t PARALLEL_MIN_OUTPUT = 64 << 20;
+// Chunks are charged to the memory budget, and a chunk that outgrows it
+// fails the guess; with room for fewer than this many the decoding is
+// mostly thrown away.
+constexpr size_t PARALLEL_MIN_BUDGET = 4 * CHUNK_START_BYTES;
+
+bool InflateMapped(const uint8_t *in, size_t in_size, int out_fd) {
+  const size_t header = GzipHeaderSize(in, in_size);
+  if (header == 0 || in_size - header < GZIP_TRAILER_SIZE) return false;
+  const uint32_t expected_crc = LoadU32(in + in_size - 8);
+  const uint32_t isize = LoadU32(in + in_size - 4);
+  // Empty output cannot be mapped, and ISIZE only holds the size mod 4 GiB.
+  if (isize == 0 || isize > in_size * MAX_INFLATE_RATIO) return false;
+
+  // Stores into a hole the filesystem has no room for raise SIGBUS, so the
+  // blocks are reserved up front; a full disk then fails here and the caller
+  // falls back to zlib.
+  if (posix_fallocate(out_fd, 0, isize) != 0) return false;
+  Mapping out(out_fd, isize, true);
+  if (!out.data()) return false;
+
+  const size_t deflate_size = in_size - header - GZIP_TRAILER_SIZE;
+  const Session *session = Session::Current();
+  const unsigned threads = session ? session->threads() : 1;
+  if (threads > 1 && isize >= PARALLEL_MIN_OUTPUT &&
+      BufferPool::Shared().budget() >= PARALLEL_MIN_BUDGET) {
+    uint32_t crc = 0;
+    if (InflateRawParallel(in + header, deflate_size, out.data(), isize,
+                           threads, crc) &&
+        crc == expected_crc) {
+      return true;
+    }
+    if (JobCancelled()) return false;
+    // A block boundary was guessed wrong somewhere; start over in order.
+  }
+
+  size_t in_used = 0, out_used = 0;
+  if (InflateRaw(in + header, deflate_size, out.data(), isize, in_used,
+                 out_used) != InflateResult::OK) {
+    return false;
+  }
+  // Anything between the end of the stream and the trailer means another
+  // member or trailing garbage; both are left to zlib.
+  return in_used == deflate_size && out_used == isize &&
+         crc32(0, out.data(), isize) == expected_crc;
+}
+}  // namespace
+
+InflateResult InflateRaw(const uint8_t *in, size_t in_size, uint8_t *out,
+                         size_t out_size, size_t &in_used, size_t &out_used) {
+  auto tables = std::make_unique<Tables>();
+  BitReader bits{in, in + in_size};
+  uint8_t *out_next = out;
+  InflateResult result = InflateResult::OK;
+
+  for (bool final = false; !final && result == InflateResult::OK;) {
+    result = DecodeBlock(bits, *tables, out, out_next, out + out_size, final);
+  }
+
+  in_used = bits.Consumed(in);
+  out_used = static_cast<size_t>(out_next - out);
+  return result;
+}
+
+size_t GzipHeaderSize(const uint8_t *data, size_t size) {
+  constexpr uint8_t FHCRC = 0x02, FEXTRA = 0x04, FNAME = 0x08,
+                    FCOMMENT = 0x10, RESERVED = 0xE0;
+  if (size < 10 || data[0] != 0x1F || data[1] != 0x8B || data[2] != 8) {
+    return 0;
+  }
+  const uint8_t flags = data[3];
+  if (flags & RESERVED) return 0;
+
+  size_t pos = 10;
+  if (flags & FEXTRA) {
+    if (size - pos < 2) return 0;
+    const size_t extra = data[pos] | (data[pos + 1] << 8);
+    if (size - pos - 2 < extra) return 0;
+    pos += 2 + extra;
+  }
+  for (uint8_t field : {FNAME, FCOMMENT}) {
+    if (!(flags & field)) continue;
+    const auto *nul = static_cast<const uint8_t *>(
+        std::memchr(data + pos, 0, size - pos));
+    if (!nul) return 0;
+    pos = static_cast<size_t>(nul - data) + 1;
+  }
+  if (flags & FHCRC) {
+    if (size - pos < 2) return 0;
+    pos += 2;
+  }
+  return pos;
+}
+
+bool InflateGzipFile(const std::filesystem::path &input,
+                     const std::filesystem::path &output) {
+  int in_fd = open(input.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in_fd < 0) return false;
+  struct stat st {};
+  if (fstat(in_fd, &st) != 0 || st.st_size <= 0) {
+    close(in_fd);
+    return false;
+  }
+  const auto in_size = static_cast<size_t>(st.st_size);
+  Mapping in(in_fd, in_size, false);
+  close(in_fd);
+  if (!in.data()) return false;
+  // The parallel path reads chunks at scattered offsets, not in order.
+  madvise(in.data(), in_size, MADV_WILLNEED);
+
+  int out_fd =
+      open(output.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (out_fd < 0) return false;
+  const bool ok = InflateMapped(in.data(), in_size, out_fd);
+  close(out_fd);
+  if (!ok) {
+    std::error_code ec;
+    std::filesystem::remove(output, ec);
+  }
+  return ok;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+
+// DEFLATE decoding for inputs and outputs that are entirely in memory. With
+// both ends known up front the decoder refills 64 bits at a time and never
+// has to stop mid-symbol for more input, which is where zlib's streaming
+// inflate spends its time.
+
+enum class InflateResult {
+  OK,
+  BAD_DATA,
+  SHORT_OUTPUT,  // the stream decodes to more than the output holds
+};
+
+// Decodes one raw DEFLATE stream. in_used is set to the bytes consumed up
+// to the end of the final block, out_used to the bytes produced.
+InflateResult InflateRaw(const uint8_t *in, size_t in_size, uint8_t *out,
+                         size_t out_size, size_t &in_used, size_t &out_used);
+
+// Size of the gzip member header at data, or 0 if it is not one this
+// decoder takes (unknown flags, truncated fields).
+size_t GzipHeaderSize(const uint8_t *data, size_t size);
+
+// Inflates a gzip file holding exactly one member into output, sized from
+// the ISIZE trailer and written through a shared mapping. Returns false,
+// leaving no output behind, for anything it does not handle (several
+// members, trailing data, ISIZE past 4 GiB, corruption), so the caller can
+// fall back to streaming zlib and its diagnostics.
+//
+// Large members are decoded speculatively on the session's worker threads,
+// their chunks charged to the buffer pool's memory budget, and again in
+// order if a guessed block boundary turns out wrong or a chunk does not fit.
+bool InflateGzipFile(const std::filesystem::path &input,
+                     const std::filesystem::path &output);
@@ -0,0 +1,303 @@
+#include "patch.h"
+
+#include <sys/stat.h>
+
+#include <fstream>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "cpio_writer.h"
+#include "log.h"
+#include "tools.h"
+
+namespace {
+constexpr size_t COPY_BUFSIZE = 65536;
+
+std::string NormalizePath(std::string_view path) {
+  while (path.starts_with("./")) path.remove_prefix(2);
+  while (path.starts_with("/")) path.remove_prefix(1);
+  while (path.ends_with("/")) path.remove_suffix(1);
+  return std::string(path);
+}
+
+bool ParseOp(std::map<std::string, std::string> &fields, RamdiskOp &op) {
+  const std::string &name = fields["op"];
+  op.path = NormalizePath(fields["path"]);
+  if (op.path.empty()) {
+    LOGE("patch: Missing path for op=%s", name.c_str());
+    return false;
+  }
+
+  auto permissions = static_cast<uint32_t>(
+      std::strtoul(fields["mode"].c_str(), nullptr, 8) & 07777);
+  op.uid = static_cast<uint32_t>(std::strtoul(fields["uid"].c_str(), nullptr, 10));
+  op.gid = static_cast<uint32_t>(std::strtoul(fields["gid"].c_str(), nullptr, 10));
+  op.source = fields["source"];
+  op.target = fields["target"];
+
+  if (name == "add") {
+    op.type = RamdiskOp::Type::Add;
+    const std::string &type = fields["type"];
+    if (type == "file") {
+      if (op.source.empty()) {
+        LOGE("patch: Missing source for %s", op.path.c_str());
+        return false;
+      }
+      op.mode = S_IFREG | (permissions ? permissions : 0644);
+    } else if (type == "dir") {
+      op.mode = S_IFDIR | (permissions ? permissions : 0755);
+    } else if (type == "symlink") {
+      if (op.target.empty()) {
+        LOGE("patch: Missing target for %s", op.path.c_str());
+        return false;
+      }
+      op.mode = S_IFLNK | (permissions ? permissions : 0777);
+    } else {
+      LOGE("patch: Unsupported entry type: %s", type.c_str());
+      return false;
+    }
+  } else if (name == "replace") {
+    op.type = RamdiskOp::Type::Replace;
+    if (op.source.empty()) {
+      LOGE("patch: Missing source for %s", op.path.c_str());
+      return false;
+    }
+  } else if (name == "remove") {
+    op.type = RamdiskOp::Type::Remove;
+  } else if (name == "chmod") {
+    op.type = RamdiskOp::Type::Chmod;
+    if (fields["mode"].empty()) {
+      LOGE("patch: Missing mode for %s", op.path.c_str());
+      return false;
+    }
+    op.mode = permissions;
+  } else {
+    LOGE("patch: Unknown op: %s", name.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool IsRemoved(const std::string &path,
+               const std::vector<const RamdiskOp *> &removals,
+               std::unordered_set<const RamdiskOp *> &applied) {
+  for (const auto *op : removals) {
+    if (path == op->path ||
+        (path.size() > op->path.size() && path.starts_with(op->path) &&
+         path[op->path.size()] == '/')) {
+      applied.insert(op);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool CopySource(const std::filesystem::path &source, CpioWriter &writer) {
+  std::ifstream in(source, std::ios::binary);
+  if (!in) {
+    LOGE("patch: Error opening %s", source.string().c_str());
+    return false;
+  }
+  std::vector<char> buffer(COPY_BUFSIZE);
+  while (in) {
+    in.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    const auto n = static_cast<size_t>(in.gcount());
+    if (n > 0 && !writer.WriteData(buffer.data(), n)) return false;
+  }
+  if (!in.eof()) {
+    LOGE("patch: Error reading %s", source.string().c_str());
+    return false;
+  }
+  return true;
+}
+
+// Points entry at a host file for its payload. Returns false if the file
+// cannot be used.
+bool UseSource(const RamdiskOp &op, CpioEntry &entry) {
+  std::error_code ec;
+  const auto size = std::filesystem::file_size(op.source, ec);
+  if (ec) {
+    LOGE("patch: File not found: %s", op.source.string().c_str());
+    return false;
+  }
+  entry.size = size;
+  return true;
+}
+
+bool CopyPayload(CpioReader &reader, CpioWriter &writer, uint64_t size) {
+  std::vector<char> buffer(std::min<uint64_t>(size, COPY_BUFSIZE));
+  while (size > 0) {
+    const size_t chunk = std::min<uint64_t>(size, buffer.size());
+    if (!reader.ReadData(buffer.data(), chunk) ||
+        !writer.WriteData(buffer.data(), chunk)) {
+      return false;
+    }
+    size -= chunk;
+  }
+  return true;
+}
+// Copies the entries of one archive from reader to writer, applying the
+// removals and edits that match them and recording which were applied.
+bool PatchEntries(
+    CpioReader &reader, CpioWriter &writer,
+    const std::vector<const RamdiskOp *> &removals,
+    const std::unordered_map<std::string, std::vector<const RamdiskOp *>> &edits,
+    std::unordered_set<const RamdiskOp *> &applied) {
+  CpioEntry entry;
+  while (reader.Next(entry)) {
+    const std::string path = NormalizePath(entry.path);
+    if (IsRemoved(path, removals, applied)) {
+      LOG("Removing %s", path.c_str());
+      continue;
+    }
+
+    CpioEntry out = entry;
+    out.path = path;
+    const RamdiskOp *source = nullptr;
+    if (auto it = edits.find(path); it != edits.end()) {
+      for (const auto *op : it->second) {
+        switch (op->type) {
+          case RamdiskOp::Type::Add:
+            out.mode = op->mode;
+            out.uid = op->uid;
+            out.gid = op->gid;
+            out.target = op->target;
+            out.size = 0;
+            source = out.is_file() ? op : nullptr;
+            break;
+          case RamdiskOp::Type::Replace:
+            if (!out.is_file()) {
+              LOGE("patch: Not a regular file: %s", path.c_str());
+              return false;
+            }
+            source = op;
+            break;
+          case RamdiskOp::Type::Chmod:
+            out.mode = (out.mode & S_IFMT) | op->mode;
+            break;
+          case RamdiskOp::Type::Remove:
+            break;
+        }
+        applied.insert(op);
+      }
+    }
+
+    if (source) {
+      LOG("Replacing %s", path.c_str());
+      if (!UseSource(*source, out) || !writer.WriteEntry(out) ||
+          !CopySource(source->source, writer)) {
+        return false;
+      }
+    } else if (!writer.WriteEntry(out) ||
+               (out.is_file() && !CopyPayload(reader, writer, out.size))) {
+      return false;
+    }
+  }
+  return !reader.failed();
+}
+
+// Writes the entries ops add that no archive had, and fails on edits of
+// entries that were never seen.
+bool AddEntries(const std::vector<RamdiskOp> &ops,
+                const std::unordered_set<const RamdiskOp *> &applied,
+                CpioWriter &writer) {
+  for (const auto &op : ops) {
+    if (applied.contains(&op)) continue;
+    switch (op.type) {
+      case RamdiskOp::Type::Add: {
+        LOG("Adding %s", op.path.c_str());
+        CpioEntry out;
+        out.path = op.path;
+        out.mode = op.mode;
+        out.uid = op.uid;
+        out.gid = op.gid;
+        out.target = op.target;
+        if (out.is_file()) {
+          if (!UseSource(op, out) || !writer.WriteEntry(out) ||
+              !CopySource(op.source, writer)) {
+            return false;
+          }
+        } else if (!writer.WriteEntry(out)) {
+          return false;
+        }
+        break;
+      }
+      case RamdiskOp::Type::Remove:
+        LOG("Nothing to remove at %s", op.path.c_str());
+        break;
+      default:
+        LOGE("patch: Entry not found: %s", op.path.c_str());
+        return false;
+    }
+  }
+  return true;
+}
+}  // namespace
+
+std::optional<std::vector<RamdiskOp>> ParseRamdiskOps(
+    const std::filesystem::path &spec) {
+  std::ifstream in(spec);
+  if (!in) {
+    LOGE("patch: Error opening %s", spec.string().c_str());
+    return std::nullopt;
+  }
+
+  std::vector<RamdiskOp> ops;
+  std::string line;
+  while (std::getline(in, line)) {
+    const auto first = line.find_first_not_of(" \t");
+    if (first == std::string::npos || line[first] == '#') continue;
+
+    std::map<std::string, std::string> fields;
+    if (!ParseConfigLine(line, fields)) return std::nullopt;
+    RamdiskOp op;
+    if (!ParseOp(fields, op)) return std::nullopt;
+    ops.push_back(std::move(op));
+  }
+  return ops;
+}
+
+bool PatchRamdisk(int in_fd, const RamdiskSection &section,
+                  const std::vector<RamdiskOp> &ops, int out_fd,
+                  uint8_t output_format) {
+  std::vector<const RamdiskOp *> removals;
+  std::unordered_map<std::string, std::vector<const RamdiskOp *>> edits;
+  for (const auto &op : ops) {
+    if (op.type == RamdiskOp::Type::Remove) {
+      removals.push_back(&op);
+    } else {
+      edits[op.path].push_back(&op);
+    }
+  }
+  std::unordered_set<const RamdiskOp *> applied;
+
+  const auto segments = SplitRamdisk(in_fd, section);
+  if (segments.size() > 1) {
+    LOG("%s has %zu segments", section.name.c_str(), segments.size());
+  }
+  FdSink sink(out_fd);
+  for (size_t i = 0; i < segments.size(); ++i) {
+    const auto &segment = segments[i];
+    const bool last = i + 1 == segments.size();
+    auto decoder = RamdiskDecoder::Open(in_fd, segment.offset, segment.size,
+                                        segment.format);
+    if (!decoder) return false;
+    auto encoder = RamdiskEncoder::Open(
+        out_fd, segments.size() > 1 ? segment.format : output_format);
+    if (!encoder) return false;
+
+    CpioReader reader(*decoder);
+    CpioWriter writer(*encoder);
+    if (!PatchEntries(reader, writer, removals, edits, applied) ||
+        (last && !AddEntries(ops, applied, writer)) || !writer.Finish()) {
+      return false;
+    }
+    if (!last) {
+      const std::vector<uint8_t> padding(
+          segments[i + 1].offset - segment.offset - segment.size);
+      if (!sink.Write(padding.data(), padding.size())) return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "ramdisk.h"
+
+// One edit applied while a ramdisk streams through PatchRamdisk.
+struct RamdiskOp {
+  enum class Type { Add, Replace, Remove, Chmod };
+
+  Type type = Type::Add;
+  std::string path;
+  // Add: full st_mode (type and permissions). Chmod: permissions only.
+  uint32_t mode = 0;
+  uint32_t uid = 0;
+  uint32_t gid = 0;
+  std::filesystem::path source;  // Add/Replace of a regular file
+  std::string target;            // Add of a symlink
+};
+
+// Reads a patch list, one operation per line in .parserconfig syntax:
+//   op=add path="etc/init/x.rc" type=file mode=0644 uid=0 gid=0 source="/sdcard/x.rc"
+//   op=add path="sbin" type=symlink target="/system/bin"
+//   op=replace path="init" source="/sdcard/init"
+//   op=remove path="lib/modules"
+//   op=chmod path="init" mode=0750
+std::optional<std::vector<RamdiskOp>> ParseRamdiskOps(
+    const std::filesystem::path &spec);
+
+// Decodes section from in_fd, applies ops entry by entry and writes the new
+// archive compressed as output_format to out_fd, without touching the disk
+// in between. Removing a directory drops everything below it; added entries
+// go in front of the trailer. A ramdisk of several segments is patched
+// archive by archive, each kept in its own format: entries are edited in
+// whichever holds them and added ones go to the last.
+bool PatchRamdisk(int in_fd, const RamdiskSection &section,
+                  const std::vector<RamdiskOp> &ops, int out_fd,
+                  uint8_t output_format);
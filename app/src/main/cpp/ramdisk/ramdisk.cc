@@ -0,0 +1,162 @@
+#include "ramdisk.h"
+
+#include <sys/stat.h>
+
+#include <cstdio>
+
+#include "json_writer.hpp"
+#include "log.h"
+#include "seek_index.h"
+#include "segments.h"
+#include "tools.h"
+#include "unpackbootimg/bootimg.h"
+#include "unpackbootimg/utils.h"
+#include "unpackbootimg/vendorbootimg.h"
+
+namespace {
+constexpr std::string_view BOOT_MAGIC = "ANDROID!";
+constexpr std::string_view VENDOR_BOOT_MAGIC = "VNDRBOOT";
+
+std::optional<RamdiskSection> FindSection(
+    const std::vector<utils::ImageEntry> &entries, const std::string &name,
+    uint8_t format) {
+  for (const auto &entry : entries) {
+    if (entry.name == name) {
+      return RamdiskSection{entry.name, entry.offset, entry.size, format};
+    }
+  }
+  return std::nullopt;
+}
+}  // namespace
+
+std::optional<std::vector<RamdiskSection>> LocateRamdisks(int fd) {
+  auto magic = utils::ReadNBytesAtOffsetX(fd, 0, BOOT_MAGIC.size());
+  std::string_view magic_view(reinterpret_cast<const char *>(magic.data()),
+                              magic.size());
+
+  std::vector<RamdiskSection> sections;
+  if (magic_view == BOOT_MAGIC) {
+    auto info = InspectBootImage(fd);
+    if (!info) return std::nullopt;
+    const auto entries = GetBootImageEntries(*info);
+    if (!utils::ValidateEntries(fd, entries)) return std::nullopt;
+    if (auto section =
+            FindSection(entries, "ramdisk", info->ramdisk_compression)) {
+      sections.push_back(std::move(*section));
+    }
+  } else if (magic_view == VENDOR_BOOT_MAGIC) {
+    auto info = InspectVendorBootImage(fd);
+    if (!info) return std::nullopt;
+    const auto entries = GetVendorBootImageEntries(*info);
+    if (!utils::ValidateEntries(fd, entries)) return std::nullopt;
+    if (info->header_version > 3) {
+      for (const auto &i : info->vendor_ramdisk_table) {
+        if (auto section =
+                FindSection(entries, i.output_name, i.ramdisk_compression)) {
+          sections.push_back(std::move(*section));
+        }
+      }
+    } else if (auto section = FindSection(entries, "vendor_ramdisk",
+                                          info->ramdisk_compression)) {
+      sections.push_back(std::move(*section));
+    }
+  } else {
+    // Not an image: accept a bare ramdisk file as a single section.
+    auto head = utils::ReadNBytesAtOffsetX(fd, 0, 16);
+    const uint8_t format = getHeaderFormat(head.data(), head.size());
+    struct stat st {};
+    if (format == FORMAT_OTHER || fstat(fd, &st) != 0) {
+      LOGE("Invalid boot magic: %s", utils::toHexString(magic_view).c_str());
+      return std::nullopt;
+    }
+    sections.push_back(
+        RamdiskSection{"ramdisk", 0, static_cast<uint64_t>(st.st_size), format});
+  }
+  return sections;
+}
+
+std::vector<RamdiskSection> SplitRamdisk(int fd, const RamdiskSection &section) {
+  const auto segments = FindRamdiskSegments(fd, section.offset, section.size);
+  if (segments.size() < 2) return {section};
+
+  std::vector<RamdiskSection> parts;
+  for (const auto &segment : segments) {
+    parts.push_back(RamdiskSection{section.name, segment.offset, segment.size,
+                                   segment.format});
+  }
+  return parts;
+}
+
+std::optional<std::vector<CpioEntry>> ListRamdisk(
+    int fd, const RamdiskSection &section) {
+  auto decoder =
+      RamdiskDecoder::Open(fd, section.offset, section.size, section.format);
+  if (!decoder) return std::nullopt;
+
+  CpioReader reader(*decoder);
+  std::vector<CpioEntry> entries;
+  CpioEntry entry;
+  while (reader.Next(entry)) entries.push_back(std::move(entry));
+  if (reader.failed()) return std::nullopt;
+  return entries;
+}
+
+std::optional<std::string> ListRamdisks(int fd,
+                                        const std::filesystem::path &index) {
+  auto sections = LocateRamdisks(fd);
+  if (!sections) return std::nullopt;
+  std::vector<RamdiskIndex> indexes;
+  if (!index.empty()) indexes = ReadSeekIndex(index).value_or(indexes);
+
+  JsonWriter json;
+  json.BeginArray();
+  for (const auto &section : *sections) {
+    json.BeginObject()
+        .Field("name", section.name)
+        .Field("compression", getFormatName(section.format));
+    const auto segments = SplitRamdisk(fd, section);
+    if (segments.size() > 1) {
+      json.Key("segments").BeginArray();
+      for (const auto &segment : segments) {
+        json.Value(getFormatName(segment.format));
+      }
+      json.EndArray();
+    }
+
+    // All segments or nothing: a ramdisk is not listed by halves.
+    std::vector<std::vector<CpioEntry>> parts;
+    for (const auto &segment : segments) {
+      const RamdiskIndex *indexed = FindRamdiskIndex(fd, indexes, segment);
+      auto entries = indexed ? std::optional(indexed->entries)
+                             : ListRamdisk(fd, segment);
+      if (!entries) break;
+      parts.push_back(std::move(*entries));
+    }
+    if (parts.size() != segments.size()) {
+      json.Field("error", "could not decode ramdisk").EndObject();
+      continue;
+    }
+
+    // Entries of every segment but the last are tagged, as unpack tags them.
+    json.Key("entries").BeginArray();
+    for (size_t i = 0; i < parts.size(); ++i) {
+      for (const auto &entry : parts[i]) {
+        char mode[8];
+        std::snprintf(mode, sizeof(mode), "0%03o", entry.mode & 07777);
+        json.BeginObject()
+            .Field("path", entry.path)
+            .Field("type", CpioTypeName(entry.mode))
+            .Field("mode", mode)
+            .Field("uid", entry.uid)
+            .Field("gid", entry.gid)
+            .Field("size", entry.size);
+        if (entry.is_symlink()) json.Field("target", entry.target);
+        if (i + 1 < parts.size()) json.Field("segment", uint64_t{i});
+        json.EndObject();
+      }
+    }
+    json.EndArray().EndObject();
+  }
+  json.EndArray();
+  return json.str();
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "cpio_reader.h"
+#include "tools.h"
+
+// Where a ramdisk lives inside an image, as found by the header parser.
+struct RamdiskSection {
+  std::string name;
+  uint64_t offset = 0;
+  uint64_t size = 0;
+  uint8_t format = FORMAT_OTHER;
+};
+
+// Finds the ramdisks of a boot or vendor_boot image. Anything else that
+// starts like a ramdisk is treated as one bare section.
+std::optional<std::vector<RamdiskSection>> LocateRamdisks(int fd);
+
+// The archives section is made of (see segments.h), in order, each a section
+// of its own under section's name. An ordinary ramdisk comes back as itself.
+std::vector<RamdiskSection> SplitRamdisk(int fd, const RamdiskSection &section);
+
+// Decodes the section straight from fd and collects every entry without
+// writing anything.
+std::optional<std::vector<CpioEntry>> ListRamdisk(int fd,
+                                                  const RamdiskSection &section);
+
+// Lists every ramdisk of the image behind fd as JSON, entries of all its
+// segments included. Segments covered by the seek index at index, if given,
+// are listed from it without decoding.
+std::optional<std::string> ListRamdisks(int fd,
+                                        const std::filesystem::path &index = {});
+
+// Materialises only the entries matching patterns (literal paths or fnmatch
+// globs) into output_dir/<section name>, whichever segment of the section
+// they are in. Decoding stops as soon as every literal has been seen, unless
+// a glob still needs the rest of the archive. With a seek index, entries are
+// matched against it and each is decoded from the checkpoint before it.
+bool ExtractRamdiskEntries(int fd, const std::vector<std::string> &patterns,
+                           const std::filesystem::path &output_dir,
+                           const std::filesystem::path &index = {});
@@ -0,0 +1,284 @@
+#include "seek_index.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "buffer_pool.h"
+#include "codec.h"
+#include "log.h"
+#include "tools.h"
+#include "xxhash.h"
+
+// Layout, little endian: "ABIKIDX\0", version, ramdisk count and the XXH64 of
+// everything after this 24 byte header, then per ramdisk
+//   name, offset, size, format, fingerprint
+//   checkpoint count, then out, in, bits, window for each
+//   entry count, then path, mode, uid, gid, nlink, mtime, size,
+//   header_offset, data_offset, target for each
+// with strings stored as a u32 length and their bytes.
+
+namespace {
+constexpr std::string_view INDEX_MAGIC{"ABIKIDX\0", 8};
+// Version 2 fingerprints the whole section.
+constexpr uint32_t INDEX_VERSION = 2;
+constexpr size_t HEADER_SIZE = 24;
+
+class IndexWriter {
+ public:
+  void U32(uint32_t value) {
+    uint8_t bytes[4];
+    StoreU32(bytes, value);
+    data_.insert(data_.end(), bytes, bytes + sizeof(bytes));
+  }
+  void U64(uint64_t value) {
+    uint8_t bytes[8];
+    StoreU64(bytes, value);
+    data_.insert(data_.end(), bytes, bytes + sizeof(bytes));
+  }
+  void Bytes(const void *data, size_t size) {
+    U32(static_cast<uint32_t>(size));
+    const auto *bytes = static_cast<const uint8_t *>(data);
+    data_.insert(data_.end(), bytes, bytes + size);
+  }
+  void String(const std::string &value) { Bytes(value.data(), value.size()); }
+
+  const std::vector<uint8_t> &data() const { return data_; }
+
+ private:
+  std::vector<uint8_t> data_;
+};
+
+// Reads back what IndexWriter wrote; any read past the end fails the rest.
+class IndexReader {
+ public:
+  IndexReader(const uint8_t *data, size_t size) : data_(data), left_(size) {}
+
+  bool U32(uint32_t &value) {
+    if (!Take(4)) return false;
+    value = LoadU32(data_ - 4);
+    return true;
+  }
+  bool U64(uint64_t &value) {
+    if (!Take(8)) return false;
+    value = LoadU64(data_ - 8);
+    return true;
+  }
+  template <typename T>
+  bool Bytes(T &value) {
+    uint32_t size;
+    if (!U32(size) || !Take(size)) return false;
+    value.assign(data_ - size, data_);
+    return true;
+  }
+  // Guards a count against the bytes left, each item taking at least min.
+  bool Count(uint32_t &count, size_t min) {
+    return U32(count) && count <= left_ / min;
+  }
+
+ private:
+  bool Take(size_t size) {
+    if (size > left_) return false;
+    data_ += size;
+    left_ -= size;
+    return true;
+  }
+
+  const uint8_t *data_;
+  size_t left_;
+};
+
+// XXH64 of every compressed byte, seeded with the size: a patch that keeps
+// the section's length but changes any byte of it invalidates the index.
+uint64_t Fingerprint(int fd, const RamdiskSection &section) {
+  std::unique_ptr<XXH64_state_t, decltype(&XXH64_freeState)> state(
+      XXH64_createState(), &XXH64_freeState);
+  if (!state || XXH64_reset(state.get(), section.size) != XXH_OK) return 0;
+  auto buffer = BufferPool::Shared().Acquire();
+  for (uint64_t done = 0; done < section.size;) {
+    const auto length = static_cast<size_t>(
+        std::min<uint64_t>(section.size - done, buffer.size()));
+    if (!ReadFullyAt(fd, buffer.data(), length,
+                     static_cast<off_t>(section.offset + done))) {
+      return 0;
+    }
+    XXH64_update(state.get(), buffer.data(), length);
+    done += length;
+  }
+  return XXH64_digest(state.get());
+}
+
+void Put(IndexWriter &out, const RamdiskIndex &index) {
+  const auto &section = index.section;
+  out.String(section.name);
+  out.U64(section.offset);
+  out.U64(section.size);
+  out.U32(section.format);
+  out.U64(index.fingerprint);
+
+  out.U32(static_cast<uint32_t>(index.checkpoints.size()));
+  for (const auto &checkpoint : index.checkpoints) {
+    out.U64(checkpoint.out);
+    out.U64(checkpoint.in);
+    out.U32(checkpoint.bits);
+    out.Bytes(checkpoint.window.data(), checkpoint.window.size());
+  }
+
+  out.U32(static_cast<uint32_t>(index.entries.size()));
+  for (const auto &entry : index.entries) {
+    out.String(entry.path);
+    out.U32(entry.mode);
+    out.U32(entry.uid);
+    out.U32(entry.gid);
+    out.U32(entry.nlink);
+    out.U32(entry.mtime);
+    out.U64(entry.size);
+    out.U64(entry.header_offset);
+    out.U64(entry.data_offset);
+    out.String(entry.target);
+  }
+}
+
+bool Get(IndexReader &in, RamdiskIndex &index) {
+  auto &section = index.section;
+  uint32_t format, count;
+  if (!in.Bytes(section.name) || !in.U64(section.offset) ||
+      !in.U64(section.size) || !in.U32(format) || !in.U64(index.fingerprint)) {
+    return false;
+  }
+  section.format = static_cast<uint8_t>(format);
+
+  if (!in.Count(count, 24)) return false;
+  index.checkpoints.resize(count);
+  for (auto &checkpoint : index.checkpoints) {
+    uint32_t bits;
+    if (!in.U64(checkpoint.out) || !in.U64(checkpoint.in) || !in.U32(bits) ||
+        !in.Bytes(checkpoint.window)) {
+      return false;
+    }
+    checkpoint.bits = static_cast<uint8_t>(bits);
+  }
+
+  if (!in.Count(count, 52)) return false;
+  index.entries.resize(count);
+  for (auto &entry : index.entries) {
+    if (!in.Bytes(entry.path) || !in.U32(entry.mode) || !in.U32(entry.uid) ||
+        !in.U32(entry.gid) || !in.U32(entry.nlink) || !in.U32(entry.mtime) ||
+        !in.U64(entry.size) || !in.U64(entry.header_offset) ||
+        !in.U64(entry.data_offset) || !in.Bytes(entry.target)) {
+      return false;
+    }
+  }
+  return true;
+}
+}  // namespace
+
+std::optional<RamdiskIndex> IndexRamdisk(int fd,
+                                         const RamdiskSection &section) {
+  auto decoder =
+      RamdiskDecoder::Open(fd, section.offset, section.size, section.format);
+  if (!decoder) return std::nullopt;
+
+  RamdiskIndex index;
+  index.section = section;
+  index.fingerprint = Fingerprint(fd, section);
+  if (FindCodec(section.format)->has(CODEC_SEEKABLE)) {
+    decoder->RecordCheckpoints(&index.checkpoints, SEEK_INDEX_SPAN);
+  }
+  CpioReader reader(*decoder);
+  CpioEntry entry;
+  while (reader.Next(entry)) index.entries.push_back(std::move(entry));
+  if (reader.failed()) return std::nullopt;
+  return index;
+}
+
+bool WriteSeekIndex(int fd, const std::filesystem::path &path) {
+  auto sections = LocateRamdisks(fd);
+  if (!sections) return false;
+
+  IndexWriter body;
+  uint32_t count = 0;
+  for (const auto &section : *sections) {
+    if (section.format == FORMAT_OTHER) continue;
+    for (const auto &segment : SplitRamdisk(fd, section)) {
+      auto index = IndexRamdisk(fd, segment);
+      if (!index) {
+        LOGE("Could not index %s", section.name.c_str());
+        continue;
+      }
+      Put(body, *index);
+      ++count;
+    }
+  }
+
+  std::vector<uint8_t> file(HEADER_SIZE);
+  std::memcpy(file.data(), INDEX_MAGIC.data(), INDEX_MAGIC.size());
+  StoreU32(file.data() + 8, INDEX_VERSION);
+  StoreU32(file.data() + 12, count);
+  StoreU64(file.data() + 16,
+           XXH64(body.data().data(), body.data().size(), 0));
+  file.insert(file.end(), body.data().begin(), body.data().end());
+
+  int out = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (out < 0) {
+    LOGE("Error creating %s", path.c_str());
+    return false;
+  }
+  bool ok = WriteFullyAt(out, file.data(), file.size(), 0);
+  ok = close(out) == 0 && ok;
+  if (!ok) LOGE("Error writing %s", path.c_str());
+  return ok;
+}
+
+std::optional<std::vector<RamdiskIndex>> ReadSeekIndex(
+    const std::filesystem::path &path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    LOGE("Error opening %s", path.c_str());
+    return std::nullopt;
+  }
+  struct stat st {};
+  std::vector<uint8_t> file;
+  bool ok = fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(HEADER_SIZE);
+  if (ok) {
+    file.resize(static_cast<size_t>(st.st_size));
+    ok = ReadFullyAt(fd, file.data(), file.size(), 0);
+  }
+  close(fd);
+  if (!ok || std::memcmp(file.data(), INDEX_MAGIC.data(), INDEX_MAGIC.size()) ||
+      LoadU32(file.data() + 8) != INDEX_VERSION ||
+      XXH64(file.data() + HEADER_SIZE, file.size() - HEADER_SIZE, 0) !=
+          LoadU64(file.data() + 16)) {
+    LOGE("Seek index %s is invalid", path.c_str());
+    return std::nullopt;
+  }
+
+  IndexReader in(file.data() + HEADER_SIZE, file.size() - HEADER_SIZE);
+  std::vector<RamdiskIndex> indexes;
+  for (uint32_t i = LoadU32(file.data() + 12); i > 0; --i) {
+    if (!Get(in, indexes.emplace_back())) {
+      LOGE("Seek index %s is invalid", path.c_str());
+      return std::nullopt;
+    }
+  }
+  return indexes;
+}
+
+const RamdiskIndex *FindRamdiskIndex(int fd,
+                                     const std::vector<RamdiskIndex> &indexes,
+                                     const RamdiskSection &section) {
+  for (const auto &index : indexes) {
+    if (index.section.name == section.name &&
+        index.section.offset == section.offset &&
+        index.section.size == section.size &&
+        index.section.format == section.format) {
+      return index.fingerprint == Fingerprint(fd, section) ? &index : nullptr;
+    }
+  }
+  return nullptr;
+}
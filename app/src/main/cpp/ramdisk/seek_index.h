@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include "cpio_reader.h"
+#include "decoder.h"
+#include "ramdisk.h"
+
+// Random access into the ramdisks of an image. Unpacking with an index leaves
+// SEEK_INDEX_FILE next to .parserconfig: for every ramdisk, its cpio entries
+// with their offsets in the decoded stream, and checkpoints decoding can
+// restart from (gzip about every SEEK_INDEX_SPAN bytes, every LZ4 block).
+// Listing then decodes nothing, and reading an entry decodes from the
+// checkpoint before it instead of from byte 0.
+
+constexpr std::string_view SEEK_INDEX_FILE = ".seekindex";
+constexpr uint64_t SEEK_INDEX_SPAN = 4 * 1024 * 1024;
+
+struct RamdiskIndex {
+  RamdiskSection section;
+  // Identifies the compressed bytes the index was taken from.
+  uint64_t fingerprint = 0;
+  std::vector<SeekCheckpoint> checkpoints;
+  std::vector<CpioEntry> entries;
+};
+
+// Decodes section once, recording its entries and checkpoints.
+std::optional<RamdiskIndex> IndexRamdisk(int fd, const RamdiskSection &section);
+
+// Indexes every ramdisk of the image behind fd into path, one entry per
+// segment.
+bool WriteSeekIndex(int fd, const std::filesystem::path &path);
+
+std::optional<std::vector<RamdiskIndex>> ReadSeekIndex(
+    const std::filesystem::path &path);
+
+// The entry of indexes for section, or nullptr if none was taken from the
+// bytes now behind fd.
+const RamdiskIndex *FindRamdiskIndex(int fd,
+                                     const std::vector<RamdiskIndex> &indexes,
+                                     const RamdiskSection &section);
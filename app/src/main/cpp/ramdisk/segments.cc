@@ -0,0 +1,207 @@
+#include "segments.h"
+
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+
+#include "buffer_pool.h"
+#include "codec.h"
+#include "cpio_newc.h"
+#include "log.h"
+#include "lz4.h"
+
+namespace {
+constexpr size_t SNIFF_SIZE = 16;
+constexpr uint32_t LZ4_LEGACY_MAGIC = 0x184C2102;
+constexpr uint32_t LZ4_LEGACY_BLOCKSIZE = 8 * 1024 * 1024;
+
+uint8_t FormatAt(int fd, uint64_t offset, uint64_t end) {
+  uint8_t head[SNIFF_SIZE];
+  const auto size = static_cast<size_t>(std::min<uint64_t>(end - offset, SNIFF_SIZE));
+  if (!ReadFullyAt(fd, head, size, static_cast<off_t>(offset))) {
+    return FORMAT_OTHER;
+  }
+  return getHeaderFormat(head, size);
+}
+
+// Offset just past the trailer of the cpio archive at offset, or nullopt if
+// an entry before it does not parse.
+std::optional<uint64_t> CpioEnd(int fd, uint64_t offset, uint64_t end) {
+  const size_t trailer_size = std::strlen(CPIO_TRAILER_NAME) + 1;
+  while (end - offset >= CPIO_NEWC_HEADER_SIZE) {
+    char header[CPIO_NEWC_HEADER_SIZE];
+    CpioNewcHeader hdr;
+    if (!ReadFullyAt(fd, header, sizeof(header), static_cast<off_t>(offset)) ||
+        !ParseCpioNewcHeader(header, hdr) || hdr.namesize == 0 ||
+        hdr.namesize > CPIO_MAX_NAME_SIZE) {
+      return std::nullopt;
+    }
+    const uint64_t name = offset + CPIO_NEWC_HEADER_SIZE;
+    const uint64_t data =
+        name + hdr.namesize + CpioPad4(CPIO_NEWC_HEADER_SIZE + hdr.namesize);
+    if (data + hdr.filesize > end) return std::nullopt;
+    // The archive may stop short of the padding after its last entry.
+    const uint64_t next =
+        std::min(end, data + hdr.filesize + CpioPad4(hdr.filesize));
+    if (hdr.namesize == trailer_size) {
+      char trailer[16];
+      if (!ReadFullyAt(fd, trailer, trailer_size, static_cast<off_t>(name))) {
+        return std::nullopt;
+      }
+      if (std::memcmp(trailer, CPIO_TRAILER_NAME, trailer_size) == 0) {
+        return next;
+      }
+    }
+    offset = next;
+  }
+  return std::nullopt;
+}
+
+// Offset just past the legacy LZ4 stream at offset: its blocks, and the
+// magics of streams concatenated to it, up to the first thing that is
+// neither or that starts another archive.
+uint64_t Lz4End(int fd, uint64_t offset, uint64_t end) {
+  offset += 4;
+  while (end - offset >= 4) {
+    uint8_t raw[4];
+    if (!ReadFullyAt(fd, raw, sizeof(raw), static_cast<off_t>(offset))) break;
+    const uint32_t block_size = LoadU32(raw);
+    if (block_size == LZ4_LEGACY_MAGIC) {
+      offset += 4;
+      continue;
+    }
+    // A gzip header can pass for a plausible block size.
+    if (block_size == 0 ||
+        block_size > LZ4_COMPRESSBOUND(LZ4_LEGACY_BLOCKSIZE) ||
+        block_size > end - offset - 4 || isGzipHeader(raw, sizeof(raw))) {
+      break;
+    }
+    offset += 4 + block_size;
+  }
+  return offset;
+}
+
+// Offset of the first non-zero byte at or after offset, or end.
+uint64_t SkipZeros(int fd, uint64_t offset, uint64_t end) {
+  uint8_t buffer[4096];
+  while (offset < end) {
+    const auto size =
+        static_cast<size_t>(std::min<uint64_t>(end - offset, sizeof(buffer)));
+    if (!ReadFullyAt(fd, buffer, size, static_cast<off_t>(offset))) break;
+    const auto *nonzero = std::find_if(buffer, buffer + size,
+                                       [](uint8_t byte) { return byte != 0; });
+    offset += static_cast<uint64_t>(nonzero - buffer);
+    if (nonzero != buffer + size) break;
+  }
+  return offset;
+}
+
+}  // namespace
+
+std::vector<RamdiskSegment> FindRamdiskSegments(int fd, uint64_t offset,
+                                                uint64_t size) {
+  std::vector<RamdiskSegment> segments;
+  const uint64_t ramdisk_end = offset + size;
+  while (offset < ramdisk_end) {
+    RamdiskSegment segment{offset, ramdisk_end - offset, 0,
+                           FormatAt(fd, offset, ramdisk_end)};
+    std::optional<uint64_t> end;
+    if (segment.format == FORMAT_NONE) {
+      end = CpioEnd(fd, offset, ramdisk_end);
+    } else if (segment.format == FORMAT_LZ4) {
+      end = Lz4End(fd, offset, ramdisk_end);
+    }
+    if (!end) {
+      // Runs to the end: compressed, or a cpio that does not parse, which
+      // extraction will report. Bytes after the last archive that start no
+      // archive are dropped, like whatever follows a compressed stream.
+      if (segments.empty() || segment.format != FORMAT_OTHER) {
+        segments.push_back(segment);
+      }
+      break;
+    }
+    segment.size = *end - offset;
+    offset = SkipZeros(fd, *end, ramdisk_end);
+    segment.padding = offset - *end;
+    segments.push_back(segment);
+  }
+  return segments;
+}
+
+bool WriteRamdiskSegment(int fd, const RamdiskSegment &segment,
+                         const std::filesystem::path &output) {
+  int out = open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (out < 0) {
+    LOGE("Error creating %s", output.c_str());
+    return false;
+  }
+  auto in_pos = static_cast<off_t>(segment.offset);
+  const auto in_end = static_cast<off_t>(segment.offset + segment.size);
+  while (in_pos < in_end) {
+    // Raw syscall: bionic only exposes copy_file_range from API 34.
+    auto n = syscall(__NR_copy_file_range, fd, &in_pos, out, nullptr,
+                     static_cast<size_t>(in_end - in_pos), 0);
+    if (n <= 0) break;
+  }
+  bool ok = true;
+  if (in_pos < in_end) {
+    // copy_file_range is unavailable across filesystems on older kernels.
+    auto buffer = BufferPool::Shared().Acquire();
+    while (ok && in_pos < in_end) {
+      const size_t chunk =
+          std::min<size_t>(buffer.size(), static_cast<size_t>(in_end - in_pos));
+      const off_t out_pos = in_pos - static_cast<off_t>(segment.offset);
+      ok = ReadFullyAt(fd, buffer.data(), chunk, in_pos) &&
+           WriteFullyAt(out, buffer.data(), chunk, out_pos);
+      in_pos += static_cast<off_t>(chunk);
+    }
+  }
+  if (close(out) != 0) ok = false;
+  if (!ok) {
+    LOGE("Error writing %s", output.c_str());
+    std::error_code ec;
+    std::filesystem::remove(output, ec);
+  }
+  return ok;
+}
+
+bool WriteSegmentLayout(const std::vector<RamdiskSegment> &segments,
+                        const std::filesystem::path &path) {
+  std::ofstream out(path);
+  for (const auto &segment : segments) {
+    out << "format=" << getFormatName(segment.format)
+        << " padding=" << segment.padding << "\n";
+  }
+  out.close();
+  if (!out) LOGE("Error writing %s", path.c_str());
+  return static_cast<bool>(out);
+}
+
+std::optional<std::vector<RamdiskSegment>> ReadSegmentLayout(
+    const std::filesystem::path &path) {
+  std::ifstream in(path);
+  if (!in) return std::nullopt;
+  std::vector<RamdiskSegment> segments;
+  std::string line;
+  while (std::getline(in, line)) {
+    std::map<std::string, std::string> entry;
+    if (!ParseConfigLine(line, entry)) return std::nullopt;
+    RamdiskSegment segment;
+    const Codec *codec = FindCodec(entry["format"]);
+    segment.format = codec ? codec->format : FORMAT_OTHER;
+    segment.padding = std::strtoull(entry["padding"].c_str(), nullptr, 10);
+    if (segment.format == FORMAT_OTHER) {
+      LOGE("Unknown format in %s: %s", path.c_str(), entry["format"].c_str());
+      return std::nullopt;
+    }
+    segments.push_back(segment);
+  }
+  if (segments.empty()) return std::nullopt;
+  return segments;
+}
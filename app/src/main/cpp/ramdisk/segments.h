@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include "tools.h"
+
+// Ramdisks made of several archives back to back, which the kernel's
+// initramfs unpacker accepts: typically an uncompressed early cpio with CPU
+// microcode followed by the compressed main archive.
+
+struct RamdiskSegment {
+  uint64_t offset = 0;
+  uint64_t size = 0;
+  uint64_t padding = 0;  // zero bytes between it and the next segment
+  uint8_t format = FORMAT_OTHER;
+};
+
+// Left in the unpacked ramdisk directory when it came from several segments.
+// Entries of every segment but the last are tagged segment=<index> in its
+// CONFIG_FILE; untagged ones, including files added later, go to the last.
+constexpr std::string_view SEGMENTS_FILE = ".segments";
+
+// Splits the size bytes of ramdisk at offset in fd into segments, whose
+// offsets are in fd. cpio archives and legacy LZ4 streams are followed
+// header by header to their end; a gzip or LZMA stream only reveals its
+// length by being decoded, so it is taken to run to the end. An ordinary
+// ramdisk comes back as one segment.
+std::vector<RamdiskSegment> FindRamdiskSegments(int fd, uint64_t offset,
+                                                uint64_t size);
+
+// Copies one segment out of fd into its own file.
+bool WriteRamdiskSegment(int fd, const RamdiskSegment &segment,
+                         const std::filesystem::path &output);
+
+// The layout keeps format and padding; offsets and sizes change on rebuild.
+bool WriteSegmentLayout(const std::vector<RamdiskSegment> &segments,
+                        const std::filesystem::path &path);
+std::optional<std::vector<RamdiskSegment>> ReadSegmentLayout(
+    const std::filesystem::path &path);
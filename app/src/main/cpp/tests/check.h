@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdio>
+
+// Just enough of a harness for the host tests: a failed EXPECT is printed
+// and counted, and main returns TestResult() so ctest sees it.
+
+inline int &TestFailures() {
+  static int failures = 0;
+  return failures;
+}
+
+#define EXPECT(condition, ...)                                           \
+  do {                                                                   \
+    if (!(condition)) {                                                  \
+      std::fprintf(stderr, "%s:%d: EXPECT(%s) failed: ", __FILE__,       \
+                   __LINE__, #condition);                                \
+      std::fprintf(stderr, __VA_ARGS__);                                 \
+      std::fputc('\n', stderr);                                          \
+      ++TestFailures();                                                  \
+    }                                                                    \
+  } while (0)
+
+inline int TestResult() {
+  if (TestFailures() == 0) {
+    std::puts("PASS");
+    return 0;
+  }
+  std::printf("FAIL: %d check(s) failed\n", TestFailures());
+  return 1;
+}
@@ -0,0 +1,311 @@
+// Differential test of the in-tree DEFLATE decoder against zlib: the same
+// streams, intact and damaged, must decode to the same bytes or fail on
+// both sides; large gzip files must come out whole on the speculative
+// parallel path.
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "buffer_pool.h"
+#include "log.h"
+#include "ramdisk/inflate.h"
+#include "session.h"
+#include "tests/check.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+using Bytes = std::vector<uint8_t>;
+
+constexpr int STRATEGIES[] = {Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY,
+                              Z_RLE, Z_FIXED};
+constexpr const char *STRATEGY_NAMES[] = {"default", "filtered", "huffman",
+                                          "rle", "fixed"};
+
+// Word salad: repetitive enough for long matches and dynamic blocks, varied
+// enough that the Huffman codes change from block to block.
+Bytes Text(size_t size, uint64_t seed) {
+  static const char *const WORDS[] = {
+      "init",  "vendor", "system", "ramdisk", "/dev/block/", "mount",
+      "ro.",   "boot",   "=",      "\n",      "0x",          "selinux",
+      "kernel", " ",     "first_stage", "fstab", "service", "on property:"};
+  std::mt19937_64 random(seed);
+  Bytes data;
+  data.reserve(size + 32);
+  while (data.size() < size) {
+    if (random() % 16 == 0) {
+      data.push_back(static_cast<uint8_t>(random()));
+      continue;
+    }
+    const char *word = WORDS[random() % std::size(WORDS)];
+    data.insert(data.end(), word, word + std::char_traits<char>::length(word));
+  }
+  data.resize(size);
+  return data;
+}
+
+Bytes Random(size_t size, uint64_t seed) {
+  std::mt19937_64 random(seed);
+  Bytes data(size);
+  for (auto &b : data) b = static_cast<uint8_t>(random());
+  return data;
+}
+
+// Long runs broken up by noise, for RLE and far matches.
+Bytes Runs(size_t size, uint64_t seed) {
+  std::mt19937_64 random(seed);
+  Bytes data;
+  while (data.size() < size) {
+    data.insert(data.end(), random() % 2000, static_cast<uint8_t>(random()));
+    for (int i = random() % 8; i > 0; --i) {
+      data.push_back(static_cast<uint8_t>(random()));
+    }
+  }
+  data.resize(size);
+  return data;
+}
+
+// window_bits < 0 gives a raw stream, 31 a gzip member.
+Bytes Deflate(const Bytes &data, int level, int strategy, int window_bits) {
+  z_stream z{};
+  if (deflateInit2(&z, level, Z_DEFLATED, window_bits, 8, strategy) != Z_OK) {
+    return {};
+  }
+  Bytes out(deflateBound(&z, data.size()));
+  z.next_in = const_cast<uint8_t *>(data.data());
+  z.avail_in = static_cast<uInt>(data.size());
+  z.next_out = out.data();
+  z.avail_out = static_cast<uInt>(out.size());
+  const int ret = deflate(&z, Z_FINISH);
+  out.resize(z.total_out);
+  deflateEnd(&z);
+  return ret == Z_STREAM_END ? out : Bytes{};
+}
+
+// What a decoder made of a stream: the output, and how much input it took,
+// if it reached the end of the final block within out_size bytes.
+struct Decoded {
+  bool complete = false;
+  Bytes output;
+  size_t in_used = 0;
+};
+
+Decoded ZlibInflate(const Bytes &in, size_t out_size) {
+  Decoded decoded;
+  z_stream z{};
+  if (inflateInit2(&z, -15) != Z_OK) return decoded;
+  decoded.output.resize(out_size);
+  z.next_in = const_cast<uint8_t *>(in.data());
+  z.avail_in = static_cast<uInt>(in.size());
+  z.next_out = decoded.output.data();
+  z.avail_out = static_cast<uInt>(out_size);
+  decoded.complete = inflate(&z, Z_FINISH) == Z_STREAM_END;
+  decoded.output.resize(z.total_out);
+  decoded.in_used = z.total_in;
+  inflateEnd(&z);
+  return decoded;
+}
+
+Decoded OurInflate(const Bytes &in, size_t out_size, InflateResult &result) {
+  Decoded decoded;
+  decoded.output.resize(out_size);
+  size_t out_used = 0;
+  result = InflateRaw(in.data(), in.size(), decoded.output.data(), out_size,
+                      decoded.in_used, out_used);
+  decoded.complete = result == InflateResult::OK;
+  decoded.output.resize(out_used);
+  return decoded;
+}
+
+void TestRoundTrips() {
+  const std::vector<std::pair<const char *, Bytes>> inputs = {
+      {"empty", {}},
+      {"one byte", {0x42}},
+      {"text", Text(300 << 10, 1)},
+      {"random", Random(100 << 10, 2)},
+      {"runs", Runs(300 << 10, 3)},
+  };
+  for (const auto &[name, data] : inputs) {
+    for (int level = 0; level <= 9; ++level) {
+      for (size_t s = 0; s < std::size(STRATEGIES); ++s) {
+        const Bytes stream = Deflate(data, level, STRATEGIES[s], -15);
+        InflateResult result;
+        const Decoded ours = OurInflate(stream, data.size(), result);
+        EXPECT(result == InflateResult::OK && ours.output == data &&
+                   ours.in_used == stream.size(),
+               "%s, level %d, %s: result %d, %zu/%zu bytes in", name, level,
+               STRATEGY_NAMES[s], static_cast<int>(result), ours.in_used,
+               stream.size());
+
+        // Whatever follows the stream is not part of it.
+        Bytes padded = stream;
+        padded.insert(padded.end(), 16, 0xA5);
+        const Decoded tail = OurInflate(padded, data.size(), result);
+        EXPECT(result == InflateResult::OK && tail.in_used == stream.size(),
+               "%s, level %d, %s: %zu bytes in with trailing data", name,
+               level, STRATEGY_NAMES[s], tail.in_used);
+      }
+    }
+  }
+}
+
+void TestShortOutput() {
+  const Bytes data = Text(64 << 10, 4);
+  for (int level : {0, 1, 6, 9}) {
+    const Bytes stream = Deflate(data, level, Z_DEFAULT_STRATEGY, -15);
+    for (size_t out_size : {size_t{0}, size_t{1}, data.size() / 2,
+                            data.size() - 1}) {
+      InflateResult result;
+      OurInflate(stream, out_size, result);
+      EXPECT(result == InflateResult::SHORT_OUTPUT,
+             "level %d into %zu of %zu bytes: result %d", level, out_size,
+             data.size(), static_cast<int>(result));
+    }
+  }
+}
+
+// Every prefix short of the whole stream is incomplete.
+void TestTruncated() {
+  const Bytes data = Text(32 << 10, 5);
+  for (int level : {0, 6}) {
+    const Bytes stream = Deflate(data, level, Z_DEFAULT_STRATEGY, -15);
+    for (size_t size = 0; size < stream.size();
+         size += std::max<size_t>(1, stream.size() / 97)) {
+      const Bytes prefix(stream.begin(), stream.begin() + size);
+      InflateResult result;
+      OurInflate(prefix, data.size(), result);
+      EXPECT(result == InflateResult::BAD_DATA,
+             "level %d cut at %zu of %zu: result %d", level, size,
+             stream.size(), static_cast<int>(result));
+    }
+  }
+}
+
+// A flipped bit may leave a valid stream that decodes to something else;
+// either way both decoders must agree on it.
+void TestFlippedBits() {
+  std::mt19937_64 random(6);
+  const std::vector<Bytes> inputs = {Text(20 << 10, 7), Runs(20 << 10, 8),
+                                     Random(4 << 10, 9)};
+  for (const Bytes &data : inputs) {
+    for (int level : {0, 1, 6, 9}) {
+      for (int strategy : {Z_DEFAULT_STRATEGY, Z_FIXED}) {
+        const Bytes stream = Deflate(data, level, strategy, -15);
+        // Room for a damaged length or distance to make it longer.
+        const size_t out_size = data.size() + 4096;
+        for (int trial = 0; trial < 200; ++trial) {
+          Bytes damaged = stream;
+          const size_t bit = random() % (damaged.size() * 8);
+          damaged[bit / 8] ^= static_cast<uint8_t>(1u << (bit % 8));
+
+          InflateResult result;
+          const Decoded ours = OurInflate(damaged, out_size, result);
+          const Decoded zlib = ZlibInflate(damaged, out_size);
+          EXPECT(ours.complete == zlib.complete,
+                 "level %d, bit %zu: ours %d, zlib %s", level, bit,
+                 static_cast<int>(result),
+                 zlib.complete ? "complete" : "failed");
+          if (ours.complete && zlib.complete) {
+            EXPECT(ours.output == zlib.output && ours.in_used == zlib.in_used,
+                   "level %d, bit %zu: decoders disagree on the output",
+                   level, bit);
+          }
+        }
+      }
+    }
+  }
+}
+
+bool ReadFile(const fs::path &path, Bytes &data) {
+  std::ifstream in(path, std::ios::binary);
+  data.assign(std::istreambuf_iterator<char>(in), {});
+  return in.good() || in.eof();
+}
+
+bool WriteFile(const fs::path &path, const Bytes &data) {
+  std::ofstream out(path, std::ios::binary);
+  out.write(reinterpret_cast<const char *>(data.data()),
+            static_cast<std::streamsize>(data.size()));
+  return out.good();
+}
+
+// Big enough for InflateGzipFile to take the parallel path, given the
+// memory budget for it.
+void TestGzipFiles(const Session &session, const fs::path &dir) {
+  const Bytes data = Text(72 << 20, 10);
+  const fs::path input = dir / "ramdisk.gz";
+  const fs::path output = dir / "ramdisk";
+  Bytes inflated;
+
+  BufferPool &pool = BufferPool::Shared();
+  const size_t budget = pool.budget();
+  for (int level : {1, 6, 9}) {
+    const Bytes member = Deflate(data, level, Z_DEFAULT_STRATEGY, 31);
+    EXPECT(WriteFile(input, member), "writing %s", input.c_str());
+    // Ample, then barely enough to try, where a chunk that outgrows it
+    // sends the decoding back to the start, in order.
+    for (size_t mib : {256, 18}) {
+      pool.SetBudget(mib << 20);
+      for (unsigned threads : {1u, 2u, 3u, 4u, 8u}) {
+        Session job(session, "inflate", threads);
+        Session::Scope scope(job);
+        const bool ok = InflateGzipFile(input, output);
+        EXPECT(ok && ReadFile(output, inflated) && inflated == data,
+               "gzip level %d on %u threads, %zu MiB budget", level, threads,
+               mib);
+      }
+    }
+    pool.SetBudget(budget);
+
+    // A damaged member must be refused as a whole: no output left behind,
+    // whichever path noticed.
+    Bytes damaged = member;
+    damaged[damaged.size() / 2] ^= 0x10;
+    EXPECT(WriteFile(input, damaged), "writing %s", input.c_str());
+    Session job(session, "inflate", 4);
+    Session::Scope scope(job);
+    EXPECT(!InflateGzipFile(input, output) && !fs::exists(output),
+           "damaged gzip level %d was accepted", level);
+  }
+
+  // Two members are left to zlib.
+  const Bytes small = Text(1 << 20, 11);
+  Bytes members = Deflate(small, 6, Z_DEFAULT_STRATEGY, 31);
+  const Bytes second = members;
+  members.insert(members.end(), second.begin(), second.end());
+  EXPECT(WriteFile(input, members), "writing %s", input.c_str());
+  EXPECT(!InflateGzipFile(input, output) && !fs::exists(output),
+         "two gzip members were accepted");
+}
+}  // namespace
+
+int main() {
+  Session session(nullptr, LEVEL_EXTRACT);
+  Session::Scope scope(session);
+
+  TestRoundTrips();
+  TestShortOutput();
+  TestTruncated();
+  TestFlippedBits();
+
+  std::string dir_template =
+      (fs::temp_directory_path() / "abik-inflate-XXXXXX").string();
+  if (mkdtemp(dir_template.data()) == nullptr) {
+    std::perror("mkdtemp");
+    return 1;
+  }
+  TestGzipFiles(session, dir_template);
+  std::error_code ec;
+  fs::remove_all(dir_template, ec);
+
+  return TestResult();
+}
@@ -0,0 +1,182 @@
+// RSA key loading, PKCS#1 v1.5 signing and signed vbmeta, checked against
+// fixtures made with openssl: tests/data holds PKCS#1 and PKCS#8 keys, the
+// signatures `openssl dgst -sha256 -sign` gives for MESSAGE, and the vbmeta
+// of WriteTestImage's image signed with each key, whose signatures were
+// checked with `openssl dgst -sha256 -verify` when they were made.
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "avb/footer.h"
+#include "avb/rsa.h"
+#include "log.h"
+#include "session.h"
+#include "tests/check.h"
+#include "tools.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+using Bytes = std::vector<uint8_t>;
+
+constexpr std::string_view MESSAGE = "abik rsa test vector";
+constexpr uint64_t IMAGE_SIZE = 100000;
+constexpr uint64_t PARTITION_SIZE = 1 << 20;
+
+Bytes ReadFile(const fs::path &path) {
+  std::ifstream in(path, std::ios::binary);
+  return Bytes(std::istreambuf_iterator<char>(in), {});
+}
+
+// Same bytes on every run, so the vbmeta over it is too.
+bool WriteTestImage(const fs::path &path) {
+  Bytes image(IMAGE_SIZE);
+  for (size_t i = 0; i < image.size(); ++i) {
+    image[i] = static_cast<uint8_t>(i * 7 + i / 251);
+  }
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  out.write(reinterpret_cast<const char *>(image.data()),
+            static_cast<std::streamsize>(image.size()));
+  return out.good();
+}
+
+avb::HashFooterArgs FooterArgs(const fs::path &key) {
+  avb::HashFooterArgs args;
+  args.partition_size = PARTITION_SIZE;
+  args.partition_name = "boot";
+  for (uint8_t i = 0; i < 32; ++i) args.salt.push_back(i * 17);
+  args.properties.emplace_back("com.android.build.boot.os_version", "14");
+  args.key = key;
+  return args;
+}
+
+void TestKeys(const fs::path &data) {
+  for (size_t bits : {2048u, 4096u}) {
+    const std::string name = "rsa" + std::to_string(bits);
+    auto key = avb::LoadRsaKey(data / (name + ".pem"));
+    auto public_key = avb::LoadRsaKey(data / (name + ".pub.pem"));
+    EXPECT(key && key->bits() == bits && !key->private_exponent.empty(),
+           "%s.pem", name.c_str());
+    EXPECT(public_key && public_key->private_exponent.empty(), "%s.pub.pem",
+           name.c_str());
+    if (!key || !public_key) continue;
+    EXPECT(key->modulus == public_key->modulus &&
+               key->public_exponent == Bytes({0x01, 0x00, 0x01}) &&
+               public_key->public_exponent == key->public_exponent,
+           "%s: private and public key disagree", name.c_str());
+
+    // The vbmeta form round-trips to the same public key.
+    const Bytes encoded = avb::EncodeAvbPublicKey(*key);
+    auto decoded = avb::DecodeAvbPublicKey(encoded.data(), encoded.size());
+    EXPECT(encoded.size() == 8 + 2 * bits / 8 && decoded &&
+               decoded->modulus == key->modulus,
+           "%s: AVB public key encoding", name.c_str());
+  }
+}
+
+void TestSignatures(const fs::path &data) {
+  const auto digest = avb::Sha256::Hash(MESSAGE.data(), MESSAGE.size());
+  auto other = digest;
+  other[0] ^= 1;
+  for (size_t bits : {2048u, 4096u}) {
+    const std::string name = "rsa" + std::to_string(bits);
+    auto key = avb::LoadRsaKey(data / (name + ".pem"));
+    auto public_key = avb::LoadRsaKey(data / (name + ".pub.pem"));
+    const Bytes expected = ReadFile(data / (name + ".sig"));
+    if (!key || !public_key) continue;
+
+    auto signature = avb::SignSha256(*key, digest);
+    EXPECT(signature && *signature == expected,
+           "%s: signature differs from openssl's", name.c_str());
+    EXPECT(avb::VerifySha256(*public_key, expected, digest),
+           "%s: openssl's signature does not verify", name.c_str());
+    EXPECT(!avb::VerifySha256(*public_key, expected, other),
+           "%s: signature verifies for another digest", name.c_str());
+    Bytes damaged = expected;
+    damaged[damaged.size() / 2] ^= 0x01;
+    EXPECT(!avb::VerifySha256(*public_key, damaged, digest),
+           "%s: damaged signature verifies", name.c_str());
+    EXPECT(!avb::SignSha256(*public_key, digest),
+           "%s: signed with a public key", name.c_str());
+  }
+}
+
+void TestVbmeta(const fs::path &data, const fs::path &dir) {
+  const fs::path image = dir / "boot.img";
+  for (size_t bits : {2048u, 4096u}) {
+    const std::string name = "rsa" + std::to_string(bits);
+    EXPECT(WriteTestImage(image), "writing %s", image.c_str());
+    EXPECT(avb::AddHashFooter(image, IMAGE_SIZE,
+                              FooterArgs(data / (name + ".pem"))),
+           "%s: adding the footer", name.c_str());
+
+    int fd = open(image.c_str(), O_RDONLY | O_CLOEXEC);
+    auto footer = avb::ReadHashFooter(fd);
+    Bytes vbmeta;
+    if (footer) {
+      vbmeta.resize(footer->vbmeta_size);
+      ReadFullyAt(fd, vbmeta.data(), vbmeta.size(),
+                  static_cast<off_t>(footer->vbmeta_offset));
+    }
+    EXPECT(footer && footer->algorithm == "SHA256_RSA" + std::to_string(bits),
+           "%s: footer algorithm", name.c_str());
+    EXPECT(vbmeta == ReadFile(data / ("vbmeta_" + name + ".bin")),
+           "%s: vbmeta differs from the fixture", name.c_str());
+
+    bool verified = false;
+    EXPECT(avb::VerifyImage(fd, data / (name + ".pub.pem"), verified) &&
+               verified,
+           "%s: image does not verify", name.c_str());
+    close(fd);
+  }
+}
+
+// libavb only knows 2048, 4096 and 8192 bit keys; anything else must not
+// end up in a vbmeta under another key size's algorithm.
+void TestRejectedKeys(const fs::path &data, const fs::path &dir) {
+  const fs::path image = dir / "boot.img";
+  for (const char *name : {"rsa1024.pem", "rsa3072.pem"}) {
+    EXPECT(!avb::LoadRsaKey(data / name), "%s was loaded", name);
+    EXPECT(WriteTestImage(image), "writing %s", image.c_str());
+    EXPECT(!avb::AddHashFooter(image, IMAGE_SIZE, FooterArgs(data / name)) &&
+               fs::file_size(image) == IMAGE_SIZE,
+           "%s signed a footer", name);
+  }
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    std::fprintf(stderr, "usage: %s <tests/data>\n", argv[0]);
+    return 2;
+  }
+  const fs::path data = argv[1];
+  Session session(nullptr, LEVEL_BUILD);
+  Session::Scope scope(session);
+
+  std::string dir_template =
+      (fs::temp_directory_path() / "abik-rsa-XXXXXX").string();
+  if (mkdtemp(dir_template.data()) == nullptr) {
+    std::perror("mkdtemp");
+    return 1;
+  }
+
+  TestKeys(data);
+  TestSignatures(data);
+  TestVbmeta(data, dir_template);
+  TestRejectedKeys(data, dir_template);
+
+  std::error_code ec;
+  fs::remove_all(dir_template, ec);
+  return TestResult();
+}
@@ -1,46 +1,38 @@
 #include "bootimg.h"
 
+#include <fcntl.h>
 #include <unistd.h>
 
 #include <array>
 #include <sstream>
 #include <vector>
 
-#include "bootconfig.h"
+#include "image_layout.h"
 #include "log.h"
+#include "parser_config.h"
 #include "tools.h"
+#include "trace.h"
 #include "utils.h"
 
 namespace {
 constexpr uint32_t BOOT_IMAGE_HEADER_V3_PAGESIZE = 4096;
 constexpr uint32_t BOOT_MAGIC_SIZE = 8;
 constexpr uint32_t SHA_LENGTH = 32;
+constexpr uint32_t BOOT_NAME_SIZE = 16;
+constexpr uint32_t BOOT_ARGS_SIZE = 512;
+constexpr uint32_t BOOT_EXTRA_ARGS_SIZE = 1024;
+constexpr uint32_t BOOT_IMAGE_HEADER_V2_SIZE = 1660;
 
-struct ImageEntry {
-  uint64_t offset;
-  uint32_t size;
-  std::string name;
-};
-}  // namespace
-
-std::optional<BootImageInfo> UnpackBootImage(
-    int fd, const std::filesystem::path &output_dir, bool dec_ramdisk) {
-  BootImageInfo info;
-
-  LOG("Working at: %s", output_dir.filename().c_str());
+// Decodes the header from the first bytes of the image without touching the
+// fd, so inspecting never costs more than a single read.
+bool ParseHeader(const uint8_t *data, size_t size, BootImageInfo &info) {
+  utils::ByteReader in(data, size);
 
-  // Read boot magic
-  if (auto magic = utils::ReadString(fd, BOOT_MAGIC_SIZE)) {
-    info.boot_magic = *magic;
-  } else {
-    return std::nullopt;
-  }
+  info.boot_magic = in.String(BOOT_MAGIC_SIZE);
 
   // Read kernel/ramdisk/second info (9 uint32_t)
   std::array<uint32_t, 9> kernel_ramdisk_second_info{};
-  for (auto &val : kernel_ramdisk_second_info) {
-    if (!utils::ReadU32(fd, val)) return std::nullopt;
-  }
+  for (auto &val : kernel_ramdisk_second_info) val = in.U32();
 
   info.header_version = kernel_ramdisk_second_info[8];
 
@@ -51,15 +43,12 @@ std::optional<BootImageInfo> UnpackBootImage(
   // };
   if (info.header_version > 1024) {
     LOGE("Legacy boot images are not supported!!!");
-    return std::nullopt;
+    return false;
   }
-  LOG("Header version: %d", info.header_version);
 
   info.page_size = (info.header_version < 3) ? kernel_ramdisk_second_info[7]
                                              : BOOT_IMAGE_HEADER_V3_PAGESIZE;
 
-  LOG("Page size: %d", info.page_size);
-
   // Handle version-specific fields
   uint32_t os_version_patch_level;
   if (info.header_version < 3) {
@@ -68,23 +57,15 @@ std::optional<BootImageInfo> UnpackBootImage(
     info.ramdisk_size = kernel_ramdisk_second_info[2];
     info.ramdisk_load_address = kernel_ramdisk_second_info[3];
     info.second_size = kernel_ramdisk_second_info[4];
-    LOG("Secondary bootloader size: %.2fMB",
-        static_cast<float>(info.second_size) / 1024 / 1024);
     info.second_load_address = kernel_ramdisk_second_info[5];
     info.tags_load_address = kernel_ramdisk_second_info[6];
-
-    if (!utils::ReadU32(fd, os_version_patch_level)) return std::nullopt;
+    os_version_patch_level = in.U32();
   } else {
     info.kernel_size = kernel_ramdisk_second_info[0];
     info.ramdisk_size = kernel_ramdisk_second_info[1];
     os_version_patch_level = kernel_ramdisk_second_info[2];
   }
 
-  LOG("Kernel size: %.2fMB",
-      static_cast<float>(info.kernel_size) / 1024 / 1024);
-  LOG("Ramdisk size: %.2fMB",
-      static_cast<float>(info.ramdisk_size) / 1024 / 1024);
-
   auto [os_ver, os_patch] =
       utils::DecodeOsVersionPatchLevel(os_version_patch_level);
   info.os_version = os_ver.value_or("");
@@ -92,87 +73,65 @@ std::optional<BootImageInfo> UnpackBootImage(
 
   // Handle command line fields
   if (info.header_version < 3) {
-    if (auto product = utils::ReadString(fd, 16)) {
-      info.product_name = utils::CStr(*product);
-      LOG("Board: %s", info.product_name.c_str());
-    }
-    if (auto cmdline = utils::ReadString(fd, 512)) {
-      info.cmdline = utils::CStr(*cmdline);
-    }
-
-    off_t result = lseek64(fd, SHA_LENGTH, SEEK_CUR);
-    if (result == -1) {
-      LOGE("Error reading SHA1 checksum");
-      return std::nullopt;
-    }
-
-    if (auto extra = utils::ReadString(fd, 1024)) {
-      info.extra_cmdline = utils::CStr(*extra);
-      LOG("Extra cmdline length: %d", info.extra_cmdline.length());
-    }
+    info.product_name = in.String(BOOT_NAME_SIZE);
+    info.cmdline = in.String(BOOT_ARGS_SIZE);
+    in.Skip(SHA_LENGTH);
+    info.extra_cmdline = in.String(BOOT_EXTRA_ARGS_SIZE);
   } else {
-    if (auto cmdline = utils::ReadString(fd, 1536))
-      info.cmdline = utils::CStr(*cmdline);
-  }
-  LOG("Cmdline length: %d", info.cmdline.length());
-  std::string full_cmdline = info.cmdline;
-  if (!info.extra_cmdline.empty()) {
-    full_cmdline += " " + info.extra_cmdline;
+    info.cmdline = in.String(BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE);
   }
 
   // Handle version-specific extensions
   if (info.header_version == 1 || info.header_version == 2) {
-    if (!utils::ReadU32(fd, info.recovery_dtbo_size)) return std::nullopt;
-    LOG("Recovery DTBO size: %.2fMB",
-        static_cast<float>(info.recovery_dtbo_size) / 1024 / 1024);
-    if (!utils::ReadU64(fd, info.recovery_dtbo_offset)) return std::nullopt;
-    if (!utils::ReadU32(fd, info.boot_header_size)) return std::nullopt;
+    info.recovery_dtbo_size = in.U32();
+    info.recovery_dtbo_offset = in.U64();
+    info.boot_header_size = in.U32();
   }
 
   if (info.header_version == 2) {
-    if (!utils::ReadU32(fd, info.dtb_size)) return std::nullopt;
-    LOG("DTB size: %.2fMB", static_cast<float>(info.dtb_size) / 1024 / 1024);
-    if (!utils::ReadU64(fd, info.dtb_load_address)) return std::nullopt;
+    info.dtb_size = in.U32();
+    info.dtb_load_address = in.U64();
   }
 
   if (info.header_version >= 4) {
-    if (!utils::ReadU32(fd, info.boot_signature_size)) return std::nullopt;
+    info.boot_signature_size = in.U32();
   }
 
-  // Calculate image offsets
-  std::vector<ImageEntry> image_entries;
-  const uint32_t page_size = info.page_size;
-  const uint32_t num_header_pages = 1;
+  if (!in.ok()) {
+    LOGE("Truncated boot image header");
+    return false;
+  }
+  if (info.page_size == 0) {
+    LOGE("Invalid page size");
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+std::vector<utils::ImageEntry> GetBootImageEntries(const BootImageInfo &info) {
+  std::vector<utils::ImageEntry> image_entries;
+  const auto layout = PlanBootImage(
+      info.header_version, info.page_size, info.kernel_size, info.ramdisk_size,
+      info.second_size, info.recovery_dtbo_size, info.dtb_size);
 
   // Kernel
-  uint32_t num_kernel_pages = GetNumberOfPages(info.kernel_size, page_size);
   if (info.kernel_size > 0) {  // Patch1: Only unpack kernel if it exists
-    image_entries.emplace_back(page_size * num_header_pages, info.kernel_size,
+    image_entries.emplace_back(layout.kernel.offset, info.kernel_size,
                                "kernel");
   }
 
   // Ramdisk
-  uint32_t num_ramdisk_pages = GetNumberOfPages(info.ramdisk_size, page_size);
   if (info.ramdisk_size > 0) {  // Patch2: Only unpack ramdisk if it exists
-    off_t ramdisk_offset = page_size * (num_header_pages + num_kernel_pages);
-    info.ramdisk_compression = FORMAT_OTHER;
-
-    if (dec_ramdisk) {
-      auto buf = utils::ReadNBytesAtOffsetX(fd, ramdisk_offset, 16);
-      if (buf.empty()) {
-        LOGE("Could not read ramdisk");
-        return std::nullopt;
-      }
-      info.ramdisk_compression = getHeaderFormat(buf.data(), buf.size());
-    }
-    image_entries.emplace_back(ramdisk_offset, info.ramdisk_size, "ramdisk");
+    image_entries.emplace_back(layout.ramdisk.offset, info.ramdisk_size,
+                               "ramdisk");
   }
 
   // Second
   if (info.second_size > 0) {
-    image_entries.emplace_back(
-        page_size * (num_header_pages + num_kernel_pages + num_ramdisk_pages),
-        info.second_size, "second");
+    image_entries.emplace_back(layout.second.offset, info.second_size,
+                               "second");
   }
 
   // Recovery DTBO
@@ -183,31 +142,114 @@ std::optional<BootImageInfo> UnpackBootImage(
 
   // DTB
   if (info.dtb_size > 0) {
-    image_entries.emplace_back(
-        page_size * (num_header_pages + num_kernel_pages + num_ramdisk_pages +
-                     GetNumberOfPages(info.second_size, page_size) +
-                     GetNumberOfPages(info.recovery_dtbo_size, page_size)),
-        info.dtb_size, "dtb");
+    image_entries.emplace_back(layout.dtb.offset, info.dtb_size, "dtb");
   }
 
-  // Boot signature
+  // Boot signature, where v4 has no second
   if (info.boot_signature_size > 0) {
-    image_entries.emplace_back(
-        page_size * (num_header_pages + num_kernel_pages + num_ramdisk_pages),
-        info.boot_signature_size, "boot_signature");
+    image_entries.emplace_back(layout.second.offset, info.boot_signature_size,
+                               "boot_signature");
   }
+  return image_entries;
+}
 
-  // Extract images
-  for (const auto &entry : image_entries) {
-    const auto output_path = output_dir / entry.name;
-    LOG("Extracting %s", entry.name.c_str());
-    if (!utils::ExtractImage(fd, entry.offset, entry.size, output_path)) {
+std::optional<BootImageInfo> InspectBootImage(int fd) {
+  BootImageInfo info;
+  {
+    TraceSpan span("header_parse");
+    auto header = utils::ReadNBytesAtOffsetX(fd, 0, BOOT_IMAGE_HEADER_V2_SIZE);
+    span.SetBytes(header.size(), 0);
+    if (!ParseHeader(header.data(), header.size(), info)) return std::nullopt;
+  }
+
+  for (const auto &entry : GetBootImageEntries(info)) {
+    if (entry.name != "ramdisk") continue;
+    TraceSpan span("sniff", entry.name);
+    auto buf = utils::ReadNBytesAtOffsetX(fd, entry.offset, 16);
+    if (buf.empty()) {
+      LOGE("Could not read ramdisk");
       return std::nullopt;
     }
+    info.ramdisk_compression = getHeaderFormat(buf.data(), buf.size());
+  }
+  return info;
+}
+
+namespace {
+void LogImageInfo(const BootImageInfo &info) {
+  LOG("Header version: %d", info.header_version);
+  LOG("Page size: %d", info.page_size);
+  if (info.header_version < 3) {
+    LOG("Secondary bootloader size: %.2fMB",
+        static_cast<float>(info.second_size) / 1024 / 1024);
+  }
+  LOG("Kernel size: %.2fMB",
+      static_cast<float>(info.kernel_size) / 1024 / 1024);
+  LOG("Ramdisk size: %.2fMB",
+      static_cast<float>(info.ramdisk_size) / 1024 / 1024);
+  if (info.header_version < 3) {
+    LOG("Board: %s", info.product_name.c_str());
+    LOG("Extra cmdline length: %d", info.extra_cmdline.length());
+  }
+  LOG("Cmdline length: %d", info.cmdline.length());
+  if (info.header_version == 1 || info.header_version == 2) {
+    LOG("Recovery DTBO size: %.2fMB",
+        static_cast<float>(info.recovery_dtbo_size) / 1024 / 1024);
+  }
+  if (info.header_version == 2) {
+    LOG("DTB size: %.2fMB", static_cast<float>(info.dtb_size) / 1024 / 1024);
   }
+}
+}  // namespace
+
+std::optional<BootImageInfo> UnpackBootImage(
+    int fd, const std::filesystem::path &output_dir, bool dec_ramdisk) {
+  LOG("Working at: %s", output_dir.filename().c_str());
+
+  auto parsed = InspectBootImage(fd);
+  if (!parsed) return std::nullopt;
+  BootImageInfo &info = *parsed;
+  if (!dec_ramdisk) info.ramdisk_compression = FORMAT_OTHER;
+  LogImageInfo(info);
+
+  // Extract images
+  const auto entries = GetBootImageEntries(info);
+  if (!utils::ValidateEntries(fd, entries)) return std::nullopt;
+  if (!utils::ExtractImages(fd, entries, output_dir)) return std::nullopt;
 
   // info.image_dir = output_dir;
-  auto config_dir = output_dir / CONFIG_FILE;
-  BootConfig::Write(info, config_dir.string());
+  if (!WriteParserConfig(info, output_dir / CONFIG_FILE)) return std::nullopt;
+  return info;
+}
+
+std::optional<BootImageInfo> UnpackBootImage(
+    utils::StreamReader &in, const std::filesystem::path &output_dir,
+    bool dec_ramdisk) {
+  LOG("Working at: %s", output_dir.filename().c_str());
+
+  BootImageInfo info;
+  {
+    TraceSpan span("header_parse");
+    auto header = in.Peek(BOOT_IMAGE_HEADER_V2_SIZE);
+    span.SetBytes(header.size(), 0);
+    if (!ParseHeader(header.data(), header.size(), info)) return std::nullopt;
+  }
+  LogImageInfo(info);
+
+  if (!utils::ExtractImages(in, GetBootImageEntries(info), output_dir)) {
+    return std::nullopt;
+  }
+  // The ramdisk has gone by; it is sniffed from its copy instead.
+  if (dec_ramdisk && info.ramdisk_size > 0) {
+    TraceSpan span("sniff", "ramdisk");
+    int ramdisk = open((output_dir / "ramdisk").c_str(), O_RDONLY | O_CLOEXEC);
+    if (ramdisk >= 0) {
+      auto buf = utils::ReadNBytesAtOffsetX(ramdisk, 0, 16);
+      info.ramdisk_compression = getHeaderFormat(buf.data(), buf.size());
+      close(ramdisk);
+    }
+  }
+
+  if (!WriteParserConfig(info, output_dir / CONFIG_FILE)) return std::nullopt;
   return info;
 }
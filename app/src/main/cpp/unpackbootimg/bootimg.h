@@ -46,5 +46,13 @@ struct BootImageInfo {
   // std::filesystem::path image_dir;
 };
 
+// Sections of the image in file order, with absolute offsets.
+std::vector<utils::ImageEntry> GetBootImageEntries(const BootImageInfo &info);
+// Parses only the header and sniffs the ramdisk; never writes anything.
+std::optional<BootImageInfo> InspectBootImage(int fd);
 std::optional<BootImageInfo> UnpackBootImage(
     int fd, const std::filesystem::path &output_dir, bool dec_ramdisk);
+// Single forward pass over an image that cannot seek, such as a pipe.
+std::optional<BootImageInfo> UnpackBootImage(
+    utils::StreamReader &in, const std::filesystem::path &output_dir,
+    bool dec_ramdisk);
@@ -0,0 +1,104 @@
+#include "inspect.h"
+
+#include <string_view>
+
+#include "json_writer.hpp"
+#include "log.h"
+#include "tools.h"
+#include "utils.h"
+
+namespace {
+constexpr std::string_view BOOT_MAGIC = "ANDROID!";
+constexpr std::string_view VENDOR_BOOT_MAGIC = "VNDRBOOT";
+}  // namespace
+
+std::string BootImageInfoToJson(const BootImageInfo &info) {
+  JsonWriter json;
+  json.BeginObject()
+      .Field("boot_magic", info.boot_magic)
+      .Field("header_version", info.header_version)
+      .Field("page_size", info.page_size)
+      .Field("kernel_size", info.kernel_size)
+      .Field("ramdisk_size", info.ramdisk_size)
+      .Field("ramdisk_compression", getFormatName(info.ramdisk_compression))
+      .Field("os_version", info.os_version)
+      .Field("os_patch_level", info.os_patch_level)
+      .Field("cmdline", info.cmdline);
+  if (info.header_version < 3) {
+    json.Field("kernel_load_address", info.kernel_load_address)
+        .Field("ramdisk_load_address", info.ramdisk_load_address)
+        .Field("second_size", info.second_size)
+        .Field("second_load_address", info.second_load_address)
+        .Field("tags_load_address", info.tags_load_address)
+        .Field("board", info.product_name)
+        .Field("extra_cmdline", info.extra_cmdline);
+  }
+  if (info.header_version == 1 || info.header_version == 2) {
+    json.Field("recovery_dtbo_size", info.recovery_dtbo_size)
+        .Field("recovery_dtbo_offset", info.recovery_dtbo_offset)
+        .Field("header_size", info.boot_header_size);
+  }
+  if (info.header_version == 2) {
+    json.Field("dtb_size", info.dtb_size)
+        .Field("dtb_load_address", info.dtb_load_address);
+  }
+  if (info.header_version >= 4) {
+    json.Field("boot_signature_size", info.boot_signature_size);
+  }
+  json.EndObject();
+  return json.str();
+}
+
+std::string VendorBootImageInfoToJson(const VendorBootImageInfo &info) {
+  JsonWriter json;
+  json.BeginObject()
+      .Field("boot_magic", info.boot_magic)
+      .Field("header_version", info.header_version)
+      .Field("page_size", info.page_size)
+      .Field("kernel_load_address", info.kernel_load_address)
+      .Field("ramdisk_load_address", info.ramdisk_load_address)
+      .Field("vendor_ramdisk_size", info.vendor_ramdisk_size)
+      .Field("cmdline", info.cmdline)
+      .Field("tags_load_address", info.tags_load_address)
+      .Field("board", info.product_name)
+      .Field("header_size", info.header_size)
+      .Field("dtb_size", info.dtb_size)
+      .Field("dtb_load_address", info.dtb_load_address);
+  if (info.header_version > 3) {
+    json.Field("vendor_bootconfig_size", info.vendor_bootconfig_size)
+        .Key("vendor_ramdisk_table")
+        .BeginArray();
+    for (const auto &entry : info.vendor_ramdisk_table) {
+      json.BeginObject()
+          .Field("output_name", entry.output_name)
+          .Field("name", entry.name)
+          .Field("type", entry.type)
+          .Field("offset", entry.offset)
+          .Field("size", entry.size)
+          .Field("compression", getFormatName(entry.ramdisk_compression))
+          .EndObject();
+    }
+    json.EndArray();
+  } else {
+    json.Field("ramdisk_compression", getFormatName(info.ramdisk_compression));
+  }
+  json.EndObject();
+  return json.str();
+}
+
+std::optional<std::string> InspectImage(int fd) {
+  auto magic = utils::ReadNBytesAtOffsetX(fd, 0, BOOT_MAGIC.size());
+  std::string_view magic_view(reinterpret_cast<const char *>(magic.data()),
+                              magic.size());
+
+  if (magic_view == BOOT_MAGIC) {
+    if (auto info = InspectBootImage(fd)) return BootImageInfoToJson(*info);
+  } else if (magic_view == VENDOR_BOOT_MAGIC) {
+    if (auto info = InspectVendorBootImage(fd)) {
+      return VendorBootImageInfoToJson(*info);
+    }
+  } else {
+    LOGE("Invalid boot magic: %s", utils::toHexString(magic_view).c_str());
+  }
+  return std::nullopt;
+}
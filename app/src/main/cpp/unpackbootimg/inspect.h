@@ -0,0 +1,13 @@
+#pragma once
+
+#include <optional>
+#include <string>
+
+#include "bootimg.h"
+#include "vendorbootimg.h"
+
+std::string BootImageInfoToJson(const BootImageInfo &info);
+std::string VendorBootImageInfoToJson(const VendorBootImageInfo &info);
+
+// Header-only triage of the image behind fd: nothing is extracted or written.
+std::optional<std::string> InspectImage(int fd);
@@ -1,11 +1,20 @@
 #include "utils.h"
 
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <cerrno>
 #include <cstdio>
 #include <system_error>
 
+#include "buffer_pool.h"
+#include "job.h"
 #include "log.h"
+#include "scheduler.h"
+#include "tools.h"
+#include "trace.h"
 
 namespace utils {
 
@@ -15,19 +24,11 @@ bool CreateDirectory(const std::filesystem::path &dir_path) {
   return !ec;
 }
 
-bool ExtractImage(int fd, uint64_t offset, uint64_t size,
-                  const std::filesystem::path &output_path) {
-  if (lseek64(fd, static_cast<int64_t>(offset), SEEK_SET) == -1) {
-    LOGE("Error seeking to %lld", offset);
-    return false;
-  }
-
-  std::vector<char> buffer(size);
-  uint64_t bytesRead = read(fd, buffer.data(), size);
-  if (bytesRead != size) {
-    LOGE("Expected %lld bytes, read %lld", size, bytesRead);
-    return false;
-  }
+namespace {
+bool CopySection(int fd, uint64_t offset, uint64_t size,
+                 const std::filesystem::path &output_path) {
+  TraceSpan span("extract", output_path.filename().native());
+  span.SetBytes(size, size);
 
   std::ofstream output(output_path, std::ios::binary);
   if (!output) {
@@ -35,13 +36,39 @@ bool ExtractImage(int fd, uint64_t offset, uint64_t size,
     return false;
   }
 
-  if (!output.write(buffer.data(), static_cast<std::streamsize>(size)).good()) {
-    LOGE("Error writing to %s", output_path.string().c_str());
-    return false;
+  // Copied through one pooled buffer, so memory use is independent of the
+  // section size. pread keeps the shared file offset untouched for
+  // concurrent readers.
+  auto buffer = BufferPool::Shared().Acquire();
+  for (uint64_t copied = 0; copied < size;) {
+    if (JobCancelled()) return false;
+    const uint64_t length =
+        std::min<uint64_t>(size - copied, buffer.size());
+    if (!ReadFullyAt(fd, buffer.data(), length,
+                     static_cast<off_t>(offset + copied))) {
+      LOGE("Error reading %llu bytes at %llu",
+           static_cast<unsigned long long>(size),
+           static_cast<unsigned long long>(offset));
+      return false;
+    }
+    if (!output.write(buffer.data(), static_cast<std::streamsize>(length))
+             .good()) {
+      LOGE("Error writing to %s", output_path.string().c_str());
+      return false;
+    }
+    copied += length;
+    JobProgress(length);
   }
 
   return true;
 }
+}  // namespace
+
+bool ExtractImage(int fd, uint64_t offset, uint64_t size,
+                  const std::filesystem::path &output_path) {
+  JobStage("extract", output_path.filename().native(), size);
+  return CopySection(fd, offset, size, output_path);
+}
 
 std::string CStr(std::string_view s) {
   if (auto pos = s.find('\0'); pos != s.npos)
@@ -75,7 +102,8 @@ bool ReadU32(int fd, uint32_t &value) {
   uint8_t bytes[4];
   uint64_t bytesRead = read(fd, reinterpret_cast<char *>(bytes), sizeof(bytes));
   if (bytesRead != sizeof(bytes)) {
-    LOGE("Error reading 4 bytes at offset %lld", lseek64(fd, 0, SEEK_CUR));
+    LOGE("Error reading 4 bytes at offset %lld",
+         static_cast<long long>(lseek64(fd, 0, SEEK_CUR)));
     return false;
   }
 
@@ -87,7 +115,8 @@ bool ReadU64(int fd, uint64_t &value) {
   uint8_t bytes[8];
   uint64_t bytesRead = read(fd, reinterpret_cast<char *>(bytes), sizeof(bytes));
   if (bytesRead != sizeof(bytes)) {
-    LOGE("Error reading 8 bytes at offset %lld", lseek64(fd, 0, SEEK_CUR));
+    LOGE("Error reading 8 bytes at offset %lld",
+         static_cast<long long>(lseek64(fd, 0, SEEK_CUR)));
     return false;
   }
 
@@ -106,8 +135,9 @@ std::optional<std::string> ReadString(int fd, size_t length) {
   std::string s(length, '\0');
   uint64_t bytesRead = read(fd, s.data(), length);
   if (bytesRead != length) {
-    LOGE("Error reading %lld bytes at offset %lld", length,
-         lseek64(fd, 0, SEEK_CUR));
+    LOGE("Error reading %llu bytes at offset %lld",
+         static_cast<unsigned long long>(length),
+         static_cast<long long>(lseek64(fd, 0, SEEK_CUR)));
     return std::nullopt;
   }
   return CStr(s);
@@ -117,8 +147,9 @@ bool ReadString(int fd, size_t length, std::string &out) {
   std::string s(length, '\0');
   uint64_t bytesRead = read(fd, s.data(), length);
   if (bytesRead != length) {
-    LOGE("Error reading %lld bytes at offset %lld", length,
-         lseek64(fd, 0, SEEK_CUR));
+    LOGE("Error reading %llu bytes at offset %lld",
+         static_cast<unsigned long long>(length),
+         static_cast<long long>(lseek64(fd, 0, SEEK_CUR)));
     return false;
   }
   out = CStr(s);
@@ -127,27 +158,210 @@ bool ReadString(int fd, size_t length, std::string &out) {
 
 std::vector<uint8_t> ReadNBytesAtOffsetX(int fd, off_t offset,
                                          size_t numBytes) {
-  off_t currentPos = lseek(fd, 0, SEEK_CUR);
-  if (currentPos == (off_t)-1) {
-    return {};
+  std::vector<uint8_t> buffer(numBytes);
+  size_t total = 0;
+  while (total < numBytes) {
+    ssize_t bytesRead = pread(fd, buffer.data() + total, numBytes - total,
+                              offset + static_cast<off_t>(total));
+    if (bytesRead < 0 && errno == EINTR) continue;
+    if (bytesRead < 0) return {};
+    if (bytesRead == 0) break;
+    total += static_cast<size_t>(bytesRead);
+  }
+  buffer.resize(total);
+  return buffer;
+}
+
+bool FitsInFile(int fd, uint64_t offset, uint64_t size) {
+  struct stat st {};
+  if (fstat(fd, &st) != 0) return false;
+  const auto file_size = static_cast<uint64_t>(st.st_size);
+  return offset <= file_size && size <= file_size - offset;
+}
+
+bool ValidateEntries(int fd, const std::vector<ImageEntry> &entries) {
+  for (const auto &entry : entries) {
+    if (!FitsInFile(fd, entry.offset, entry.size)) {
+      LOGE("%s exceeds image size (offset %llu, size %u)", entry.name.c_str(),
+           static_cast<unsigned long long>(entry.offset), entry.size);
+      return false;
+    }
   }
+  return true;
+}
 
-  if (lseek(fd, offset, SEEK_SET) == (off_t)-1) {
-    return {};
+bool ExtractImages(int fd, const std::vector<ImageEntry> &entries,
+                   const std::filesystem::path &output_dir) {
+  uint64_t total = 0;
+  for (const auto &entry : entries) {
+    LOG("Extracting %s", entry.name.c_str());
+    total += entry.size;
   }
+  JobStage("extract", output_dir.filename().native(), total);
+  return ParallelFor(entries.size(), TaskThreads(), [&](size_t i) {
+    const auto &entry = entries[i];
+    return CopySection(fd, entry.offset, entry.size, output_dir / entry.name);
+  });
+}
 
-  std::vector<uint8_t> buffer(numBytes);
-  ssize_t bytesRead = read(fd, buffer.data(), numBytes);
-  if (bytesRead < 0) {
-    lseek(fd, currentPos, SEEK_SET);
-    return {};
+size_t StreamReader::Read(uint8_t *out, size_t size) {
+  size_t done = std::min(size, pending_.size());
+  std::copy_n(pending_.begin(), done, out);
+  pending_.erase(pending_.begin(), pending_.begin() + done);
+  while (done < size) {
+    ssize_t n = read(fd_, out + done, size - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    done += static_cast<size_t>(n);
   }
-  buffer.resize(static_cast<size_t>(bytesRead));
+  offset_ += done;
+  return done;
+}
 
-  if (lseek(fd, currentPos, SEEK_SET) == (off_t)-1) {
-    return {};
+std::span<const uint8_t> StreamReader::Peek(size_t size) {
+  size_t have = pending_.size();
+  if (have < size) {
+    pending_.resize(size);
+    while (have < size) {
+      ssize_t n = read(fd_, pending_.data() + have, size - have);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) break;
+      have += static_cast<size_t>(n);
+    }
+    pending_.resize(have);
   }
-  return buffer;
+  return {pending_.data(), std::min(size, have)};
 }
 
+bool StreamReader::SkipTo(uint64_t offset) {
+  if (offset < offset_) return false;
+  auto buffer = BufferPool::Shared().Acquire();
+  while (offset_ < offset) {
+    const auto length = static_cast<size_t>(
+        std::min<uint64_t>(offset - offset_, buffer.size()));
+    if (Read(reinterpret_cast<uint8_t *>(buffer.data()), length) != length) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool StreamReader::CopyTo(uint64_t size, const std::filesystem::path &path) {
+  TraceSpan span("extract", path.filename().native());
+  span.SetBytes(size, size);
+
+  int out = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (out < 0) {
+    LOGE("Error opening %s", path.string().c_str());
+    return false;
+  }
+  auto buffer = BufferPool::Shared().Acquire();
+  auto *data = reinterpret_cast<uint8_t *>(buffer.data());
+  bool ok = true;
+  for (uint64_t copied = 0; ok && copied < size;) {
+    const auto length =
+        static_cast<size_t>(std::min<uint64_t>(size - copied, buffer.size()));
+    if (JobCancelled()) {
+      ok = false;
+    } else if (Read(data, length) != length) {
+      LOGE("Image ends inside %s", path.filename().c_str());
+      ok = false;
+    } else if (!WriteFully(out, data, length)) {
+      LOGE("Error writing to %s", path.string().c_str());
+      ok = false;
+    }
+    copied += length;
+    JobProgress(length);
+  }
+  if (close(out) != 0) ok = false;
+  return ok;
+}
+
+std::optional<uint64_t> StreamReader::SpoolRest(
+    const std::filesystem::path &path) {
+  constexpr size_t BLOCK = 4096;
+  int out = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (out < 0) {
+    LOGE("Error opening %s", path.string().c_str());
+    return std::nullopt;
+  }
+  auto buffer = BufferPool::Shared().Acquire();
+  auto *data = reinterpret_cast<uint8_t *>(buffer.data());
+  bool ok = true;
+  while (ok && !JobCancelled()) {
+    const uint64_t start = offset_;
+    const size_t length = Read(data, buffer.size());
+    if (length == 0) break;
+    for (size_t pos = 0; ok && pos < length; pos += BLOCK) {
+      const size_t block = std::min(BLOCK, length - pos);
+      const bool zero = std::all_of(data + pos, data + pos + block,
+                                    [](uint8_t b) { return b == 0; });
+      if (!zero) {
+        ok = WriteFullyAt(out, data + pos, block,
+                          static_cast<off_t>(start + pos));
+      }
+    }
+  }
+  ok = ok && !JobCancelled() &&
+       ftruncate(out, static_cast<off_t>(offset_)) == 0;
+  if (close(out) != 0) ok = false;
+  if (!ok) return std::nullopt;
+  return offset_;
+}
+
+bool ExtractImages(StreamReader &in, std::vector<ImageEntry> entries,
+                   const std::filesystem::path &output_dir) {
+  std::sort(entries.begin(), entries.end(),
+            [](const ImageEntry &a, const ImageEntry &b) {
+              return a.offset < b.offset;
+            });
+  uint64_t total = 0;
+  for (const auto &entry : entries) {
+    LOG("Extracting %s", entry.name.c_str());
+    total += entry.size;
+  }
+  JobStage("extract", output_dir.filename().native(), total);
+  for (const auto &entry : entries) {
+    if (entry.offset < in.offset()) {
+      LOGE("%s overlaps the previous section; it needs a seekable image",
+           entry.name.c_str());
+      return false;
+    }
+    if (!in.SkipTo(entry.offset)) {
+      LOGE("%s is past the end of the image", entry.name.c_str());
+      return false;
+    }
+    if (!in.CopyTo(entry.size, output_dir / entry.name)) return false;
+  }
+  return true;
+}
+
+const uint8_t *ByteReader::Take(size_t length) {
+  if (!ok_ || length > size_ - pos_) {
+    ok_ = false;
+    return nullptr;
+  }
+  const uint8_t *p = data_ + pos_;
+  pos_ += length;
+  return p;
+}
+
+uint32_t ByteReader::U32() {
+  const uint8_t *p = Take(4);
+  return p ? LoadU32(p) : 0;
+}
+
+uint64_t ByteReader::U64() {
+  const uint8_t *p = Take(8);
+  return p ? LoadU64(p) : 0;
+}
+
+std::string ByteReader::String(size_t length) {
+  const uint8_t *p = Take(length);
+  if (!p) return {};
+  return CStr(std::string_view(reinterpret_cast<const char *>(p), length));
+}
+
+void ByteReader::Skip(size_t length) { Take(length); }
+
 }  // namespace utils
@@ -4,7 +4,9 @@
 #include <filesystem>
 #include <fstream>
 #include <optional>
+#include <span>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "tools.h"
@@ -16,9 +18,11 @@ bool ExtractImage(int fd, uint64_t offset, uint64_t size,
                   const std::filesystem::path &output_path);
 
 inline std::string toHexString(std::string_view data) {
+  static constexpr char digits[] = "0123456789ABCDEF";
   std::string result = "0x";
   for (unsigned char c : data) {
-    result += std::format("{:02X}", c);
+    result += digits[c >> 4];
+    result += digits[c & 0x0F];
   }
   return result;
 }
@@ -39,6 +43,27 @@ std::optional<std::string> ReadString(int fd, size_t length);
 bool ReadString(int fd, size_t length, std::string &out);
 std::vector<uint8_t> ReadNBytesAtOffsetX(int fd, off_t offset, size_t numBytes);
 
+// Bounds-checked little-endian cursor over a header that was read in one go.
+// Reads past the end yield zeroes and clear ok().
+class ByteReader {
+ public:
+  ByteReader(const uint8_t *data, size_t size) : data_(data), size_(size) {}
+
+  uint32_t U32();
+  uint64_t U64();
+  std::string String(size_t length);
+  void Skip(size_t length);
+  bool ok() const { return ok_; }
+
+ private:
+  const uint8_t *Take(size_t length);
+
+  const uint8_t *data_;
+  size_t size_;
+  size_t pos_ = 0;
+  bool ok_ = true;
+};
+
 template <size_t N>
 bool ReadU32Array(int fd, std::array<uint32_t, N> &arr) {
   for (auto &val : arr) {
@@ -56,4 +81,48 @@ struct ImageEntry {
       : offset(o), size(s), name(std::move(n)) {}
 };
 
+// Header fields are untrusted: these check a range against the real length
+// of fd before anything is allocated or copied for it.
+bool FitsInFile(int fd, uint64_t offset, uint64_t size);
+bool ValidateEntries(int fd, const std::vector<ImageEntry> &entries);
+
+// Extracts every entry into output_dir under its name, as one job stage.
+// The sections are independent, so they are copied concurrently on the
+// scheduler.
+bool ExtractImages(int fd, const std::vector<ImageEntry> &entries,
+                   const std::filesystem::path &output_dir);
+
+// Forward-only reader for images arriving through a pipe or socket, where
+// every section has to be taken in offset order as it goes by.
+class StreamReader {
+ public:
+  explicit StreamReader(int fd) : fd_(fd) {}
+
+  // Up to size bytes from offset() on, buffered without being consumed;
+  // fewer only at the end of the stream.
+  std::span<const uint8_t> Peek(size_t size);
+  // Discards everything up to offset, which must not be behind offset().
+  bool SkipTo(uint64_t offset);
+  // Moves the next size bytes into the file at path.
+  bool CopyTo(uint64_t size, const std::filesystem::path &path);
+  // Drains the stream into path at the same offsets, with holes for what
+  // came before and for blocks of zeroes, so offsets into the image hold in
+  // the copy. Returns the length of the stream, or nullopt on error.
+  std::optional<uint64_t> SpoolRest(const std::filesystem::path &path);
+  uint64_t offset() const { return offset_; }
+
+ private:
+  // Reads up to size bytes, the peeked ones first.
+  size_t Read(uint8_t *out, size_t size);
+
+  int fd_;
+  uint64_t offset_ = 0;
+  std::vector<uint8_t> pending_;  // peeked, not yet consumed
+};
+
+// ExtractImages for a stream: the entries are extracted in offset order, one
+// after another, and must not overlap.
+bool ExtractImages(StreamReader &in, std::vector<ImageEntry> entries,
+                   const std::filesystem::path &output_dir);
+
 }  // namespace utils
@@ -1,160 +1,298 @@
 #include "vendorbootimg.h"
 
+#include <fcntl.h>
 #include <unistd.h>
 
 #include <array>
+#include <cstdio>
 #include <sstream>
 
+#include "image_layout.h"
 #include "log.h"
+#include "parser_config.h"
 #include "tools.h"
+#include "trace.h"
 #include "utils.h"
-#include "vendorbootconfig.h"
 
 namespace {
 constexpr uint32_t VENDOR_RAMDISK_NAME_SIZE = 32;
-}
+constexpr uint32_t VENDOR_BOOT_MAGIC_SIZE = 8;
+constexpr uint32_t VENDOR_BOOT_ARGS_SIZE = 2048;
+constexpr uint32_t VENDOR_BOOT_NAME_SIZE = 16;
+constexpr uint32_t VENDOR_BOOT_IMAGE_HEADER_V4_SIZE = 2128;
+constexpr uint32_t VENDOR_RAMDISK_TABLE_ENTRY_BOARD_ID_SIZE = 16;
 
-std::optional<VendorBootImageInfo> UnpackVendorBootImage(
-    int fd, const std::filesystem::path &output_dir, bool dec_ramdisk) {
-  VendorBootImageInfo info;
+bool ParseHeader(const uint8_t *data, size_t size, VendorBootImageInfo &info) {
+  utils::ByteReader in(data, size);
 
-  LOG("Working at: %s", output_dir.filename().c_str());
+  info.boot_magic = in.String(VENDOR_BOOT_MAGIC_SIZE);
+  info.header_version = in.U32();
+  info.page_size = in.U32();
+  info.kernel_load_address = in.U32();
+  info.ramdisk_load_address = in.U32();
+  info.vendor_ramdisk_size = in.U32();
+  info.cmdline = in.String(VENDOR_BOOT_ARGS_SIZE);
+  info.tags_load_address = in.U32();
+  info.product_name = in.String(VENDOR_BOOT_NAME_SIZE);
+  info.header_size = in.U32();
+  info.dtb_size = in.U32();
+  info.dtb_load_address = in.U64();
 
-  // Read header fields
-  if (!(utils::ReadString(fd, 8, info.boot_magic) &&
-        utils::ReadU32(fd, info.header_version) &&
-        utils::ReadU32(fd, info.page_size) &&
-        utils::ReadU32(fd, info.kernel_load_address) &&
-        utils::ReadU32(fd, info.ramdisk_load_address) &&
-        utils::ReadU32(fd, info.vendor_ramdisk_size) &&
-        utils::ReadString(fd, 2048, info.cmdline) &&
-        utils::ReadU32(fd, info.tags_load_address) &&
-        utils::ReadString(fd, 16, info.product_name) &&
-        utils::ReadU32(fd, info.header_size) &&
-        utils::ReadU32(fd, info.dtb_size) &&
-        utils::ReadU64(fd, info.dtb_load_address))) {
-    return std::nullopt;
+  // Handle version >3 fields
+  if (info.header_version > 3) {
+    info.vendor_ramdisk_table_size = in.U32();
+    info.vendor_ramdisk_table_entry_num = in.U32();
+    info.vendor_ramdisk_table_entry_size = in.U32();
+    info.vendor_bootconfig_size = in.U32();
   }
 
-  LOG("Header version: %d", info.header_version);
-  LOG("Page size: %d", info.page_size);
-  LOG("Ramdisk(s) total size: %.2fMB",
-      static_cast<float>(info.vendor_ramdisk_size) / 1024 / 1024);
-  LOG("Board: %s", info.product_name.c_str());
-  LOG("Cmdline length: %d", info.cmdline.length());
-  LOG("DTB size: %.2fMB", static_cast<float>(info.dtb_size) / 1024 / 1024);
+  if (!in.ok()) {
+    LOGE("Truncated vendor_boot header");
+    return false;
+  }
+  if (info.page_size == 0) {
+    LOGE("Invalid page size");
+    return false;
+  }
+  return true;
+}
 
-  info.cmdline = utils::CStr(info.cmdline);
-  info.product_name = utils::CStr(info.product_name);
+VendorBootImageLayout PlanImage(const VendorBootImageInfo &info) {
+  return PlanVendorBootImage(info.header_version, info.page_size,
+                             info.header_size, info.vendor_ramdisk_size,
+                             info.dtb_size, info.vendor_ramdisk_table_size,
+                             info.vendor_bootconfig_size);
+}
 
-  // Handle version >3 fields
-  if (info.header_version > 3) {
-    if (!(utils::ReadU32(fd, info.vendor_ramdisk_table_size) &&
-          utils::ReadU32(fd, info.vendor_ramdisk_table_entry_num) &&
-          utils::ReadU32(fd, info.vendor_ramdisk_table_entry_size) &&
-          utils::ReadU32(fd, info.vendor_bootconfig_size))) {
-      return std::nullopt;
-    }
-    LOG("Bootconfig size: %d", info.vendor_bootconfig_size);
+// Reads the table at table_offset of fd, which is the image or, when
+// streaming, a copy of the table alone.
+bool ParseRamdiskTable(int fd, uint64_t table_offset,
+                       VendorBootImageInfo &info) {
+  constexpr uint32_t min_entry_size = 3 * sizeof(uint32_t) +
+                                      VENDOR_RAMDISK_NAME_SIZE +
+                                      VENDOR_RAMDISK_TABLE_ENTRY_BOARD_ID_SIZE;
+  if (info.vendor_ramdisk_table_entry_size < min_entry_size) {
+    LOGE("Invalid vendor ramdisk table entry size");
+    return false;
   }
 
-  // Calculate offsets
-  const uint32_t page_size = info.page_size;
-  const uint32_t num_header_pages =
-      GetNumberOfPages(info.header_size, page_size);
-  const uint32_t ramdisk_offset_base = page_size * num_header_pages;
+  const uint64_t table_size =
+      static_cast<uint64_t>(info.vendor_ramdisk_table_entry_size) *
+      info.vendor_ramdisk_table_entry_num;
+  if (!utils::FitsInFile(fd, table_offset, table_size)) {
+    LOGE("Vendor ramdisk table exceeds image size");
+    return false;
+  }
+  auto table = utils::ReadNBytesAtOffsetX(fd, static_cast<off_t>(table_offset),
+                                          table_size);
+  if (table.size() != table_size) {
+    LOGE("Error reading vendor ramdisk table");
+    return false;
+  }
 
-  std::vector<utils::ImageEntry> image_entries;
-  std::vector<std::pair<std::string, std::string>> vendor_ramdisk_symlinks;
+  for (uint32_t i = 0; i < info.vendor_ramdisk_table_entry_num; ++i) {
+    utils::ByteReader in(table.data() + info.vendor_ramdisk_table_entry_size * i,
+                         info.vendor_ramdisk_table_entry_size);
+    VendorRamdiskTableEntry entry;
+    entry.size = in.U32();
+    entry.offset = in.U32();
+    entry.type = in.U32();
+    entry.name = in.String(VENDOR_RAMDISK_NAME_SIZE);
+    for (auto &id : entry.board_id) id = in.U32();
 
-  // Handle vendor ramdisk table
-  if (info.header_version > 3) {
-    const uint32_t table_pages =
-        GetNumberOfPages(info.vendor_ramdisk_table_size, page_size);
-    const uint64_t table_offset =
-        page_size * (num_header_pages +
-                     GetNumberOfPages(info.vendor_ramdisk_size, page_size) +
-                     GetNumberOfPages(info.dtb_size, page_size));
-
-    for (uint32_t i = 0; i < info.vendor_ramdisk_table_entry_num; ++i) {
-      const uint64_t entry_offset =
-          table_offset + (info.vendor_ramdisk_table_entry_size * i);
-      if (lseek64(fd, static_cast<int64_t>(entry_offset), SEEK_SET) == -1) {
-        LOGE("Error seeking in file");
-        return std::nullopt;
-      }
-
-      VendorRamdiskTableEntry entry;
-      if (!(utils::ReadU32(fd, entry.size) &&
-            utils::ReadU32(fd, entry.offset) &&
-            utils::ReadU32(fd, entry.type) &&
-            utils::ReadString(fd, VENDOR_RAMDISK_NAME_SIZE, entry.name) &&
-            utils::ReadU32Array(fd, entry.board_id))) {
-        return std::nullopt;
-      }
-
-      entry.output_name = std::format("vendor_ramdisk{:02}", i);
-      entry.name = utils::CStr(entry.name);
+    char output_name[32];
+    std::snprintf(output_name, sizeof(output_name), "vendor_ramdisk%02u", i);
+    entry.output_name = output_name;
+    entry.ramdisk_compression = FORMAT_OTHER;
+    info.vendor_ramdisk_table.push_back(std::move(entry));
+  }
+  return true;
+}
 
-      entry.ramdisk_compression = FORMAT_OTHER;
+uint8_t SniffRamdisk(int fd, uint64_t offset) {
+  TraceSpan span("sniff");
+  auto buf = utils::ReadNBytesAtOffsetX(fd, static_cast<off_t>(offset), 16);
+  return getHeaderFormat(buf.data(), buf.size());
+}
+}  // namespace
 
-      if (dec_ramdisk) {
-        auto buf = utils::ReadNBytesAtOffsetX(
-            fd, ramdisk_offset_base + entry.offset, 16);
-        if (buf.empty()) {
-          LOGE("Could not read %s", entry.output_name.c_str());
-          return std::nullopt;
-        }
-        entry.ramdisk_compression = getHeaderFormat(buf.data(), buf.size());
-      }
+std::vector<utils::ImageEntry> GetVendorBootImageEntries(
+    const VendorBootImageInfo &info) {
+  const auto layout = PlanImage(info);
+  const uint64_t ramdisk_offset_base = layout.ramdisk.offset;
 
+  std::vector<utils::ImageEntry> image_entries;
+
+  if (info.header_version > 3) {
+    for (const auto &entry : info.vendor_ramdisk_table) {
       image_entries.emplace_back(ramdisk_offset_base + entry.offset, entry.size,
                                  entry.output_name);
-
-      vendor_ramdisk_symlinks.emplace_back(entry.output_name, entry.name);
-      info.vendor_ramdisk_table.push_back(std::move(entry));
     }
 
     // Handle bootconfig
-    const uint64_t bootconfig_offset =
-        page_size * (num_header_pages +
-                     GetNumberOfPages(info.vendor_ramdisk_size, page_size) +
-                     GetNumberOfPages(info.dtb_size, page_size) + table_pages);
-    image_entries.emplace_back(bootconfig_offset, info.vendor_bootconfig_size,
-                               "bootconfig");
+    image_entries.emplace_back(layout.bootconfig.offset,
+                               info.vendor_bootconfig_size, "bootconfig");
   } else {
-    info.ramdisk_compression = FORMAT_OTHER;
-
-    if (dec_ramdisk) {
-        auto buf = utils::ReadNBytesAtOffsetX(fd, ramdisk_offset_base, 16);
-        if (buf.empty()) {
-            LOGE("Could not read vendor_ramdisk");
-            return std::nullopt;
-        }
-        info.ramdisk_compression = getHeaderFormat(buf.data(), buf.size());
-    }
     image_entries.emplace_back(ramdisk_offset_base, info.vendor_ramdisk_size,
                                "vendor_ramdisk");
   }
 
   // Handle DTB
   if (info.dtb_size > 0) {
-    const uint64_t dtb_offset =
-        page_size * (num_header_pages +
-                     GetNumberOfPages(info.vendor_ramdisk_size, page_size));
-    image_entries.emplace_back(dtb_offset, info.dtb_size, "dtb");
+    image_entries.emplace_back(layout.dtb.offset, info.dtb_size, "dtb");
   }
 
-  // Extract images
-  for (const auto &entry : image_entries) {
-    const auto output_path = output_dir / entry.name;
-    LOG("Extracting %s", entry.name.c_str());
-    if (!utils::ExtractImage(fd, entry.offset, entry.size, output_path)) {
+  return image_entries;
+}
+
+std::optional<VendorBootImageInfo> InspectVendorBootImage(int fd) {
+  VendorBootImageInfo info;
+  {
+    TraceSpan span("header_parse");
+    auto header =
+        utils::ReadNBytesAtOffsetX(fd, 0, VENDOR_BOOT_IMAGE_HEADER_V4_SIZE);
+    span.SetBytes(header.size(), 0);
+    if (!ParseHeader(header.data(), header.size(), info)) return std::nullopt;
+    if (info.header_version > 3 &&
+        !ParseRamdiskTable(fd, PlanImage(info).ramdisk_table.offset, info)) {
       return std::nullopt;
     }
   }
 
-  auto config_dir = output_dir / CONFIG_FILE;
-  VendorBootConfig::Write(info, config_dir.string());
+  const uint64_t ramdisk_offset_base = PlanImage(info).ramdisk.offset;
+  if (info.header_version > 3) {
+    for (auto &entry : info.vendor_ramdisk_table) {
+      entry.ramdisk_compression =
+          SniffRamdisk(fd, ramdisk_offset_base + entry.offset);
+    }
+  } else {
+    info.ramdisk_compression = SniffRamdisk(fd, ramdisk_offset_base);
+  }
+  return info;
+}
+
+namespace {
+void LogImageInfo(const VendorBootImageInfo &info) {
+  LOG("Header version: %d", info.header_version);
+  LOG("Page size: %d", info.page_size);
+  LOG("Ramdisk(s) total size: %.2fMB",
+      static_cast<float>(info.vendor_ramdisk_size) / 1024 / 1024);
+  LOG("Board: %s", info.product_name.c_str());
+  LOG("Cmdline length: %d", info.cmdline.length());
+  LOG("DTB size: %.2fMB", static_cast<float>(info.dtb_size) / 1024 / 1024);
+  if (info.header_version > 3) {
+    LOG("Bootconfig size: %d", info.vendor_bootconfig_size);
+  }
+}
+
+// Scratch copies a stream is split through, removed again once unpacked.
+constexpr std::string_view STREAM_RAMDISKS = ".vendor_ramdisks";
+constexpr std::string_view STREAM_RAMDISK_TABLE = ".vendor_ramdisk_table";
+
+// The ramdisks of a v4 image come before the table that splits them, so a
+// stream keeps the whole ramdisk section and splits it afterwards.
+bool SplitStreamedRamdisks(VendorBootImageInfo &info,
+                           const std::filesystem::path &output_dir,
+                           bool dec_ramdisk) {
+  const auto table_path = output_dir / STREAM_RAMDISK_TABLE;
+  int table = open(table_path.c_str(), O_RDONLY | O_CLOEXEC);
+  const bool parsed = table >= 0 && ParseRamdiskTable(table, 0, info);
+  if (table >= 0) close(table);
+  if (!parsed) return false;
+
+  int ramdisks = open((output_dir / STREAM_RAMDISKS).c_str(),
+                      O_RDONLY | O_CLOEXEC);
+  if (ramdisks < 0) {
+    LOGE("Error opening the vendor ramdisks");
+    return false;
+  }
+  std::vector<utils::ImageEntry> entries;
+  for (const auto &entry : info.vendor_ramdisk_table) {
+    entries.emplace_back(entry.offset, entry.size, entry.output_name);
+  }
+  bool ok = utils::ValidateEntries(ramdisks, entries) &&
+            utils::ExtractImages(ramdisks, entries, output_dir);
+  if (ok && dec_ramdisk) {
+    for (auto &entry : info.vendor_ramdisk_table) {
+      entry.ramdisk_compression = SniffRamdisk(ramdisks, entry.offset);
+    }
+  }
+  close(ramdisks);
+  return ok;
+}
+}  // namespace
+
+std::optional<VendorBootImageInfo> UnpackVendorBootImage(
+    int fd, const std::filesystem::path &output_dir, bool dec_ramdisk) {
+  LOG("Working at: %s", output_dir.filename().c_str());
+
+  auto parsed = InspectVendorBootImage(fd);
+  if (!parsed) return std::nullopt;
+  VendorBootImageInfo &info = *parsed;
+  if (!dec_ramdisk) {
+    info.ramdisk_compression = FORMAT_OTHER;
+    for (auto &entry : info.vendor_ramdisk_table) {
+      entry.ramdisk_compression = FORMAT_OTHER;
+    }
+  }
+  LogImageInfo(info);
+
+  // Extract images
+  const auto entries = GetVendorBootImageEntries(info);
+  if (!utils::ValidateEntries(fd, entries)) return std::nullopt;
+  if (!utils::ExtractImages(fd, entries, output_dir)) return std::nullopt;
+
+  if (!WriteParserConfig(info, output_dir / CONFIG_FILE)) return std::nullopt;
+  return info;
+}
+
+std::optional<VendorBootImageInfo> UnpackVendorBootImage(
+    utils::StreamReader &in, const std::filesystem::path &output_dir,
+    bool dec_ramdisk) {
+  LOG("Working at: %s", output_dir.filename().c_str());
+
+  VendorBootImageInfo info;
+  {
+    TraceSpan span("header_parse");
+    auto header = in.Peek(VENDOR_BOOT_IMAGE_HEADER_V4_SIZE);
+    span.SetBytes(header.size(), 0);
+    if (!ParseHeader(header.data(), header.size(), info)) return std::nullopt;
+  }
+  LogImageInfo(info);
+
+  const auto layout = PlanImage(info);
+  std::vector<utils::ImageEntry> entries;
+  if (info.header_version > 3) {
+    entries.emplace_back(layout.ramdisk.offset, info.vendor_ramdisk_size,
+                         std::string(STREAM_RAMDISKS));
+    entries.emplace_back(layout.ramdisk_table.offset,
+                         info.vendor_ramdisk_table_size,
+                         std::string(STREAM_RAMDISK_TABLE));
+    entries.emplace_back(layout.bootconfig.offset, info.vendor_bootconfig_size,
+                         "bootconfig");
+    if (info.dtb_size > 0) {
+      entries.emplace_back(layout.dtb.offset, info.dtb_size, "dtb");
+    }
+  } else {
+    entries = GetVendorBootImageEntries(info);
+  }
+  bool ok = utils::ExtractImages(in, entries, output_dir);
+
+  if (ok && info.header_version > 3) {
+    ok = SplitStreamedRamdisks(info, output_dir, dec_ramdisk);
+    std::error_code ec;
+    std::filesystem::remove(output_dir / STREAM_RAMDISKS, ec);
+    std::filesystem::remove(output_dir / STREAM_RAMDISK_TABLE, ec);
+  } else if (ok && dec_ramdisk) {
+    int ramdisk = open((output_dir / "vendor_ramdisk").c_str(),
+                       O_RDONLY | O_CLOEXEC);
+    if (ramdisk >= 0) {
+      info.ramdisk_compression = SniffRamdisk(ramdisk, 0);
+      close(ramdisk);
+    }
+  }
+  if (!ok) return std::nullopt;
+
+  if (!WriteParserConfig(info, output_dir / CONFIG_FILE)) return std::nullopt;
   return info;
 }
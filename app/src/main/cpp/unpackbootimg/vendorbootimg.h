@@ -1,5 +1,6 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
 #include <filesystem>
 #include <string>
@@ -44,5 +45,15 @@ struct VendorBootImageInfo {
   // std::filesystem::path image_dir;
 };
 
+// Sections of the image in file order, with absolute offsets.
+std::vector<utils::ImageEntry> GetVendorBootImageEntries(
+    const VendorBootImageInfo &info);
+// Parses the header and ramdisk table and sniffs every ramdisk; never writes
+// anything.
+std::optional<VendorBootImageInfo> InspectVendorBootImage(int fd);
 std::optional<VendorBootImageInfo> UnpackVendorBootImage(
     int fd, const std::filesystem::path &output_dir, bool dec_ramdisk);
+// Single forward pass over an image that cannot seek, such as a pipe.
+std::optional<VendorBootImageInfo> UnpackVendorBootImage(
+    utils::StreamReader &in, const std::filesystem::path &output_dir,
+    bool dec_ramdisk);
@@ -14,6 +14,25 @@ class ABIKBridge(private val application: Application) {
     private var currentToast: Toast? = null
     private external fun jniExtract(input_fd: Int, input_name: String, dir: String, extract_ramdisk: Boolean): Boolean
     private external fun jniBuild(input_dir: String): Boolean
+    private external fun jniBuildTo(input_dir: String, output_fd: Int): Boolean
+    private external fun jniInspect(input_fd: Int): String?
+    private external fun jniVerifyImage(input_fd: Int, key: String?): String?
+    private external fun jniListRamdisks(input_fd: Int): String?
+    private external fun jniExtractEntries(input_fd: Int, input_name: String, dir: String, patterns: Array<String>): Boolean
+    private external fun jniPatchRamdisk(input_fd: Int, ramdisk: String, spec: String, output: String): Boolean
+    private external fun jniPatchImage(input_fd: Int, cmdline: String?, os_version: String?, os_patch_level: String?,
+                                       board: String?, bootconfig: String?, avb_key: String?, output: String): Boolean
+    private external fun jniBatchExtract(input_fds: IntArray, input_names: Array<String>, dir: String, extract_ramdisk: Boolean,
+                                         max_jobs: Int, max_threads: Int, memory_budget_mb: Int): BooleanArray?
+    private external fun jniBatchBuild(input_dirs: Array<String>, max_jobs: Int, max_threads: Int, memory_budget_mb: Int): BooleanArray?
+    private external fun jniSetTracing(enabled: Boolean)
+    private external fun jniSetMemoryBudget(mb: Int)
+    private external fun jniStartExtract(input_fd: Int, input_name: String, dir: String, extract_ramdisk: Boolean): Long
+    private external fun jniStartBuild(input_dir: String): Long
+    private external fun jniStartBuildTo(input_dir: String, output_fd: Int): Long
+    private external fun jniPollJob(job: Long): String?
+    private external fun jniCancelJob(job: Long): Boolean
+    private external fun jniReleaseJob(job: Long): Boolean
 
     fun showToast(str: String) {
         currentToast?.cancel()
@@ -41,6 +60,110 @@ class ABIKBridge(private val application: Application) {
         }
     }
 
+    // Builds into output_fd instead of the project directory: a SAF document, or a pipe into
+    // flashing tools, which gets the image in a single forward pass. The caller keeps the fd.
+    fun buildTo(input_dir: String, output_fd: Int) {
+        DataHelper.isABIKRunning = true
+        GlobalScope.launch(Dispatchers.IO) {
+            jniBuildTo(input_dir, output_fd)
+            withContext(Dispatchers.Main) {
+                DataHelper.isABIKRunning = false
+            }
+        }
+    }
+
+    // Makes later jobs write a Chrome/Perfetto trace next to their project directory.
+    fun setTracing(enabled: Boolean) = jniSetTracing(enabled)
+
+    // Caps the I/O buffers all running jobs share, in MiB (default 16).
+    fun setMemoryBudget(mb: Int) = jniSetMemoryBudget(mb)
+
+    // Non-blocking extract/build. Each returns a job id; pollJob gives its progress as JSON
+    // (state, stage, done/total bytes of the stage), cancelJob stops it and cleans up its
+    // files, and releaseJob forgets a finished job.
+    fun startExtract(input_fd: Int, input_name: String, dir: String, extract_ramdisk: Boolean): Long =
+        jniStartExtract(input_fd, input_name, dir, extract_ramdisk)
+
+    fun startBuild(input_dir: String): Long = jniStartBuild(input_dir)
+
+    // output_fd is duplicated, so the caller may close its own right away.
+    fun startBuildTo(input_dir: String, output_fd: Int): Long = jniStartBuildTo(input_dir, output_fd)
+
+    fun pollJob(job: Long): String? = jniPollJob(job)
+
+    fun cancelJob(job: Long): Boolean = jniCancelJob(job)
+
+    fun releaseJob(job: Long): Boolean = jniReleaseJob(job)
+
+    // Header-only triage, returns the parsed header as JSON or null.
+    fun inspect(input_fd: Int): String? = jniInspect(input_fd)
+
+    // Checks the AVB hash footer, optionally against a PEM key; returns the
+    // report as JSON, or null when the image has no footer.
+    fun verifyImage(input_fd: Int, key: String?): String? = jniVerifyImage(input_fd, key)
+
+    // Lists the entries of every ramdisk as JSON without extracting anything.
+    fun listRamdisks(input_fd: Int): String? = jniListRamdisks(input_fd)
+
+    // Extracts only the ramdisk entries matching the given paths or globs.
+    fun extractEntries(input_fd: Int, input_name: String, dir: String, patterns: Array<String>) {
+        DataHelper.isABIKRunning = true
+        GlobalScope.launch(Dispatchers.IO) {
+            jniExtractEntries(input_fd, input_name, dir, patterns)
+            withContext(Dispatchers.Main) {
+                DataHelper.isABIKRunning = false
+            }
+        }
+    }
+
+    // Applies an add/replace/remove/chmod list to one ramdisk in a single streaming pass.
+    fun patchRamdisk(input_fd: Int, ramdisk: String, spec: String, output: String) {
+        DataHelper.isABIKRunning = true
+        GlobalScope.launch(Dispatchers.IO) {
+            jniPatchRamdisk(input_fd, ramdisk, spec, output)
+            withContext(Dispatchers.Main) {
+                DataHelper.isABIKRunning = false
+            }
+        }
+    }
+
+    // Copies a boot/vendor_boot image to output with only its header rewritten. Null fields are
+    // left alone; bootconfig is a file replacing a v4 vendor_boot's bootconfig, and avb_key
+    // re-signs a signed AVB footer.
+    fun patchImage(input_fd: Int, cmdline: String?, os_version: String?, os_patch_level: String?,
+                   board: String?, bootconfig: String?, avb_key: String?, output: String) {
+        DataHelper.isABIKRunning = true
+        GlobalScope.launch(Dispatchers.IO) {
+            jniPatchImage(input_fd, cmdline, os_version, os_patch_level, board, bootconfig, avb_key, output)
+            withContext(Dispatchers.Main) {
+                DataHelper.isABIKRunning = false
+            }
+        }
+    }
+
+    // Unpacks many images concurrently. Zero limits mean one job/thread per core and no memory cap.
+    fun batchExtract(input_fds: IntArray, input_names: Array<String>, dir: String, extract_ramdisk: Boolean,
+                     max_jobs: Int = 0, max_threads: Int = 0, memory_budget_mb: Int = 0) {
+        DataHelper.isABIKRunning = true
+        GlobalScope.launch(Dispatchers.IO) {
+            jniBatchExtract(input_fds, input_names, dir, extract_ramdisk, max_jobs, max_threads, memory_budget_mb)
+            withContext(Dispatchers.Main) {
+                DataHelper.isABIKRunning = false
+            }
+        }
+    }
+
+    // Builds many unpacked work directories concurrently, with the same limits as batchExtract.
+    fun batchBuild(input_dirs: Array<String>, max_jobs: Int = 0, max_threads: Int = 0, memory_budget_mb: Int = 0) {
+        DataHelper.isABIKRunning = true
+        GlobalScope.launch(Dispatchers.IO) {
+            jniBatchBuild(input_dirs, max_jobs, max_threads, memory_budget_mb)
+            withContext(Dispatchers.Main) {
+                DataHelper.isABIKRunning = false
+            }
+        }
+    }
+
    init {
        System.loadLibrary("abik")
    }